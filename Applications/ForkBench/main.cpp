@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lemon/syscall.h>
+#include <lemon/spawn.h>
+
+#define ITERATIONS 1000
+#define TOUCHED_SIZE (16 * 1024 * 1024)
+
+static inline uint64_t ReadTSC(){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+static uint64_t ForkExit(){
+    uint64_t start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i++){
+        pid_t pid = lemon_fork();
+        if(!pid){
+            syscall(SYS_EXIT, 0, 0, 0, 0, 0);
+        } else if(pid < 0){
+            perror("fork");
+            exit(1);
+        }
+
+        syscall(SYS_WAIT_PID, pid, 0, 0, 0, 0);
+    }
+
+    return (ReadTSC() - start) / ITERATIONS;
+}
+
+// fork, exit in the child and wait in the parent
+// Run again with a large amount of memory touched, with copy-on-write only the page tables get copied
+int main(){
+    uint64_t smallCycles = ForkExit();
+
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(TOUCHED_SIZE));
+    memset(buffer, 1, TOUCHED_SIZE);
+
+    uint64_t largeCycles = ForkExit();
+
+    printf("%d fork + exit + wait\n", ITERATIONS);
+    printf("Small process: %lu cycles per fork\n", smallCycles);
+    printf("%d MB touched: %lu cycles per fork\n", TOUCHED_SIZE / 1024 / 1024, largeCycles);
+
+    free(buffer);
+    return 0;
+}
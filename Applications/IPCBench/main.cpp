@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <lemon/syscall.h>
+#include <lemon/spawn.h>
+
+#include <core/msghandler.h>
+
+#include "IPCBenchInterface.h"
+
+#define ITERATIONS 100000
+#define BATCH 64 // Damage messages sent between each sync call
+
+#define LEGACY_PROTOCOL 0x1000 // Lemon::Message encoding of the same calls
+
+enum {
+    LegacyDamage,
+    LegacySetTitle,
+    LegacySync,
+};
+
+static const char* socketAddress = "ipcbench";
+static const char* title = "Window Title";
+
+static inline uint64_t ReadTSC(){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+class BenchServer : public IPCBench::Server {
+public:
+    uint64_t checksum = 0; // So the compiler can't throw away the decoding
+    uint64_t received = 0;
+
+protected:
+    void OnDamage(int, int32_t x, int32_t y, int32_t width, int32_t height, uint64_t sequence){
+        checksum += x + y + width + height + sequence;
+        received++;
+    }
+
+    void OnSetTitle(int, const char* title){
+        checksum += strlen(title);
+        received++;
+    }
+
+    void OnSync(int, uint64_t, uint64_t& received){
+        received = this->received;
+    }
+};
+
+// Decode the Lemon::Message version, the way LemonWM read WMCommands
+static void LegacyDispatch(BenchServer& handler, Lemon::MessageServer& server, int client, const Lemon::LemonMessage* msg){
+    uint16_t cmd;
+    memcpy(&cmd, msg->data, sizeof(uint16_t));
+
+    if(cmd == LegacyDamage){
+        int32_t rect[4];
+        uint64_t sequence;
+        memcpy(rect, msg->data + sizeof(uint16_t), sizeof(rect));
+        memcpy(&sequence, msg->data + sizeof(uint16_t) + sizeof(rect), sizeof(uint64_t));
+
+        handler.checksum += rect[0] + rect[1] + rect[2] + rect[3] + sequence;
+        handler.received++;
+    } else if(cmd == LegacySetTitle){
+        uint16_t length;
+        memcpy(&length, msg->data + sizeof(uint16_t), sizeof(uint16_t));
+
+        char* title = (char*)malloc(length + 1);
+        strncpy(title, (const char*)msg->data + sizeof(uint16_t) * 2, length);
+        title[length] = 0;
+
+        handler.checksum += strlen(title);
+        handler.received++;
+        free(title);
+    } else if(cmd == LegacySync){
+        server.Send(Lemon::Message(LEGACY_PROTOCOL, static_cast<uint16_t>(LegacySync), handler.received), client);
+    }
+}
+
+// Encode and decode in the same process, the cost of the message format itself
+static void EncodeDecode(BenchServer& handler, Lemon::MessageServer& server){
+    uint64_t start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i++){
+        Lemon::Message msg(LEGACY_PROTOCOL, static_cast<uint16_t>(LegacyDamage), i, i, 64, 64, static_cast<uint64_t>(i));
+        LegacyDispatch(handler, server, 0, reinterpret_cast<const Lemon::LemonMessage*>(msg.data()));
+    }
+    uint64_t legacyDamage = (ReadTSC() - start) / ITERATIONS;
+
+    start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i++){
+        Lemon::Message msg(LEGACY_PROTOCOL, static_cast<uint16_t>(LegacySetTitle), Lemon::Message::EncodeString(title));
+        LegacyDispatch(handler, server, 0, reinterpret_cast<const Lemon::LemonMessage*>(msg.data()));
+    }
+    uint64_t legacyTitle = (ReadTSC() - start) / ITERATIONS;
+
+    start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i++){
+        IPCBench::Message<IPCBench::DamageRequest> msg;
+        msg.body.x = msg.body.y = i;
+        msg.body.width = msg.body.height = 64;
+        msg.body.sequence = i;
+        handler.Dispatch(server, 0, &msg.header);
+    }
+    uint64_t generatedDamage = (ReadTSC() - start) / ITERATIONS;
+
+    start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i++){
+        IPCBench::Message<IPCBench::SetTitleRequest> msg;
+        IPCBench::CopyString(msg.body.title, title, sizeof(msg.body.title));
+        handler.Dispatch(server, 0, &msg.header);
+    }
+    uint64_t generatedTitle = (ReadTSC() - start) / ITERATIONS;
+
+    printf("Encode + decode (cycles per message, checksum %lu)\n", handler.checksum);
+    printf("    Damage:   Lemon::Message %lu, generated %lu\n", legacyDamage, generatedDamage);
+    printf("    SetTitle: Lemon::Message %lu, generated %lu\n", legacyTitle, generatedTitle);
+}
+
+// Child, sends batches of damage followed by a sync call to wait for the server to catch up
+static void RunClient(){
+    sockaddr_un address;
+    strcpy(address.sun_path, socketAddress);
+    address.sun_family = AF_UNIX;
+
+    Lemon::MessageClient client;
+    client.Connect(address, sizeof(sockaddr_un));
+    bool ring = client.UseSharedRing();
+
+    uint64_t start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i += BATCH){
+        for(int j = 0; j < BATCH; j++){
+            client.Send(Lemon::Message(LEGACY_PROTOCOL, static_cast<uint16_t>(LegacyDamage), j, j, 64, 64, static_cast<uint64_t>(i + j)));
+        }
+
+        client.Send(Lemon::Message(LEGACY_PROTOCOL, static_cast<uint16_t>(LegacySync), static_cast<uint64_t>(i)));
+        if(!client.PollSync()){
+            printf("Connection closed\n");
+            exit(1);
+        }
+    }
+    uint64_t legacy = (ReadTSC() - start) / ITERATIONS;
+
+    IPCBench::Client stub(client);
+
+    start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i += BATCH){
+        for(int j = 0; j < BATCH; j++){
+            stub.Damage(j, j, 64, 64, i + j);
+        }
+
+        uint64_t received;
+        if(!stub.Sync(i, received)){
+            printf("Connection closed\n");
+            exit(1);
+        }
+    }
+    uint64_t generated = (ReadTSC() - start) / ITERATIONS;
+
+    printf("Client to server, %d messages per sync (cycles per message, %s)\n", BATCH, ring ? "shared ring" : "socket");
+    printf("    Damage:   Lemon::Message %lu, generated %lu\n", legacy, generated);
+}
+
+// Compare the generated stubs with building messages out of Lemon::Message
+int main(){
+    sockaddr_un address;
+    strcpy(address.sun_path, socketAddress);
+    address.sun_family = AF_UNIX;
+
+    Lemon::MessageServer server(address, sizeof(sockaddr_un));
+    BenchServer handler;
+
+    EncodeDecode(handler, server);
+
+    pid_t pid = lemon_fork();
+    if(!pid){
+        RunClient();
+        exit(0);
+    } else if(pid < 0){
+        perror("fork");
+        return 1;
+    }
+
+    Lemon::MessageMultiplexer mp;
+    mp.AddSource(server);
+
+    for(bool connected = true; connected;){
+        int client;
+        while(const Lemon::LemonMessage* msg = server.Next(client)){
+            if(msg->protocol == IPCBench::Protocol){
+                handler.Dispatch(server, client, msg);
+            } else if(msg->protocol == LEGACY_PROTOCOL){
+                LegacyDispatch(handler, server, client, msg);
+            } else if(msg->protocol == 0){ // Disconnected
+                connected = false;
+            }
+        }
+
+        if(connected){
+            mp.PollSync();
+        }
+    }
+
+    syscall(SYS_WAIT_PID, pid, 0, 0, 0, 0);
+    return 0;
+}
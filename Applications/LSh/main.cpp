@@ -186,25 +186,30 @@ void ParseLine(){
 		return;
 	} else for(std::string path : path){
 		if((fd = open(path.c_str(), O_RDONLY | O_DIRECTORY)) > 0){
-			lemon_dirent_t dirent;
-
-			int i = 0;
-			while (lemon_readdir(fd, i++, &dirent)){
-				// Check exact filenames and try omitting extension of .lef files
-				if(strcmp(argv[0], dirent.name) == 0 || (strcmp(dirent.name + strlen(dirent.name) - 4, ".lef") == 0 && strncmp(argv[0], dirent.name, strlen(dirent.name) - 4) == 0)){
-					path = path + "/" + dirent.name;
-					
-					pid_t pid = lemon_spawn(path.c_str(), argc, argv, 1);
-
-					if(pid){
-						syscall(SYS_WAIT_PID, pid, 0, 0, 0, 0);
-					} else {
-						printf("Error executing %s\n", dirent.name);
+			alignas(8) uint8_t direntBuffer[2048];
+
+			ssize_t length;
+			while ((length = lemon_readdir_batch(fd, direntBuffer, sizeof(direntBuffer), 0)) > 0){
+				for(ssize_t offset = 0; offset < length;){
+					lemon_batch_dirent_t* dirent = (lemon_batch_dirent_t*)(direntBuffer + offset);
+					offset += dirent->recordLength;
+
+					// Check exact filenames and try omitting extension of .lef files
+					if(strcmp(argv[0], dirent->name) == 0 || (dirent->nameLength > 4 && strcmp(dirent->name + dirent->nameLength - 4, ".lef") == 0 && strncmp(argv[0], dirent->name, dirent->nameLength - 4) == 0)){
+						path = path + "/" + dirent->name;
+						
+						pid_t pid = lemon_spawn(path.c_str(), argc, argv, 1);
+
+						if(pid){
+							syscall(SYS_WAIT_PID, pid, 0, 0, 0, 0);
+						} else {
+							printf("Error executing %s\n", dirent->name);
+						}
+
+						close(fd);
+						free(lnC);
+						return;
 					}
-
-					close(fd);
-					free(lnC);
-					return;
 				}
 			}
 
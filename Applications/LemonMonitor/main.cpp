@@ -23,15 +23,17 @@ Lemon::GUI::ListColumn procName = {.name = "Process", .displayWidth = 168};
 Lemon::GUI::ListColumn procID = {.name = "PID", .displayWidth = 48};
 Lemon::GUI::ListColumn procUptime = {.name = "Uptime", .displayWidth = 64};
 Lemon::GUI::ListColumn procCPUUsage = {.name = "CPU Usage", .displayWidth = 80};
+Lemon::GUI::ListColumn procMaxWait = {.name = "Max Wait", .displayWidth = 80}; // Longest a thread has waited for a processor
 
 int main(int argc, char** argv){
-    window = new Lemon::GUI::Window("LemonMonitor", {360, 400}, 0, Lemon::GUI::WindowType::GUI);
+    window = new Lemon::GUI::Window("LemonMonitor", {440, 400}, 0, Lemon::GUI::WindowType::GUI);
     
     listView = new Lemon::GUI::ListView({0, 0, 0, 0});
     listView->AddColumn(procName);
     listView->AddColumn(procID);
     listView->AddColumn(procUptime);
     listView->AddColumn(procCPUUsage);
+    listView->AddColumn(procMaxWait);
     listView->SetLayout(Lemon::GUI::LayoutSize::Stretch, Lemon::GUI::LayoutSize::Stretch);
 
     window->AddWidget(listView);
@@ -78,7 +80,10 @@ int main(int argc, char** argv){
                 processTimer[proc.pid] = {.recordTime = time, .activeUs = proc.activeUs, .lastUsage = 0 };
             }
 
-            Lemon::GUI::ListItem pItem = {.details = {proc.name, std::to_string(proc.pid), uptime, usage}};
+            char maxWait[16];
+            snprintf(maxWait, 16, "%lums", proc.maxWaitUs / 1000);
+
+            Lemon::GUI::ListItem pItem = {.details = {proc.name, std::to_string(proc.pid), uptime, usage, maxWait}};
             listView->AddItem(pItem);
         }
 
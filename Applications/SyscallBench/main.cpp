@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <lemon/syscall.h>
+#include <lemon/fastsyscall.h>
+
+#define ITERATIONS 1000000
+
+static inline uint64_t ReadTSC(){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+// Round trips of a syscall that does next to nothing, through int 0x69 and through SYSCALL
+int main(){
+    uint64_t pid;
+
+    // Warm up
+    for(int i = 0; i < 1000; i++){
+        syscall(SYS_GETPID, &pid, 0, 0, 0, 0);
+        fast_syscall(SYS_GETPID, &pid, 0, 0, 0, 0);
+    }
+
+    uint64_t start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i++){
+        syscall(SYS_GETPID, &pid, 0, 0, 0, 0);
+    }
+    uint64_t interruptCycles = ReadTSC() - start;
+
+    start = ReadTSC();
+    for(int i = 0; i < ITERATIONS; i++){
+        fast_syscall(SYS_GETPID, &pid, 0, 0, 0, 0);
+    }
+    uint64_t fastCycles = ReadTSC() - start;
+
+    printf("%d getpid calls\n", ITERATIONS);
+    printf("int 0x69: %lu cycles per call\n", interruptCycles / ITERATIONS);
+    printf("syscall:  %lu cycles per call\n", fastCycles / ITERATIONS);
+
+    return 0;
+}
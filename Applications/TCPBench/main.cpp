@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef TCP_NODELAY
+    #define TCP_NODELAY 1
+#endif
+
+#define TRANSFER_SIZE (64 * 1024 * 1024)
+#define CHUNK_SIZE (16 * 1024) // Less than the send and receive buffers so one thread can write and then read it
+#define ROUND_TRIPS 10000
+#define PORT 7778
+
+static inline uint64_t ReadTSC(){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+static uint8_t sendBuffer[CHUNK_SIZE];
+static uint8_t receiveBuffer[CHUNK_SIZE];
+
+static bool SendAll(int fd, const uint8_t* data, size_t len){
+    while(len){
+        ssize_t ret = send(fd, data, len, 0);
+        if(ret <= 0){
+            perror("send");
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+static bool ReceiveAll(int fd, uint8_t* data, size_t len){
+    while(len){
+        ssize_t ret = recv(fd, data, len, 0);
+        if(ret <= 0){
+            if(ret == 0){
+                printf("recv: Connection closed early\n");
+            } else {
+                perror("recv");
+            }
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+// Returns cycles per chunk, or 0 if the data did not make it across intact
+static uint64_t Throughput(int client, int server){
+    uint64_t start = ReadTSC();
+    for(unsigned i = 0; i < TRANSFER_SIZE / CHUNK_SIZE; i++){
+        sendBuffer[0] = i; // Make sure each chunk is different so lost or repeated segments show up
+
+        if(!SendAll(client, sendBuffer, CHUNK_SIZE) || !ReceiveAll(server, receiveBuffer, CHUNK_SIZE)){
+            return 0;
+        }
+
+        if(memcmp(sendBuffer, receiveBuffer, CHUNK_SIZE)){
+            printf("Chunk %u was corrupted\n", i);
+            return 0;
+        }
+    }
+
+    return (ReadTSC() - start) / (TRANSFER_SIZE / CHUNK_SIZE);
+}
+
+// One byte each way, returns cycles per round trip
+static uint64_t RoundTrips(int client, int server){
+    uint8_t byte = 0;
+
+    uint64_t start = ReadTSC();
+    for(int i = 0; i < ROUND_TRIPS; i++){
+        if(!SendAll(client, &byte, 1) || !ReceiveAll(server, &byte, 1) || !SendAll(server, &byte, 1) || !ReceiveAll(client, &byte, 1)){
+            return 0;
+        }
+    }
+
+    return (ReadTSC() - start) / ROUND_TRIPS;
+}
+
+// TCP over the loopback interface, no card involved so this measures the stack itself
+int main(){
+    for(unsigned i = 0; i < CHUNK_SIZE; i++){
+        sendBuffer[i] = i * 7;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    if(listener < 0 || client < 0){
+        perror("socket");
+        return 1;
+    }
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    address.sin_port = htons(PORT);
+
+    if(bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(sockaddr_in)) || listen(listener, 1)){
+        perror("bind/listen");
+        return 1;
+    }
+
+    // The kernel completes the handshake for the listener, so we can connect before accepting
+    if(connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(sockaddr_in))){
+        perror("connect");
+        return 1;
+    }
+
+    int server = accept(listener, nullptr, nullptr);
+    if(server < 0){
+        perror("accept");
+        return 1;
+    }
+
+    int noDelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+
+    uint64_t chunkCycles = Throughput(client, server);
+    if(!chunkCycles){
+        return 1;
+    }
+
+    uint64_t roundTripCycles = RoundTrips(client, server);
+    if(!roundTripCycles){
+        return 1;
+    }
+
+    printf("%d MB in %d KB chunks over loopback\n", TRANSFER_SIZE / 1024 / 1024, CHUNK_SIZE / 1024);
+    printf("send/recv:  %lu cycles per chunk (%lu cycles per byte)\n", chunkCycles, chunkCycles / CHUNK_SIZE);
+    printf("round trip: %lu cycles (1 byte each way, %d round trips)\n", roundTripCycles, ROUND_TRIPS);
+
+    close(client);
+    close(server);
+    close(listener);
+    return 0;
+}
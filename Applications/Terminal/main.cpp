@@ -84,24 +84,59 @@ void Scroll(){
 	while(bufferOffset + rowCount >= buffer.size()) buffer.push_back(std::vector<TerminalChar>());
 }
 
+std::vector<std::vector<TerminalChar>> drawnRows; // What is on screen, so only rows that changed get redrawn
+vector2i_t drawnCurPos = {-1, -1};
+vector2i_t drawnSize = {0, 0};
+
+bool RowsEqual(const std::vector<TerminalChar>& l, const std::vector<TerminalChar>& r){
+	if(l.size() != r.size()) return false;
+
+	for(unsigned i = 0; i < l.size(); i++){
+		if(l[i].c != r[i].c || l[i].s.fgColour != r[i].s.fgColour || l[i].s.bgColour != r[i].s.bgColour) return false;
+	}
+
+	return true;
+}
+
 void OnPaint(surface_t* surface){
-	Lemon::Graphics::DrawRect(0, 0, window->GetSize().x, window->GetSize().y, 0, 0, 0, surface);
+	static const std::vector<TerminalChar> emptyRow;
 
-	int line = 0;
-	int i = 0;
 	int fontHeight = terminalFont->height;
+	vector2i_t size = window->GetSize();
+
+	bool full = size.x != drawnSize.x || size.y != drawnSize.y; // New window buffers
+	if(full){
+		Lemon::Graphics::DrawRect(0, 0, size.x, size.y, 0, 0, 0, surface);
+		drawnRows.clear();
+	}
+	drawnRows.resize(rowCount);
 
-	for(int i = 0; i < rowCount && (bufferOffset + i) < buffer.size(); i++){
-		for(int j = 0; j < buffer[bufferOffset + i].size(); j++){
-			TerminalChar ch = buffer[bufferOffset + i][j];
+	for(int i = 0; i < rowCount; i++){
+		const std::vector<TerminalChar>& row = (bufferOffset + i) < buffer.size() ? buffer[bufferOffset + i] : emptyRow;
+
+		if(!full){
+			if(i != curPos.y && i != drawnCurPos.y && RowsEqual(row, drawnRows[i])) continue;
+
+			// Only send the rows we redraw to the window manager
+			window->Damage({0, i * fontHeight, size.x, fontHeight});
+			Lemon::Graphics::DrawRect(0, i * fontHeight, size.x, fontHeight, 0, 0, 0, surface);
+		}
+
+		for(int j = 0; j < row.size(); j++){
+			TerminalChar ch = row[j];
 			rgba_colour_t fg = colours[ch.s.fgColour];
 			rgba_colour_t bg = colours[ch.s.bgColour];
 			Lemon::Graphics::DrawRect(j * 8, i * fontHeight, 8, fontHeight, bg.r, bg.g, bg.b, surface);
 			Lemon::Graphics::DrawChar(ch.c, j * 8, i * fontHeight, fg.r, fg.g, fg.b, surface, terminalFont);
 		}
+
+		drawnRows[i] = row;
 	}
 
 	Lemon::Graphics::DrawRect(curPos.x * 8, curPos.y * fontHeight + (fontHeight / 4 * 3), 8, fontHeight / 4, colours[0x7] /* Grey */, surface);
+
+	drawnCurPos = curPos;
+	drawnSize = size;
 }
 
 void DoAnsiSGR(){
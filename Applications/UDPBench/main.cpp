@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <lemon/syscall.h>
+
+#ifndef SYS_SEND_MMSG
+    #define SYS_SEND_MMSG 85
+    #define SYS_RECV_MMSG 86
+#endif
+
+#define DATAGRAMS 100000
+#define DATAGRAM_SIZE 64
+#define BATCH 32 // Less than the kernel's receive queue so nothing gets dropped
+#define PORT 7777
+
+// Same layout as the kernel's msghdr and mmsghdr
+struct KernelMsgHdr {
+    void* name;
+    socklen_t namelen;
+    iovec* iov;
+    size_t iovlen;
+    void* control;
+    size_t controllen;
+    int flags;
+};
+
+struct KernelMMsgHdr {
+    KernelMsgHdr hdr;
+    unsigned int len;
+};
+
+static inline uint64_t ReadTSC(){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+static uint8_t buffers[BATCH][DATAGRAM_SIZE];
+
+// One sendto and one recvfrom per datagram
+static uint64_t SingleDatagrams(int sender, int receiver, sockaddr_in& address){
+    uint64_t start = ReadTSC();
+    for(int i = 0; i < DATAGRAMS; i += BATCH){
+        for(int j = 0; j < BATCH; j++){
+            sendto(sender, buffers[j], DATAGRAM_SIZE, 0, reinterpret_cast<sockaddr*>(&address), sizeof(sockaddr_in));
+        }
+
+        for(int j = 0; j < BATCH; j++){
+            recvfrom(receiver, buffers[j], DATAGRAM_SIZE, 0, nullptr, nullptr);
+        }
+    }
+
+    return (ReadTSC() - start) / DATAGRAMS;
+}
+
+// BATCH datagrams per sendmmsg and recvmmsg
+static uint64_t BatchedDatagrams(int sender, int receiver, sockaddr_in& address){
+    iovec iovs[BATCH];
+    KernelMMsgHdr messages[BATCH];
+
+    for(int j = 0; j < BATCH; j++){
+        iovs[j].iov_base = buffers[j];
+        iovs[j].iov_len = DATAGRAM_SIZE;
+    }
+
+    uint64_t start = ReadTSC();
+    for(int i = 0; i < DATAGRAMS; i += BATCH){
+        for(int j = 0; j < BATCH; j++){
+            memset(&messages[j], 0, sizeof(KernelMMsgHdr));
+            messages[j].hdr.name = &address;
+            messages[j].hdr.namelen = sizeof(sockaddr_in);
+            messages[j].hdr.iov = &iovs[j];
+            messages[j].hdr.iovlen = 1;
+        }
+        syscall(SYS_SEND_MMSG, sender, messages, BATCH, 0, 0);
+
+        for(int received = 0; received < BATCH;){
+            for(int j = 0; j < BATCH; j++){
+                memset(&messages[j], 0, sizeof(KernelMMsgHdr));
+                messages[j].hdr.iov = &iovs[j];
+                messages[j].hdr.iovlen = 1;
+            }
+
+            long ret = syscall(SYS_RECV_MMSG, receiver, messages, BATCH - received, 0, 0);
+            if(ret <= 0){
+                break;
+            }
+
+            received += ret;
+        }
+    }
+
+    return (ReadTSC() - start) / DATAGRAMS;
+}
+
+// UDP over the loopback interface, no card involved so this measures the stack itself
+int main(){
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    if(receiver < 0 || sender < 0){
+        perror("socket");
+        return 1;
+    }
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    address.sin_port = htons(PORT);
+
+    if(bind(receiver, reinterpret_cast<sockaddr*>(&address), sizeof(sockaddr_in))){
+        perror("bind");
+        return 1;
+    }
+
+    uint64_t singleCycles = SingleDatagrams(sender, receiver, address);
+    uint64_t batchedCycles = BatchedDatagrams(sender, receiver, address);
+
+    printf("%d datagrams of %d bytes over loopback\n", DATAGRAMS, DATAGRAM_SIZE);
+    printf("sendto/recvfrom:   %lu cycles per datagram\n", singleCycles);
+    printf("sendmmsg/recvmmsg: %lu cycles per datagram (batches of %d)\n", batchedCycles, BATCH);
+
+    close(sender);
+    close(receiver);
+    return 0;
+}
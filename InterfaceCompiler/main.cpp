@@ -1,10 +1,27 @@
-#include <stdio.h> 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <stack>
 
-/*std::map<std::string,std::string> types = {
+// Generates C++ stubs for IPC interfaces, for example
+//
+// include <gfx/types.h>
+//
+// interface LemonWM {
+//     async SetTitle(string<128> title)
+//     sync GetPosition() response (vector2i_t pos)
+// }
+//
+// Every call gets a fixed size request (and response for sync calls) struct, sent in one piece with a LemonMessage header.
+// Parameters are either one of the types below, string<N> for a string of at most N - 1 characters
+// or any trivially copyable C++ type without spaces in its name (e.g. rect_t).
+
+std::map<std::string,std::string> types = {
     {"byte", "uint8_t"},
     {"uint16", "uint16_t"},
     {"uint32", "uint32_t"},
@@ -12,7 +29,7 @@
     {"int16", "int16_t"},
     {"int32", "int32_t"},
     {"int64", "int64_t"},
-};*/
+};
 
 enum TokenType{
     TokenEndline,
@@ -28,14 +45,15 @@ enum TokenType{
     KeywordSync,
     KeywordAsync,
     KeywordResponse,
+    KeywordInclude,
 };
 
 enum StatementType {
+    StatementInclude,
     StatementDeclareInterface,
     StatementExitInterfaceScope,
     StatementAsyncCallDeclaration,
     StatementSyncCallDeclaration,
-    StatementParameterList,
 };
 
 enum {
@@ -44,10 +62,14 @@ enum {
     ParserStateDeclarationSync,
     ParserStateDeclarationInterface,
     ParserStateParameterList,
+    ParserStateResponse,
+    ParserStateInclude,
 };
 
 #define IsDeclaration(x) ((x == ParserStateDeclarationSync) || (x == ParserStateDeclarationAsync) || (x == ParserStateDeclarationInterface))
 
+using ParameterList = std::vector<std::pair<std::string, std::string>>; // Type and name
+
 struct Statement
 {
     StatementType type;
@@ -56,6 +78,15 @@ struct Statement
     Statement(StatementType t) { type = t; }
 };
 
+struct IncludeStatement : Statement {
+    std::string path;
+
+    IncludeStatement(std::string& path){
+        this->path = path;
+        type = StatementInclude;
+    }
+};
+
 struct InterfaceDeclarationStatment : Statement {
     std::string interfaceName;
 
@@ -65,6 +96,22 @@ struct InterfaceDeclarationStatment : Statement {
     }
 };
 
+struct CallDeclarationStatement : Statement {
+    std::string name;
+    int lineNum;
+
+    ParameterList parameters;
+    ParameterList response;
+    bool parametersParsed = false; // Sync calls may still be followed by a response
+    bool hasResponse = false;
+
+    CallDeclarationStatement(StatementType t, std::string& name, int ln){
+        type = t;
+        this->name = name;
+        lineNum = ln;
+    }
+};
+
 struct Token{
     TokenType type;
     std::string value;
@@ -94,55 +141,74 @@ struct ParserState{
     }
 };
 
-using ParameterList = std::vector<std::pair<std::string, std::string>>; // Type and name
+// Resolved type of a parameter, strings become fixed size char arrays
+struct FieldType{
+    std::string type;
+    unsigned arrayLength = 0; // 0 if not a string
+};
 
 std::map<std::string, TokenType> keywords = {
     {"interface", KeywordInterface},
     {"sync", KeywordSync},
     {"async", KeywordAsync},
     {"response", KeywordResponse},
+    {"include", KeywordInclude},
 };
 
 std::vector<Token> tokens;
 std::vector<Statement*> statements;
 
 void BuildTokens(std::string& input){
-    int lineNum = 0;
+    int lineNum = 1;
 
     std::string buf;
-    for(char c : input){
-        auto appendIdentifier = [lineNum](std::string& buf) { 
-            if(buf.length()){
-                tokens.push_back(Token(lineNum, TokenIdentifier, buf));
-                buf.clear();
-            }
-        };
+    auto appendIdentifier = [&lineNum](std::string& buf) {
+        if(buf.length()){
+            tokens.push_back(Token(lineNum, TokenIdentifier, buf));
+            buf.clear();
+        }
+    };
+
+    for(size_t i = 0; i < input.length(); i++){
+        char c = input[i];
 
         switch (c)
-        {   
+        {
         case ',':
-            tokens.push_back(Token(lineNum, TokenComma));
             appendIdentifier(buf);
+            tokens.push_back(Token(lineNum, TokenComma));
             break;
         case ')':
-            tokens.push_back(Token(lineNum, TokenRightParens));
             appendIdentifier(buf);
+            tokens.push_back(Token(lineNum, TokenRightParens));
             break;
         case '(':
-            tokens.push_back(Token(lineNum, TokenLeftParens));
             appendIdentifier(buf);
+            tokens.push_back(Token(lineNum, TokenLeftParens));
             break;
         case '}':
-            tokens.push_back(Token(lineNum, TokenRightBrace));
             appendIdentifier(buf);
+            tokens.push_back(Token(lineNum, TokenRightBrace));
             break;
         case '{':
-            tokens.push_back(Token(lineNum, TokenLeftBrace));
             appendIdentifier(buf);
+            tokens.push_back(Token(lineNum, TokenLeftBrace));
+            break;
+        case '/':
+            if(i + 1 < input.length() && input[i + 1] == '/'){ // Comment, skip to the end of the line
+                appendIdentifier(buf);
+                while(i + 1 < input.length() && input[i + 1] != '\n') i++;
+            } else {
+                buf += c;
+            }
             break;
         case '\n':
+            appendIdentifier(buf);
             lineNum++;
+            break;
         case ' ':
+        case '\t':
+        case '\r':
             appendIdentifier(buf);
             break;
         default:
@@ -151,6 +217,8 @@ void BuildTokens(std::string& input){
         }
     }
 
+    appendIdentifier(buf);
+
     for(Token& tok : tokens){
         if(tok.type == TokenIdentifier){
             for(auto keyword : keywords){
@@ -163,40 +231,33 @@ void BuildTokens(std::string& input){
     }
 }
 
-int main(int argc, char** argv){
-    if(argc < 2){
-        printf("Usage: %s <file>\n", argv[0]);
-        exit(2);
-    }
-
-    FILE* inputFile;
-    if(!(inputFile = fopen(argv[1], "r"))){
-        perror("Error opening file for reading: ");
-        exit(2);
-    }
-
-    std::string input;
-
-    fseek(inputFile, 0, SEEK_END);
-    size_t inputSz = ftell(inputFile);
+void Parse(){
+    std::stack<ParserState> parserState;
+    parserState.push(ParserState(ParserStateNone));
 
-    input.resize(inputSz);
-    fseek(inputFile, 0, SEEK_SET);
+    bool inInterface = false;
+    std::set<std::string> callNames; // Of the current interface
 
-    fread(&input.front(), 1, inputSz, inputFile);
+    CallDeclarationStatement* call = nullptr; // Call being declared
+    ParameterList* parameters = nullptr; // List being filled in
+    std::pair<std::string, std::string> currentParameter;
 
-    BuildTokens(input);
+    auto endCall = [&]() {
+        statements.push_back(call);
+        call = nullptr;
+        parserState.pop();
+    };
 
-    ParameterList parameters;
-    std::pair<std::string, std::string> currentParameter;
-    std::stack<ParserState> parserState;
-    parserState.push(ParserState(ParserStateNone));
+    for(Token& tok : tokens){
+        // Sync calls without a response end at the first token after their parameters
+        if(call && call->parametersParsed && !call->hasResponse && tok.type != KeywordResponse){
+            endCall();
+        }
 
-    for(Token tok : tokens){
         switch(tok.type){
             case KeywordSync:
             case KeywordAsync:
-                if(parserState.top().state == ParserStateNone){
+                if(parserState.top().state == ParserStateNone && inInterface){
                     parserState.push((tok.type == KeywordSync) ? ParserStateDeclarationSync : ParserStateDeclarationAsync);
                 } else {
                     printf("error: [line %d] Unexpected declaration '%s'.\n", tok.lineNum, tok.value.c_str());
@@ -204,18 +265,38 @@ int main(int argc, char** argv){
                 }
                 break;
             case KeywordInterface:
-                if(parserState.top().state == ParserStateNone){
+                if(parserState.top().state == ParserStateNone && !inInterface){
                     parserState.push(ParserState(ParserStateDeclarationInterface));
                 } else {
                     printf("error: [line %d] Unexpected declaration '%s'.\n", tok.lineNum, tok.value.c_str());
                     exit(1);
                 }
                 break;
+            case KeywordInclude:
+                if(parserState.top().state == ParserStateNone && !inInterface){
+                    parserState.push(ParserState(ParserStateInclude));
+                } else {
+                    printf("error: [line %d] Unexpected include.\n", tok.lineNum);
+                    exit(1);
+                }
+                break;
+            case KeywordResponse:
+                if(call && call->parametersParsed && !call->hasResponse){
+                    call->hasResponse = true;
+                    parserState.push(ParserState(ParserStateResponse));
+                } else {
+                    printf("error: [line %d] Unexpected 'response', only sync calls have a response.\n", tok.lineNum);
+                    exit(1);
+                }
+                break;
             case TokenIdentifier:
-                if(IsDeclaration(parserState.top().state)){
+                if(parserState.top().state == ParserStateInclude){
+                    statements.push_back(new IncludeStatement(tok.value));
+                    parserState.pop();
+                } else if(IsDeclaration(parserState.top().state) && !parserState.top().identified){
                     parserState.top().identifier = tok;
                     parserState.top().identified = true;
-                } else {
+                } else if(parserState.top().state == ParserStateParameterList) {
                     if(!currentParameter.first.length()){ // type name
                         currentParameter.first = tok.value;
                     } else if(!currentParameter.second.length()){
@@ -224,44 +305,437 @@ int main(int argc, char** argv){
                         printf("error: [line %d] Unexpected identifier: %s.\n", tok.lineNum, tok.value.c_str());
                         exit(1);
                     }
+                } else {
+                    printf("error: [line %d] Unexpected identifier: %s.\n", tok.lineNum, tok.value.c_str());
+                    exit(1);
                 }
                 break;
             case TokenLeftBrace:
-                if(parserState.top().state == ParserStateDeclarationInterface){
+                if(parserState.top().state == ParserStateDeclarationInterface && parserState.top().identified){
                     statements.push_back(new InterfaceDeclarationStatment(parserState.top().identifier.value));
                     parserState.pop();
+
+                    inInterface = true;
+                    callNames.clear();
                 } else {
                     printf("error: [line %d] Unexpected '{'.\n", tok.lineNum);
                     exit(1);
                 }
                 break;
             case TokenRightBrace:
-                statements.push_back(new Statement(StatementExitInterfaceScope));
+                if(parserState.top().state == ParserStateNone && inInterface){
+                    statements.push_back(new Statement(StatementExitInterfaceScope));
+                    inInterface = false;
+                } else {
+                    printf("error: [line %d] Unexpected '}'.\n", tok.lineNum);
+                    exit(1);
+                }
                 break;
             case TokenLeftParens:
-                if(IsDeclaration(parserState.top().state) && parserState.top().state != ParserStateDeclarationInterface){
+                if(IsDeclaration(parserState.top().state) && parserState.top().state != ParserStateDeclarationInterface && !call){
                     if(!parserState.top().identified){
                         printf("error: [line %d] Expected identifier before '('.\n", tok.lineNum);
                         exit(1);
                     }
 
-                    parameters.clear();
+                    Token& identifier = parserState.top().identifier;
+                    if(callNames.count(identifier.value)){
+                        printf("error: [line %d] Redeclaration of '%s'.\n", tok.lineNum, identifier.value.c_str());
+                        exit(1);
+                    }
+                    callNames.insert(identifier.value);
+
+                    call = new CallDeclarationStatement((parserState.top().state == ParserStateDeclarationSync) ? StatementSyncCallDeclaration : StatementAsyncCallDeclaration, identifier.value, identifier.lineNum);
+                    parameters = &call->parameters;
+                    parserState.push(ParserState(ParserStateParameterList));
+                } else if(parserState.top().state == ParserStateResponse){
+                    parserState.pop();
+
+                    parameters = &call->response;
                     parserState.push(ParserState(ParserStateParameterList));
                 } else {
                     printf("error: [line %d] Unexpected '('\n", tok.lineNum);
                     exit(1);
                 }
                 break;
+            case TokenComma:
+                if(parserState.top().state == ParserStateParameterList && currentParameter.second.length()){
+                    parameters->push_back(currentParameter);
+                    currentParameter = {};
+                } else {
+                    printf("error: [line %d] Unexpected ','\n", tok.lineNum);
+                    exit(1);
+                }
+                break;
             case TokenRightParens:
                 if(parserState.top().state != ParserStateParameterList){
                     printf("error: [line %d] Unexpected ')'\n", tok.lineNum);
                     exit(1);
+                }
+
+                if(currentParameter.first.length()){
+                    if(!currentParameter.second.length()){
+                        printf("error: [line %d] Expected name of parameter after '%s'\n", tok.lineNum, currentParameter.first.c_str());
+                        exit(1);
+                    }
+
+                    parameters->push_back(currentParameter);
+                    currentParameter = {};
+                }
+                parserState.pop();
+
+                if(parserState.top().state == ParserStateDeclarationAsync || call->hasResponse){
+                    endCall();
                 } else {
-                    parserState.pop();
+                    call->parametersParsed = true;
                 }
                 break;
+            default:
+                break;
         }
     }
 
+    if(call && call->parametersParsed && !call->hasResponse){
+        endCall();
+    }
+
+    if(parserState.size() > 1 || inInterface){
+        printf("error: Unexpected end of file.\n");
+        exit(1);
+    }
+}
+
+FieldType ResolveType(const std::string& type){
+    FieldType field;
+
+    if(!type.compare(0, 7, "string<")){
+        char* end;
+        unsigned long length = strtoul(type.c_str() + 7, &end, 10);
+
+        if(end == type.c_str() + 7 || strcmp(end, ">") || length < 2 || length > UINT16_MAX){
+            printf("error: Invalid string type '%s', expected string<N> where 1 < N <= %u.\n", type.c_str(), UINT16_MAX);
+            exit(1);
+        }
+
+        field.type = "char";
+        field.arrayLength = length;
+    } else if(types.count(type)){
+        field.type = types.at(type);
+    } else {
+        field.type = type;
+    }
+
+    return field;
+}
+
+// Hash of the interface name, the top bit is set so it can't collide with the LEMON_MESSAGE_PROTOCOL values
+uint32_t ProtocolNumber(const std::string& name){
+    uint32_t hash = 2166136261; // FNV-1a
+    for(char c : name){
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619;
+    }
+
+    return hash | 0x80000000;
+}
+
+void GenerateStruct(FILE* out, const std::string& name, const char* id, ParameterList& parameters){
+    fprintf(out, "    struct %s {\n", name.c_str());
+    fprintf(out, "        uint16_t id = %s;\n", id);
+    for(auto& param : parameters){
+        FieldType field = ResolveType(param.first);
+
+        if(field.arrayLength){
+            fprintf(out, "        %s %s[%u];\n", field.type.c_str(), param.second.c_str(), field.arrayLength);
+        } else {
+            fprintf(out, "        %s %s;\n", field.type.c_str(), param.second.c_str());
+        }
+    }
+    fprintf(out, "    };\n");
+    fprintf(out, "    static_assert(std::is_trivially_copyable<%s>::value, \"%s must be trivially copyable\");\n", name.c_str(), name.c_str());
+    fprintf(out, "    static_assert(sizeof(%s) <= UINT16_MAX, \"%s does not fit in a message\");\n\n", name.c_str(), name.c_str());
+}
+
+// Parameters of a client call or server handler
+std::string ParameterDeclarations(CallDeclarationStatement* call, bool server){
+    std::string decl = server ? "int client" : "";
+
+    for(auto& param : call->parameters){
+        FieldType field = ResolveType(param.first);
+        if(decl.length()) decl += ", ";
+
+        if(field.arrayLength){
+            decl += "const char* " + param.second;
+        } else {
+            decl += field.type + " " + param.second;
+        }
+    }
+
+    for(auto& param : call->response){
+        FieldType field = ResolveType(param.first);
+        if(decl.length()) decl += ", ";
+
+        if(field.arrayLength){
+            decl += "char (&" + param.second + ")[" + std::to_string(field.arrayLength) + "]";
+        } else {
+            decl += field.type + "& " + param.second;
+        }
+    }
+
+    return decl;
+}
+
+void GenerateInterface(FILE* out, const std::string& name, std::vector<CallDeclarationStatement*>& calls){
+    bool hasSync = false;
+    for(CallDeclarationStatement* call : calls){
+        if(call->type == StatementSyncCallDeclaration) hasSync = true;
+    }
+
+    fprintf(out, "namespace %s {\n", name.c_str());
+    fprintf(out, "    static constexpr unsigned int Protocol = 0x%x; // LemonMessage protocol of every message of the interface\n\n", ProtocolNumber(name));
+
+    fprintf(out, "    enum : uint16_t {\n");
+    for(size_t i = 0; i < calls.size(); i++){
+        fprintf(out, "        Request%s = %lu,\n", calls[i]->name.c_str(), i + 1);
+        if(calls[i]->type == StatementSyncCallDeclaration){
+            fprintf(out, "        Response%s = 0x%lx,\n", calls[i]->name.c_str(), (i + 1) | 0x8000);
+        }
+    }
+    fprintf(out, "    };\n\n");
+
+    for(CallDeclarationStatement* call : calls){
+        GenerateStruct(out, call->name + "Request", ("Request" + call->name).c_str(), call->parameters);
+
+        if(call->type == StatementSyncCallDeclaration){
+            GenerateStruct(out, call->name + "Response", ("Response" + call->name).c_str(), call->response);
+        }
+    }
+
+    fprintf(out,
+        "    // Header and body in one piece so messages can be built on the stack and sent with one copy\n"
+        "    template<typename T>\n"
+        "    struct Message {\n"
+        "        static_assert(sizeof(Lemon::LemonMessage) %% alignof(T) == 0, \"The body must directly follow the header\");\n\n"
+        "        Lemon::LemonMessage header;\n"
+        "        T body;\n\n"
+        "        Message() : body() {\n"
+        "            header.protocol = Protocol;\n"
+        "            header.length = sizeof(T);\n"
+        "        }\n"
+        "    };\n\n");
+
+    fprintf(out,
+        "    inline void CopyString(char* dest, const char* src, size_t size){\n"
+        "        strncpy(dest, src, size - 1);\n"
+        "        dest[size - 1] = 0;\n"
+        "    }\n\n");
+
+    // Client
+    fprintf(out, "    class Client {\n");
+    fprintf(out, "        Lemon::MessageClient& client;\n");
+    fprintf(out, "    public:\n");
+    fprintf(out, "        Client(Lemon::MessageClient& client) : client(client) {}\n");
+
+    for(CallDeclarationStatement* call : calls){
+        bool sync = call->type == StatementSyncCallDeclaration;
+
+        fprintf(out, "\n");
+        if(sync){
+            fprintf(out, "        // Returns false if the server did not answer\n");
+        }
+        fprintf(out, "        %s %s(%s){\n", sync ? "bool" : "void", call->name.c_str(), ParameterDeclarations(call, false).c_str());
+        fprintf(out, "            Message<%sRequest> msg;\n", call->name.c_str());
+        for(auto& param : call->parameters){
+            if(ResolveType(param.first).arrayLength){
+                fprintf(out, "            CopyString(msg.body.%s, %s, sizeof(msg.body.%s));\n", param.second.c_str(), param.second.c_str(), param.second.c_str());
+            } else {
+                fprintf(out, "            msg.body.%s = %s;\n", param.second.c_str(), param.second.c_str());
+            }
+        }
+        fprintf(out, "\n            client.Send(&msg.header);\n");
+
+        if(sync){
+            fprintf(out, "\n            const Lemon::LemonMessage* reply = client.WaitFor(Protocol);\n");
+            fprintf(out, "            if(!reply || reply->length != sizeof(%sResponse)){\n", call->name.c_str());
+            fprintf(out, "                return false;\n");
+            fprintf(out, "            }\n\n");
+            fprintf(out, "            %sResponse response;\n", call->name.c_str());
+            fprintf(out, "            memcpy(&response, reply->data, sizeof(%sResponse));\n", call->name.c_str());
+            fprintf(out, "            if(response.id != Response%s){\n", call->name.c_str());
+            fprintf(out, "                return false;\n");
+            fprintf(out, "            }\n\n");
+            for(auto& param : call->response){
+                if(ResolveType(param.first).arrayLength){
+                    fprintf(out, "            memcpy(%s, response.%s, sizeof(%s));\n", param.second.c_str(), param.second.c_str(), param.second.c_str());
+                    fprintf(out, "            %s[sizeof(%s) - 1] = 0;\n", param.second.c_str(), param.second.c_str());
+                } else {
+                    fprintf(out, "            %s = response.%s;\n", param.second.c_str(), param.second.c_str());
+                }
+            }
+            fprintf(out, "            return true;\n");
+        }
+        fprintf(out, "        }\n");
+    }
+    fprintf(out, "    };\n\n");
+
+    // Server
+    fprintf(out, "    class Server {\n");
+    fprintf(out, "    protected:\n");
+    for(CallDeclarationStatement* call : calls){
+        fprintf(out, "        virtual void On%s(%s) = 0;\n", call->name.c_str(), ParameterDeclarations(call, true).c_str());
+    }
+    fprintf(out, "\n    public:\n");
+    fprintf(out, "        virtual ~Server() = default;\n\n");
+    fprintf(out,
+        "        /////////////////////////////\n"
+        "        /// \\brief Call the handler of a request, sending the response of sync calls back through server\n"
+        "        ///\n"
+        "        /// \\return false if msg is not a valid request of this interface\n"
+        "        /////////////////////////////\n");
+    fprintf(out, "        bool Dispatch(Lemon::MessageServer& server, int client, const Lemon::LemonMessage* msg){\n");
+    if(!hasSync){
+        fprintf(out, "            (void)server; // Only used to answer sync calls\n\n");
+    }
+    fprintf(out, "            uint16_t id;\n");
+    fprintf(out, "            if(msg->protocol != Protocol || msg->length < sizeof(id)){\n");
+    fprintf(out, "                return false;\n");
+    fprintf(out, "            }\n\n");
+    fprintf(out, "            memcpy(&id, msg->data, sizeof(id));\n\n");
+    fprintf(out, "            switch(id){\n");
+    for(CallDeclarationStatement* call : calls){
+        bool sync = call->type == StatementSyncCallDeclaration;
+
+        fprintf(out, "            case Request%s: {\n", call->name.c_str());
+        fprintf(out, "                %sRequest request; // Copied out of the message so the client can't change it under us\n", call->name.c_str());
+        fprintf(out, "                if(msg->length != sizeof(request)){\n");
+        fprintf(out, "                    return false;\n");
+        fprintf(out, "                }\n\n");
+        fprintf(out, "                memcpy(&request, msg->data, sizeof(request));\n");
+
+        std::string arguments = "client";
+        for(auto& param : call->parameters){
+            if(ResolveType(param.first).arrayLength){
+                fprintf(out, "                request.%s[sizeof(request.%s) - 1] = 0;\n", param.second.c_str(), param.second.c_str());
+            }
+
+            arguments += ", request." + param.second;
+        }
+
+        if(sync){
+            fprintf(out, "\n                Message<%sResponse> response;\n", call->name.c_str());
+            for(auto& param : call->response){
+                arguments += ", response.body." + param.second;
+            }
+        }
+
+        fprintf(out, "\n                On%s(%s);\n", call->name.c_str(), arguments.c_str());
+        if(sync){
+            fprintf(out, "                server.Send(&response.header, client);\n");
+        }
+        fprintf(out, "                return true;\n");
+        fprintf(out, "            }\n");
+    }
+    fprintf(out, "            default:\n");
+    fprintf(out, "                return false;\n");
+    fprintf(out, "            }\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "    };\n");
+    fprintf(out, "}\n\n");
+}
+
+void Generate(FILE* out, const char* inputName){
+    fprintf(out, "// Generated by the Lemon interface compiler from %s, do not edit\n\n", inputName);
+    fprintf(out, "#pragma once\n\n");
+    fprintf(out, "#include <core/message.h>\n");
+    fprintf(out, "#include <core/msghandler.h>\n\n");
+    fprintf(out, "#include <stddef.h>\n");
+    fprintf(out, "#include <stdint.h>\n");
+    fprintf(out, "#include <string.h>\n");
+    fprintf(out, "#include <type_traits>\n\n");
+
+    bool includes = false;
+    for(Statement* statement : statements){
+        if(statement->type == StatementInclude){
+            fprintf(out, "#include %s\n", static_cast<IncludeStatement*>(statement)->path.c_str());
+            includes = true;
+        }
+    }
+
+    if(includes){
+        fprintf(out, "\n");
+    }
+
+    std::string interfaceName;
+    std::vector<CallDeclarationStatement*> calls;
+    for(Statement* statement : statements){
+        switch(statement->type){
+            case StatementDeclareInterface:
+                interfaceName = static_cast<InterfaceDeclarationStatment*>(statement)->interfaceName;
+                calls.clear();
+                break;
+            case StatementSyncCallDeclaration:
+            case StatementAsyncCallDeclaration:
+                calls.push_back(static_cast<CallDeclarationStatement*>(statement));
+                break;
+            case StatementExitInterfaceScope:
+                GenerateInterface(out, interfaceName, calls);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        printf("Usage: %s <file> [output]\n", argv[0]);
+        exit(2);
+    }
+
+    FILE* inputFile;
+    if(!(inputFile = fopen(argv[1], "r"))){
+        perror("Error opening file for reading: ");
+        exit(2);
+    }
+
+    std::string input;
+
+    fseek(inputFile, 0, SEEK_END);
+    size_t inputSz = ftell(inputFile);
+
+    input.resize(inputSz);
+    fseek(inputFile, 0, SEEK_SET);
+
+    if(fread(&input.front(), 1, inputSz, inputFile) != inputSz){
+        perror("Error reading file: ");
+        exit(2);
+    }
+    fclose(inputFile);
+
+    BuildTokens(input);
+    Parse();
+
+    for(Statement* statement : statements){ // Check every type before any output is written
+        if(statement->type == StatementSyncCallDeclaration || statement->type == StatementAsyncCallDeclaration){
+            CallDeclarationStatement* call = static_cast<CallDeclarationStatement*>(statement);
+
+            for(auto& param : call->parameters) ResolveType(param.first);
+            for(auto& param : call->response) ResolveType(param.first);
+        }
+    }
+
+    FILE* outputFile = stdout;
+    if(argc >= 3 && !(outputFile = fopen(argv[2], "w"))){
+        perror("Error opening file for writing: ");
+        exit(2);
+    }
+
+    const char* inputName = strrchr(argv[1], '/');
+    Generate(outputFile, inputName ? inputName + 1 : argv[1]);
+
+    if(outputFile != stdout){
+        fclose(outputFile);
+    }
+
     exit(0);
-}
\ No newline at end of file
+}
@@ -298,6 +298,7 @@ typedef struct tagHBA_CMD_TBL
 } __attribute__((packed)) hba_cmd_tbl_t;
 
 #define AHCI_GHC_ENABLE (1 << 31)
+#define AHCI_GHC_IE (1 << 1) // Interrupt enable
 
 #define AHCI_CAP_S64A (1 << 31) // 64-bit addressing
 #define AHCI_CAP_NCQ (1 << 30) // Support for Native Command Queueing?
@@ -306,6 +307,7 @@ typedef struct tagHBA_CMD_TBL
 #define AHCI_CAP_SSC (1 << 14) // Slumber state capable?
 #define AHCI_CAP_PSC (1 << 13) // Partial state capable
 #define AHCI_CAP_SALP (1 << 26) // Supports aggressive link power management
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1) // Number of command slots
 
 #define AHCI_CAP2_NVMHCI (1 << 1) // NVMHCI Present
 #define AHCI_CAP2_BOHC (1 << 0) // BIOS/OS Handoff
@@ -328,13 +330,29 @@ typedef struct tagHBA_CMD_TBL
 #define HBA_PxCMD_ICC 	(0xf << 28)
 #define HBA_PxCMD_ICC_ACTIVE (1 << 28)
 
+#define HBA_PxIS_DHRS	(1 << 0) // Device to host register FIS
+#define HBA_PxIS_PSS	(1 << 1) // PIO setup FIS
+#define HBA_PxIS_DSS	(1 << 2) // DMA setup FIS
+#define HBA_PxIS_SDBS	(1 << 3) // Set device bits FIS (NCQ completion)
+#define HBA_PxIS_DPS	(1 << 5) // Descriptor processed
+#define HBA_PxIS_IFS	(1 << 27) // Interface fatal error
+#define HBA_PxIS_HBDS	(1 << 28) // Host bus data error
+#define HBA_PxIS_HBFS	(1 << 29) // Host bus fatal error
+#define HBA_PxIS_TFES	(1 << 30) // Task file error
+#define HBA_PxIS_ERROR	(HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
 #define HBA_PORT_IPM_ACTIVE 1
 
 #define HBA_PxSSTS_DET 0xfULL
 #define HBA_PxSSTS_DET_INIT 1
 #define HBA_PxSSTS_DET_PRESENT 3
 
+#define AHCI_MAX_SLOTS 32
+#define AHCI_PRDT_MAX_ENTRIES ((PAGE_SIZE_4K - 0x80) / sizeof(hba_prdt_entry_t)) // Each command table gets one page
+#define AHCI_MAX_TRANSFER 0x80000 // Largest transfer issued as a single command (512KB)
+
 #include <devicemanager.h>
+#include <diskqueue.h>
 
 namespace AHCI{
 	enum AHCIStatus{
@@ -343,18 +361,33 @@ namespace AHCI{
 		Active = 2,
 	};
 
-	class Port : public DiskDevice{
+	class Port : public DiskDevice, public DiskQueue{
 	public:
 		Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem);
 
 		int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 		int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 
+		// Switch from polling to interrupt driven completion
+		void EnableInterrupts();
+
+		// Called from the controller interrupt handler
+		void OnInterrupt();
+
+		// Measure sequential and random read IOPS
+		void Benchmark();
+
         int blocksize = 512;
 		AHCIStatus status = AHCIStatus::Uninitialized;
 	private:
+		int BuildPRDT(hba_cmd_tbl_t* commandTable, uint8_t* buffer, uint32_t size);
+		int Submit(DiskRequest& req, uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+		int Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+
+		void ProcessCompletions() override;
+		void HandleError();
+
 		int FindCmdSlot();
-		int Access(uint64_t lba, uint32_t count, int write);
 		void Identify();
 
 		hba_port_t* registers;
@@ -362,7 +395,14 @@ namespace AHCI{
 		hba_cmd_header_t* commandList; // Address Mapping of the Command List
 		void* fis; // Address Mapping of the FIS
 
-		hba_cmd_tbl_t* commandTables[8];
+		hba_cmd_tbl_t* commandTables[AHCI_MAX_SLOTS];
+
+		unsigned slotCount = 1; // Usable command slots
+		bool ncq = false; // Using FPDMA queued commands
+		bool addressing64 = false; // HBA supports 64-bit DMA addresses
+		uint64_t sectorCount = 0;
+
+		uint32_t issuedSlots = 0; // Slots issued to the HBA and not yet completed
 
 		uint64_t bufPhys;
 		void* bufVirt;
@@ -30,6 +30,14 @@
 
 #define LOCAL_APIC_BASE 0xFFFFFFFFFF000
 
+#define LOCAL_APIC_LVT_MASKED (1 << 16)
+
+#define LOCAL_APIC_TIMER_MODE_ONE_SHOT 0
+#define LOCAL_APIC_TIMER_MODE_PERIODIC (1 << 17)
+#define LOCAL_APIC_TIMER_MODE_TSC_DEADLINE (2 << 17)
+
+#define LOCAL_APIC_TIMER_DIVIDE_16 0x3
+
 #define ICR_VECTOR(x) (x & 0xFF)
 #define ICR_MESSAGE_TYPE_FIXED 0
 #define ICR_MESSAGE_TYPE_LOW_PRIORITY (1 << 8)
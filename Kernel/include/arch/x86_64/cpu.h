@@ -2,9 +2,11 @@
 
 #include <device.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <tss.h>
 #include <scheduler.h>
 #include <list.h>
+#include <physicalallocator.h>
 
 typedef struct {
 	uint16_t limit;
@@ -13,6 +15,8 @@ typedef struct {
 
 struct CPU{
 	CPU* self;
+	uint64_t syscallKernelStack; // Kernel stack of the current thread, loaded on SYSCALL entry
+	uint64_t syscallUserStack; // User stack pointer is saved here on SYSCALL entry
     uint64_t id; // APIC/CPU id
     void* gdt; // GDT
 	gdt_ptr_t gdtPtr;
@@ -20,9 +24,18 @@ struct CPU{
 	process_t* idleProcess = nullptr;
 	volatile int runQueueLock = 0;
 	FastList<thread_t*>* runQueue;
+	uint64_t minVruntime = 0; // Lowest virtual runtime in the run queue, only ever increases
+	uint64_t lastSchedule = 0; // Uptime in ns when the scheduler last ran, what the current thread has used is measured from here
+	Memory::PhysicalBlockCache pageCache;
+	volatile int tlbFlushPending = 0; // Set by ShootdownTLB until this processor has flushed its TLB
+	uint8_t* copyWindow = nullptr; // Kernel page the page fault handler maps frames at to fill them, only used with interrupts disabled
     tss_t tss __attribute__((aligned(16))); 
 };
 
+// Accessed through GS in syscall.asm
+static_assert(offsetof(CPU, syscallKernelStack) == 8);
+static_assert(offsetof(CPU, syscallUserStack) == 16);
+
 enum {
 	CPUID_ECX_SSE3 = 1 << 0,
 	CPUID_ECX_PCLMUL = 1 << 1,
@@ -46,6 +59,7 @@ enum {
 	CPUID_ECX_x2APIC = 1 << 21,
 	CPUID_ECX_MOVBE = 1 << 22,
 	CPUID_ECX_POPCNT = 1 << 23,
+	CPUID_ECX_TSC_DEADLINE = 1 << 24,
 	CPUID_ECX_AES = 1 << 25,
 	CPUID_ECX_XSAVE = 1 << 26,
 	CPUID_ECX_OSXSAVE = 1 << 27,
@@ -105,6 +119,13 @@ static inline CPU* GetCPULocal(){
 	return ret;
 }
 
+// Reads currentThread with a single instruction, so the result stays right even if the thread gets moved to another processor
+static inline thread_t* GetCurrentThread(){
+	thread_t* ret;
+	asm volatile("swapgs; movq %%gs:%c1, %0; swapgs;" : "=r"(ret) : "i"(offsetof(CPU, currentThread)));
+	return ret;
+}
+
 static inline int CheckInterrupts()
 {
     unsigned long flags;
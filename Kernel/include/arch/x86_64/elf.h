@@ -48,6 +48,10 @@ typedef struct {
 #define PT_PHDR 6
 
 typedef struct process process_t;
+class FsNode;
 
 int VerifyELF(void* elf);
-elf_info_t LoadELFSegments(process_t* proc, void* elf, uintptr_t base);
\ No newline at end of file
+
+// Loads the PT_LOAD segments of an ELF into proc. Whole pages of file data are mapped from the page cache
+// (private, copied on write) rather than copied, .bss is demand zero. entry is 0 on failure.
+elf_info_t LoadELFSegments(process_t* proc, FsNode* node, uintptr_t base);
\ No newline at end of file
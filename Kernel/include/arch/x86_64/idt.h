@@ -5,8 +5,13 @@
 
 #define IRQ0 32
 
+#define IRQ_DYNAMIC_BASE 48 // Vectors handed out to drivers using MSI/MSI-X
+#define IRQ_DYNAMIC_COUNT 16
+
 #define IPI_HALT 0xFE
 #define IPI_SCHEDULE 0xFD
+#define IRQ_LOCAL_TIMER 0xFC // Local APIC timer, dispatched the same way as an IPI
+#define IPI_TLB_SHOOTDOWN 0xFB // Flush the TLB after page table entries were made more restrictive
 
 typedef struct {
 	uint16_t base_low;
@@ -30,6 +35,9 @@ extern "C" void idt_flush();
 namespace IDT{
 	void Initialize();
 	void RegisterInterruptHandler(uint8_t interrupt, isr_t handler);
+
+	// Reserve a vector in the dynamic range, returns -1 if there are none left
+	int ReserveUnusedInterrupt();
 	
 	void DisablePIC();
 
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <system.h>
+#include <spin.h>
 
 #define KERNEL_VIRTUAL_BASE 0xFFFFFFFF80000000ULL
 #define IO_VIRTUAL_BASE (KERNEL_VIRTUAL_BASE - 0x100000000ULL) // KERNEL_VIRTUAL_BASE - 4GB
@@ -33,6 +34,10 @@
 #define PAGE_USER (1 << 2)
 #define PAGE_WRITETHROUGH (1 << 3)
 #define PAGE_CACHE_DISABLED (1 << 4)
+#define PAGE_DEMAND_ZERO (1 << 9) // Available to the OS, page is not present yet and is zero filled when first accessed
+#define PAGE_FILE (1 << 10) // Available to the OS, page belongs to a file mapping. If present the frame belongs to the page cache
+#define PAGE_COW (1 << 11) // Available to the OS, read only page that gets copied when written to. Without PAGE_FILE the frame is reference counted anonymous memory shared after fork
+#define PAGE_SHARED (1ULL << 52) // Available to the OS, frame is not owned by the address space (shared memory, framebuffer), never copied or freed
 #define PAGE_FRAME 0xFFFFFFFFFF000
 
 #define PAGE_SIZE_4K 4096
@@ -69,6 +74,7 @@ typedef struct{ // Each process will have a maximum of 96GB of virtual memory.
     pml4_entry_t* pml4;
     uint64_t pdptPhys;
     uint64_t pml4Phys;
+    lock_t faultLock; // Held whilst a page fault is being resolved
 } __attribute__((packed)) address_space_t;
 
 namespace Memory{
@@ -92,6 +98,9 @@ namespace Memory{
 
     void Free4KPages(void* addr, uint64_t amount, address_space_t* addressSpace);
 
+    // Reserve amount pages at addr, fails if the region is out of range or any page in it is already mapped
+    bool Reserve4KPages(uintptr_t addr, uint64_t amount, address_space_t* addressSpace);
+
     void* KernelAllocate4KPages(uint64_t amount);
     void* KernelAllocate2MPages(uint64_t amount);
     void* KernelAllocate1GPages(uint64_t amount);
@@ -102,17 +111,42 @@ namespace Memory{
     void KernelMapVirtualMemory2M(uint64_t phys, uint64_t virt, uint64_t amount);
     void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount);
     void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags);
-    void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, address_space_t* addressSpace);
+    void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, address_space_t* addressSpace, uint64_t flags = 0);
+
+    // Mark pages as demand zero, a frame is only allocated (and cleared) once the page is first accessed
+    void MapDemandZero4K(uint64_t virt, uint64_t amount, address_space_t* addressSpace);
+
+    // Mark pages as file backed, they are brought in from the file mapping covering them when first accessed
+    void MapFile4K(uint64_t virt, uint64_t amount, address_space_t* addressSpace);
 
     uintptr_t GetIOMapping(uintptr_t addr);
 
     address_space_t* CreateAddressSpace();
+
+    // Copy the user half of src (the current address space) into dest (which must be empty) for fork.
+    // Anonymous pages are shared copy-on-write, the writable ones become read only in both address spaces.
+    // inUse is set if other threads may be running in src, their TLBs are flushed before anything is shared.
+    // Returns -ENOMEM if there is not enough memory for the page tables.
+    int CloneAddressSpace(address_space_t* src, address_space_t* dest, bool inUse);
+
+    // Flush the TLB of every other processor, can be called with interrupts disabled
+    void ShootdownTLB();
     void ChangeAddressSpace(address_space_t*);
     bool CheckRegion(uintptr_t addr, uint64_t len, address_space_t* addressSpace);
 	bool CheckUsermodePointer(uintptr_t addr, uint64_t len, address_space_t* addressSpace);
+
+    // Back every page of a user buffer (and copy it if write is set and it is copy on write) before the kernel touches it.
+    // Resolving a fault can block on the disk and take file system locks, so this must be done before copying
+    // to or from user memory with a lock held. Pages of user memory are never taken away once backed.
+    // Returns false if part of the buffer is not mapped, kernel buffers are left alone.
+    bool PrefaultUserBuffer(uintptr_t addr, uint64_t len, bool write);
     uint64_t VirtualToPhysicalAddress(uint64_t addr);
     uint64_t VirtualToPhysicalAddress(uint64_t addr, address_space_t* addressSpace);
 
+    // Get the physical address (including the page offset) backing a kernel address or an address in addressSpace
+    // Returns 0 if it is not mapped, used to point DMA straight at a buffer
+    uint64_t GetPhysicalAddress(uintptr_t addr, address_space_t* addressSpace);
+
     void SwitchPageDirectory(uint64_t phys);
     
 	void PageFaultHandler(regs64_t* regs);
@@ -38,6 +38,22 @@
 
 #define PCI_CLASS_COPROCESSOR 0x40
 
+#define PCI_STATUS_CAPABILITIES (1 << 4)
+
+#define PCI_CONFIG_CAPABILITIES_PTR 0x34
+
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_MSIX 0x11
+
+#define PCI_MSI_CONTROL_ENABLE (1 << 0)
+#define PCI_MSI_CONTROL_64BIT (1 << 7)
+#define PCI_MSIX_CONTROL_TABLE_SIZE 0x7FF
+#define PCI_MSIX_CONTROL_FUNCTION_MASK (1 << 14)
+#define PCI_MSIX_CONTROL_ENABLE (1 << 15)
+#define PCI_MSIX_VECTOR_MASKED 1
+
+#define PCI_MSI_ADDRESS(apicID) (0xFEE00000 | ((apicID & 0xFF) << 12)) // Fixed delivery to a single local APIC
+
 #define PCI_IO_PORT_CONFIG_ADDRESS 0xCF8
 #define PCI_IO_PORT_CONFIG_DATA 0xCFC
 
@@ -137,9 +153,32 @@ typedef struct {
 	bool generic = false;
 } pci_device_t;
 
+typedef struct {
+	volatile uint32_t* table; // Mapping of the MSI-X table, 4 dwords per vector
+	uint16_t size; // Number of vectors
+	uint8_t capability; // Offset of the MSI-X capability in configuration space
+} pci_msix_t;
+
 namespace PCI{
 	uint16_t ReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 	void Config_WriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data);
+	uint32_t Config_ReadDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+	void Config_WriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data);
+
+	// Returns the offset of the capability in configuration space, 0 if the device does not have it
+	uint8_t FindCapability(const pci_device_t& device, uint8_t id);
+
+	// Get the (64-bit aware) physical address of a memory BAR
+	uintptr_t GetBaseAddressRegister(const pci_device_t& device, uint8_t index);
+
+	// Enable MSI with a single vector delivered to apicID, disables legacy interrupts
+	bool EnableMSI(const pci_device_t& device, uint8_t vector, uint8_t apicID);
+
+	// Map the MSI-X table and enable MSI-X with every vector masked, disables legacy interrupts
+	bool InitializeMSIX(const pci_device_t& device, pci_msix_t& msix);
+
+	// Point MSI-X table entry index at vector on apicID and unmask it
+	void SetMSIXVector(pci_msix_t& msix, unsigned index, uint8_t vector, uint8_t apicID);
 	void RegsiterPCIVendor(pci_vendor_t vendor);
 	pci_device_t RegisterPCIDevice(pci_device_t device);
 	bool CheckDevice(uint8_t bus, uint8_t device, uint8_t func);
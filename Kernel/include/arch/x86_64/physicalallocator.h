@@ -10,19 +10,35 @@
 // The amount of blocks in a byte
 #define PHYSALLOC_BLOCKS_PER_BYTE 8
 
-// The size of the memory bitmap in dwords
-#define PHYSALLOC_BITMAP_SIZE_DWORDS 524488 // 64GB
+// The maximum amount of physical memory blocks we can manage
+#define PHYSALLOC_MAX_BLOCKS 0x1000000ULL // 64GB
+
+// Buddy allocator orders, each order is twice the size of the last
+#define PHYSALLOC_ORDER_4K 0
+#define PHYSALLOC_ORDER_2M 9
+#define PHYSALLOC_ORDER_1G 18
+#define PHYSALLOC_MAX_ORDER PHYSALLOC_ORDER_1G
+
+// Size of the per-CPU block cache and the amount of blocks moved to/from the global pool at once
+#define PHYSALLOC_CPU_CACHE_SIZE 64
+#define PHYSALLOC_CPU_CACHE_BATCH 32
 
 extern void* kernel_end;
 
 namespace Memory{
+    // Per-CPU cache of free 4K blocks, sits in front of the global allocator
+    struct PhysicalBlockCache{
+        uint64_t blocks[PHYSALLOC_CPU_CACHE_SIZE]; // Block indexes
+        unsigned count = 0;
+
+        uint64_t hits = 0; // Allocations and frees served from the cache
+        uint64_t refills = 0; // Batches taken from the global pool
+        uint64_t drains = 0; // Batches returned to the global pool
+    };
 
     // Initialize the physical page allocator
     void InitializePhysicalAllocator(memory_info_t* mem_info);
 
-    // Finds the first free block in physical memory
-    uint64_t GetFirstFreeMemoryBlock();
-
     // Marks a region in physical memory as being used
     void MarkMemoryRegionUsed(uint64_t base, size_t size);
 
@@ -35,10 +51,36 @@ namespace Memory{
     // Allocates a 2MB block of physical memory
     uint64_t AllocateLargePhysicalMemoryBlock();
 
+    // Allocates (PHYSALLOC_BLOCK_SIZE << order) bytes of contiguous, naturally aligned physical memory
+    // Returns 0 if there is no block of the requested size available
+    uint64_t AllocatePhysicalMemoryBlocks(unsigned order);
+
     // Frees a block of physical memory
+    // If the block is shared this drops a reference instead, it is only freed once the last one is gone
     void FreePhysicalMemoryBlock(uint64_t addr);
 
+    // Adds a reference to a block of physical memory that is now mapped in another address space
+    void ReferencePhysicalMemoryBlock(uint64_t addr);
+
+    // Checks whether a block of physical memory has more than one reference
+    bool PhysicalMemoryBlockShared(uint64_t addr);
+
+    // Frees a 2MB block of physical memory
+    void FreeLargePhysicalMemoryBlock(uint64_t addr);
+
+    // Frees a block of physical memory allocated with AllocatePhysicalMemoryBlocks
+    void FreePhysicalMemoryBlocks(uint64_t addr, unsigned order);
+
+    // Start using the per-CPU block caches, CPU local data must be set up
+    void EnablePhysicalBlockCaches();
+
+    // Get the amount of blocks held in per-CPU caches
+    uint64_t GetCachedPhysicalBlocks();
+
+    // Checks the physical allocator and reports allocation throughput
+    void PhysicalAllocatorSelfTest();
+
     // Used Blocks of Memory
     extern uint64_t usedPhysicalBlocks;
     extern uint64_t maxPhysicalBlocks;
-}
\ No newline at end of file
+}
@@ -7,6 +7,7 @@
 #include <list.h>
 #include <vector.h>
 #include <fs/filesystem.h>
+#include <fs/pagecache.h>
 #include <lock.h>
 #include <timer.h>
 #include <hash.h>
@@ -33,6 +34,8 @@ typedef struct process {
 	pid_t pid = -1; // PID
 	address_space_t* addressSpace; // Pointer to page directory and tables
 	List<mem_region_t> sharedMemory; // Used to ensure these memory regions don't get freed when a process is terminated
+	lock_t sharedMemoryLock = 0; // Protects sharedMemory, other threads can map and unmap whilst it is walked
+	FastList<file_mapping_t*> fileMappings; // Only changed with addressSpace->faultLock held
 	uint8_t state = ThreadStateRunning; // Process state
 	Vector<thread_t*> threads;
 	uint32_t threadCount = 0; // Amount of threads
@@ -46,7 +49,7 @@ typedef struct process {
 	char name[NAME_MAX];
 
 	timeval_t creationTime; // When the process was created
-	uint64_t activeTicks = 0; // How many ticks this process has been active
+	uint64_t activeNs = 0; // How long this process has been active
 
 	Vector<fs_fd_t*> fileDescriptors;
 	List<message_t> messageQueue;
@@ -68,13 +71,22 @@ typedef struct {
 
 	uint64_t runningTime; // Amount of time in seconds that the process has been running
 	uint64_t activeUs;
+
+	uint64_t waitUs; // Time the process's threads have spent runnable but waiting for a processor
+	uint64_t maxWaitUs; // Longest any thread has waited for a processor
+	uint8_t schedClass; // Scheduling class of the main thread
+	int8_t nice; // Nice value of the main thread
 } process_info_t;
 
 namespace Scheduler{
     pid_t CreateChildThread(process_t* process, uintptr_t entry, uintptr_t stack);
 
+    // Duplicate parent and the calling thread for fork, regs are the registers the calling thread entered the syscall with
+    // Returns nullptr if there is not enough memory for the child
+    process_t* CloneProcess(process_t* parent, regs64_t* regs);
+
     process_t* CreateProcess(void* entry);
-	process_t* CreateELFProcess(void* elf, int argc = 0, char** argv = nullptr, int envc = 0, char** envp = nullptr);
+	process_t* CreateELFProcess(FsNode* node, int argc = 0, char** argv = nullptr, int envc = 0, char** envp = nullptr);
 
 	process_t* GetCurrentProcess();
 
@@ -92,6 +104,9 @@ namespace Scheduler{
     uint64_t GetNextProccessPID(uint64_t pid);
 	void InsertNewThreadIntoQueue(thread_t* thread);
 
+	// Set the scheduling class and nice value of a thread, returns 0 on success or a negative error
+	int SetThreadScheduling(thread_t* thread, int schedClass, int nice);
+
     void Initialize();
     void Tick(regs64_t* r);
 
@@ -1,3 +1,6 @@
 #pragma once
 
-void InitializeSyscalls();
\ No newline at end of file
+void InitializeSyscalls();
+
+// Enable the SYSCALL/SYSRET entry path on the current processor
+void InitializeFastSyscalls();
\ No newline at end of file
@@ -16,6 +16,12 @@ extern "C"{
     uint32_t inportl(uint16_t port);
 }
 
+// GDT selectors, user data has to directly precede user code for SYSRET
+#define KERNEL_CS 0x08
+#define KERNEL_SS 0x10
+#define USER_SS 0x1B // User data, RPL 3
+#define USER_CS 0x23 // User code, RPL 3
+
 typedef struct {
     uint64_t r15;
     uint64_t r14;
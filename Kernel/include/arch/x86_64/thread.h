@@ -4,19 +4,31 @@
 #include <list.h>
 
 #define THREAD_TIMESLICE_DEFAULT 7
+
+#define THREAD_NICE_MIN -20
+#define THREAD_NICE_MAX 19
+#define THREAD_NICE_0_WEIGHT 1024
 typedef uint64_t pid_t;
 
 enum {
 	ThreadStateRunning,
 	ThreadStateBlocked,
+	ThreadStateDying, // Process is being killed, never gets unblocked
+};
+
+enum {
+	SchedulingClassFair, // Share the processor in proportion to their weight, the thread with the least virtual runtime goes next
+	SchedulingClassInteractive, // Always run before fair threads and preempt them when woken, ordered by nice value
 };
 
 struct process;
 struct thread;
+struct CPU;
 
 typedef struct thread {
 	lock_t lock = 0; // Thread lock
 	lock_t stateLock = 0; // Thread state lock
+	lock_t switchLock = 0; // Held by the processor running on the thread's stack, released by TaskSwitch once it has left it
 
 	process* parent; // Parent Process
 	void* stack; // Pointer to the initial stack
@@ -30,11 +42,21 @@ typedef struct thread {
 	thread* next; // Next thread in queue
 	thread* prev; // Previous thread in queue
 	
-	uint8_t priority; // Thread priority
+	uint8_t schedClass; // Scheduling class
+	int8_t nice; // Nice value, THREAD_NICE_MIN to THREAD_NICE_MAX
+	uint32_t weight; // Derived from the nice value, THREAD_NICE_0_WEIGHT at nice 0
+	uint64_t vruntime; // Virtual runtime, ticks spent running scaled by THREAD_NICE_0_WEIGHT / weight
 	uint8_t state; // Thread state
+	bool inRunQueue; // Blocked threads are taken off their run queue, protected by stateLock
+	CPU* cpu; // Run queue the thread is in (or was last in)
 
 	uint64_t fsBase;
 
+	uint64_t activeNs; // Time spent running
+	uint64_t waitNs; // Time spent runnable but waiting for a processor
+	uint64_t maxWaitNs; // Longest wait for a processor
+	uint64_t readySince; // Uptime in ns when the thread last became runnable
+
 	List<List<thread*>*> waiting; // Thread is waiting in these queues
 } thread_t;
 
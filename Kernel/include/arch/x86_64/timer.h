@@ -20,19 +20,48 @@ typedef struct timespec {
 struct thread;
 
 namespace Timer{
+    // Wakes a thread once the deadline has passed, events are kept in a per processor pairing heap
+    struct TimerEvent {
+        uint64_t deadline = 0; // Nanoseconds since boot
+        struct thread* thread = nullptr; // Thread to unblock
+
+        int cpu = -1; // Processor whose queue the event is in, -1 if it is not queued. Set last when the event fires.
+
+        TimerEvent* child = nullptr;
+        TimerEvent* sibling = nullptr;
+        TimerEvent* prev = nullptr; // Parent if we are the first child, otherwise the previous sibling
+    };
 
     timeval_t GetSystemUptimeStruct();
     int TimeDifference(timeval_t newTime, timeval_t oldTime);
 
     uint64_t GetSystemUptime();
+    uint64_t GetSystemUptimeNs(); // Nanoseconds since boot, read from the TSC
     uint32_t GetTicks();
-    uint32_t GetFrequency();
+    uint64_t GetSystemTicks(); // Scheduler ticks since boot
+    uint32_t GetFrequency(); // Scheduler tick frequency
 
     void Wait(long ms);
 
+    // Queue an event on the current processor, interrupts must be disabled
+    void AddTimer(TimerEvent* event);
+    // Returns false if the event has already fired, the event can be freed once this returns
+    bool RemoveTimer(TimerEvent* event);
+
     void SleepCurrentThread(timeval_t& time);
     void SleepCurrentThread(long ticks);
+    void SleepCurrentThreadNs(uint64_t ns);
+
+    // Tell the timer whether the current processor needs scheduler ticks, idle processors only wake for their own events.
+    // Interrupts must be disabled
+    void SetLocalTick(bool tick);
 
-    // Initialize
+    // Calibrate the TSC against the PIT
     void Initialize(uint32_t freq);
-}
\ No newline at end of file
+
+    // Calibrate the local APIC timer, must be called after APIC::Initialize
+    void InitializeLocalTimers();
+
+    // Start the local APIC timer of the current processor
+    void EnableLocalTimer();
+}
@@ -36,6 +36,13 @@
 #define ATA_CMD_READ_DMA_EX     0x25
 #define ATA_CMD_WRITE_DMA_EX    0x35
 #define ATA_CMD_IDENTIFY        0xec
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60 // NCQ read
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61 // NCQ write
+
+#define ATA_IDENTIFY_QUEUE_DEPTH    75 // Word containing the maximum queue depth - 1
+#define ATA_IDENTIFY_SATA_CAP       76 // SATA capabilities word
+#define ATA_IDENTIFY_SATA_CAP_NCQ   (1 << 8)
+#define ATA_IDENTIFY_LBA48_SECTORS  100 // Words 100-103 contain the amount of LBA48 sectors
 
 #define ATA_PRD_BUFFER(x) (x & 0xFFFFFFFF)
 #define ATA_PRD_TRANSFER_SIZE(x) ((x & 0xFFFF) << 32)
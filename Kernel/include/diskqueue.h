@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <spin.h>
+#include <thread.h>
+#include <paging.h>
+
+#define DISK_QUEUE_MAX_SLOTS 32
+
+// Get the physical address of a kernel or current process buffer, 0 if it is not mapped
+uintptr_t BufferPhysicalAddress(uintptr_t addr);
+
+// Call segment(phys, size) for each page of buffer, returns false if a page is not mapped or segment returns false
+template<typename F>
+bool ForEachBufferPage(uint8_t* buffer, uint32_t size, F segment){
+    uintptr_t addr = reinterpret_cast<uintptr_t>(buffer);
+    while(size){
+        uint32_t chunk = PAGE_SIZE_4K - (addr & (PAGE_SIZE_4K - 1));
+        if(chunk > size) chunk = size;
+
+        uintptr_t phys = BufferPhysicalAddress(addr);
+        if(!phys || !segment(phys, chunk)){
+            return false;
+        }
+
+        addr += chunk;
+        size -= chunk;
+    }
+
+    return true;
+}
+
+// Commands submitted together, completed from the interrupt handler
+struct DiskRequest{
+    volatile unsigned pending = 0; // Commands still in flight
+    volatile int error = 0;
+    thread_t* waiter = nullptr; // Woken when pending reaches 0
+
+    uint32_t slots = 0; // Slots owned by this request, released once it has been waited on
+
+    struct {
+        uint8_t slot;
+        uint8_t* buffer;
+        uint32_t size;
+    } bounces[DISK_QUEUE_MAX_SLOTS]; // Reads that went through a bounce buffer and need copying out
+    unsigned bounceCount = 0;
+};
+
+// Command slots of a controller queue, shared between requests
+class DiskQueue{
+public:
+    virtual ~DiskQueue() = default;
+
+    // Returns a free slot, or -1 if req already owns some and has to wait on them first
+    int AcquireSlot(DiskRequest& req);
+
+    // Wait for all of the request's commands and release its slots
+    int Wait(DiskRequest& req);
+
+    bool useInterrupts = false; // Set once the interrupt handler is installed, otherwise completions are polled
+protected:
+    // Allocate a bounce page for each of count slots
+    void InitializeSlots(unsigned count);
+
+    // Stage buffer in the slot's bounce page for a controller that can't reach it, returns the size covered
+    uint32_t Bounce(DiskRequest& req, int slot, uint8_t* buffer, uint32_t size, bool write);
+
+    // Both of these must be called with queueLock held and interrupts disabled
+    void Issue(DiskRequest& req, int slot);
+    void Complete(int slot);
+
+    // Check the controller for finished commands, called with queueLock held and interrupts disabled
+    virtual void ProcessCompletions() = 0;
+
+    bool CanBlock();
+
+    lock_t queueLock = 0; // Interrupts must be disabled while this is held
+    uint32_t slotMask = 0; // Usable slots
+    uint32_t reservedSlots = 0; // Slots owned by a request
+    DiskRequest* slotRequests[DISK_QUEUE_MAX_SLOTS];
+
+    uint64_t bouncePhys[DISK_QUEUE_MAX_SLOTS]; // Per slot bounce pages
+    uint8_t* bounceVirt[DISK_QUEUE_MAX_SLOTS];
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <device.h>
+#include <hash.h>
+#include <list.h>
+#include <lock.h>
+#include <spin.h>
+
+#include <stdint.h>
+
+#define BLOCK_CACHE_DEFAULT_SIZE 0x1000000 // 16MB
+#define BLOCK_CACHE_FLUSH_INTERVAL 5000 // Write back dirty blocks every 5s
+#define BLOCK_CACHE_PREFETCH_QUEUE 16 // Read-ahead requests waiting for the cache thread, more are dropped
+
+namespace fs{
+    // Size capped write-back cache of filesystem blocks.
+    // Blocks are evicted with the CLOCK algorithm, dirty blocks are written back
+    // when evicted, on Flush() or periodically by the cache thread, which also does read-ahead.
+    //
+    // The lock is never held for disk I/O. Entries being read in or written back are marked busy,
+    // they can't be evicted and anyone else wanting them sleeps until the I/O is done.
+    class BlockCache{
+        struct CachedBlock{
+            uint32_t block;
+            uint8_t* data = nullptr;
+            bool valid = false;
+            bool dirty = false; // Only cleared once the write back has completed
+            bool referenced = false;
+            bool busy = false; // Being read from or written to disk
+        };
+
+        PartitionDevice* part;
+        uint32_t blockSize;
+        uint32_t lbaPerBlock;
+
+        CachedBlock* entries;
+        unsigned capacity;
+        unsigned clockHand = 0;
+
+        HashMap<uint32_t, CachedBlock*> index;
+        lock_t lock = 0;
+
+        List<Semaphore*> ioWaiters; // Threads waiting for a busy entry
+        int writeError = 0; // Last failed write back when evicting, returned by the next Flush()
+
+        struct PrefetchRequest{
+            uint32_t block;
+            unsigned count;
+        };
+
+        PrefetchRequest prefetchQueue[BLOCK_CACHE_PREFETCH_QUEUE];
+        unsigned prefetchHead = 0;
+        unsigned prefetchCount = 0;
+
+        CachedBlock* Lookup(uint32_t block);
+        CachedBlock* Get(uint32_t block, bool& found);
+        CachedBlock* Evict();
+        int WriteBack(CachedBlock* entry);
+
+        void WaitForIO();
+        void WakeIOWaiters();
+
+        void ReadAhead(uint32_t block, unsigned count);
+    public:
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t writebacks = 0;
+        uint64_t readAheads = 0; // Blocks brought in by Prefetch()
+        unsigned dirtyCount = 0;
+
+        BlockCache(PartitionDevice* part, uint32_t blockSize, size_t maxSize = BLOCK_CACHE_DEFAULT_SIZE);
+        ~BlockCache();
+
+        /////////////////////////////
+        /// \brief Read a block through the cache, caching it on a miss
+        /////////////////////////////
+        int Read(uint32_t block, void* buffer);
+
+        /////////////////////////////
+        /// \brief Write a block into the cache, it is written back to disk later
+        /////////////////////////////
+        int Write(uint32_t block, void* buffer);
+
+        /////////////////////////////
+        /// \brief Read a block, only using the cache if it is already present
+        /////////////////////////////
+        int ReadUncached(uint32_t block, void* buffer);
+
+        /////////////////////////////
+        /// \brief Read a run of contiguous blocks into buffer
+        ///
+        /// Blocks that are not cached are read from disk straight into buffer with as few requests as possible
+        /// and are not added to the cache. Blocks cached while the disk read was in progress are copied over it.
+        /////////////////////////////
+        int ReadBlocks(uint32_t block, unsigned count, void* buffer);
+
+        /////////////////////////////
+        /// \brief Queue a run of contiguous blocks to be read into the cache by the cache thread, returns straight away
+        /////////////////////////////
+        void Prefetch(uint32_t block, unsigned count);
+
+        /////////////////////////////
+        /// \brief Carry out queued read-ahead, called by the cache thread
+        /////////////////////////////
+        void RunPrefetches();
+
+        /////////////////////////////
+        /// \brief Write a block straight to disk, updating any cached copy
+        /////////////////////////////
+        int WriteThrough(uint32_t block, void* buffer);
+
+        /////////////////////////////
+        /// \brief Drop a block from the cache without writing it back (e.g. it has been freed)
+        /////////////////////////////
+        void Invalidate(uint32_t block);
+
+        /////////////////////////////
+        /// \brief Write a block back to disk if it is dirty
+        ///
+        /// \return 0 on success, otherwise the disk error
+        /////////////////////////////
+        int Flush(uint32_t block);
+
+        /////////////////////////////
+        /// \brief Write all dirty blocks back to disk
+        ///
+        /// \return 0 on success, otherwise the last disk error (including write backs that failed on eviction since the last call)
+        /////////////////////////////
+        int Flush();
+
+        inline size_t MemoryUsage() const { return static_cast<size_t>(capacity) * blockSize; }
+    };
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <fs/filesystem.h>
+
+#include <stdint.h>
+
+#define DENTRY_CACHE_MAX_ENTRIES 4096
+#define DENTRY_CACHE_BUCKETS 1024
+
+namespace fs{
+    // Global cache of directory lookups keyed by (parent node, name).
+    // Only directories with cacheDentries set are cached. Failed lookups are cached too (negative entries).
+    // Every cached entry holds a reference (handleCount) to its parent and node so neither can be freed and reused while cached.
+    namespace DentryCache{
+        extern uint64_t hits;
+        extern uint64_t negativeHits; // Hits on entries for names that do not exist
+        extern uint64_t misses;
+
+        /////////////////////////////
+        /// \brief Look up name in parent
+        ///
+        /// \param node Set to the cached node, nullptr for a negative entry
+        ///
+        /// \return true if the lookup was cached
+        /////////////////////////////
+        bool Lookup(FsNode* parent, const char* name, FsNode*& node);
+
+        /////////////////////////////
+        /// \brief Cache the result of a lookup
+        ///
+        /// \param node Node found, nullptr if there is no such entry
+        /// \param generation Value of Generation() from before the lookup, nothing is cached if the cache has been invalidated since
+        /////////////////////////////
+        void Insert(FsNode* parent, const char* name, FsNode* node, uint64_t generation);
+
+        uint64_t Generation();
+
+        /////////////////////////////
+        /// \brief Drop the entry for name in parent, call before a directory entry is created or removed
+        ///
+        /// If the entry was for a directory, everything cached under it is dropped too.
+        /// Nothing is cached until the matching EndChange, so the filesystem sees no references held by the cache.
+        /////////////////////////////
+        void BeginChange(FsNode* parent, const char* name);
+
+        /////////////////////////////
+        /// \brief Call once the change started by BeginChange has been made
+        /////////////////////////////
+        void EndChange();
+    }
+}
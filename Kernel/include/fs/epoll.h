@@ -0,0 +1,109 @@
+#pragma once
+
+#include <fs/filesystem.h>
+#include <list.h>
+#include <spin.h>
+
+#define FS_NODE_EPOLL 0xE000 // Not a real file type, epoll instances can only be reached through a file descriptor
+
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLPRI POLLPRI
+#define EPOLLHUP POLLHUP
+#define EPOLLERR POLLERR
+#define EPOLLRDHUP POLLRDHUP
+#define EPOLLONESHOT (1U << 30) // Disable the entry after one event until it is modified
+#define EPOLLET (1U << 31) // Edge triggered, only report when the node signals
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLL_WAIT_MAX_EVENTS 64 // Most events returned by one call to Wait
+
+typedef struct {
+    uint32_t events;
+    uint64_t data; // Returned with events, left alone by the kernel
+} __attribute__((packed)) epoll_event_t; // Same layout as Linux
+
+class EPoll;
+
+// A handle in an interest set, registered with the node as a watcher
+class EPollEntry : public FilesystemWatcher {
+public:
+    EPoll* epoll;
+    FsNode* node;
+    fs_fd_t* handle;
+    int fd;
+
+    uint32_t events;
+    uint64_t data;
+
+    bool ready = false; // On the ready list
+    EPollEntry* next = nullptr; // Ready list
+    EPollEntry* prev = nullptr;
+    EPollEntry* rearmNext = nullptr;
+    EPollEntry* handleNext = nullptr; // Entries in other interest sets for the same handle
+
+    EPollEntry(EPoll* epoll, fs_fd_t* handle, int fd, epoll_event_t& event) : epoll(epoll), node(handle->node), handle(handle), fd(fd), events(event.events), data(event.data) {}
+
+    void Signal() override;
+};
+
+// Persistent set of file handles to wait on.
+// Each entry is a watcher that stays registered with its node, when the node signals it the entry goes on the ready list.
+// Wait only looks at the ready list so it costs O(ready) rather than O(watched).
+class EPoll : public FsNode {
+    friend class EPollEntry;
+    using Entry = EPollEntry;
+
+    lock_t ctlLock = 0; // Held whilst entries are added, removed or armed
+    lock_t readyLock = 0;
+
+    List<Entry*> entries;
+    FastList<Entry*> readyList;
+    List<FilesystemWatcher*> watching;
+
+    static lock_t handlesLock; // Protects the entry list of every handle, taken before ctlLock
+
+    void OnReady(Entry* entry);
+    void Arm(Entry* entry);
+    void RemoveEntry(Entry* entry); // handlesLock and ctlLock must be held
+    int Harvest(epoll_event_t* events, int maxEvents);
+public:
+    EPoll();
+    ~EPoll();
+
+    /////////////////////////////
+    /// \brief Add, modify or remove a handle from the interest set
+    ///
+    /// \param op EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+    /// \param fd File descriptor of handle, entries are looked up by it
+    /// \param handle Handle to watch
+    /// \param event Events to watch for and data to return, ignored for EPOLL_CTL_DEL
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    int Control(int op, int fd, fs_fd_t* handle, epoll_event_t* event);
+
+    /////////////////////////////
+    /// \brief Wait for handles in the interest set to become ready
+    ///
+    /// \param events Array to fill with ready events
+    /// \param maxEvents Size of events
+    /// \param timeout Timeout in ms, negative to wait indefinitely
+    ///
+    /// \return Amount of events
+    /////////////////////////////
+    int Wait(epoll_event_t* events, int maxEvents, long timeout);
+
+    void Close();
+
+    bool CanRead() { return readyList.get_length(); }
+
+    void Watch(FilesystemWatcher& watcher, int events);
+    void Unwatch(FilesystemWatcher& watcher);
+
+    // Closing a handle takes it out of any interest sets it is in
+    static void OnHandleClose(fs_fd_t* handle);
+};
@@ -1,5 +1,6 @@
 #include <fs/filesystem.h>
 #include <fs/fsvolume.h>
+#include <fs/blockcache.h>
 #include <device.h>
 #include <hash.h>
 #include <lock.h>
@@ -39,6 +40,27 @@
 
 #define EXT2_ROOT_INODE_INDEX 2
 
+#define EXT2_INDEX_FL 0x1000 // Directory is indexed with a hash tree
+
+#define EXT2_FLAGS_SIGNED_HASH 0x1
+#define EXT2_FLAGS_UNSIGNED_HASH 0x2
+
+#define EXT2_HASH_LEGACY 0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA 2
+#define EXT2_HASH_LEGACY_UNSIGNED 3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED 5
+
+#define EXT2_DX_ROOT_INFO_OFFSET 24 // The root info comes after the "." and ".." entries
+#define EXT2_DX_NODE_ENTRIES_OFFSET 8 // Interior index blocks start with an empty directory entry covering the whole block
+#define EXT2_DX_BLOCK_MASK 0x0FFFFFFF
+#define EXT2_DX_MAX_LEVELS 2
+
+#define EXT2_READ_AHEAD_MIN 0x4000 // 16KB
+#define EXT2_READ_AHEAD_MAX 0x20000 // 128KB
+#define EXT2_READ_RUN_MAX 0x400000 // Largest single device request (4MB)
+
 #define EXT2_DIRECT_BLOCK_COUNT 12
 #define EXT2_SINGLY_INDIRECT_INDEX 12
 #define EXT2_DOUBLY_INDIRECT_INDEX 13
@@ -146,6 +168,24 @@ namespace fs::Ext2{
         uint8_t preallocatedBlocks; // Blocks to preallocate when a file is created
         uint8_t preallocdDirBlocks; // Blocks to preallocate when a directory is created
         uint16_t align;
+        uint8_t journalUUID[16];    // UUID of the journal superblock
+        uint32_t journalInode;      // Inode of the journal file
+        uint32_t journalDevice;     // Device number of the journal file
+        uint32_t lastOrphan;        // Start of the list of inodes to delete
+        uint32_t hashSeed[4];       // Seed for directory hashes
+        uint8_t defHashVersion;     // Default hash version for new directories
+        uint8_t journalBackupType;
+        uint16_t descSize;
+        uint32_t defaultMountOptions;
+        uint32_t firstMetaBg;
+        uint32_t mkfsTime;
+        uint32_t journalBlocks[17]; // Backup of the journal inode
+        uint32_t blockCountHigh;
+        uint32_t resvBlockCountHigh;
+        uint32_t freeBlockCountHigh;
+        uint16_t minExtraInodeSize;
+        uint16_t wantExtraInodeSize;
+        uint32_t flags;             // Signed or unsigned directory hash
     } __attribute__((packed)) ext2_superblock_extended_t; // Ext2 extended superblock
 
     typedef struct {
@@ -191,12 +231,46 @@ namespace fs::Ext2{
         char name[];
     } __attribute__((packed)) ext2_directory_entry_t;
 
+    typedef struct {
+        uint32_t reserved;          // Zero
+        uint8_t hashVersion;        // Hash used for the directory
+        uint8_t infoLength;         // Length of this structure (8)
+        uint8_t indirectLevels;     // Depth of the tree not including the leaves
+        uint8_t unusedFlags;
+    } __attribute__((packed)) ext2_dx_root_info_t; // Hash tree root, stored in the first directory block
+
+    typedef struct {
+        uint32_t hash;              // Lowest hash in the block, the lowest bit is set if the previous block has entries with the same hash
+        uint32_t block;             // Directory block (not filesystem block)
+    } __attribute__((packed)) ext2_dx_entry_t;
+
+    typedef struct {
+        uint16_t limit;             // Maximum amount of entries
+        uint16_t count;             // Amount of entries including this one
+    } __attribute__((packed)) ext2_dx_countlimit_t; // Takes the place of the hash of the first ext2_dx_entry_t
+
+    typedef struct {
+        uint8_t* buffer;            // Index block
+        ext2_dx_entry_t* entries;   // First entry of the block
+        ext2_dx_entry_t* entry;     // Entry followed down to the next level
+        ext2_dx_entry_t* end;       // Past the last entry of the block
+    } ext2_dx_frame_t; // Position in one level of the hash tree
+
     class Ext2Volume;
 
     class Ext2Node : public FsNode{ 
     protected:
         List<uint32_t> cachedBlocks;
 
+        // Sequential read detection
+        size_t readAheadOffset = 0; // Where the next read starts if access is sequential
+        uint32_t readAheadEnd = 0; // Block index up to which read-ahead has been issued
+        uint32_t readAheadWindow = 0; // In bytes
+
+        // Position of the next entry for ReadDir, the index is in the upper 32 bits and the byte offset in the lower 32
+        // so that it is updated in one go. Reset to the start whenever the directory is modified.
+        uint64_t dirCursor = 0;
+
         Ext2Volume* vol;
         ext2_inode_t e2inode;
 
@@ -246,9 +320,8 @@ namespace fs::Ext2{
         uint32_t inodeSize = 128;
 
         HashMap<uint32_t, Ext2Node*> inodeCache;
-        HashMap<uint32_t, uint8_t*> blockCache;
         HashMap<uint32_t, uint8_t*> bitmapCache;
-        unsigned blockCacheMemoryUsage;
+        BlockCache* blockCache = nullptr;
 
         inline uint32_t LocationToBlock(uint64_t l){
             return (l >> super.logBlockSize) >> 10;
@@ -266,11 +339,12 @@ namespace fs::Ext2{
             return (inode - 1) % super.inodesPerGroup;
         }
 
-        inline uint64_t InodeLBA(uint32_t inode){
-            uint32_t block = blockGroups[ResolveInodeBlockGroup(inode)].inodeTable;
-            uint64_t lba = (block * blocksize + ResolveInodeBlockGroupIndex(inode) * inodeSize) / part->parentDisk->blocksize;
+        inline uint32_t InodeBlock(uint32_t inode){
+            return blockGroups[ResolveInodeBlockGroup(inode)].inodeTable + (ResolveInodeBlockGroupIndex(inode) * inodeSize) / blocksize;
+        }
 
-            return lba;
+        inline uint32_t InodeBlockOffset(uint32_t inode){
+            return (ResolveInodeBlockGroupIndex(inode) * inodeSize) % blocksize;
         }
 
         void WriteSuperblock();
@@ -296,9 +370,17 @@ namespace fs::Ext2{
         uint32_t AllocateBlock();
         int FreeBlock(uint32_t block);
 
-        int ListDir(Ext2Node* node, List<DirectoryEntry>& entries);
-        int WriteDir(Ext2Node* node, List<DirectoryEntry>& entries);
-        int InsertDir(Ext2Node* node, List<DirectoryEntry>& entries);
+        inline uint32_t DirBlockCount(Ext2Node* node){
+            return node->e2inode.size / blocksize;
+        }
+
+        int ReadDirBlock(Ext2Node* node, uint32_t index, uint8_t* buffer);
+        int WriteDirBlock(Ext2Node* node, uint32_t index, uint8_t* buffer);
+
+        bool HTreeReadNode(Ext2Node* node, ext2_dx_frame_t& frame, ext2_dx_entry_t* entries);
+        ext2_dx_entry_t* HTreeLookup(Ext2Node* node, const char* name, uint8_t* buffer, uint32_t& hash, ext2_dx_frame_t* frames, unsigned& levels);
+        ext2_dx_entry_t* HTreeNextLeaf(Ext2Node* node, uint32_t hash, ext2_dx_frame_t* frames, unsigned levels);
+        ext2_directory_entry_t* LookupDir(Ext2Node* node, const char* name, uint8_t* buffer, uint32_t& blockIndex, ext2_directory_entry_t** prev = nullptr);
         int InsertDir(Ext2Node* node, DirectoryEntry& ent);
     public:
         Ext2Volume(PartitionDevice* part, const char* name);
@@ -317,6 +399,10 @@ namespace fs::Ext2{
         void SyncNode(Ext2Node* node);
         void CleanNode(Ext2Node* node);
 
+        int FlushCache();
+        int FlushNode(Ext2Node* node);
+        int FlushIndirect(uint32_t block, unsigned levels);
+
         int Error() { return error; }
     };
     
@@ -99,11 +99,17 @@ typedef struct {
 } stat_t;
 
 class FsNode;
+class EPollEntry;
+
+namespace fs{
+    class PageCache;
+}
 
 typedef struct fs_fd{
     FsNode* node;
     off_t pos;
     mode_t mode;
+    EPollEntry* epollEntries; // Interest sets the handle is in, must be null for new and copied handles
 } fs_fd_t;
 
 struct pollfd {
@@ -159,6 +165,9 @@ public:
     unsigned handleCount = 0; // Amount of file handles that point to this node
     volume_id_t volumeID;
 
+    bool cacheDentries = false; // Lookups in this directory can go in the dentry cache, only set when every change to the directory goes through fs::Create/CreateDirectory/Link/Unlink
+    fs::PageCache* pageCache = nullptr; // Created when the node is first memory mapped, see fs::GetPageCache
+
     int error = 0;
 
     virtual ~FsNode();
@@ -227,6 +236,11 @@ public:
 
     }
 
+    // Called by nodes once they are ready, after they have stopped watching
+    virtual void Signal(){
+        Semaphore::Signal();
+    }
+
     void WatchNode(FsNode* node, int events){
         node->Watch(*this, events);
 
@@ -246,6 +260,19 @@ typedef struct fs_dirent {
 	char name[NAME_MAX]; // Filename
 } fs_dirent_t;
 
+#define READDIR_BATCH_STAT 0x1 // Fill in a stat_t for each entry
+
+// Variable length entry returned by SysReadDirBatch
+typedef struct fs_batch_dirent {
+	uint64_t inode; // Inode number
+	uint16_t recordLength; // Size of the entry, the next one starts straight after it
+	uint16_t nameLength; // Length of the name, not including the null terminator
+	uint16_t statOffset; // Offset of the stat_t from the start of the entry, 0 if it was not requested
+	uint8_t type;
+	uint8_t reserved;
+	char name[]; // Null terminated filename
+} fs_batch_dirent_t;
+
 namespace fs{
     class FsVolume;
 
@@ -324,6 +351,16 @@ namespace fs{
     fs_fd_t* Open(FsNode* node, uint32_t flags = 0);
     void Close(FsNode* node);
     void Close(fs_fd_t* handle);
+
+    /////////////////////////////
+    /// \brief Check which events are ready on a node
+    ///
+    /// \param node Node to check
+    /// \param events Events to check for (POLLIN, POLLOUT)
+    /// 
+    /// \return Ready events, POLLHUP is reported whether requested or not
+    /////////////////////////////
+    int Poll(FsNode* node, int events);
     int ReadDir(FsNode* node, DirectoryEntry* dirent, uint32_t index);
     FsNode* FindDir(FsNode* node, char* name);
     
@@ -334,6 +371,8 @@ namespace fs{
     
     int Link(FsNode*, FsNode*, DirectoryEntry*);
     int Unlink(FsNode*, DirectoryEntry*, bool unlinkDirectories = false);
+    int Create(FsNode* dir, DirectoryEntry* ent, uint32_t mode);
+    int CreateDirectory(FsNode* dir, DirectoryEntry* ent, uint32_t mode);
 
     int Ioctl(fs_fd_t* handle, uint64_t cmd, uint64_t arg);
 
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <fs/filesystem.h>
+#include <spin.h>
+
+#include <stdint.h>
+
+#define PAGE_CACHE_BUCKETS 64
+
+struct process;
+
+#define MAP_SHARED 0x1 // Writes go to the page cache and are written back to the file
+#define MAP_PRIVATE 0x2 // Pages are shared until written to, then copied
+
+// A file backed region of a process address space
+typedef struct file_mapping {
+    uintptr_t base;
+    uint64_t pageCount;
+    FsNode* node; // Holds a reference (handleCount) on the node
+    uint64_t offset; // Offset in the file, page aligned
+    int flags;
+
+    file_mapping* next = nullptr;
+    file_mapping* prev = nullptr;
+} file_mapping_t;
+
+namespace fs{
+    // Page sized pieces of a file shared by every mapping of it.
+    // Pages stay in the cache for as long as the node exists.
+    class PageCache{
+        struct CachedPage{
+            uint64_t index; // Offset in the file / PAGE_SIZE_4K
+            uint64_t phys;
+            uint8_t* virt; // Kernel mapping of the frame
+            CachedPage* next = nullptr; // Hash chain
+        };
+
+        FsNode* node;
+        CachedPage* buckets[PAGE_CACHE_BUCKETS];
+        lock_t lock = 0; // Only held with interrupts disabled so it can be taken in the page fault handler
+
+        CachedPage* Find(uint64_t index);
+    public:
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        PageCache(FsNode* node);
+        ~PageCache();
+
+        /////////////////////////////
+        /// \brief Find a page without reading anything in, safe with interrupts disabled
+        ///
+        /// \param index Offset in the file / PAGE_SIZE_4K
+        /// \param virt Set to the kernel mapping of the page if not null
+        ///
+        /// \return Physical address of the page, 0 if it is not cached
+        /////////////////////////////
+        uint64_t Lookup(uint64_t index, uint8_t** virt = nullptr);
+
+        /////////////////////////////
+        /// \brief Find a page, reading it in from the node on a miss. May block.
+        ///
+        /// \return Physical address of the page, 0 on failure
+        /////////////////////////////
+        uint64_t GetPage(uint64_t index, uint8_t** virt = nullptr);
+
+        /////////////////////////////
+        /// \brief Copy data written to the node into any cached pages it covers
+        /////////////////////////////
+        void Update(size_t off, size_t size, uint8_t* buffer);
+
+        /////////////////////////////
+        /// \brief Write cached pages back to the node, never past the end of the file
+        /////////////////////////////
+        void WriteBack(uint64_t index, uint64_t count);
+    };
+
+    /////////////////////////////
+    /// \brief Get the page cache of node, creating it if it does not exist
+    /////////////////////////////
+    PageCache* GetPageCache(FsNode* node);
+
+    /////////////////////////////
+    /// \brief Map pages of node into the address space of proc, pages are brought in when first accessed
+    ///
+    /// \param base Page aligned address to map at, replaces anything already mapped there
+    /// \param offset Page aligned offset in the file
+    /// \param flags MAP_SHARED or MAP_PRIVATE
+    /////////////////////////////
+    void MapFile(process* proc, FsNode* node, uintptr_t base, uint64_t pageCount, uint64_t offset, int flags);
+
+    /////////////////////////////
+    /// \brief Drop every file mapping of proc, writing back shared mappings. Call when the process exits.
+    /////////////////////////////
+    void UnmapFiles(process* proc);
+}
@@ -96,25 +96,29 @@ public:
 		if (!front) {
 			front = obj;
 			obj->prev = obj;
-		} else if (back) {
+			obj->next = obj;
+		} else {
 			back->next = obj;
+			front->prev = obj; // Keep the ring closed so remove() works on the front and back
 			obj->prev = back;
+			obj->next = front;
 		}
 		back = obj;
-		obj->next = front;//obj->next = nullptr;
 		num++;
 	}
 
 	void add_front(T obj) {
 		if (!back) {
 			back = obj;
-		}
-		else if(front) {
+			obj->prev = obj;
+			obj->next = obj;
+		} else {
 			front->prev = obj;
+			back->next = obj;
 			obj->next = front;
+			obj->prev = back;
 		}
 		front = obj;
-		obj->prev = back;
 		num++;
 	}
 
@@ -405,7 +409,7 @@ public:
 
 		while(current && current != back && current->obj != val) current = current->next;
 
-		if(current){
+		if(current && current->obj == val){ // Nothing to do if val is not in the list
 			current->prev->next = current->next;
 			current->next->prev = current->prev;
 			if (front == current) front = current->next;
@@ -63,7 +63,8 @@ public:
 
     void Wait();
 
-    void WaitTimeout(long timeout);
+    // Wait for up to timeout microseconds, returns false if the semaphore was not signalled in time
+    bool WaitTimeout(long timeout);
 
     inline void Signal(){
         __sync_fetch_and_add(&value, 1);
@@ -11,6 +11,7 @@
 #define I8254_REGISTER_EEPROM       0x14
 #define I8254_REGISTER_CTRL_EXT     0x18
 #define I8254_REGISTER_INT_READ     0xC0
+#define I8254_REGISTER_ITR          0xC4 // Interrupt Throttling
 #define I8254_REGISTER_INT_MASK     0xD0
 
 #define I8254_REGISTER_RCTRL        0x100
@@ -19,6 +20,8 @@
 #define I8254_REGISTER_RDESC_LEN    0x2808
 #define I8254_REGISTER_RDESC_HEAD   0x2810
 #define I8254_REGISTER_RDESC_TAIL   0x2818
+#define I8254_REGISTER_RDTR         0x2820 // Receive Delay Timer
+#define I8254_REGISTER_RADV         0x282C // Receive Interrupt Absolute Delay Timer
 
 #define I8254_REGISTER_TCTRL        0x400
 #define I8254_REGISTER_TDESC_LO     0x3800
@@ -26,6 +29,8 @@
 #define I8254_REGISTER_TDESC_LEN    0x3808
 #define I8254_REGISTER_TDESC_HEAD   0x3810
 #define I8254_REGISTER_TDESC_TAIL   0x3818
+#define I8254_REGISTER_TIDV         0x3820 // Transmit Interrupt Delay Value
+#define I8254_REGISTER_TADV         0x382C // Transmit Absolute Interrupt Delay Value
 
 #define I8254_REGISTER_MTA          0x5200
 
@@ -54,6 +59,7 @@
 #define TCTRL_COLD(x) ((x & 0xFF) << 12)// Colision Distance
 
 #define BSIZE_4096 (RCTRL_G_BSIZE(3) | RCTRL_BSEX)
+#define BSIZE_2048 RCTRL_G_BSIZE(0)
 
 #define TCMD_EOP (1 << 0) // End of packet
 #define TCMD_IFCS (1 << 1) // Insert FCS
@@ -66,6 +72,22 @@
 #define TSTATUS_EC (1 << 1) // Excess Collisions
 #define TSTATUS_LC (1 << 2) // Late collision
 
+#define RSTATUS_DD (1 << 0) // Descriptor Done
+#define RSTATUS_EOP (1 << 1) // End of packet
+
+#define ICR_TXDW (1 << 0) // Transmit descriptor written back
+#define ICR_LSC (1 << 2) // Link status change
+#define ICR_RXDMT0 (1 << 4) // Receive descriptor minimum threshold reached
+#define ICR_RXO (1 << 6) // Receiver overrun
+#define ICR_RXT0 (1 << 7) // Receiver timer interrupt
+
+// Interrupt moderation, ITR is in units of 256ns and the delay timers in units of 1.024us
+#define I8254_ITR_INTERVAL 488 // At most ~8000 interrupts a second
+#define I8254_RX_DELAY 32 // Wait for more packets to arrive before interrupting
+#define I8254_RX_ABSOLUTE_DELAY 128 // but never hold a packet back for longer than this
+#define I8254_TX_DELAY 64
+#define I8254_TX_ABSOLUTE_DELAY 256
+
 #define STATUS_LINK_UP (1 << 1)
 #define STATUS_SPEED (3 << 6)   // 00b - 10Mb/s, 01b - 100MB/s, 10b/11b - 1000Mb/s
 
@@ -101,11 +123,16 @@ namespace Network{
 
         r_desc_t* rxDescriptors;
         t_desc_t* txDescriptors;
-        void** txDescriptorsVirt;
-        void** rxDescriptorsVirt;
+        NetworkPacket** rxPackets; // Buffer each descriptor receives into
+        NetworkPacket** txPackets; // Packet each descriptor is sending, released once the card is done with it
 
         unsigned txTail = 0;
-        unsigned rxTail = 0;
+        unsigned txClean = 0; // Oldest descriptor that may still be in use by the card
+        unsigned rxNext = 0; // Next descriptor the card will fill
+        lock_t txLock = 0; // Only held with interrupts disabled
+
+        uint64_t rxDropped = 0;
+        uint64_t txDropped = 0;
 
         uint64_t memBase;
         void* memBaseVirt;
@@ -128,6 +155,9 @@ namespace Network{
         void InitializeRx();
         void InitializeTx();
 
+        void ReceivePackets();
+        void ReclaimTx();
+
         void UpdateLink();
 
         public:
@@ -136,6 +166,7 @@ namespace Network{
         void Interrupt();
         static void DetectAndInitialize();
 
-        void SendPacket(void* data, size_t len);
+        using NetworkAdapter::SendPacket;
+        void SendPacket(NetworkPacket* packet);
     };
 }
\ No newline at end of file
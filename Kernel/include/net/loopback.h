@@ -0,0 +1,15 @@
+#pragma once
+
+#include <net/networkadapter.h>
+
+namespace Network{
+    // Packets sent through lo come straight back in on its receive queue, no card is involved
+    class LoopbackAdapter : public NetworkAdapter {
+    public:
+        LoopbackAdapter();
+
+        void SendPacket(NetworkPacket* packet);
+    };
+
+    extern NetworkAdapter* loopback;
+}
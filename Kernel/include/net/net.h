@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <endian.h>
 #include <string.h>
+#include <spin.h>
 
 class Socket;
 
@@ -12,9 +13,25 @@ class Socket;
 #define EPHEMERAL_PORT_RANGE_START 49152
 #define EPHEMERAL_PORT_RANGE_END PORT_MAX
 
+#define NETWORK_PACKET_SIZE 2048 // Fits a whole Ethernet frame, two buffers to a page
+#define ETHERNET_MIN_FRAME_SIZE 60 // Not counting the FCS, shorter frames are padded
+
+#define ARP_CACHE_SIZE 32
+#define ARP_ENTRY_LIFETIME 300 // Seconds before a resolved address is looked up again
+#define ARP_REQUEST_INTERVAL 1 // Seconds between requests for the same address
+#define NETWORK_PACKET_POOL_SIZE 1024
+
+// Packet buffers come from a pool of memory the card can DMA into and out of.
+// They get passed up and down the stack rather than being copied.
 struct NetworkPacket{
-    void* data;
+    void* data; // Start of the frame, NETWORK_PACKET_SIZE bytes
     size_t length;
+    uint64_t phys; // Physical address of data
+
+    volatile int refCount = 0;
+
+    NetworkPacket* next = nullptr; // Free list or receive queue
+    NetworkPacket* prev = nullptr;
 };
 
 struct IPv4Address{
@@ -44,6 +61,14 @@ struct IPv4Address{
 
         return *this;
     }
+
+    bool operator==(const IPv4Address& r){
+        return !memcmp(data, r.data, 4);
+    }
+
+    bool operator!=(const IPv4Address& r){
+        return !operator==(r);
+    }
 } __attribute__((packed));
 
 struct IPv4Header{ // Keep in mind that our architecture is little endian so the bitfields are swapped
@@ -112,6 +137,20 @@ struct UDPHeader {
     uint8_t data[];
 } __attribute__((packed));
 
+struct TCPHeader {
+    BigEndianUInt16 srcPort;
+    BigEndianUInt16 destPort;
+    BigEndianUInt32 sequence;
+    BigEndianUInt32 acknowledgement;
+    uint8_t reserved : 4;
+    uint8_t dataOffset : 4; // Header length in dwords
+    uint8_t flags;
+    BigEndianUInt16 windowSize;
+    BigEndianUInt16 checksum;
+    BigEndianUInt16 urgentPointer;
+    uint8_t data[];
+} __attribute__((packed));
+
 struct ICMPHeader{
     uint8_t type;
     uint8_t code;
@@ -125,42 +164,107 @@ namespace Network {
         EtherTypeARP = 0x806,
     };
 
+    enum {
+        ARPHardwareEthernet = 1,
+    };
+
+    enum {
+        ARPRequest = 1,
+        ARPReply = 2,
+    };
+
     enum {
         IPv4ProtocolICMP = 0x1,
         IPv4ProtocolTCP = 0x6,
         IPv4ProtocolUDP = 0x11,
     };
 
-    static inline BigEndianUInt16 CaclulateChecksum(void* data, size_t size){
+    static inline BigEndianUInt16 CaclulateChecksum(void* data, size_t size, uint32_t checksum = 0){
         uint16_t* ptr = (uint16_t*)data;
-        size_t count = sizeof(IPv4Header);
-        uint32_t checksum = 0;
+        size_t count = size;
 
         while(count >= 2){
             checksum += *ptr++;
             count -= 2;
         }
 
+        if(count){
+            checksum += *(uint8_t*)ptr; // Odd byte, padded with zero
+        }
+
         checksum = (checksum & 0xFFFF) + (checksum >> 16);
         checksum += checksum >> 16;
 
         BigEndianUInt16 ret;
-        ret = ~checksum;
+        ret.value = ~checksum; // The sum was taken over big endian words so it is already in network order
         return ret;
     }
 
+    // Sum of the TCP/UDP pseudo header, pass it to CaclulateChecksum as the initial sum
+    static inline uint32_t PseudoHeaderSum(IPv4Address& source, IPv4Address& destination, uint8_t protocol, uint16_t length){
+        uint16_t* src = (uint16_t*)source.data;
+        uint16_t* dest = (uint16_t*)destination.data;
+
+        return src[0] + src[1] + dest[0] + dest[1] + EndianLittleToBig16(protocol) + EndianLittleToBig16(length);
+    }
+
+    // Ports bound by the sockets of one protocol, TCP and UDP port numbers are separate
+    class PortTable {
+        Socket* ports[PORT_MAX + 1] = {};
+        unsigned short nextEphemeral = EPHEMERAL_PORT_RANGE_START; // Allocation carries on from the last port handed out
+    public:
+        lock_t lock = 0; // Hold to keep the socket returned by Get from being unbound
+
+        /////////////////////////////
+        /// \brief Bind sock to a free ephemeral port
+        ///
+        /// \return Port in host byte order, 0 if every ephemeral port is in use
+        /////////////////////////////
+        unsigned short Allocate(Socket& sock);
+
+        /////////////////////////////
+        /// \brief Bind sock to port (host byte order)
+        ///
+        /// \return 0 on success, -EADDRINUSE if the port is taken
+        /////////////////////////////
+        int Acquire(Socket& sock, unsigned short port);
+        void Release(unsigned short port);
+
+        // lock must be held
+        inline Socket* Get(unsigned short port) { return ports[port]; }
+    };
+
+    extern PortTable tcpPorts;
+    extern PortTable udpPorts;
+
     void InitializeDrivers();
     void InitializeConnections();
+
+    void InitializePacketPool();
+
+    // Get an empty packet buffer holding one reference, nullptr if the pool is empty. Safe to call from interrupt handlers.
+    NetworkPacket* AllocatePacket();
+
+    void ReferencePacket(NetworkPacket* packet);
+
+    // Drop a reference, the buffer goes back in the pool when the last one is gone
+    void ReleasePacket(NetworkPacket* packet);
     
-    unsigned short AllocatePort(Socket& sock);
-    int AcquirePort(Socket& sock, unsigned short port);
-    void ReleasePort(unsigned short port);
+    #define IPV4_PAYLOAD_OFFSET (sizeof(EthernetFrame) + sizeof(IPv4Header)) // Offset of the IPv4 payload in a packet buffer
 
     namespace Interface {
+        extern IPv4Address address;
+
         void Initialize();
 
+        // Address packets sent to destination come from, 127.0.0.1 over loopback
+        IPv4Address SourceAddress(IPv4Address& destination);
+
         void Send(void* data, size_t length);
         int SendIPv4(void* data, size_t length, IPv4Address& destination, uint8_t protocol);
+
+        // Send a packet with the payload already at IPV4_PAYLOAD_OFFSET, takes over our reference to packet
+        int SendIPv4(NetworkPacket* packet, size_t length, IPv4Address& destination, uint8_t protocol);
         int SendUDP(void* data, size_t length, IPv4Address& destination, BigEndianUInt16 sourcePort, BigEndianUInt16 destinationPort);
     }
     
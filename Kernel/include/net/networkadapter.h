@@ -3,6 +3,7 @@
 #include <device.h>
 #include <net/net.h>
 #include <scheduler.h>
+#include <lock.h>
 
 enum {
     LinkDown,
@@ -15,35 +16,31 @@ namespace Network{
         static int nextDeviceNumber;
     
         int linkState = LinkDown;
-        List<NetworkPacket> queue;
 
-        lock_t threadLock = 0;
-        Scheduler::GenericThreadBlocker blocker;
+        FastList<NetworkPacket*> queue; // Received packets
+        lock_t queueLock = 0; // Only held with interrupts disabled
+        Semaphore packetsQueued = Semaphore(0);
+
+        // Hand a received packet up the stack, called from the interrupt handler
+        void EnqueuePacket(NetworkPacket* packet);
     public:
         MACAddress mac;
         
         NetworkAdapter();
+        NetworkAdapter(const char* name);
         
-        virtual void SendPacket(void* data, size_t len);
+        // Transmit packet, the adapter takes over our reference and drops it once the packet has been sent
+        virtual void SendPacket(NetworkPacket* packet);
+
+        // Copy data into a packet buffer and transmit it
+        void SendPacket(void* data, size_t len);
 
         virtual int GetLink() { return linkState; }
         virtual int QueueSize() { return queue.get_length(); }
-        virtual NetworkPacket Dequeue() { 
-            if(queue.get_length()) {
-                return queue.remove_at(0); 
-            } else {
-                return {nullptr, 0};
-            }
-        }
-        virtual NetworkPacket DequeueBlocking() {
-            Scheduler::BlockCurrentThread(blocker, threadLock);
-
-            if(queue.get_length()){
-                return queue.remove_at(0); 
-            } else {
-                return {nullptr, 0};
-            }
-        }
+
+        // The caller gets the queue's reference to the packet and must release it
+        virtual NetworkPacket* Dequeue();
+        virtual NetworkPacket* DequeueBlocking();
 
         virtual ~NetworkAdapter() = default;
     };
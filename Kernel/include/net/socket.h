@@ -62,6 +62,14 @@ struct msghdr {
     int flags;
 };
 
+struct mmsghdr {
+    struct msghdr hdr;
+    unsigned int len; // Set to the amount of bytes sent or received
+};
+
+#define MMSG_MAX 1024 // Most messages in one call to sendmmsg or recvmmsg
+#define IOV_MAX 1024 // Most iovecs in one message
+
 struct poll {
     int fd;
     short events;
@@ -132,6 +140,9 @@ public:
     virtual fs_fd_t* Open(size_t flags);
     virtual void Close();
 
+    virtual int SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength);
+    virtual int GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength);
+
     virtual void Watch(FilesystemWatcher& watcher, int events);
     virtual void Unwatch(FilesystemWatcher& watcher);
 
@@ -144,9 +155,15 @@ public:
 };
 
 class LocalSocket : public Socket {
-    lock_t slock = 0;
+    static lock_t peerLock; // Held whilst peers are linked and unlinked
+
+    lock_t slock = 0; // Also protects watching
 
     List<FilesystemWatcher*> watching;
+
+    void SignalWatchers();
+    // Signal anyone watching the peer, after we have written to it or freed up space for it to write
+    void SignalPeer();
 public:
     LocalSocket* peer = nullptr;
 
@@ -175,17 +192,18 @@ public:
     void Unwatch(FilesystemWatcher& watcher);
 
     bool CanRead() { if(inbound) return !inbound->Empty(); else return false; }
+    bool CanWrite();
 };
 
 class IPSocket : public Socket {
 protected:
-    IPv4Address address = 0;
+    IPv4Address address = 0; // Local address
     BigEndianUInt16 port = 0;
+    IPv4Address peerAddress = 0;
     BigEndianUInt16 destinationPort = 0;
 
-    List<NetworkPacket> pQueue;
-
-    virtual int64_t IPReceiveFrom(void* buffer, size_t len);
+    // Fill in src with address and port if there is room
+    static void FillAddress(sockaddr* src, socklen_t* addrlen, IPv4Address& address, BigEndianUInt16 port);
 public:
     IPSocket(int type, int protocol);
     virtual ~IPSocket();
@@ -195,17 +213,56 @@ public:
     int Connect(const sockaddr* addr, socklen_t addrlen);
     int Listen(int backlog);
 
-    void Close();
+    fs_fd_t* Open(size_t flags);
     
     int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen);
     virtual int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen);
 };
 
+#define UDP_RECEIVE_QUEUE_SIZE 128 // Datagrams, anything past this is dropped until the socket is read
+
 class UDPSocket : public IPSocket {
-    int64_t IPReceiveFrom(void* buffer, size_t len);
+    // Received datagrams stay in the packet buffer they arrived in until they are read
+    struct Datagram {
+        NetworkPacket* packet;
+        uint8_t* data;
+        uint16_t length;
+        IPv4Address source;
+        BigEndianUInt16 sourcePort;
+    };
+
+    lock_t queueLock = 0;
+    Datagram queue[UDP_RECEIVE_QUEUE_SIZE];
+    unsigned queueHead = 0; // Free running, the queue is at (index % UDP_RECEIVE_QUEUE_SIZE)
+    unsigned queueTail = 0;
+
+    List<FilesystemWatcher*> watching;
 public:
+    uint64_t dropped = 0; // Datagrams that arrived with the queue full
+
     UDPSocket(int type, int protocol);
+    ~UDPSocket();
+
+    /////////////////////////////
+    /// \brief Queue a received datagram, called by the interface layer with udpPorts.lock held
+    ///
+    /// \param packet Packet the datagram is in, referenced for as long as the datagram is queued
+    /////////////////////////////
+    void OnReceive(NetworkPacket* packet, IPv4Address& source, BigEndianUInt16 sourcePort, uint8_t* data, size_t length);
+
+    int Bind(const sockaddr* addr, socklen_t addrlen);
+    int Connect(const sockaddr* addr, socklen_t addrlen);
+
+    void Close();
+
+    int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen);
     int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen);
+
+    void Watch(FilesystemWatcher& watcher, int events);
+    void Unwatch(FilesystemWatcher& watcher);
+
+    bool CanRead() { return queueHead != queueTail; }
+    int IsConnected() { return true; } // Datagram sockets never hang up
 };
 
 namespace SocketManager{
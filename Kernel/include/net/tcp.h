@@ -0,0 +1,187 @@
+#pragma once
+
+#include <net/net.h>
+#include <net/socket.h>
+#include <stream.h>
+#include <list.h>
+#include <spin.h>
+
+#define IPPROTO_TCP 6
+#define TCP_NODELAY 1 // Socket option, send small segments straight away rather than waiting for outstanding data to be acknowledged
+
+#define TCP_FLAG_FIN (1 << 0)
+#define TCP_FLAG_SYN (1 << 1)
+#define TCP_FLAG_RST (1 << 2)
+#define TCP_FLAG_PSH (1 << 3)
+#define TCP_FLAG_ACK (1 << 4)
+#define TCP_FLAG_URG (1 << 5)
+
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_MSS 2
+
+#define TCP_MSS_DEFAULT 536 // Used if the peer does not send an MSS option
+#define TCP_MSS_MAX (1500 - sizeof(IPv4Header) - sizeof(TCPHeader)) // Largest segment that fits in an Ethernet frame
+
+#define TCP_RECEIVE_BUFFER 0x10000 // 64KB, the largest window we can advertise without window scaling
+#define TCP_SEND_BUFFER 0x10000 // Most data queued (sent or not) before Send blocks
+
+#define TCP_TIMER_INTERVAL 10 // ms, granularity of every TCP timer
+#define TCP_DELAYED_ACK_TIMEOUT 40 // ms
+#define TCP_RTO_INITIAL 1000 // ms
+#define TCP_RTO_MIN 200 // ms
+#define TCP_RTO_MAX 60000 // ms
+#define TCP_MAX_RETRANSMITS 12
+#define TCP_TIME_WAIT_TIMEOUT 60000 // ms, 2 * MSL
+
+#define TCP_CONNECTION_BUCKETS 256
+
+// Modular comparisons of sequence numbers
+#define TCP_SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define TCP_SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define TCP_SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define TCP_SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+enum {
+    TCPStateClosed,
+    TCPStateListen,
+    TCPStateSynSent,
+    TCPStateSynReceived,
+    TCPStateEstablished,
+    TCPStateFinWait1,
+    TCPStateFinWait2,
+    TCPStateCloseWait,
+    TCPStateClosing,
+    TCPStateLastAck,
+    TCPStateTimeWait,
+};
+
+class TCPSocket : public IPSocket {
+    // Queued data, built straight into a packet buffer when it is sent to us so it is never copied again.
+    // Segments stay queued until they are acknowledged and are retransmitted from the same buffer.
+    struct Segment {
+        NetworkPacket* packet;
+        uint32_t sequence;
+        uint16_t length; // Payload length
+        uint8_t flags; // SYN and FIN take up sequence space
+        uint64_t sentAt = 0; // Uptime in ms when it was first sent, 0 if it has not been
+        bool retransmitted = false; // Retransmitted segments are not used to measure the RTT (Karn's algorithm)
+
+        Segment* next = nullptr;
+        Segment* prev = nullptr;
+
+        inline uint32_t End() { return sequence + length + ((flags & TCP_FLAG_SYN) ? 1 : 0) + ((flags & TCP_FLAG_FIN) ? 1 : 0); }
+    };
+
+    lock_t lock = 0;
+    int state = TCPStateClosed;
+    int error = 0; // Reported to the user once the connection has failed
+    bool orphaned = false; // Every handle has been closed, freed by the timer once the connection is closed
+    bool noDelay = false;
+    bool hashed = false; // In the connection table
+    bool portAcquired = false; // Holds port in the port table, accepted connections share the port of their listener
+
+    // Send sequence space
+    uint32_t sendUnacknowledged = 0; // Oldest unacknowledged sequence number
+    uint32_t sendNext = 0; // Next sequence number to send
+    uint32_t sendQueued = 0; // Sequence number of the next byte queued
+    uint32_t sendWindow = 0; // Window advertised by the peer
+    uint32_t sendWL1 = 0; // Sequence and acknowledgement numbers of the segment that last updated the window
+    uint32_t sendWL2 = 0;
+    uint16_t mss = TCP_MSS_DEFAULT;
+
+    FastList<Segment*> segments; // In sequence order, the ones before sendNext have been sent
+    size_t queuedBytes = 0;
+    bool finQueued = false;
+
+    // Congestion control (NewReno)
+    uint32_t congestionWindow = 0;
+    uint32_t slowStartThreshold = 0xFFFF;
+    unsigned duplicateAcks = 0;
+    bool fastRecovery = false;
+    uint32_t recover = 0; // sendNext when fast recovery started
+
+    // Retransmission timer
+    uint32_t smoothedRTT = 0; // ms
+    uint32_t rttVariance = 0;
+    uint32_t rto = TCP_RTO_INITIAL;
+    uint64_t retransmitDeadline = 0; // 0 if the timer is not running
+    unsigned retransmits = 0;
+
+    // Receive sequence space
+    uint32_t receiveNext = 0;
+    uint32_t advertisedEdge = 0; // receiveNext + window in the last segment we sent
+    DataStream* receiveBuffer = nullptr; // Only allocated once the socket connects or is accepted
+    bool finReceived = false;
+
+    bool ackPending = false;
+    unsigned unacknowledgedSegments = 0; // Full sized segments received since we last sent an ACK
+    uint64_t delayedAckDeadline = 0;
+    uint64_t timeWaitDeadline = 0; // Also limits how long an orphaned socket waits in FIN-WAIT-2
+
+    TCPSocket* listener = nullptr; // Listening socket that created us, until we are accepted
+    unsigned halfOpen = 0; // Connections of a listening socket that are still in SYN-RECEIVED
+    unsigned backlog = 0;
+
+    List<FilesystemWatcher*> watching;
+
+    TCPSocket* hashNext = nullptr; // Connection table chain
+
+    void SignalWatchers();
+    void WaitForChange();
+
+    uint16_t ReceiveWindow();
+
+    Segment* QueueSegment(uint8_t flags);
+    bool TransmitSegment(Segment* segment);
+    void SendControl(uint8_t flags, uint32_t sequence);
+    void SendAck();
+    void Output();
+    void Retransmit();
+
+    void OnAcknowledgement(uint32_t ack, bool duplicate);
+    void OnData(TCPHeader* header, uint8_t* data, size_t length);
+    void OnSegment(IPv4Header& ipHeader, TCPHeader* header, size_t length);
+    void OnListenSegment(IPv4Header& ipHeader, TCPHeader* header, size_t length);
+
+    void OnRetransmitTimeout();
+    void OnTimer(uint64_t now);
+    void Reset(int error);
+    void ReleaseSegments();
+
+public:
+    static void OnReceive(IPv4Header& ipHeader, void* data, size_t length);
+    static void OnTimers();
+
+    TCPSocket(int type, int protocol);
+    ~TCPSocket();
+
+    Socket* Accept(sockaddr* addr, socklen_t* addrlen, int mode);
+    int Bind(const sockaddr* addr, socklen_t addrlen);
+    int Connect(const sockaddr* addr, socklen_t addrlen);
+    int Listen(int backlog);
+
+    void Close();
+
+    int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen);
+    int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen);
+
+    int SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength);
+    int GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength);
+
+    void Watch(FilesystemWatcher& watcher, int events);
+    void Unwatch(FilesystemWatcher& watcher);
+
+    bool CanRead();
+    bool CanWrite();
+
+    int IsConnected() { return connected; }
+    int PendingConnections() { return pending.get_length(); }
+};
+
+namespace Network::TCP {
+    void Initialize();
+
+    // Called by the interface layer for every TCP segment addressed to us
+    void OnReceive(IPv4Header& ipHeader, void* data, size_t length);
+}
@@ -1,3 +1,207 @@
+#pragma once
+
+#include <stdint.h>
+#include <device.h>
+#include <pci.h>
+#include <spin.h>
+#include <scheduler.h>
+#include <diskqueue.h>
+
+// Controller registers
+#define NVME_REG_CAP 0x00 // Controller Capabilities
+#define NVME_REG_VS 0x08 // Version
+#define NVME_REG_INTMS 0x0C // Interrupt Mask Set
+#define NVME_REG_INTMC 0x10 // Interrupt Mask Clear
+#define NVME_REG_CC 0x14 // Controller Configuration
+#define NVME_REG_CSTS 0x1C // Controller Status
+#define NVME_REG_AQA 0x24 // Admin Queue Attributes
+#define NVME_REG_ASQ 0x28 // Admin Submission Queue Base Address
+#define NVME_REG_ACQ 0x30 // Admin Completion Queue Base Address
+#define NVME_REG_DOORBELL_BASE 0x1000
+
+#define NVME_CAP_MQES(x) ((x) & 0xFFFF) // Maximum Queue Entries Supported (0's based)
+#define NVME_CAP_TIMEOUT(x) (((x) >> 24) & 0xFF) // Worst case ready time in 500ms units
+#define NVME_CAP_DSTRD(x) (((x) >> 32) & 0xF) // Doorbell stride is 4 << DSTRD
+#define NVME_CAP_MPSMIN(x) (((x) >> 48) & 0xF) // Minimum page size is 4K << MPSMIN
+
+#define NVME_CC_ENABLE (1 << 0)
+#define NVME_CC_CSS_NVM (0 << 4)
+#define NVME_CC_MPS(x) ((x) << 7) // Page size is 4K << MPS
+#define NVME_CC_AMS_RR (0 << 11) // Round robin arbitration
+#define NVME_CC_IOSQES(x) ((x) << 16) // IO Submission Queue entry size is 2^x
+#define NVME_CC_IOCQES(x) ((x) << 20) // IO Completion Queue entry size is 2^x
+
+#define NVME_CSTS_READY (1 << 0)
+#define NVME_CSTS_FATAL (1 << 1)
+
+// Admin command set
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_IDENTIFY_NAMESPACE 0x00
+#define NVME_IDENTIFY_CONTROLLER 0x01
+#define NVME_IDENTIFY_ACTIVE_NAMESPACES 0x02
+
+#define NVME_FEATURE_NUMBER_OF_QUEUES 0x07
+
+#define NVME_QUEUE_PHYS_CONTIGUOUS (1 << 0)
+#define NVME_CQ_INTERRUPTS_ENABLED (1 << 1)
+
+// NVM command set
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+#define NVME_ADMIN_QUEUE_DEPTH 8
+#define NVME_IO_QUEUE_DEPTH 32
+#define NVME_IO_QUEUE_SLOTS (NVME_IO_QUEUE_DEPTH - 1) // A queue of N entries can only hold N - 1 commands
+#define NVME_MAX_IO_QUEUES 64
+#define NVME_MAX_TRANSFER 0x80000 // 512KB, further limited by the controller's MDTS
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid; // Command Identifier
+    uint32_t nsid; // Namespace Identifier
+    uint64_t reserved;
+    uint64_t mptr; // Metadata Pointer
+    uint64_t prp1; // Data Pointer
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) nvme_command_t;
+
+typedef struct {
+    uint32_t result; // Command specific
+    uint32_t reserved;
+    uint16_t sqHead;
+    uint16_t sqID;
+    uint16_t cid;
+    uint16_t status; // Bit 0 is the phase tag
+} __attribute__((packed)) nvme_completion_t;
+
+static_assert(sizeof(nvme_command_t) == 64);
+static_assert(sizeof(nvme_completion_t) == 16);
+static_assert(NVME_IO_QUEUE_SLOTS <= DISK_QUEUE_MAX_SLOTS);
+
 namespace NVMe{
+    class Controller;
+    class Queue;
+
+    // Commands submitted together, completed from the interrupt handler
+    struct Request : public DiskRequest{
+        Queue* queue = nullptr; // All commands of a request go through the same queue
+        uint32_t result = 0; // Dword 0 of the last completion
+    };
+
+    // A submission/completion queue pair, command IDs are the slots of the DiskQueue
+    class Queue : public DiskQueue{
+    public:
+        Queue(Controller* controller, uint16_t id, uint16_t depth);
+
+        // Submit cmd in slot, the caller fills in everything but the command ID
+        void Submit(Request& req, int slot, nvme_command_t& cmd);
+
+        // Build the data pointers of cmd for buffer, going through the slot's bounce page if the controller can't reach it
+        // Returns the number of bytes covered
+        uint32_t BuildPRP(Request& req, int slot, nvme_command_t& cmd, uint8_t* buffer, uint32_t size, bool write);
+
+        void OnInterrupt();
+
+        uint16_t id;
+        uint16_t depth;
+        uint16_t vector = 0; // Interrupt vector (MSI-X table index) of the completion queue
+
+        uint64_t sqPhys;
+        uint64_t cqPhys;
+    private:
+        void ProcessCompletions() override;
+
+        Controller* controller;
+
+        nvme_command_t* sq;
+        volatile nvme_completion_t* cq;
+        volatile uint32_t* sqDoorbell;
+        volatile uint32_t* cqDoorbell;
+
+        uint16_t sqTail = 0;
+        uint16_t cqHead = 0;
+        uint16_t phase = 1; // Expected phase tag of new completions
+
+        uint64_t prpListPhys[NVME_IO_QUEUE_SLOTS];
+        uint64_t* prpLists[NVME_IO_QUEUE_SLOTS];
+    };
+
+    class Namespace : public DiskDevice{
+    public:
+        Namespace(Controller* controller, uint32_t nsID, uint64_t blockCount, unsigned lbaShift);
+
+        int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+        int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+    private:
+        int Submit(Request& req, uint64_t lba, uint32_t size, uint8_t* buffer, bool write);
+        int Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+
+        Controller* controller;
+        uint32_t nsID;
+        uint64_t blockCount;
+        unsigned lbaShift;
+    };
+
+    class Controller{
+        friend class Queue;
+    public:
+        Controller(const pci_device_t& device);
+
+        // Reset and configure the controller, create the IO queues and register its namespaces
+        int Initialize();
+
+        // Queue for the current processor
+        Queue* GetIOQueue();
+
+        void OnInterrupt();
+
+        uint32_t maxTransfer = NVME_MAX_TRANSFER;
+    private:
+        int Enable(bool enable);
+        int AdminCommand(nvme_command_t& cmd, uint32_t* result = nullptr);
+        int Identify(uint8_t cns, uint32_t nsID);
+
+        void InitializeInterrupts();
+        int CreateIOQueues();
+        void InitializeNamespaces();
+
+        inline uint32_t ReadRegister(uint32_t reg){ return *reinterpret_cast<volatile uint32_t*>(registers + reg); }
+        inline void WriteRegister(uint32_t reg, uint32_t value){ *reinterpret_cast<volatile uint32_t*>(registers + reg) = value; }
+        inline volatile uint32_t* Doorbell(uint16_t queue, bool completion){ return reinterpret_cast<volatile uint32_t*>(registers + NVME_REG_DOORBELL_BASE + (2 * queue + completion) * doorbellStride); }
+
+        pci_device_t pciDevice;
+        uint8_t* registers;
+        uint64_t capabilities;
+        uint32_t doorbellStride;
+        unsigned timeout; // ms
+
+        Queue* adminQueue = nullptr;
+        Queue* ioQueues[NVME_MAX_IO_QUEUES];
+        unsigned ioQueueCount = 0;
+        Queue* cpuQueues[256]; // Indexed by APIC id
+
+        pci_msix_t msix;
+        bool useMSIX = false;
+        bool perCPUVectors = false; // Each IO queue interrupts the processor that owns it
+        int interruptVector = -1;
+
+        uint64_t identifyPhys;
+        uint8_t* identifyVirt;
+
+        List<Namespace*> namespaces;
+    };
+
     void Initialize();
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <characterbuffer.h>
+#include <stream.h>
 #include <types.h>
 #include <scheduler.h>
 
@@ -14,6 +15,8 @@ typedef unsigned int tcflag_t;
 #define TIOCGWINSZ 0x5413
 #define TIOCSWINSZ 0x5414
 
+#define PTY_OUTPUT_BUFSIZE 0x10000 // 64KB of output before the slave blocks
+
 #define NCCS    11
 #define VEOF     0
 #define VEOL     1
@@ -95,6 +98,8 @@ public:
     ssize_t Write(size_t, size_t, uint8_t *);
     int Ioctl(uint64_t cmd, uint64_t arg);
 
+    void Close();
+
     void Watch(FilesystemWatcher& watcher, int events);
     void Unwatch(FilesystemWatcher& watcher);
 
@@ -105,11 +110,12 @@ class PTY{
 private:
     Scheduler::GenericThreadBlocker slaveBlocker;
 
+    lock_t watcherLock = 0; // Watchers are signalled with this held so Unwatch can't return whilst one is being signalled
     List<FilesystemWatcher*> watchingSlave;
     List<FilesystemWatcher*> watchingMaster;
 public:
-    CharacterBuffer master;
-    CharacterBuffer slave;
+    DataStream master = DataStream(PTY_OUTPUT_BUFSIZE); // Output from the slave, read by the master
+    CharacterBuffer slave; // Input from the master, needs line editing
 
     PTYDevice masterFile;
     PTYDevice slaveFile;
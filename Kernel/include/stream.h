@@ -31,24 +31,72 @@ public:
     virtual ~Stream();
 };
 
+// Circular byte buffer, the capacity is rounded up to a power of two.
+// The reader and writer sides never take the same lock, so a single reader and a single writer
+// never wait on each other. readLock/writeLock only serialise multiple readers or writers.
 class DataStream final : public Stream {
-    lock_t streamLock = 0;
+    lock_t readLock = 0;
+    lock_t writeLock = 0;
+    lock_t waitLock = 0; // Protects the blocked thread lists
 
     size_t bufferSize = 0;
-    size_t bufferPos = 0;
+    size_t bufferMask = 0;
 
-    void* buffer = nullptr;
+    // Free running positions, data is at (pos & bufferMask)
+    size_t readPos = 0; // Only advanced by the reader
+    size_t writePos = 0; // Only advanced by the writer
+
+    uint8_t* buffer = nullptr;
+
+    bool hungUp = false; // The other end has gone away
+
+    unsigned waitingReaders = 0;
+    unsigned waitingWriters = 0;
+    Scheduler::GenericThreadBlocker readers; // Waiting for data
+    Scheduler::GenericThreadBlocker writers; // Waiting for space
+
+    void WakeReaders();
+    void WakeWriters();
+    void Block(Scheduler::GenericThreadBlocker& blocker, unsigned& waitCount, bool forSpace);
 public:
     DataStream(size_t bufSize);
     ~DataStream();
 
+    /////////////////////////////
+    /// \brief Block until there is data to read
+    /////////////////////////////
     void Wait();
 
+    /////////////////////////////
+    /// \brief Block until there is space to write
+    /////////////////////////////
+    void WaitForSpace();
+
     int64_t Read(void* buffer, size_t len);
     int64_t Peek(void* buffer, size_t len);
+
+    /////////////////////////////
+    /// \brief Write as much of buffer as fits, never blocks
+    ///
+    /// \return Amount of bytes written, 0 if the stream is full
+    /////////////////////////////
     int64_t Write(void* buffer, size_t len);
+
+    /////////////////////////////
+    /// \brief Discard everything in the stream
+    /////////////////////////////
+    void Flush();
+
+    /////////////////////////////
+    /// \brief Mark the other end as gone and wake everyone blocked on the stream
+    ///
+    /// Wait and WaitForSpace no longer block once the stream has been hung up.
+    /////////////////////////////
+    void HangUp();
+    bool HungUp() { return __atomic_load_n(&hungUp, __ATOMIC_ACQUIRE); }
     
-    int64_t Pos() { return bufferPos; }
+    int64_t Pos() { return __atomic_load_n(&writePos, __ATOMIC_ACQUIRE) - __atomic_load_n(&readPos, __ATOMIC_ACQUIRE); }
+    size_t Space() { return bufferSize - Pos(); }
     virtual int64_t Empty();
 };
 
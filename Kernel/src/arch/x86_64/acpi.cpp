@@ -277,19 +277,7 @@ extern "C"{
 	}
 		
 	void laihost_sleep(uint64_t ms){
-		uint64_t freq = Timer::GetFrequency();
-		uint64_t delayInTicks = (freq/1000)*ms;
-		uint64_t seconds = Timer::GetSystemUptime();
-		uint64_t ticks = Timer::GetTicks();
-		uint64_t totalTicks = seconds*freq + ticks;
-
-		for(;;){
-			uint64_t totalTicksNew = Timer::GetSystemUptime()*freq + Timer::GetTicks();
-			if(totalTicksNew - totalTicks == delayInTicks){
-				break;
-			}
-		}
-		return;
+		Timer::Wait(ms);
 	}
 
 	/* Write a byte/word/dword to the given device's PCI configuration space
@@ -5,7 +5,7 @@
 #include <scheduler.h>
 #include <paging.h>
 #include <physicalallocator.h>
-#include <scheduler.h>
+#include <fs/pagecache.h>
 
 int VerifyELF(void* elf){
     elf64_header_t elfHdr = *(elf64_header_t*)elf;
@@ -19,50 +19,144 @@ int VerifyELF(void* elf){
     } else return 1;
 }
 
-elf_info_t LoadELFSegments(process_t* proc, void* elf, uintptr_t base){
+// Returns true if any PT_LOAD segment other than skip touches the page at address
+static bool PageSharedWithSegment(elf64_program_header_t* pHdrs, uint16_t phNum, uint16_t skip, uintptr_t base, uintptr_t address){
+    for(uint16_t i = 0; i < phNum; i++){
+        if(i == skip || pHdrs[i].type != PT_LOAD || !pHdrs[i].memSize) continue;
+
+        uintptr_t start = (base + pHdrs[i].vaddr) & ~(PAGE_SIZE_4K - 1);
+        uintptr_t end = base + pHdrs[i].vaddr + pHdrs[i].memSize;
+        if(address >= start && address < end) return true;
+    }
+
+    return false;
+}
+
+elf_info_t LoadELFSegments(process_t* proc, FsNode* node, uintptr_t base){
     elf_info_t elfInfo;
     memset(&elfInfo, 0, sizeof(elfInfo));
 
-    if(!VerifyELF(elf)) return elfInfo; // Invalid ELF Header
-
-    elf64_header_t elfHdr = *(elf64_header_t*)elf;
+    elf64_header_t elfHdr;
+    if(fs::Read(node, 0, sizeof(elf64_header_t), (uint8_t*)&elfHdr) != sizeof(elf64_header_t) || !VerifyELF(&elfHdr)) return elfInfo; // Invalid ELF Header
+    if(elfHdr.phEntrySize < sizeof(elf64_program_header_t)) return elfInfo;
 
-    elfInfo.entry = base + elfHdr.entry;
-    elfInfo.phEntrySize = elfHdr.phEntrySize;
-    elfInfo.phNum = elfHdr.phNum;
+    uint8_t* pHdrBuffer = (uint8_t*)kmalloc(elfHdr.phNum * elfHdr.phEntrySize);
+    if(fs::Read(node, elfHdr.phOff, elfHdr.phNum * elfHdr.phEntrySize, pHdrBuffer) != elfHdr.phNum * elfHdr.phEntrySize){
+        kfree(pHdrBuffer);
+        return elfInfo;
+    }
 
+    elf64_program_header_t* pHdrs = (elf64_program_header_t*)kmalloc(elfHdr.phNum * sizeof(elf64_program_header_t));
     for(uint16_t i = 0; i < elfHdr.phNum; i++){
-        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(elf + elfHdr.phOff + i * elfHdr.phEntrySize));
+        pHdrs[i] = *((elf64_program_header_t*)(pHdrBuffer + i * elfHdr.phEntrySize));
+    }
+    kfree(pHdrBuffer);
+
+    fs::PageCache* cache = fs::GetPageCache(node);
+    void* window = Memory::KernelAllocate4KPages(1); // Used to fill frames before they are mapped into the process
+    bool failed = false;
+
+    for(uint16_t i = 0; i < elfHdr.phNum && !failed; i++){
+        elf64_program_header_t& elfPHdr = pHdrs[i];
+
+        if(elfPHdr.type != PT_LOAD || elfPHdr.memSize == 0) continue;
 
-        if(elfPHdr.memSize == 0) continue;
-        for(unsigned j = 0; j < ((elfPHdr.memSize + (elfPHdr.vaddr & 0xFFF) + 0xFFF) >> 12); j++){
-            uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
-            Memory::MapVirtualMemory4K(phys,base + elfPHdr.vaddr + j * PAGE_SIZE_4K, 1, proc->addressSpace);
+        uintptr_t segmentStart = base + elfPHdr.vaddr;
+        uintptr_t fileEnd = segmentStart + elfPHdr.fileSize;
+        uintptr_t segmentEnd = segmentStart + elfPHdr.memSize;
+
+        if((segmentStart & (PAGE_SIZE_4K - 1)) != (elfPHdr.offset & (PAGE_SIZE_4K - 1))){
+            Log::Warning("ELF segment offset (%x) and address (%x) are not congruent", elfPHdr.offset, elfPHdr.vaddr);
+            failed = true;
+            break;
+        }
+
+        uintptr_t pageStart = segmentStart & ~(PAGE_SIZE_4K - 1);
+        uint64_t fileOffset = elfPHdr.offset & ~(PAGE_SIZE_4K - 1); // Offset in the file of pageStart
+
+        uintptr_t runStart = 0; // Current run of pages mapped straight from the file
+        uint64_t runPages = 0;
+
+        for(uintptr_t page = pageStart; page < segmentEnd; page += PAGE_SIZE_4K, fileOffset += PAGE_SIZE_4K){
+            bool shared = PageSharedWithSegment(pHdrs, elfHdr.phNum, i, base, page);
+
+            // Whole pages of file data are mapped from the page cache and copied when written to
+            if(page + PAGE_SIZE_4K <= fileEnd && !shared){
+                if(!runPages) runStart = page;
+                runPages++;
+                continue;
+            }
+
+            if(runPages){
+                fs::MapFile(proc, node, runStart, runPages, fileOffset - runPages * PAGE_SIZE_4K, MAP_PRIVATE);
+                runPages = 0;
+            }
+
+            // Pages of only .bss are zero filled when they are first touched
+            if(page >= fileEnd && !shared){
+                Memory::MapDemandZero4K(page, 1, proc->addressSpace);
+                continue;
+            }
+
+            // Partial pages (and pages other segments also use) get a private frame, segments can share a page so keep any frame that is already there
+            uint64_t phys = Memory::VirtualToPhysicalAddress(page, proc->addressSpace);
+            if(!phys){
+                phys = Memory::AllocatePhysicalMemoryBlock();
+                Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)window, 1);
+                memset(window, 0, PAGE_SIZE_4K);
+
+                Memory::MapVirtualMemory4K(phys, page, 1, proc->addressSpace);
+            } else {
+                Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)window, 1);
+            }
+
+            uintptr_t dataStart = page > segmentStart ? page : segmentStart;
+            uintptr_t dataEnd = page + PAGE_SIZE_4K < fileEnd ? page + PAGE_SIZE_4K : fileEnd;
+            if(dataEnd > dataStart){
+                uint8_t* data;
+                if(!cache->GetPage(fileOffset / PAGE_SIZE_4K, &data)){
+                    failed = true;
+                    break;
+                }
+
+                memcpy((uint8_t*)window + (dataStart - page), data + (dataStart - page), dataEnd - dataStart);
+            }
+
+            uintptr_t zeroStart = dataEnd > dataStart ? dataEnd : dataStart;
+            uintptr_t zeroEnd = page + PAGE_SIZE_4K < segmentEnd ? page + PAGE_SIZE_4K : segmentEnd;
+            if(zeroEnd > zeroStart){
+                memset((uint8_t*)window + (zeroStart - page), 0, zeroEnd - zeroStart);
+            }
+        }
+
+        if(runPages && !failed){
+            fs::MapFile(proc, node, runStart, runPages, fileOffset - runPages * PAGE_SIZE_4K, MAP_PRIVATE);
         }
     }
 
-    char* linkPath = nullptr;
+    Memory::KernelFree4KPages(window, 1);
 
     for(int i = 0; i < elfHdr.phNum; i++){
-        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(elf + elfHdr.phOff + i * elfHdr.phEntrySize));
-        
-        if(elfPHdr.type == PT_LOAD && elfPHdr.memSize > 0){
-            asm("cli");
-            asm volatile("mov %%rax, %%cr3" :: "a"(proc->addressSpace->pml4Phys));
-            memset((void*)base + elfPHdr.vaddr,0,elfPHdr.memSize);
-            memcpy((void*)base + elfPHdr.vaddr,(void*)(elf + elfPHdr.offset),elfPHdr.fileSize);
-            asm volatile("mov %%rax, %%cr3" :: "a"(Scheduler::GetCurrentProcess()->addressSpace->pml4Phys));
-            asm("sti");
-        } else if (elfPHdr.type == PT_PHDR) {
+        elf64_program_header_t& elfPHdr = pHdrs[i];
+
+        if (elfPHdr.type == PT_PHDR) {
             elfInfo.pHdrSegment = base + elfPHdr.vaddr;
         } else if(elfPHdr.type == PT_INTERP){
-            linkPath = (char*)kmalloc(elfPHdr.fileSize + 1);
-            strncpy(linkPath, (char*)(elf + elfPHdr.offset), elfPHdr.fileSize);
+            char* linkPath = (char*)kmalloc(elfPHdr.fileSize + 1);
+            fs::Read(node, elfPHdr.offset, elfPHdr.fileSize, (uint8_t*)linkPath);
             linkPath[elfPHdr.fileSize] = 0; // Null terminate the path
 
             elfInfo.linkerPath = linkPath;
         }
     }
 
+    kfree(pHdrs);
+
+    if(!failed){
+        elfInfo.entry = base + elfHdr.entry;
+        elfInfo.phEntrySize = elfHdr.phEntrySize;
+        elfInfo.phNum = elfHdr.phNum;
+    }
+
     return elfInfo;
-}
\ No newline at end of file
+}
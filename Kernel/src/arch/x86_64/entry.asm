@@ -61,19 +61,19 @@ GDT64:                           ; Global Descriptor Table (64-bit).
     db 10010010b                 ; Access (read/write).
     db 00000000b                 ; Granularity.
     db 0                         ; Base (high).
-    .UserCode: equ $ - GDT64     ; The usermode code descriptor.
+    .UserData: equ $ - GDT64     ; The usermode data descriptor, must directly precede user code for SYSRET.
     dw 0                         ; Limit (low).
     dw 0                         ; Base (low).
     db 0                         ; Base (middle)
-    db 11111010b                 ; Access (exec/read).
-    db 00100000b                 ; Granularity, 64 bits flag, limit19:16.
+    db 11110010b                 ; Access (read/write).
+    db 00000000b                 ; Granularity.
     db 0                         ; Base (high).
-    .UserData: equ $ - GDT64     ; The usermode data descriptor.
+    .UserCode: equ $ - GDT64     ; The usermode code descriptor.
     dw 0                         ; Limit (low).
     dw 0                         ; Base (low).
     db 0                         ; Base (middle)
-    db 11110010b                 ; Access (read/write).
-    db 00000000b                 ; Granularity.
+    db 11111010b                 ; Access (exec/read).
+    db 00100000b                 ; Granularity, 64 bits flag, limit19:16.
     db 0                         ; Base (high).
     .TSS: ;equ $ - GDT64         ; TSS Descriptor
     .len:
@@ -249,6 +249,7 @@ entry64:
   mov rax, cr0
 	and ax, 0xFFFB		; Clear coprocessor emulation
 	or ax, 0x2			; Set coprocessor monitoring
+	or rax, 1 << 16		; Write protect, the kernel faults on read only user pages so copy on write works for it too
 	mov cr0, rax
 
 	;Enable SSE
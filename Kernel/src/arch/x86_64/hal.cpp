@@ -187,10 +187,12 @@ namespace HAL{
         
         Log::Info("Initializing Local and I/O APIC...");
         APIC::Initialize();
+        Timer::InitializeLocalTimers();
         Log::Write("OK");
         
         Log::Info("Initializing SMP...");
         SMP::Initialize();
+        Timer::EnableLocalTimer();
         Log::Write("OK");
     }
 
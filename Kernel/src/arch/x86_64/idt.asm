@@ -145,6 +145,8 @@ ISR_ERROR_CODE 30
 ISR_NO_ERROR_CODE 31
 ISR_NO_ERROR_CODE 32
 ISR_NO_ERROR_CODE 0x69 ; Syscall
+IPI 0xFB ; IPI_TLB_SHOOTDOWN
+IPI 0xFC ; IRQ_LOCAL_TIMER
 IPI 0xFD ; IPI_SCHEDULE
 IPI 0xFE ; IPI_HALT
 
@@ -163,4 +165,22 @@ IRQ 11, 43
 IRQ 12, 44
 IRQ 13, 45
 IRQ 14, 46
-IRQ 15, 47
\ No newline at end of file
+IRQ 15, 47
+
+; Dynamically assigned (MSI/MSI-X)
+IRQ 16, 48
+IRQ 17, 49
+IRQ 18, 50
+IRQ 19, 51
+IRQ 20, 52
+IRQ 21, 53
+IRQ 22, 54
+IRQ 23, 55
+IRQ 24, 56
+IRQ 25, 57
+IRQ 26, 58
+IRQ 27, 59
+IRQ 28, 60
+IRQ 29, 61
+IRQ 30, 62
+IRQ 31, 63
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <scheduler.h>
 #include <apic.h>
 #include <strace.h>
+#include <spin.h>
 
 idt_entry_t idt[256];
 
@@ -111,10 +112,46 @@ extern "C"
 void irq14();
 extern "C"
 void irq15();
+extern "C"
+void irq16();
+extern "C"
+void irq17();
+extern "C"
+void irq18();
+extern "C"
+void irq19();
+extern "C"
+void irq20();
+extern "C"
+void irq21();
+extern "C"
+void irq22();
+extern "C"
+void irq23();
+extern "C"
+void irq24();
+extern "C"
+void irq25();
+extern "C"
+void irq26();
+extern "C"
+void irq27();
+extern "C"
+void irq28();
+extern "C"
+void irq29();
+extern "C"
+void irq30();
+extern "C"
+void irq31();
 
 extern "C"
 void isr0x69();
 
+extern "C"
+void ipi0xFB(); // IPI_TLB_SHOOTDOWN
+extern "C"
+void ipi0xFC(); // IRQ_LOCAL_TIMER
 extern "C"
 void ipi0xFD(); // IPI_SCHEDULE
 extern "C"
@@ -186,6 +223,8 @@ namespace IDT{
 		SetGate(30, (uint64_t)isr30,0x08,0x8E);
 		SetGate(31, (uint64_t)isr31,0x08,0x8E);
 		SetGate(0x69, (uint64_t)isr0x69, 0x08, 0xEE /* Allow syscalls to be called from user mode*/, 0); // Syscall
+		SetGate(IPI_TLB_SHOOTDOWN, (uint64_t)ipi0xFB,0x08,0x8E);
+		SetGate(IRQ_LOCAL_TIMER, (uint64_t)ipi0xFC,0x08,0x8E);
 		SetGate(IPI_SCHEDULE, (uint64_t)ipi0xFD,0x08,0x8E);
 		SetGate(IPI_HALT, (uint64_t)ipi0xFE,0x08,0x8E);
 
@@ -218,6 +257,22 @@ namespace IDT{
 		SetGate(45, (uint64_t)irq13, 0x08, 0x8E);
 		SetGate(46, (uint64_t)irq14, 0x08, 0x8E);
 		SetGate(47, (uint64_t)irq15, 0x08, 0x8E);
+		SetGate(48, (uint64_t)irq16, 0x08, 0x8E);
+		SetGate(49, (uint64_t)irq17, 0x08, 0x8E);
+		SetGate(50, (uint64_t)irq18, 0x08, 0x8E);
+		SetGate(51, (uint64_t)irq19, 0x08, 0x8E);
+		SetGate(52, (uint64_t)irq20, 0x08, 0x8E);
+		SetGate(53, (uint64_t)irq21, 0x08, 0x8E);
+		SetGate(54, (uint64_t)irq22, 0x08, 0x8E);
+		SetGate(55, (uint64_t)irq23, 0x08, 0x8E);
+		SetGate(56, (uint64_t)irq24, 0x08, 0x8E);
+		SetGate(57, (uint64_t)irq25, 0x08, 0x8E);
+		SetGate(58, (uint64_t)irq26, 0x08, 0x8E);
+		SetGate(59, (uint64_t)irq27, 0x08, 0x8E);
+		SetGate(60, (uint64_t)irq28, 0x08, 0x8E);
+		SetGate(61, (uint64_t)irq29, 0x08, 0x8E);
+		SetGate(62, (uint64_t)irq30, 0x08, 0x8E);
+		SetGate(63, (uint64_t)irq31, 0x08, 0x8E);
 		
 		__asm__ __volatile__("sti");
 
@@ -228,6 +283,24 @@ namespace IDT{
 		interrupt_handlers[interrupt] = handler;
 	}
 
+	int ReserveUnusedInterrupt(){
+		static lock_t reserveLock = 0;
+		static uint32_t reserved = 0;
+
+		acquireLock(&reserveLock);
+		for(int i = 0; i < IRQ_DYNAMIC_COUNT; i++){
+			if(!(reserved & (1U << i)) && !interrupt_handlers[IRQ_DYNAMIC_BASE + i]){
+				reserved |= 1U << i;
+				releaseLock(&reserveLock);
+
+				return IRQ_DYNAMIC_BASE + i;
+			}
+		}
+		releaseLock(&reserveLock);
+
+		return -1;
+	}
+
 	void DisablePIC(){
 		outportb(0x20, 0x11);
 		outportb(0xA0, 0x11);
@@ -9,7 +9,11 @@
 #include <physicalallocator.h>
 #include <panic.h>
 #include <apic.h>
+#include <smp.h>
+#include <cpu.h>
 #include <strace.h>
+#include <fs/pagecache.h>
+#include <errno.h>
 
 //extern uint32_t kernel_end;
 
@@ -29,6 +33,68 @@ namespace Memory{
 	page_t kernelHeapDirTables[TABLES_PER_DIR][PAGES_PER_TABLE] __attribute__((aligned(4096)));
 	page_dir_t ioDirs[4] __attribute__((aligned(4096)));
 
+	// Page directories of a process are only created once something is mapped in the 1GB they cover
+	static void CreatePageDir(uint16_t pdptIndex, address_space_t* addressSpace){
+		pd_entry_t* pageDir = (pd_entry_t*)KernelAllocate4KPages(1);
+		uint64_t pageDirPhys = AllocatePhysicalMemoryBlock();
+		KernelMapVirtualMemory4K(pageDirPhys, (uintptr_t)pageDir, 1);
+		memset(pageDir, 0, PAGE_SIZE_4K);
+
+		page_t** pageTables = (page_t**)KernelAllocate4KPages(1);
+		KernelMapVirtualMemory4K(AllocatePhysicalMemoryBlock(), (uintptr_t)pageTables, 1);
+		memset(pageTables, 0, PAGE_SIZE_4K);
+
+		addressSpace->pageTables[pdptIndex] = pageTables;
+		addressSpace->pageDirsPhys[pdptIndex] = pageDirPhys;
+		addressSpace->pageDirs[pdptIndex] = pageDir;
+
+		addressSpace->pdpt[pdptIndex] = (pageDirPhys & PDPT_FRAME) | PDPT_WRITABLE | PDPT_PRESENT | PDPT_USER;
+	}
+
+	static inline bool HasPageTable(address_space_t* addressSpace, uint32_t pdptIndex, uint32_t pageDirIndex){
+		return addressSpace->pageDirs[pdptIndex] && (addressSpace->pageDirs[pdptIndex][pageDirIndex] & PDE_PRESENT) && addressSpace->pageTables[pdptIndex][pageDirIndex];
+	}
+
+	lock_t shootdownLock = 0;
+	volatile unsigned shootdownPending = 0;
+
+	// Interrupts must be disabled. The flag stops us flushing twice when we polled it before the IPI arrived.
+	static void FlushPendingTLB(){
+		if(__atomic_exchange_n(&GetCPULocal()->tlbFlushPending, 0, __ATOMIC_ACQ_REL)){
+			asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory"); // Reloading cr3 flushes every non global entry
+			__sync_fetch_and_sub(&shootdownPending, 1);
+		}
+	}
+
+	static void TLBShootdownHandler(regs64_t* regs){
+		FlushPendingTLB();
+	}
+
+	void ShootdownTLB(){
+		if(SMP::processorCount <= 1) return;
+
+		// With interrupts disabled we can't take the IPI, so answer anyone else's shootdown whilst we wait for ours
+		bool intsEnabled = CheckInterrupts();
+		while(acquireTestLock(&shootdownLock)){
+			if(!intsEnabled) FlushPendingTLB();
+			asm("pause");
+		}
+
+		CPU* self = GetCPULocal();
+		for(unsigned i = 0; i < 256; i++){
+			if(SMP::cpus[i] && SMP::cpus[i] != self){
+				SMP::cpus[i]->tlbFlushPending = 1;
+			}
+		}
+
+		shootdownPending = SMP::processorCount - 1;
+		APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_TLB_SHOOTDOWN);
+
+		while(shootdownPending) asm("pause");
+
+		releaseLock(&shootdownLock);
+	}
+
 	uint64_t VirtualToPhysicalAddress(uint64_t addr) {
 		uint64_t address = 0;
 
@@ -57,7 +123,7 @@ namespace Memory{
 		uint32_t pageTableIndex = PAGE_TABLE_GET_INDEX(addr);
 
 		if(pml4Index == 0){ // From Process Address Space
-			if((addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1) && addressSpace->pageTables[pdptIndex][pageDirIndex])
+			if(HasPageTable(addressSpace, pdptIndex, pageDirIndex))
 				return addressSpace->pageTables[pdptIndex][pageDirIndex][pageTableIndex] & PAGE_FRAME;
 			else return 0;		
 		} else { // From Kernel Address Space
@@ -70,9 +136,49 @@ namespace Memory{
 		return address;
 	}
 
+	uint64_t GetPhysicalAddress(uintptr_t addr, address_space_t* addressSpace){
+		uint64_t offset = addr & (PAGE_SIZE_4K - 1);
+
+		if(PML4_GET_INDEX(addr) == 0){ // From Process Address Space
+			if(!addressSpace) return 0;
+
+			uint32_t pdptIndex = PDPT_GET_INDEX(addr);
+			uint32_t pageDirIndex = PAGE_DIR_GET_INDEX(addr);
+			if(!HasPageTable(addressSpace, pdptIndex, pageDirIndex)) return 0;
+
+			// Pages that have not been backed yet and read only page cache frames (the device may write to the buffer) have to be bounced
+			uint64_t page = addressSpace->pageTables[pdptIndex][pageDirIndex][PAGE_TABLE_GET_INDEX(addr)];
+			if((page & (PAGE_PRESENT | PAGE_WRITABLE)) != (PAGE_PRESENT | PAGE_WRITABLE) || (page & PAGE_COW)) return 0;
+
+			return (page & PAGE_FRAME) ? ((page & PAGE_FRAME) + offset) : 0;
+		} else if(addr >= IO_VIRTUAL_BASE && addr < KERNEL_VIRTUAL_BASE){ // IO mappings are linear
+			return addr - IO_VIRTUAL_BASE;
+		} else if(addr >= KERNEL_VIRTUAL_BASE && PDPT_GET_INDEX(addr) == PDPT_GET_INDEX(KERNEL_VIRTUAL_BASE)){ // Kernel image is mapped linearly
+			return addr - KERNEL_VIRTUAL_BASE;
+		} else if(addr >= KERNEL_VIRTUAL_BASE && PDPT_GET_INDEX(addr) == KERNEL_HEAP_PDPT_INDEX){
+			uint32_t pageDirIndex = PAGE_DIR_GET_INDEX(addr);
+
+			if(!(kernelHeapDir[pageDirIndex] & 0x1)){
+				return 0;
+			} else if(kernelHeapDir[pageDirIndex] & 0x80){
+				return (GetPageFrame(kernelHeapDir[pageDirIndex]) << 12) + (addr & (PAGE_SIZE_2M - 1));
+			}
+
+			uint64_t page = kernelHeapDirTables[pageDirIndex][PAGE_TABLE_GET_INDEX(addr)];
+			if(!(page & 0x1)){
+				return 0;
+			}
+
+			return (GetPageFrame(page) << 12) + offset;
+		}
+
+		return 0;
+	}
+
 	void InitializeVirtualMemory()
 	{
 		IDT::RegisterInterruptHandler(14,PageFaultHandler);
+		IDT::RegisterInterruptHandler(IPI_TLB_SHOOTDOWN,TLBShootdownHandler);
 		memset(kernelPML4, 0, sizeof(pml4_t));
 		memset(kernelPDPT, 0, sizeof(pdpt_t));
 		memset(kernelHeapDir, 0, sizeof(page_dir_t));
@@ -122,26 +228,16 @@ namespace Memory{
 		page_t*** pageTables = (page_t***)KernelAllocate4KPages(1); // Page Tables
 		Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), (uintptr_t)pageTables,1);
 
+		// Page directories are created as they are needed, see CreatePageDir
+		memset(pageDirs, 0, PAGE_SIZE_4K);
+		memset(pageDirsPhys, 0, PAGE_SIZE_4K);
+		memset(pageTables, 0, PAGE_SIZE_4K);
+
 		pml4_entry_t* pml4 = (pml4_entry_t*)KernelAllocate4KPages(1); // Page Tables
 		uintptr_t pml4Phys = Memory::AllocatePhysicalMemoryBlock();
 		Memory::KernelMapVirtualMemory4K(pml4Phys, (uintptr_t)pml4,1);
 		memcpy(pml4, kernelPML4, 4096);
 
-		for(int i = 0; i < 512; i++){
-			pageDirs[i] = (pd_entry_t*)KernelAllocate4KPages(1);
-			pageDirsPhys[i] = Memory::AllocatePhysicalMemoryBlock();
-			KernelMapVirtualMemory4K(pageDirsPhys[i],(uintptr_t)pageDirs[i],1);
-
-			pageTables[i] = (page_t**)Memory::KernelAllocate4KPages(1);
-			KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),(uintptr_t)pageTables[i],1);
-
-			SetPageFrame(&(pdpt[i]),pageDirsPhys[i]);
-			pdpt[i] |= PDPT_WRITABLE | PDPT_PRESENT | PDPT_USER;
-
-			memset(pageDirs[i],0,4096);
-			memset(pageTables[i],0,4096);
-		}
-
 		addressSpace->pageDirs = pageDirs;
 		addressSpace->pageDirsPhys = pageDirsPhys;
 		addressSpace->pageTables = pageTables;
@@ -149,6 +245,7 @@ namespace Memory{
 		addressSpace->pdptPhys = pdptPhys;
 		addressSpace->pml4Phys = pml4Phys;
 		addressSpace->pdpt = pdpt;
+		addressSpace->faultLock = 0;
 
 		pml4[0] = pdptPhys | PML4_PRESENT | PML4_WRITABLE | PAGE_USER;
 
@@ -157,20 +254,19 @@ namespace Memory{
 
 	void DestroyAddressSpace(address_space_t* addressSpace){
 		for(int i = 0; i < DIRS_PER_PDPT; i++){
+			if(!addressSpace->pageDirs[i]) continue;
+
 			for(int j = 0; j < TABLES_PER_DIR; j++){
 				pd_entry_t dirEnt = addressSpace->pageDirs[i][j];
 				if(dirEnt & PAGE_PRESENT){
-					uint64_t phys = GetPageFrame(dirEnt);
-
 					for(int k = 0; k < PAGES_PER_TABLE; k++){
-						if(addressSpace->pageTables[i][j][k] & 0x1){
-							uint64_t pagePhys = GetPageFrame(addressSpace->pageTables[i][j][k]);
-							FreePhysicalMemoryBlock(pagePhys);
+						page_t page = addressSpace->pageTables[i][j][k];
+						if((page & PAGE_PRESENT) && (page & PAGE_FRAME) && !(page & (PAGE_FILE | PAGE_SHARED))){ // Page cache and shared memory frames are not ours to free
+							FreePhysicalMemoryBlock(page & PAGE_FRAME); // Only drops a reference if the frame is shared after fork
 						}
 					}
 
-					FreePhysicalMemoryBlock(phys);
-					addressSpace->pageDirs[i][j] = 0;
+					FreePhysicalMemoryBlock(dirEnt & PDE_FRAME);
 					KernelFree4KPages(addressSpace->pageTables[i][j], 1);
 				}
 				addressSpace->pageDirs[i][j] = 0;
@@ -183,23 +279,28 @@ namespace Memory{
 	}
 
 	bool CheckRegion(uintptr_t addr, uint64_t len, address_space_t* addressSpace){
-		return addr < PDPT_SIZE && (addr + len) < PDPT_SIZE && (addressSpace->pdpt[PDPT_GET_INDEX(addr)] & PDPT_USER) && (addressSpace->pdpt[PDPT_GET_INDEX(addr + len)] & PDPT_USER);
+		return addr < PDPT_SIZE && (addr + len) < PDPT_SIZE;
 	}
 
 	bool CheckUsermodePointer(uintptr_t addr, uint64_t len, address_space_t* addressSpace){
-		if(!(addressSpace->pageDirs[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)] & (PAGE_PRESENT))){
+		if(addr >= PDPT_SIZE || addr + len >= PDPT_SIZE){
+			return 0;
+		}
+
+		if(!HasPageTable(addressSpace, PDPT_GET_INDEX(addr), PAGE_DIR_GET_INDEX(addr))){
 			return 0;
 		}
 		
-		if(!(addressSpace->pageDirs[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)] & (PAGE_PRESENT))){
+		if(!HasPageTable(addressSpace, PDPT_GET_INDEX(addr + len), PAGE_DIR_GET_INDEX(addr + len))){
 			return 0;
 		}
 
-		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_PRESENT)) && addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_USER))){
+		// Demand zero and file backed pages are valid, they get backed when the kernel touches them
+		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_PRESENT | PAGE_DEMAND_ZERO | PAGE_FILE)) && addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_USER))){
 			return 0;
 		}
 		
-		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_PRESENT)) && addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_USER))){
+		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_PRESENT | PAGE_DEMAND_ZERO | PAGE_FILE)) && addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_USER))){
 			return 0;
 		}
 
@@ -224,12 +325,129 @@ namespace Memory{
 	}
 
 	void CreatePageTable(uint16_t pdptIndex, uint16_t pageDirIndex, address_space_t* addressSpace){
+		if(!addressSpace->pageDirs[pdptIndex]) CreatePageDir(pdptIndex, addressSpace);
+
 		page_table_t pTable = AllocatePageTable();
 		SetPageFrame(&(addressSpace->pageDirs[pdptIndex][pageDirIndex]),pTable.phys);
 		addressSpace->pageDirs[pdptIndex][pageDirIndex] |= PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
 		addressSpace->pageTables[pdptIndex][pageDirIndex] = pTable.virt;
 	}
 
+	// Lazy entries, page cache frames and shared memory are copied as they are
+	static inline bool IsPrivatePage(page_t page){
+		return (page & PAGE_PRESENT) && (page & PAGE_FRAME) && !(page & (PAGE_FILE | PAGE_SHARED));
+	}
+
+	int CloneAddressSpace(address_space_t* src, address_space_t* dest, bool inUse){
+		int interruptsEnabled = CheckInterrupts();
+		asm("cli");
+		acquireLock(&src->faultLock); // Keep faults from changing entries under us
+
+		// Write protect everything first, a write that gets through after a frame is shared would show up in the child
+		uint64_t tables = 0;
+		for(unsigned i = 0; i < DIRS_PER_PDPT; i++){
+			if(!src->pageDirs[i]) continue;
+
+			tables++;
+			for(unsigned j = 0; j < TABLES_PER_DIR; j++){
+				if(!HasPageTable(src, i, j)) continue;
+
+				tables++;
+				page_t* srcTable = src->pageTables[i][j];
+				for(unsigned k = 0; k < PAGES_PER_TABLE; k++){
+					if(IsPrivatePage(srcTable[k]) && (srcTable[k] & PAGE_WRITABLE)){
+						srcTable[k] = (srcTable[k] & ~PAGE_WRITABLE) | PAGE_COW;
+					}
+				}
+			}
+		}
+
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0" : "=r"(cr3));
+		asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory"); // Drop our writable entries
+
+		if(tables >= maxPhysicalBlocks - usedPhysicalBlocks + GetCachedPhysicalBlocks()){
+			releaseLock(&src->faultLock); // Nothing is shared yet, pages we write protected just become writable again when they are next written to
+			if(interruptsEnabled) asm("sti");
+			return -ENOMEM;
+		}
+
+		if(inUse){
+			// Other threads may have the pages cached as writable, the lock is dropped as they could be waiting on it with interrupts disabled
+			releaseLock(&src->faultLock);
+			ShootdownTLB();
+			acquireLock(&src->faultLock);
+		}
+
+		// Frames that were made writable again whilst the lock was dropped may still be cached as writable elsewhere,
+		// the child gets its own copy of those rather than sharing them
+		uint8_t* copyPages = reinterpret_cast<uint8_t*>(KernelAllocate4KPages(2));
+
+		for(unsigned i = 0; i < DIRS_PER_PDPT; i++){
+			if(!src->pageDirs[i]) continue;
+
+			for(unsigned j = 0; j < TABLES_PER_DIR; j++){
+				if(!HasPageTable(src, i, j)) continue;
+
+				CreatePageTable(i, j, dest);
+
+				page_t* srcTable = src->pageTables[i][j];
+				page_t* destTable = dest->pageTables[i][j];
+				for(unsigned k = 0; k < PAGES_PER_TABLE; k++){
+					page_t page = srcTable[k];
+
+					if(IsPrivatePage(page) && (page & PAGE_WRITABLE)){
+						uint64_t phys = AllocatePhysicalMemoryBlock();
+
+						KernelMapVirtualMemory4K(page & PAGE_FRAME, (uintptr_t)copyPages, 1);
+						KernelMapVirtualMemory4K(phys, (uintptr_t)copyPages + PAGE_SIZE_4K, 1);
+						memcpy(copyPages + PAGE_SIZE_4K, copyPages, PAGE_SIZE_4K);
+
+						page = (page & ~PAGE_FRAME) | (phys & PAGE_FRAME);
+					} else if(IsPrivatePage(page)){
+						ReferencePhysicalMemoryBlock(page & PAGE_FRAME);
+					}
+
+					destTable[k] = page;
+				}
+			}
+		}
+
+		KernelFree4KPages(copyPages, 2);
+
+		releaseLock(&src->faultLock);
+		if(interruptsEnabled) asm("sti");
+		return 0;
+	}
+
+	bool Reserve4KPages(uintptr_t addr, uint64_t amount, address_space_t* addressSpace){
+		if(!amount || amount > PDPT_SIZE / PAGE_SIZE_4K || !CheckRegion(addr, amount * PAGE_SIZE_4K, addressSpace)){
+			return false;
+		}
+
+		int interruptsEnabled = CheckInterrupts();
+		asm("cli");
+		acquireLock(&addressSpace->faultLock); // Another thread could be mapping over the same region
+
+		for(uintptr_t virt = addr; virt < addr + amount * PAGE_SIZE_4K; virt += PAGE_SIZE_4K){
+			if(HasPageTable(addressSpace, PDPT_GET_INDEX(virt), PAGE_DIR_GET_INDEX(virt)) && (addressSpace->pageTables[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)][PAGE_TABLE_GET_INDEX(virt)] & (PAGE_PRESENT | PAGE_DEMAND_ZERO | PAGE_FILE))){
+				releaseLock(&addressSpace->faultLock);
+				if(interruptsEnabled) asm("sti");
+				return false;
+			}
+		}
+
+		for(uintptr_t virt = addr; virt < addr + amount * PAGE_SIZE_4K; virt += PAGE_SIZE_4K){
+			if(!HasPageTable(addressSpace, PDPT_GET_INDEX(virt), PAGE_DIR_GET_INDEX(virt))) CreatePageTable(PDPT_GET_INDEX(virt), PAGE_DIR_GET_INDEX(virt), addressSpace);
+
+			addressSpace->pageTables[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)][PAGE_TABLE_GET_INDEX(virt)] = 0x3; // Same reservation as Allocate4KPages
+		}
+
+		releaseLock(&addressSpace->faultLock);
+		if(interruptsEnabled) asm("sti");
+		return true;
+	}
+
 	void* Allocate4KPages(uint64_t amount, address_space_t* addressSpace){
 		uint64_t offset = 0;
 		uint64_t pageDirOffset = 0;
@@ -239,12 +457,12 @@ namespace Memory{
 		uint64_t pml4Index = 0;
 		for(int d = 0; d < 512; d++){
 			uint64_t pdptIndex = d;
-			if(!(addressSpace->pdpt[d] & 0x1)) break;
+			if(!addressSpace->pageDirs[d]) CreatePageDir(d, addressSpace);
 			/* Attempt 1: Already Allocated Page Tables*/
 			for(int i = 0; i < TABLES_PER_DIR; i++){
 				if(addressSpace->pageDirs[d][i] & 0x1 && !(addressSpace->pageDirs[d][i] & 0x80)){
 					for(int j = 0; j < PAGES_PER_TABLE; j++){
-						if(addressSpace->pageTables[d][i][j] & 0x1){
+						if(addressSpace->pageTables[d][i][j] & (PAGE_PRESENT | PAGE_DEMAND_ZERO | PAGE_FILE)){
 							pageDirOffset = i;
 							offset = j+1;
 							counter = 0;
@@ -464,11 +682,11 @@ namespace Memory{
 			const char* panic[1] = {"Process address space cannot be >512GB"};
 			if(pdptIndex > MAX_PDPT_INDEX || pml4Index) KernelPanic(panic,1);
 
-			if(!(addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1)) continue;
-			
-			addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] = 0;
+			if(HasPageTable(addressSpace, pdptIndex, pageDirIndex)){
+				addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] = 0;
 
-			invlpg(virt);
+				invlpg(virt);
+			}
 
 			virt += PAGE_SIZE_4K; /* Go to next page */
 		}
@@ -508,7 +726,7 @@ namespace Memory{
 		MapVirtualMemory4K(phys,virt,amount,currentAddressSpace);
 	}
 
-	void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+	void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, address_space_t* addressSpace, uint64_t flags){
 		uint64_t pml4Index, pdptIndex, pageDirIndex, pageIndex;
 
 		//phys &= ~(PAGE_SIZE_4K-1);
@@ -523,10 +741,9 @@ namespace Memory{
 			const char* panic[1] = {"Process address space cannot be >512GB"};
 			if(pdptIndex > MAX_PDPT_INDEX || pml4Index) KernelPanic(panic,1);
 
-			if(!(addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1)) CreatePageTable(pdptIndex,pageDirIndex,addressSpace); // If we don't have a page table at this address, create one.
+			if(!HasPageTable(addressSpace, pdptIndex, pageDirIndex)) CreatePageTable(pdptIndex,pageDirIndex,addressSpace); // If we don't have a page table at this address, create one.
 			
-			SetPageFrame(&(addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex]), phys);
-			addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] |= PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+			addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] = (phys & PAGE_FRAME) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | flags; // Replaces any reservation or demand zero entry
 
 			invlpg(virt);
 
@@ -535,6 +752,218 @@ namespace Memory{
 		}
 	}
 
+	// Fill page table entries that are not present yet, the page fault handler backs them when they are first accessed
+	static void MapLazy4K(uint64_t virt, uint64_t amount, uint64_t flags, address_space_t* addressSpace){
+		uint64_t pml4Index, pdptIndex, pageDirIndex, pageIndex;
+
+		while(amount--){
+			pml4Index = PML4_GET_INDEX(virt);
+			pdptIndex = PDPT_GET_INDEX(virt);
+			pageDirIndex = PAGE_DIR_GET_INDEX(virt);
+			pageIndex = PAGE_TABLE_GET_INDEX(virt);
+
+			const char* panic[1] = {"Process address space cannot be >512GB"};
+			if(pdptIndex > MAX_PDPT_INDEX || pml4Index) KernelPanic(panic,1);
+
+			if(!HasPageTable(addressSpace, pdptIndex, pageDirIndex)) CreatePageTable(pdptIndex,pageDirIndex,addressSpace);
+
+			addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] = flags | PAGE_WRITABLE | PAGE_USER; // Not present, so the first access faults
+
+			invlpg(virt);
+
+			virt += PAGE_SIZE_4K;
+		}
+	}
+
+	void MapDemandZero4K(uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+		MapLazy4K(virt, amount, PAGE_DEMAND_ZERO, addressSpace);
+	}
+
+	void MapFile4K(uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+		MapLazy4K(virt, amount, PAGE_FILE, addressSpace);
+	}
+
+	// Give a page a private frame holding a copy of src, faultLock must be held
+	// The frame is mapped kernel only whilst it is filled so other threads can't see what was left in it
+	static void MapPrivateCopy(page_t* page, uintptr_t pageAddress, const void* src){
+		uint64_t phys = AllocatePhysicalMemoryBlock();
+
+		*page = (phys & PAGE_FRAME) | PAGE_PRESENT | PAGE_WRITABLE;
+		invlpg(pageAddress);
+
+		if(src){
+			memcpy((void*)pageAddress, src, PAGE_SIZE_4K);
+		} else {
+			memset((void*)pageAddress, 0, PAGE_SIZE_4K);
+		}
+
+		*page |= PAGE_USER;
+		invlpg(pageAddress);
+	}
+
+	// Fill a frame that has no kernel mapping with a copy of src through this processor's window, interrupts must be disabled
+	static void CopyToFrame(uint64_t phys, const void* src){
+		CPU* cpu = GetCPULocal();
+		if(!cpu->copyWindow){
+			cpu->copyWindow = reinterpret_cast<uint8_t*>(KernelAllocate4KPages(1));
+		}
+
+		KernelMapVirtualMemory4K(phys, (uintptr_t)cpu->copyWindow, 1);
+		memcpy(cpu->copyWindow, src, PAGE_SIZE_4K);
+	}
+
+	// Bring in a page of a file mapping, faultLock must be held and is still held on return
+	// If the page is not in the page cache it has to be read in, the lock is dropped and interrupts enabled whilst that happens
+	static bool ResolveFileFault(process_t* proc, page_t* page, uintptr_t pageAddress, int errCode, bool canBlock){
+		address_space_t* addressSpace = proc->addressSpace;
+
+		file_mapping_t* mapping = proc->fileMappings.get_front();
+		for(unsigned i = 0; i < proc->fileMappings.get_length(); i++, mapping = mapping->next){
+			if(pageAddress >= mapping->base && pageAddress < mapping->base + mapping->pageCount * PAGE_SIZE_4K){
+				break;
+			}
+		}
+
+		if(!mapping || pageAddress < mapping->base || pageAddress >= mapping->base + mapping->pageCount * PAGE_SIZE_4K){
+			return false;
+		}
+
+		fs::PageCache* cache = mapping->node->pageCache;
+		uint64_t index = (mapping->offset + (pageAddress - mapping->base)) / PAGE_SIZE_4K;
+		bool shared = mapping->flags & MAP_SHARED;
+
+		uint8_t* virt = nullptr;
+		uint64_t phys = cache->Lookup(index, &virt);
+		if(!phys){
+			if(!canBlock){
+				return false; // Can't read from the disk with interrupts disabled
+			}
+
+			// The mapping holds a reference on the node and mappings are only removed when the process exits, so it is still valid afterwards
+			releaseLock(&addressSpace->faultLock);
+			asm("sti");
+			phys = cache->GetPage(index, &virt);
+			asm("cli");
+			acquireLock(&addressSpace->faultLock);
+
+			if(!phys){
+				return false;
+			}
+
+			if((*page & (PAGE_PRESENT | PAGE_FILE)) != PAGE_FILE){
+				return true; // Another thread got there first, if it is still not accessible we will fault again
+			}
+		}
+
+		if(shared){
+			*page = (phys & PAGE_FRAME) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | PAGE_FILE;
+			invlpg(pageAddress);
+		} else if(errCode & 0x2){
+			MapPrivateCopy(page, pageAddress, virt); // Written to straight away, skip sharing it
+		} else {
+			*page = (phys & PAGE_FRAME) | PAGE_PRESENT | PAGE_USER | PAGE_FILE | PAGE_COW; // Read only until it is written to
+			invlpg(pageAddress);
+		}
+
+		return true;
+	}
+
+	// Back demand zero and file backed pages on first access and copy private file pages when they are written to
+	// Returns false if the fault is not one we can resolve.
+	// Runs with interrupts disabled, either from usermode or from the kernel touching a user buffer
+	static bool ResolveUserPageFault(uintptr_t faultAddress, int errCode, bool canBlock){
+		process_t* proc = Scheduler::GetCurrentProcess();
+		if(!proc || PML4_GET_INDEX(faultAddress)) return false;
+
+		address_space_t* addressSpace = proc->addressSpace;
+
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0" : "=r"(cr3));
+		if((cr3 & PAGE_FRAME) != addressSpace->pml4Phys) return false; // Only resolve faults in the address space we are running in
+
+		uint32_t pdptIndex = PDPT_GET_INDEX(faultAddress);
+		uint32_t pageDirIndex = PAGE_DIR_GET_INDEX(faultAddress);
+		uint32_t pageIndex = PAGE_TABLE_GET_INDEX(faultAddress);
+		uintptr_t pageAddress = faultAddress & ~(PAGE_SIZE_4K - 1);
+
+		acquireLock(&addressSpace->faultLock);
+
+		if(!HasPageTable(addressSpace, pdptIndex, pageDirIndex)){
+			releaseLock(&addressSpace->faultLock);
+			return false;
+		}
+
+		page_t* page = &addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex];
+		bool resolved = false;
+		bool shootdown = false;
+
+		if((*page & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER) && (*page & PAGE_FRAME) && (!(errCode & 0x2) || (*page & PAGE_WRITABLE))){
+			invlpg(pageAddress); // Another thread got here first, or our TLB entry was stale
+			resolved = true;
+		} else if((*page & (PAGE_PRESENT | PAGE_COW)) == (PAGE_PRESENT | PAGE_COW)){
+			if(!(errCode & 0x2)){
+				// Genuine protection fault
+			} else if(!(*page & PAGE_FILE) && !PhysicalMemoryBlockShared(*page & PAGE_FRAME)){
+				// Anonymous page that everyone we forked with has copied or dropped, it's ours again
+				*page = (*page | PAGE_WRITABLE) & ~PAGE_COW;
+				invlpg(pageAddress);
+				resolved = true;
+			} else { // Private file page or shared anonymous page written to for the first time
+				uint64_t shared = (*page & PAGE_FILE) ? 0 : (*page & PAGE_FRAME);
+
+				// The old frame is still mapped at pageAddress, copy straight from it
+				uint64_t phys = AllocatePhysicalMemoryBlock();
+				CopyToFrame(phys, (void*)pageAddress);
+
+				*page = (phys & PAGE_FRAME) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+				invlpg(pageAddress);
+
+				if(shared){
+					FreePhysicalMemoryBlock(shared); // Drop our reference
+				}
+
+				shootdown = proc->threadCount > 1; // Other threads may still be reading the old frame
+				resolved = true;
+			}
+		} else if(*page & PAGE_PRESENT){
+			// Genuine protection fault
+		} else if(*page & PAGE_DEMAND_ZERO){
+			MapPrivateCopy(page, pageAddress, nullptr);
+			resolved = true;
+		} else if(*page & PAGE_FILE){
+			resolved = ResolveFileFault(proc, page, pageAddress, errCode, canBlock);
+		}
+
+		releaseLock(&addressSpace->faultLock);
+
+		if(shootdown){
+			if(canBlock) asm("sti");
+			ShootdownTLB();
+			if(canBlock) asm("cli");
+		}
+
+		return resolved;
+	}
+
+	bool PrefaultUserBuffer(uintptr_t addr, uint64_t len, bool write){
+		if(!len || PML4_GET_INDEX(addr)){
+			return true;
+		}
+
+		for(uintptr_t page = addr & ~(PAGE_SIZE_4K - 1); page < addr + len; page += PAGE_SIZE_4K){
+			bool intsEnabled = CheckInterrupts();
+			asm("cli");
+			bool resolved = ResolveUserPageFault(page, write ? 0x2 : 0, intsEnabled);
+			if(intsEnabled) asm("sti");
+
+			if(!resolved){
+				return false;
+			}
+		}
+
+		return true;
+	}
+
 	uintptr_t GetIOMapping(uintptr_t addr){
 		if(addr > 0xffffffff){ // Typically most MMIO will not reside > 4GB, but check just in case
 			Log::Error("MMIO >4GB current unsupported");
@@ -551,14 +980,19 @@ namespace Memory{
 	void PageFaultHandler(regs64_t* regs)
 	{
 		asm("cli");
-		Log::Error("Page Fault!\r\n");
-		Log::SetVideoConsole(nullptr);
 
 		int err_code = IDT::GetErrCode();
 
 		uint64_t faultAddress;
 		asm volatile("movq %%cr2, %0" : "=r" (faultAddress));
 
+		if(ResolveUserPageFault(faultAddress, err_code, regs->rflags & 0x200 /* Interrupts were enabled */)){
+			return; // Demand zero or file backed page, now backed
+		}
+
+		Log::Error("Page Fault!\r\n");
+		Log::SetVideoConsole(nullptr);
+
 		int present = !(err_code & 0x1); // Page not present
 		int rw = err_code & 0x2;           // Attempted write to read only page
 		int us = err_code & 0x4;           // Processor was in user-mode and tried to access kernel page
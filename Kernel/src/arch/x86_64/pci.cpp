@@ -3,6 +3,7 @@
 #include <system.h>
 #include <logging.h>
 #include <list.h>
+#include <paging.h>
 
 #define AMD 0x1022
 #define INTEL 0x8086
@@ -68,6 +69,126 @@ namespace PCI{
 		outportb(0xCFC, data);
 	}
 
+	uint32_t Config_ReadDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset){
+		uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
+
+		outportl(0xCF8, address);
+		return inportl(0xCFC);
+	}
+
+	void Config_WriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data){
+		uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
+
+		outportl(0xCF8, address);
+		outportl(0xCFC, data);
+	}
+
+	uint8_t FindCapability(const pci_device_t& device, uint8_t id){
+		if(!(Config_ReadWord(device.bus, device.slot, device.func, 6) & PCI_STATUS_CAPABILITIES)){
+			return 0;
+		}
+
+		uint8_t ptr = Config_ReadByte(device.bus, device.slot, device.func, PCI_CONFIG_CAPABILITIES_PTR) & 0xFC;
+		for(int i = 0; ptr && i < 48; i++){ // Bound the walk in case the list loops
+			if(Config_ReadByte(device.bus, device.slot, device.func, ptr) == id){
+				return ptr;
+			}
+
+			ptr = Config_ReadByte(device.bus, device.slot, device.func, ptr + 1) & 0xFC;
+		}
+
+		return 0;
+	}
+
+	uintptr_t GetBaseAddressRegister(const pci_device_t& device, uint8_t index){
+		uint32_t bar = Config_ReadDword(device.bus, device.slot, device.func, 0x10 + index * 4);
+
+		if(bar & 0x1){
+			return bar & 0xFFFFFFFC; // IO space
+		}
+
+		uintptr_t address = bar & 0xFFFFFFF0;
+		if(((bar >> 1) & 0x3) == 0x2){ // 64-bit BAR
+			address |= static_cast<uintptr_t>(Config_ReadDword(device.bus, device.slot, device.func, 0x10 + (index + 1) * 4)) << 32;
+		}
+
+		return address;
+	}
+
+	static void DisableLegacyInterrupts(const pci_device_t& device){
+		uint16_t command = Config_ReadWord(device.bus, device.slot, device.func, 4);
+		Config_WriteWord(device.bus, device.slot, device.func, 4, command | PCI_CMD_INTERRUPT_DISABLE);
+	}
+
+	bool EnableMSI(const pci_device_t& device, uint8_t vector, uint8_t apicID){
+		uint8_t cap = FindCapability(device, PCI_CAP_MSI);
+		if(!cap){
+			return false;
+		}
+
+		uint32_t header = Config_ReadDword(device.bus, device.slot, device.func, cap); // Control is the upper 16 bits
+		uint16_t control = header >> 16;
+
+		Config_WriteDword(device.bus, device.slot, device.func, cap + 4, PCI_MSI_ADDRESS(apicID));
+		if(control & PCI_MSI_CONTROL_64BIT){
+			Config_WriteDword(device.bus, device.slot, device.func, cap + 8, 0);
+			Config_WriteDword(device.bus, device.slot, device.func, cap + 12, vector);
+		} else {
+			Config_WriteDword(device.bus, device.slot, device.func, cap + 8, vector);
+		}
+
+		control &= ~(0x7 << 4); // Single message
+		control |= PCI_MSI_CONTROL_ENABLE;
+		Config_WriteDword(device.bus, device.slot, device.func, cap, (header & 0xFFFF) | (static_cast<uint32_t>(control) << 16));
+
+		DisableLegacyInterrupts(device);
+		return true;
+	}
+
+	bool InitializeMSIX(const pci_device_t& device, pci_msix_t& msix){
+		uint8_t cap = FindCapability(device, PCI_CAP_MSIX);
+		if(!cap){
+			return false;
+		}
+
+		uint32_t header = Config_ReadDword(device.bus, device.slot, device.func, cap);
+		uint16_t control = header >> 16;
+		uint32_t tableInfo = Config_ReadDword(device.bus, device.slot, device.func, cap + 4);
+
+		uintptr_t tablePhys = GetBaseAddressRegister(device, tableInfo & 0x7) + (tableInfo & ~0x7U);
+		if(tablePhys >= 0x100000000ULL){
+			Log::Warning("[PCI] MSI-X table above 4GB, not supported");
+			return false;
+		}
+
+		msix.capability = cap;
+		msix.size = (control & PCI_MSIX_CONTROL_TABLE_SIZE) + 1;
+		msix.table = reinterpret_cast<volatile uint32_t*>(Memory::GetIOMapping(tablePhys));
+
+		for(unsigned i = 0; i < msix.size; i++){
+			msix.table[i * 4 + 3] |= PCI_MSIX_VECTOR_MASKED;
+		}
+
+		control &= ~PCI_MSIX_CONTROL_FUNCTION_MASK;
+		control |= PCI_MSIX_CONTROL_ENABLE;
+		Config_WriteDword(device.bus, device.slot, device.func, cap, (header & 0xFFFF) | (static_cast<uint32_t>(control) << 16));
+
+		DisableLegacyInterrupts(device);
+		return true;
+	}
+
+	void SetMSIXVector(pci_msix_t& msix, unsigned index, uint8_t vector, uint8_t apicID){
+		if(index >= msix.size){
+			return;
+		}
+
+		volatile uint32_t* entry = &msix.table[index * 4];
+		entry[0] = PCI_MSI_ADDRESS(apicID);
+		entry[1] = 0;
+		entry[2] = vector;
+		entry[3] &= ~PCI_MSIX_VECTOR_MASKED;
+	}
+
 	pci_device_header_type0_t ReadConfig(uint8_t bus, uint8_t slot, uint8_t func){
 		pci_device_header_type0_t header;
 		uint8_t offset = 0;
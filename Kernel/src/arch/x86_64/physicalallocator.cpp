@@ -6,68 +6,286 @@
 #include <logging.h>
 #include <panic.h>
 #include <lock.h>
+#include <assert.h>
+#include <timer.h>
+#include <liballoc.h>
+#include <cpu.h>
+#include <smp.h>
 
 namespace Memory{
-    uint32_t physicalMemoryBitmap[PHYSALLOC_BITMAP_SIZE_DWORDS];
+    // Physical memory is managed by a buddy allocator.
+    // A block of order n is (PHYSALLOC_BLOCK_SIZE << n) bytes and is aligned to its own size.
+    //
+    // We have no direct map of physical memory, so free blocks cannot hold list pointers.
+    // Instead each order has a bitmap of free blocks with three summary levels above it
+    // (one bit for every non-zero word in the level below), so finding the first free block
+    // of an order is four lookups rather than a scan of the bitmap.
+    struct BuddyOrder{
+        uint64_t* blocks; // One bit per block, set if the block is free
+        uint64_t* words; // One bit per non-zero word in blocks
+        uint64_t* groups; // One bit per non-zero word in words
+        uint64_t summary; // One bit per non-zero word in groups
+    };
 
-    uint64_t usedPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
-    uint64_t maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
+    constexpr uint64_t BitmapWords(uint64_t bits){
+        return (bits + 63) / 64;
+    }
+
+    constexpr uint64_t BuddyBitmapPoolSize(){
+        uint64_t size = 0;
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            uint64_t blockWords = BitmapWords(PHYSALLOC_MAX_BLOCKS >> order);
+            size += blockWords + BitmapWords(blockWords) + BitmapWords(BitmapWords(blockWords));
+        }
+        return size;
+    }
+
+    static_assert(BitmapWords(BitmapWords(BitmapWords(PHYSALLOC_MAX_BLOCKS))) <= 64, "Buddy summary level cannot cover PHYSALLOC_MAX_BLOCKS");
+
+    uint64_t buddyBitmapPool[BuddyBitmapPoolSize()];
+    BuddyOrder buddyOrders[PHYSALLOC_MAX_ORDER + 1];
+
+    uint64_t usedPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
+    uint64_t maxPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
 
     lock_t allocatorLock = 0;
+    bool cpuCachesEnabled = false;
 
-    // Initialize the physical page allocator
-    void InitializePhysicalAllocator(memory_info_t* mem_info)
-    {
-        memset(physicalMemoryBitmap, 0xFFFFFFFF, PHYSALLOC_BITMAP_SIZE_DWORDS * sizeof(uint32_t));
+    // Blocks shared between address spaces (copy on write after fork) have a reference count.
+    // Only references past the first are counted so the table is only needed once something is shared, it covers every block up to the highest usable one.
+    // The counts are 32 bit as every fork adds one, a 16 bit count can be wrapped from user space and a block freed whilst still mapped.
+    volatile uint32_t* blockReferences = nullptr;
+    uint64_t blockReferencesCount = 0;
+    uint64_t highestUsableBlock = 0;
+    lock_t blockReferencesLock = 0;
 
-        maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS;
-        usedPhysicalBlocks = maxPhysicalBlocks;
+    // Marks a block of the given order as free
+    inline void BuddySetFree(unsigned order, uint64_t index){
+        BuddyOrder& o = buddyOrders[order];
+
+        o.blocks[index >> 6] |= 1ULL << (index & 63);
+        o.words[index >> 12] |= 1ULL << ((index >> 6) & 63);
+        o.groups[index >> 18] |= 1ULL << ((index >> 12) & 63);
+        o.summary |= 1ULL << (index >> 18);
     }
 
-    // Sets a bit in the physical memory bitmap
-    inline void bit_set(uint64_t bit) {  
-        physicalMemoryBitmap[bit >> 5] |= (1 << (bit % 32));
+    // Marks a block of the given order as no longer free
+    inline void BuddyClearFree(unsigned order, uint64_t index){
+        BuddyOrder& o = buddyOrders[order];
+
+        if((o.blocks[index >> 6] &= ~(1ULL << (index & 63)))) return;
+        if((o.words[index >> 12] &= ~(1ULL << ((index >> 6) & 63)))) return;
+        if((o.groups[index >> 18] &= ~(1ULL << ((index >> 12) & 63)))) return;
+        o.summary &= ~(1ULL << (index >> 18));
     }
 
-    // Clears a bit in the physical memory bitmap
-    inline void bit_clear(uint64_t bit) {
-        physicalMemoryBitmap[bit >> 5] &= ~ (1 << (bit % 32));
+    // Tests whether a block of the given order is free
+    inline bool BuddyIsFree(unsigned order, uint64_t index){
+        return buddyOrders[order].blocks[index >> 6] & (1ULL << (index & 63));
     }
 
-    // Tests a bit in the physical memory bitmap
-    inline bool bit_test(uint64_t bit) {
-        return physicalMemoryBitmap[bit >> 5] & (1 << (bit % 32));
+    // Finds the lowest free block of the given order
+    inline uint64_t BuddyFindFree(unsigned order){
+        BuddyOrder& o = buddyOrders[order];
+
+        uint64_t group = __builtin_ctzll(o.summary);
+        uint64_t word = (group << 6) + __builtin_ctzll(o.groups[group]);
+        uint64_t block = (word << 6) + __builtin_ctzll(o.words[word]);
+        return (block << 6) + __builtin_ctzll(o.blocks[block]);
+    }
+
+    // Allocates a block of the given order, splitting larger blocks as required
+    // Returns the index of the first 4K block or 0 if there is nothing available (block 0 is always reserved)
+    uint64_t BuddyAllocate(unsigned order){
+        unsigned current = order;
+        while(current <= PHYSALLOC_MAX_ORDER && !buddyOrders[current].summary) current++;
+
+        if(current > PHYSALLOC_MAX_ORDER){
+            return 0;
+        }
+
+        uint64_t index = BuddyFindFree(current);
+        BuddyClearFree(current, index);
+
+        while(current > order){ // Split and return the upper half to the free pool
+            current--;
+            index <<= 1;
+            BuddySetFree(current, index + 1);
+        }
+
+        usedPhysicalBlocks += 1ULL << order;
+        return index << order;
+    }
+
+    // Returns a block of the given order to the free pool, merging with its buddy where possible
+    // Returns false if the block was already free
+    bool BuddyFree(uint64_t block, unsigned order){
+        uint64_t index = block >> order;
+
+        if(BuddyIsFree(order, index)){
+            return false;
+        }
+
+        usedPhysicalBlocks -= 1ULL << order;
+
+        while(order < PHYSALLOC_MAX_ORDER && BuddyIsFree(order, index ^ 1)){
+            BuddyClearFree(order, index ^ 1);
+            index >>= 1;
+            order++;
+        }
+
+        BuddySetFree(order, index);
+        return true;
+    }
+
+    // Removes a single 4K block from whichever free block contains it
+    // Returns false if the block was not free
+    bool BuddyReserve(uint64_t block){
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            if(!BuddyIsFree(order, block >> order)) continue;
+
+            BuddyClearFree(order, block >> order);
+            while(order > 0){ // Split down, freeing the halves that do not contain the block
+                order--;
+                BuddySetFree(order, (block >> order) ^ 1);
+            }
+
+            usedPhysicalBlocks++;
+            return true;
+        }
+
+        return false;
     }
 
-    // Finds the first free block in physical memory
-    uint64_t GetFirstFreeMemoryBlock() {
-        for (uint32_t i = 0; i < maxPhysicalBlocks / 32; i++)
-            if (physicalMemoryBitmap[i] != 0xffffffff) // If all 32 bits at the index are used then ignore them
-                for (uint32_t j = 0; j < 32; j++) // Test each bit in the dword
-                    if (!(physicalMemoryBitmap[i] & (1 << j)) && (i || j))
-                        return i * 32 + j;
+    // Initialize the physical page allocator
+    void InitializePhysicalAllocator(memory_info_t* mem_info)
+    {
+        uint64_t* pool = buddyBitmapPool;
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            BuddyOrder& o = buddyOrders[order];
+            uint64_t blockWords = BitmapWords(PHYSALLOC_MAX_BLOCKS >> order);
+            uint64_t wordWords = BitmapWords(blockWords);
+
+            o.blocks = pool;
+            pool += blockWords;
+            o.words = pool;
+            pool += wordWords;
+            o.groups = pool;
+            pool += BitmapWords(wordWords);
+            o.summary = 0;
+        }
+
+        memset(buddyBitmapPool, 0, sizeof(buddyBitmapPool)); // Everything starts as used
 
-        // The first block is always reserved
-        return 0;
+        maxPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
+        usedPhysicalBlocks = maxPhysicalBlocks;
     }
 
     // Marks a region in physical memory as being used
     void MarkMemoryRegionUsed(uint64_t base, size_t size) {
-        for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE, align = base / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, usedPhysicalBlocks++)
-            bit_set(align++);
+        uint64_t block = base / PHYSALLOC_BLOCK_SIZE;
+        uint64_t end = (base + size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE;
+        if(end > maxPhysicalBlocks) end = maxPhysicalBlocks;
+
+        acquireLock(&allocatorLock);
+        for(; block < end; block++)
+            BuddyReserve(block);
+        releaseLock(&allocatorLock);
     }
 
     // Marks a region in physical memory as being free
     void MarkMemoryRegionFree(uint64_t base, size_t size) {
-        for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE, align = base / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, usedPhysicalBlocks--)
-            bit_clear(align++);
+        // Only whole blocks inside the region can be used
+        uint64_t block = (base + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE;
+        uint64_t end = (base + size) / PHYSALLOC_BLOCK_SIZE;
+        if(end > maxPhysicalBlocks) end = maxPhysicalBlocks;
+        if(!block) block = 1; // The first block is always reserved
+        if(end > highestUsableBlock) highestUsableBlock = end;
+
+        acquireLock(&allocatorLock);
+        while(block < end){
+            // Free the largest naturally aligned block that fits in the region
+            unsigned order = 0;
+            while(order < PHYSALLOC_MAX_ORDER && !(block & ((2ULL << order) - 1)) && block + (2ULL << order) <= end) order++;
+
+            BuddyFree(block, order);
+            block += 1ULL << order;
+        }
+        releaseLock(&allocatorLock);
+    }
+
+    // Takes a batch of blocks from the global pool, interrupts must be disabled
+    void RefillBlockCache(PhysicalBlockCache& cache){
+        acquireLock(&allocatorLock);
+        while(cache.count < PHYSALLOC_CPU_CACHE_BATCH){
+            uint64_t index = BuddyAllocate(PHYSALLOC_ORDER_4K);
+            if(!index) break;
+
+            cache.blocks[cache.count++] = index;
+        }
+        releaseLock(&allocatorLock);
+
+        cache.refills++;
+    }
+
+    // Returns the oldest batch of blocks to the global pool, interrupts must be disabled
+    // Returns the amount of blocks that were already free
+    unsigned DrainBlockCache(PhysicalBlockCache& cache){
+        unsigned doubleFrees = 0;
+
+        acquireLock(&allocatorLock);
+        for(unsigned i = 0; i < PHYSALLOC_CPU_CACHE_BATCH; i++){
+            if(!BuddyFree(cache.blocks[i], PHYSALLOC_ORDER_4K)) doubleFrees++;
+        }
+        releaseLock(&allocatorLock);
+
+        cache.count -= PHYSALLOC_CPU_CACHE_BATCH;
+        for(unsigned i = 0; i < cache.count; i++){ // Keep the most recently freed blocks
+            cache.blocks[i] = cache.blocks[i + PHYSALLOC_CPU_CACHE_BATCH];
+        }
+
+        cache.drains++;
+        return doubleFrees;
+    }
+
+    void EnablePhysicalBlockCaches(){
+        cpuCachesEnabled = true;
+    }
+
+    uint64_t GetCachedPhysicalBlocks(){
+        uint64_t count = 0;
+        for(unsigned i = 0; i < 256; i++){
+            if(SMP::cpus[i]) count += SMP::cpus[i]->pageCache.count;
+        }
+        return count;
     }
 
     // Allocates a block of physical memory
     uint64_t AllocatePhysicalMemoryBlock() {
-        acquireLock(&allocatorLock);
+        uint64_t index = 0;
+
+        if(cpuCachesEnabled){
+            int interruptsEnabled = CheckInterrupts();
+            asm("cli"); // The cache belongs to this CPU, make sure nothing else on this CPU touches it
+
+            PhysicalBlockCache& cache = GetCPULocal()->pageCache;
+            if(cache.count){
+                cache.hits++;
+            } else {
+                RefillBlockCache(cache);
+            }
+
+            if(cache.count){
+                index = cache.blocks[--cache.count];
+            }
+
+            if(interruptsEnabled) asm("sti");
+        } else {
+            acquireLock(&allocatorLock);
+            index = BuddyAllocate(PHYSALLOC_ORDER_4K);
+            releaseLock(&allocatorLock);
+        }
 
-        uint64_t index = GetFirstFreeMemoryBlock();
         if (!index){
             Log::Error("Out of memory!");
             KernelPanic((const char**)(&"Out of memory!"),1);
@@ -75,55 +293,178 @@ namespace Memory{
             //return 0;
         }
 
-        bit_set(index);
-        usedPhysicalBlocks++;
+        return index * PHYSALLOC_BLOCK_SIZE;
+    }
 
+    // Allocates a block of 2MB physical memory
+    uint64_t AllocateLargePhysicalMemoryBlock() {
+        return AllocatePhysicalMemoryBlocks(PHYSALLOC_ORDER_2M);
+    }
+
+    // Allocates (PHYSALLOC_BLOCK_SIZE << order) bytes of contiguous physical memory
+    uint64_t AllocatePhysicalMemoryBlocks(unsigned order) {
+        if(order > PHYSALLOC_MAX_ORDER){
+            return 0;
+        }
+
+        acquireLock(&allocatorLock);
+        uint64_t index = BuddyAllocate(order);
         releaseLock(&allocatorLock);
 
         return index * PHYSALLOC_BLOCK_SIZE;
     }
 
-    // Allocates a block of 2MB physical memory
-    /*uint64_t AllocateLargePhysicalMemoryBlock() {
-        uint64_t index = GetFirstFreeMemoryBlock();
-        uint64_t blockCount = 0x200000
-        uint64_t counter = 0;
-        while(counter < blockCount){
-            if(bit_test(index)){
-                index++;
-                counter = 0;
-                continue;
+    // Allocates the reference count table, interrupts must be disabled
+    static void InitializeBlockReferences(){
+        acquireLock(&blockReferencesLock);
+        if(!blockReferences){
+            uint64_t pageCount = (highestUsableBlock * sizeof(uint32_t) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+            uint8_t* table = (uint8_t*)KernelAllocate4KPages(pageCount);
+            for(uint64_t i = 0; i < pageCount; i++){
+                KernelMapVirtualMemory4K(AllocatePhysicalMemoryBlock(), (uintptr_t)table + i * PAGE_SIZE_4K, 1);
             }
+            memset(table, 0, pageCount * PAGE_SIZE_4K);
 
-            index++;
-            counter++;
+            blockReferencesCount = highestUsableBlock;
+            blockReferences = (volatile uint32_t*)table;
         }
+        releaseLock(&blockReferencesLock);
+    }
 
-        if (index == 0)
-            return 0;
+    void ReferencePhysicalMemoryBlock(uint64_t addr){
+        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
+
+        if(!blockReferences){
+            int interruptsEnabled = CheckInterrupts();
+            asm("cli");
+            InitializeBlockReferences();
+            if(interruptsEnabled) asm("sti");
+        }
+
+        assert(index < blockReferencesCount);
+        uint32_t references = __sync_fetch_and_add(&blockReferences[index], 1);
+        assert(references != UINT32_MAX); // Each reference is a page table entry, there isn't the memory for this many
+    }
+
+    bool PhysicalMemoryBlockShared(uint64_t addr){
+        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
+
+        return blockReferences && index < blockReferencesCount && blockReferences[index];
+    }
+
+    // Drops a reference to a shared block, returns false if this was the last reference
+    static inline bool DropBlockReference(uint64_t index){
+        if(!blockReferences || index >= blockReferencesCount){
+            return false;
+        }
 
-        uint64_t addr = index * PHYSALLOC_BLOCK_SIZE;
-        
-        while(blockCount--)
-            bit_set(index++);
-        usedPhysicalBlocks += counter;
+        uint32_t references;
+        do {
+            references = blockReferences[index];
+            if(!references){
+                return false;
+            }
+        } while(!__sync_bool_compare_and_swap(&blockReferences[index], references, references - 1));
 
-        return addr;
-    }*/
+        return true;
+    }
 
     // Frees a block of physical memory
     void FreePhysicalMemoryBlock(uint64_t addr) {
         uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-        bit_clear(index);
-        usedPhysicalBlocks--;
+        if(DropBlockReference(index)){
+            return; // Still mapped somewhere else
+        }
+        if(!cpuCachesEnabled || !index || index >= maxPhysicalBlocks || (addr & (PHYSALLOC_BLOCK_SIZE - 1))){
+            FreePhysicalMemoryBlocks(addr, PHYSALLOC_ORDER_4K);
+            return;
+        }
+
+        unsigned doubleFrees = 0;
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli");
+
+        PhysicalBlockCache& cache = GetCPULocal()->pageCache;
+        if(cache.count >= PHYSALLOC_CPU_CACHE_SIZE){
+            doubleFrees = DrainBlockCache(cache);
+        } else {
+            cache.hits++;
+        }
+
+        cache.blocks[cache.count++] = index;
+
+        if(interruptsEnabled) asm("sti");
+
+        if(doubleFrees){
+            Log::Warning("[PhysicalAllocator] %d blocks in CPU cache were already free!", doubleFrees);
+        }
     }
 
     // Frees a block of physical memory
     void FreeLargePhysicalMemoryBlock(uint64_t addr) {
+        FreePhysicalMemoryBlocks(addr, PHYSALLOC_ORDER_2M);
+    }
+
+    // Frees a block of physical memory allocated with AllocatePhysicalMemoryBlocks
+    void FreePhysicalMemoryBlocks(uint64_t addr, unsigned order) {
         uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-        uint64_t blockCount = 0x200000 /* 2MB */ / PHYSALLOC_BLOCK_SIZE;
-        usedPhysicalBlocks-=blockCount;
-        while(blockCount--)
-            bit_clear(index++);
+        if(!index || index >= maxPhysicalBlocks || order > PHYSALLOC_MAX_ORDER || (index & ((1ULL << order) - 1))){
+            Log::Warning("[PhysicalAllocator] Attempted to free invalid block %x (order %d)", addr, order);
+            return;
+        }
+
+        acquireLock(&allocatorLock);
+        bool wasUsed = BuddyFree(index, order);
+        releaseLock(&allocatorLock);
+
+        if(!wasUsed){
+            Log::Warning("[PhysicalAllocator] Block %x (order %d) is already free!", addr, order);
+        }
+    }
+
+    // Checks the physical allocator and reports allocation throughput
+    void PhysicalAllocatorSelfTest(){
+        const unsigned blockCount = 4096;
+        uint64_t* blocks = (uint64_t*)kmalloc(blockCount * sizeof(uint64_t));
+        uint64_t usedBefore = usedPhysicalBlocks - GetCachedPhysicalBlocks();
+
+        for(unsigned i = 0; i < blockCount; i++){
+            blocks[i] = AllocatePhysicalMemoryBlock();
+            assert(!(blocks[i] & (PHYSALLOC_BLOCK_SIZE - 1)));
+        }
+        assert(usedPhysicalBlocks - GetCachedPhysicalBlocks() == usedBefore + blockCount);
+
+        for(unsigned i = 0; i < blockCount; i++){
+            FreePhysicalMemoryBlock(blocks[i]);
+        }
+        assert(usedPhysicalBlocks - GetCachedPhysicalBlocks() == usedBefore);
+
+        if(uint64_t large = AllocateLargePhysicalMemoryBlock()){
+            assert(!(large & (PAGE_SIZE_2M - 1)));
+            FreeLargePhysicalMemoryBlock(large);
+        } else {
+            Log::Warning("[PhysicalAllocator] Self test could not allocate a 2MB block");
+        }
+        assert(usedPhysicalBlocks - GetCachedPhysicalBlocks() == usedBefore);
+
+        // Benchmark: allocate and free batches of blocks for 250ms
+        uint64_t allocations = 0;
+        timeval_t start = Timer::GetSystemUptimeStruct();
+        int elapsed = 0;
+        while((elapsed = Timer::TimeDifference(Timer::GetSystemUptimeStruct(), start)) < 250){
+            for(unsigned i = 0; i < blockCount; i++){
+                blocks[i] = AllocatePhysicalMemoryBlock();
+            }
+
+            for(unsigned i = 0; i < blockCount; i++){
+                FreePhysicalMemoryBlock(blocks[i]);
+            }
+
+            allocations += blockCount;
+        }
+
+        kfree(blocks);
+
+        Log::Info("[PhysicalAllocator] Self test passed, %d allocations in %d ms (%d allocations/s)", allocations, elapsed, allocations * 1000 / elapsed);
     }
-}
\ No newline at end of file
+}
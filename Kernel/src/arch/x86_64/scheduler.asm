@@ -28,6 +28,11 @@ section .text
 TaskSwitch:
     mov rsp, rdi ; Set the stack pointer to the location of our register context
     mov rax, rsi ; PML4
+
+    test rdx, rdx
+    jz .load
+    mov dword [rdx], 0 ; We are off the previous thread's stack, release its switch lock so another processor can run it
+.load:
     popaq ; Load register context (we don't load RAX yet)
 
     mov cr3, rax ; Set CR3
@@ -17,10 +17,11 @@
 #include <smp.h>
 #include <apic.h>
 #include <timer.h>
+#include <errno.h>
 
 #define INITIAL_HANDLE_TABLE_SIZE 0xFFFF
 
-extern "C" [[noreturn]] void TaskSwitch(regs64_t* r, uint64_t pml4);
+extern "C" [[noreturn]] void TaskSwitch(regs64_t* r, uint64_t pml4, lock_t* switchLock); // switchLock is released once off the old stack
 
 extern "C"
 void IdleProc();
@@ -40,15 +41,69 @@ namespace Scheduler{
     uint32_t handleTableSize = INITIAL_HANDLE_TABLE_SIZE;
     
     void Schedule(regs64_t* r);
-    
-    inline void InsertThreadIntoQueue(thread_t* thread){
-        GetCPULocal()->runQueue->add_back(thread);
+
+    // Weight of each nice value (THREAD_NICE_MIN to THREAD_NICE_MAX), each step is roughly 10% of processor time
+    const uint32_t niceWeights[] = {
+        88761, 71755, 56483, 46273, 36291,
+        29154, 23254, 18705, 14949, 11916,
+        9548, 7620, 6100, 4904, 3906,
+        3121, 2501, 1991, 1586, 1277,
+        1024, 820, 655, 526, 423,
+        335, 272, 215, 172, 137,
+        110, 87, 70, 56, 45,
+        36, 29, 23, 18, 15,
+    };
+
+    // Does a go before b
+    static inline bool SchedulesBefore(thread_t* a, thread_t* b){
+        if(a->schedClass != b->schedClass){
+            return a->schedClass == SchedulingClassInteractive;
+        } else if(a->schedClass == SchedulingClassInteractive){
+            return a->nice < b->nice;
+        }
+
+        return a->vruntime < b->vruntime;
     }
 
-    inline void RemoveThreadFromQueue(thread_t* thread){
-        GetCPULocal()->runQueue->remove(thread);
+    int SetThreadScheduling(thread_t* thread, int schedClass, int nice){
+        if(schedClass != SchedulingClassFair && schedClass != SchedulingClassInteractive){
+            return -EINVAL;
+        }
+
+        if(nice < THREAD_NICE_MIN || nice > THREAD_NICE_MAX){
+            return -EINVAL;
+        }
+
+        thread->schedClass = schedClass;
+        thread->nice = nice;
+        thread->weight = niceWeights[nice - THREAD_NICE_MIN];
+
+        return 0;
     }
     
+    static inline bool IsIdle(CPU* cpu){
+        return cpu->currentThread && cpu->currentThread->parent == cpu->idleProcess;
+    }
+
+    // Idle processors stop ticking, so nudge one when cpu has been given work
+    static void KickIdleProcessor(CPU* cpu){
+        CPU* local = GetCPULocal();
+
+        if(cpu != local && IsIdle(cpu)){
+            APIC::Local::SendIPI(cpu->id, 0, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+            return;
+        }
+
+        for(unsigned i = 0; i < SMP::processorCount; i++){
+            CPU* other = SMP::cpus[i];
+
+            if(other != cpu && other != local && IsIdle(other) && !other->runQueue->get_length()){
+                APIC::Local::SendIPI(other->id, 0, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE); // Let it steal from cpu
+                return;
+            }
+        }
+    }
+
     void InsertNewThreadIntoQueue(thread_t* thread){
         CPU* cpu = SMP::cpus[0];
         for(unsigned i = 1; i < SMP::processorCount; i++){
@@ -63,11 +118,16 @@ namespace Scheduler{
 
         //Log::Info("Inserting thread into run queue of CPU %d", cpu->id);
 
-        asm("sti");
-        acquireLock(&cpu->runQueueLock);
         asm("cli");
+        acquireLock(&cpu->runQueueLock);
+        thread->vruntime = cpu->minVruntime; // Start level with everything else, otherwise it would get the processor to itself
+        thread->readySince = Timer::GetSystemUptimeNs();
         cpu->runQueue->add_back(thread);
+        thread->inRunQueue = true;
+        thread->cpu = cpu;
         releaseLock(&cpu->runQueueLock);
+
+        KickIdleProcessor(cpu);
         asm("sti");
     }
 
@@ -224,7 +284,7 @@ namespace Scheduler{
         thread_t* thread = proc->threads[0];
 
         thread->stack = 0;
-        thread->priority = 1;
+        SetThreadScheduling(thread, SchedulingClassFair, 0);
         thread->timeSliceDefault = 1;
         thread->timeSlice = thread->timeSliceDefault;
         thread->fsBase = 0;
@@ -261,11 +321,38 @@ namespace Scheduler{
         return proc;
     }
 
+    // Free a process from InitializeProcessStructure that failed to load and was never scheduled
+    static void DestroyProcessStructure(process_t* proc){
+        for(unsigned i = 0; i < proc->fileDescriptors.get_length(); i++){
+            if(proc->fileDescriptors[i]){
+                fs::Close(proc->fileDescriptors[i]);
+            }
+        }
+        proc->fileDescriptors.clear();
+
+        fs::UnmapFiles(proc); // Drops the node references taken by any segments that were mapped
+
+        Memory::DestroyAddressSpace(proc->addressSpace);
+
+        thread_t* thread = proc->threads[0];
+        Memory::FreePhysicalMemoryBlock(Memory::VirtualToPhysicalAddress((uintptr_t)thread->fxState));
+        Memory::KernelFree4KPages(thread->fxState, 1);
+
+        void* kernelStack = (uint8_t*)thread->kernelStack - PAGE_SIZE_4K * 32;
+        for(int i = 0; i < 32; i++){
+            Memory::FreePhysicalMemoryBlock(Memory::VirtualToPhysicalAddress((uintptr_t)kernelStack + PAGE_SIZE_4K * i));
+        }
+        Memory::KernelFree4KPages(kernelStack, 32);
+
+        delete thread;
+        delete proc;
+    }
+
     void Yield(){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCurrentThread();
         
-        if(cpu->currentThread) {
-            cpu->currentThread->timeSlice = 0;
+        if(thread) {
+            thread->timeSlice = 0;
         }
         asm("int $0xFD"); // Send schedule IPI to self
     }
@@ -317,17 +404,93 @@ namespace Scheduler{
         
         regs64_t* registers = &thread.registers;
         registers->rflags = 0x202; // IF - Interrupt Flag, bit 1 should be 1
-        thread.registers.cs = 0x1B; // We want user mode so use user mode segments, make sure RPL is 3
-        thread.registers.ss = 0x23;
+        thread.registers.cs = USER_CS; // We want user mode so use user mode segments, make sure RPL is 3
+        thread.registers.ss = USER_SS;
         thread.timeSliceDefault = THREAD_TIMESLICE_DEFAULT;
         thread.timeSlice = thread.timeSliceDefault;
-        thread.priority = 4;
+        SetThreadScheduling(&thread, process->threads[0]->schedClass, process->threads[0]->nice); // Inherit from the main thread
 
         InsertNewThreadIntoQueue(&thread);
 
         return threadID;
     }
 
+    process_t* CloneProcess(process_t* parent, regs64_t* regs){
+        process_t* proc = InitializeProcessStructure();
+        thread_t* current = GetCPULocal()->currentThread;
+        thread_t* thread = proc->threads[0];
+
+        if(Memory::CloneAddressSpace(parent->addressSpace, proc->addressSpace, parent->threadCount > 1)){
+            DestroyProcessStructure(proc);
+            return nullptr;
+        }
+
+        // The fd table is copied, handles are duplicated rather than shared so the file offset is not
+        for(unsigned i = 0; i < proc->fileDescriptors.get_length(); i++){
+            fs::Close(proc->fileDescriptors[i]);
+        }
+        proc->fileDescriptors.clear();
+
+        for(unsigned i = 0; i < parent->fileDescriptors.get_length(); i++){
+            fs_fd_t* fd = parent->fileDescriptors[i];
+            if(fd){
+                fd = new fs_fd_t(*fd);
+                fd->epollEntries = nullptr;
+                fd->node->handleCount++;
+            }
+
+            proc->fileDescriptors.add_back(fd);
+        }
+
+        acquireLock(&parent->sharedMemoryLock);
+        for(unsigned i = 0; i < parent->sharedMemory.get_length(); i++){
+            proc->sharedMemory.add_back(parent->sharedMemory[i]);
+        }
+        releaseLock(&parent->sharedMemoryLock);
+
+        asm("cli");
+        acquireLock(&parent->addressSpace->faultLock);
+        file_mapping_t* mapping = parent->fileMappings.get_front();
+        for(unsigned i = 0; i < parent->fileMappings.get_length(); i++, mapping = mapping->next){
+            file_mapping_t* copy = new file_mapping_t;
+            copy->base = mapping->base;
+            copy->pageCount = mapping->pageCount;
+            copy->node = mapping->node;
+            copy->offset = mapping->offset;
+            copy->flags = mapping->flags;
+
+            copy->node->handleCount++;
+            proc->fileMappings.add_back(copy);
+        }
+        releaseLock(&parent->addressSpace->faultLock);
+        asm("sti");
+
+        strncpy(proc->workingDir, parent->workingDir, PATH_MAX);
+        strncpy(proc->name, parent->name, NAME_MAX);
+        proc->uid = parent->uid;
+        proc->gid = parent->gid;
+
+        // Only the calling thread is duplicated, it returns 0 from the syscall
+        thread->registers = *regs;
+        thread->registers.rax = 0;
+        thread->stack = current->stack;
+        thread->stackLimit = current->stackLimit;
+        thread->fsBase = current->fsBase;
+        thread->timeSliceDefault = current->timeSliceDefault;
+        thread->timeSlice = thread->timeSliceDefault;
+        SetThreadScheduling(thread, current->schedClass, current->nice);
+
+        asm volatile("fxsave64 (%0)" :: "r"((uintptr_t)thread->fxState) : "memory"); // Our saved state is from the last task switch
+
+        proc->parent = parent;
+        parent->children.add_back(proc);
+
+        processes->add_back(proc);
+        InsertNewThreadIntoQueue(thread);
+
+        return proc;
+    }
+
     void EndProcess(process_t* process){
         asm("sti");
         if(process->children.get_length())
@@ -335,11 +498,11 @@ namespace Scheduler{
                 EndProcess(child);
             }
         
-        CPU* cpu = GetCPULocal();
+        thread_t* currentThread = GetCurrentThread();
         
         for(unsigned i = 0; i < process->threads.get_length(); i++){
             thread_t* thread = process->threads[i];
-            if(thread != cpu->currentThread && thread){
+            if(thread != currentThread && thread){
                 acquireLock(&thread->lock); // Make sure we acquire a lock on all threads to ensure that they are not in a syscall and are not retaining a lock
             }
         }
@@ -363,7 +526,12 @@ namespace Scheduler{
             
             process->threads[i]->waiting.clear();
 
-            thread->state = ThreadStateBlocked;
+            asm("cli");
+            acquireLock(&thread->stateLock);
+            thread->state = ThreadStateDying; // Make sure UnblockThread does not put it back in a run queue
+            releaseLock(&thread->stateLock);
+            asm("sti");
+
             thread->timeSlice = thread->timeSliceDefault = 0;
         }
 
@@ -373,41 +541,36 @@ namespace Scheduler{
             }
         }
 
-        acquireLock(&cpu->runQueueLock);
-        asm("cli");
+        fs::UnmapFiles(process); // Shared mappings are written back here so interrupts need to be enabled
 
-        for(unsigned j = 0; j < cpu->runQueue->get_length(); j++){
-            if(cpu->runQueue->get_at(j)->parent == process) cpu->runQueue->remove_at(j);
-        }
+        asm("cli");
+        CPU* cpu = GetCPULocal();
 
         process->fileDescriptors.clear();
         
         for(unsigned i = 0; i < SMP::processorCount; i++){
-            if(i == cpu->id) continue; // Is current processor?
+            CPU* other = SMP::cpus[i];
 
-            if(SMP::cpus[i]->currentThread->parent == process){
-                SMP::cpus[i]->currentThread = nullptr;
-            }
-
-            asm("sti");
-            //acquireLock(&SMP::cpus[i]->runQueueLock);
-            asm("cli");
-            
-            for(unsigned j = 0; j < SMP::cpus[i]->runQueue->get_length(); j++){
-                thread_t* thread = SMP::cpus[i]->runQueue->get_at(j);
+            acquireLock(&other->runQueueLock);
 
-                assert(thread);
+            thread_t* thread = other->runQueue->front;
+            for(unsigned j = other->runQueue->get_length(); j > 0; j--){
+                thread_t* next = thread->next;
 
                 if(thread->parent == process){
-                    SMP::cpus[i]->runQueue->remove(thread);
+                    other->runQueue->remove(thread);
+                    thread->inRunQueue = false;
                 }
+
+                thread = next;
             }
-            
-            //releaseLock(&SMP::cpus[i]->runQueueLock);
 
-            if(SMP::cpus[i]->currentThread == nullptr){
+            if(other != cpu && other->currentThread && other->currentThread->parent == process){
+                other->currentThread = nullptr; // Force the processor to reschedule
                 APIC::Local::SendIPI(i, 0, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
             }
+
+            releaseLock(&other->runQueueLock);
         }
 
         if(cpu->currentThread->parent == process){
@@ -427,7 +590,6 @@ namespace Scheduler{
         if(cpu->currentThread->parent == process){
             cpu->currentThread = nullptr; // Force reschedule
             kfree(process);
-            releaseLock(&cpu->runQueueLock);
             asm("sti");
 
             Schedule(nullptr);
@@ -437,36 +599,43 @@ namespace Scheduler{
             }
         }
 
-        releaseLock(&cpu->runQueueLock);
         kfree(process);
         asm("sti");
     }
 
 	void BlockCurrentThread(List<thread_t*>& list, lock_t& lock){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCurrentThread();
 
         acquireLock(&lock);
-        acquireLock(&cpu->runQueueLock);
-        releaseLock(&cpu->currentThread->lock);
-        list.add_back(cpu->currentThread);
-        cpu->currentThread->state = ThreadStateBlocked;
+        releaseLock(&thread->lock);
+
+        int intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&thread->stateLock);
+        list.add_back(thread);
+        thread->state = ThreadStateBlocked; // Taken off the run queue the next time we get scheduled out
+        releaseLock(&thread->stateLock);
+        if(intsEnabled) asm("sti");
+
         releaseLock(&lock);
-        releaseLock(&cpu->runQueueLock);
 
         Yield();
     }
 
 	void BlockCurrentThread(ThreadBlocker& blocker, lock_t& lock){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCurrentThread();
 
         acquireLock(&lock);
-        acquireLock(&cpu->runQueueLock);
-        acquireLock(&cpu->currentThread->stateLock);
-        blocker.Block(cpu->currentThread);
-        cpu->currentThread->state = ThreadStateBlocked;
-        releaseLock(&cpu->currentThread->stateLock);
+
+        int intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&thread->stateLock);
+        blocker.Block(thread);
+        thread->state = ThreadStateBlocked;
+        releaseLock(&thread->stateLock);
+        if(intsEnabled) asm("sti");
+
         releaseLock(&lock);
-        releaseLock(&cpu->runQueueLock);
 
         Yield();
     }
@@ -482,9 +651,51 @@ namespace Scheduler{
     }
     
 	void UnblockThread(thread_t* thread){
+        int intsEnabled = CheckInterrupts();
+        asm("cli");
         acquireLock(&thread->stateLock);
+
+        if(thread->state == ThreadStateDying){
+            releaseLock(&thread->stateLock);
+            if(intsEnabled) asm("sti");
+            return;
+        }
+
         thread->state = ThreadStateRunning;
+
+        if(!thread->inRunQueue){
+            CPU* cpu = thread->cpu ? thread->cpu : GetCPULocal(); // Go back to the processor we last ran on, its caches are most likely to still be warm
+
+            acquireLock(&cpu->runQueueLock);
+
+            // Don't let a thread that has slept for a while build up credit and hog the processor,
+            // but let it go slightly ahead of the queue so it gets to respond quickly
+            uint64_t credit = THREAD_TIMESLICE_DEFAULT * (1000000000 / Timer::GetFrequency());
+            uint64_t floor = cpu->minVruntime > credit ? cpu->minVruntime - credit : 0;
+            if(thread->vruntime < floor){
+                thread->vruntime = floor;
+            }
+
+            thread->readySince = Timer::GetSystemUptimeNs();
+            cpu->runQueue->add_back(thread);
+            thread->inRunQueue = true;
+
+            thread_t* current = cpu->currentThread;
+            if(thread->schedClass == SchedulingClassInteractive && current && current->schedClass != SchedulingClassInteractive){
+                current->timeSlice = 0; // Preempt fair threads
+
+                if(cpu != GetCPULocal()){
+                    APIC::Local::SendIPI(cpu->id, 0, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+                }
+            }
+
+            releaseLock(&cpu->runQueueLock);
+
+            KickIdleProcessor(cpu);
+        }
+
         releaseLock(&thread->stateLock);
+        if(intsEnabled) asm("sti");
 
         /*for(List<thread_t*>* l : thread->waiting){
             l->remove(thread);
@@ -494,103 +705,217 @@ namespace Scheduler{
     void Tick(regs64_t* r){
         if(!schedulerReady) return;
 
-        APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+        Schedule(r); // Every processor has its own timer, no need to tell the others
+    }
+
+    // Take a runnable thread from the run queue of another processor, cpu->runQueueLock must be held
+    thread_t* StealThread(CPU* cpu){
+        for(unsigned i = 0; i < SMP::processorCount; i++){
+            CPU* victim = SMP::cpus[i];
+
+            if(victim == cpu || victim->runQueue->get_length() < 2){
+                continue; // Leave processors with a single thread alone
+            }
+
+            if(acquireTestLock(&victim->runQueueLock)){
+                continue; // Don't wait on a busy queue, try the next one
+            }
+
+            thread_t* thread = victim->runQueue->front;
+            for(unsigned j = victim->runQueue->get_length(); j > 0; j--){
+                if(thread->state == ThreadStateRunning && !acquireTestLock(&thread->switchLock)){ // The switch lock is held whilst a thread is running
+                    victim->runQueue->remove(thread);
+
+                    // Keep its place relative to the other threads when moving between queues
+                    int64_t lag = thread->vruntime - victim->minVruntime;
+                    thread->vruntime = (lag < 0 && static_cast<uint64_t>(-lag) > cpu->minVruntime) ? 0 : cpu->minVruntime + lag;
+
+                    cpu->runQueue->add_back(thread);
+                    thread->cpu = cpu;
+
+                    releaseLock(&victim->runQueueLock);
+                    return thread;
+                }
+
+                thread = thread->next;
+            }
+
+            releaseLock(&victim->runQueueLock);
+        }
 
-        Schedule(r);
+        return nullptr;
     }
 
     void Schedule(regs64_t* r){
         CPU* cpu = GetCPULocal();
+        thread_t* prev = cpu->currentThread;
+
+        uint64_t now = Timer::GetSystemUptimeNs();
+        uint64_t delta = now - cpu->lastSchedule;
+        cpu->lastSchedule = now;
+
+        if(prev) {
+            prev->parent->activeNs += delta;
+            prev->activeNs += delta;
+            prev->vruntime += delta * THREAD_NICE_0_WEIGHT / prev->weight;
 
-        if(cpu->currentThread) {
-            cpu->currentThread->parent->activeTicks++;
-            if(cpu->currentThread->timeSlice > 0) {
-                cpu->currentThread->timeSlice--;
+            if(prev->timeSlice > 0) {
+                prev->timeSlice--;
                 return;
             }
         }
 
-        while(__builtin_expect(acquireTestLock(&cpu->runQueueLock), 0)) {
-            return;
+        if(__builtin_expect(acquireTestLock(&cpu->runQueueLock), 0)) {
+            if(prev && prev->state == ThreadStateRunning){
+                return; // Try again next tick
+            }
+
+            acquireLock(&cpu->runQueueLock); // A blocked thread can't keep running
         }
 
-        if (__builtin_expect(cpu->runQueue->get_length() <= 0 || !cpu->runQueue->front, 0)){
-            cpu->currentThread = cpu->idleProcess->threads[0];
-        } else if(__builtin_expect(cpu->currentThread && cpu->currentThread->parent != cpu->idleProcess, 1)){
-            cpu->currentThread->timeSlice = cpu->currentThread->timeSliceDefault;
+        thread_t* start = cpu->runQueue->front;
+        if(__builtin_expect(prev && prev->parent != cpu->idleProcess, 1)){
+            prev->timeSlice = prev->timeSliceDefault;
 
-            asm volatile ("fxsave64 (%0)" :: "r"((uintptr_t)cpu->currentThread->fxState) : "memory");
+            asm volatile ("fxsave64 (%0)" :: "r"((uintptr_t)prev->fxState) : "memory");
 
-            cpu->currentThread->registers = *r;
+            prev->registers = *r;
 
-            cpu->currentThread = cpu->currentThread->next;
-        } else {
-            cpu->currentThread = cpu->runQueue->front;
+            if(prev->inRunQueue){
+                start = prev->next; // Round robin, prev gets looked at last
+            }
         }
-            
-        if(cpu->currentThread->state == ThreadStateBlocked){
-            thread_t* first = cpu->currentThread;
 
-            do {
-                cpu->currentThread = cpu->currentThread->next;
-            } while(cpu->currentThread->state == ThreadStateBlocked && cpu->currentThread != first);
+        // Threads that have blocked are taken off the queue here rather than when they block,
+        // it saves UnblockThread from having to find out whether they are still running
+        thread_t* next = nullptr;
+        thread_t* thread = start;
+        uint64_t minVruntime = UINT64_MAX;
+        for(unsigned i = cpu->runQueue->get_length(); i > 0 && thread; i--){
+            thread_t* following = thread->next;
 
-            if(cpu->currentThread->state == ThreadStateBlocked){
-                cpu->currentThread = cpu->idleProcess->threads[0];
+            if(thread->state != ThreadStateRunning){
+                if(!acquireTestLock(&thread->stateLock)){ // If someone is unblocking it, leave it for now
+                    if(thread->state != ThreadStateRunning){
+                        cpu->runQueue->remove(thread);
+                        thread->inRunQueue = false;
+                    }
+
+                    releaseLock(&thread->stateLock);
+                }
+            } else if(thread == prev || !thread->switchLock){ // Skip threads that are still on their way out of another processor
+                if(thread->schedClass == SchedulingClassFair && thread->vruntime < minVruntime){
+                    minVruntime = thread->vruntime;
+                }
+
+                if(!next || SchedulesBefore(thread, next)){
+                    next = thread; // Ties go to whoever is first after prev, so equal threads take turns
+                }
+            }
+
+            thread = following;
+        }
+
+        if(minVruntime != UINT64_MAX && minVruntime > cpu->minVruntime){
+            cpu->minVruntime = minVruntime;
+        }
+
+        if(next && next != prev && acquireTestLock(&next->switchLock)){
+            next = nullptr; // Someone else got to it first
+        }
+
+        if(!next){
+            next = StealThread(cpu);
+        }
+
+        if(!next){
+            next = cpu->idleProcess->threads[0];
+        }
+
+        next->cpu = cpu;
+        cpu->currentThread = next;
+
+        bool busy = next->parent != cpu->idleProcess || cpu->runQueue->get_length(); // Nothing to preempt when idle, so skip the ticks
+
+        if(next == prev){
+            releaseLock(&cpu->runQueueLock);
+
+            Timer::SetLocalTick(busy);
+            return; // Keep running, no need to switch
+        }
+
+        if(prev && prev->parent != cpu->idleProcess && prev->state == ThreadStateRunning){
+            prev->readySince = now; // Preempted, so waiting from now on
+        }
+
+        if(next->parent != cpu->idleProcess){
+            uint64_t wait = now - next->readySince;
+            next->waitNs += wait;
+            if(wait > next->maxWaitNs){
+                next->maxWaitNs = wait;
             }
         }
 
         releaseLock(&cpu->runQueueLock);
-        asm volatile ("fxrstor64 (%0)" :: "r"((uintptr_t)cpu->currentThread->fxState) : "memory");
 
-	    asm volatile ("wrmsr" :: "a"(cpu->currentThread->fsBase & 0xFFFFFFFF) /*Value low*/, "d"((cpu->currentThread->fsBase >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
+        Timer::SetLocalTick(busy);
+
+        asm volatile ("fxrstor64 (%0)" :: "r"((uintptr_t)next->fxState) : "memory");
+
+	    asm volatile ("wrmsr" :: "a"(next->fsBase & 0xFFFFFFFF) /*Value low*/, "d"((next->fsBase >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
         
-        TSS::SetKernelStack(&cpu->tss, (uintptr_t)cpu->currentThread->kernelStack);
+        TSS::SetKernelStack(&cpu->tss, (uintptr_t)next->kernelStack);
+        cpu->syscallKernelStack = (uintptr_t)next->kernelStack;
+
+        // We are still on the stack of prev, so another processor can't pick it up until TaskSwitch is done with it
+        lock_t* prevSwitchLock = (prev && prev != next && prev->parent != cpu->idleProcess) ? &prev->switchLock : nullptr;
 
-        TaskSwitch(&cpu->currentThread->registers, cpu->currentThread->parent->addressSpace->pml4Phys);
+        TaskSwitch(&next->registers, next->parent->addressSpace->pml4Phys, prevSwitchLock);
     }
 
-    process_t* CreateELFProcess(void* elf, int argc, char** argv, int envc, char** envp) {
-        if(!VerifyELF(elf)) return nullptr;
+    process_t* CreateELFProcess(FsNode* node, int argc, char** argv, int envc, char** envp) {
+        elf64_header_t elfHdr;
+        if(fs::Read(node, 0, sizeof(elf64_header_t), (uint8_t*)&elfHdr) != sizeof(elf64_header_t) || !VerifyELF(&elfHdr)) return nullptr;
 
         // Create process structure
         process_t* proc = InitializeProcessStructure();
 
         thread_t* thread = proc->threads[0];
-        thread->registers.cs = 0x1B; // We want user mode so use user mode segments, make sure RPL is 3
-        thread->registers.ss = 0x23;
+        thread->registers.cs = USER_CS; // We want user mode so use user mode segments, make sure RPL is 3
+        thread->registers.ss = USER_SS;
         thread->timeSliceDefault = THREAD_TIMESLICE_DEFAULT;
         thread->timeSlice = thread->timeSliceDefault;
-        thread->priority = 4;
 
         Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),0,1,proc->addressSpace);
 
-        elf_info_t elfInfo = LoadELFSegments(proc, elf, 0);
+        elf_info_t elfInfo = LoadELFSegments(proc, node, 0);
+        if(!elfInfo.entry){
+            Log::Warning("Failed to load ELF segments");
+
+            if(elfInfo.linkerPath) kfree(elfInfo.linkerPath);
+            DestroyProcessStructure(proc);
+            return nullptr;
+        }
         
         thread->registers.rip = elfInfo.entry;
         
         if(elfInfo.linkerPath){
-            //char* linkPath = elfInfo.linkerPath;
+            kfree(elfInfo.linkerPath); // ld.so is always loaded from the ramdisk
             uintptr_t linkerBaseAddress = 0x7FC0000000; // Linker base address
 
-            FsNode* node = fs::ResolvePath("/initrd/ld.so");
+            FsNode* linkerNode = fs::ResolvePath("/initrd/ld.so");
 
-            void* linkerElf = kmalloc(node->size);
-
-            fs::Read(node, 0, node->size, (uint8_t*)linkerElf); // Load Dynamic Linker
-            
-            if(!VerifyELF(linkerElf)){
+            elf_info_t linkerELFInfo = {};
+            if(!linkerNode || !(linkerELFInfo = LoadELFSegments(proc, linkerNode, linkerBaseAddress)).entry){ // Load Dynamic Linker, mapped like the executable
                 Log::Warning("Invalid Dynamic Linker ELF");
-                asm volatile("mov %%rax, %%cr3" :: "a"(GetCurrentProcess()->addressSpace->pml4Phys));
-                asm("sti");
+
+                if(linkerELFInfo.linkerPath) kfree(linkerELFInfo.linkerPath);
+                DestroyProcessStructure(proc);
                 return nullptr;
             }
 
-            elf_info_t linkerELFInfo = LoadELFSegments(proc, linkerElf, linkerBaseAddress);
-
+            if(linkerELFInfo.linkerPath) kfree(linkerELFInfo.linkerPath);
             thread->registers.rip = linkerELFInfo.entry;
-
-            kfree(linkerElf);
         }
 
         char** tempArgv = (char**)kmalloc(argc * sizeof(char*));
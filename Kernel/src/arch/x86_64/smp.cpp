@@ -9,6 +9,7 @@
 #include <tss.h>
 #include <idt.h>
 #include <hal.h>
+#include <syscalls.h>
 
 #include "smpdefines.inc"
 
@@ -59,10 +60,14 @@ namespace SMP{
 
         TSS::InitializeTSS(&cpu->tss, cpu->gdt);
 
+        InitializeFastSyscalls();
+
         APIC::Local::Enable();
 
         cpu->runQueue = new FastList<thread_t*>();
 
+        Timer::EnableLocalTimer();
+
         asm("sti");
 
         for(;;);
@@ -122,6 +127,7 @@ namespace SMP{
         cpus[0]->runQueueLock = 0;
         cpus[0]->runQueue = new FastList<thread_t*>();
         SetCPULocal(cpus[0]);
+        Memory::EnablePhysicalBlockCaches();
 
         if(HAL::disableSMP) {
             TSS::InitializeTSS(&cpus[0]->tss, cpus[0]->gdt);
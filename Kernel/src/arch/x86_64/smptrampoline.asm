@@ -45,6 +45,7 @@ smpentry64:
     mov rax, cr0
 	and ax, 0xFFFB		; Clear coprocessor emulation
 	or ax, 0x2			; Set coprocessor monitoring
+	or rax, 1 << 16		; Write protect, the kernel faults on read only user pages so copy on write works for it too
 	mov cr0, rax
 
 	;Enable SSE
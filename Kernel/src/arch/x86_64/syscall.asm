@@ -0,0 +1,72 @@
+BITS 64
+
+extern syscall_handler
+
+global syscall_entry
+
+CPU_SYSCALL_KERNEL_STACK equ 8 ; Offsets in struct CPU, see cpu.h
+CPU_SYSCALL_USER_STACK equ 16
+
+USER_SS equ 0x1B
+USER_CS equ 0x23
+
+; SYSCALL entry point (LSTAR)
+; The CPU leaves the user RIP in RCX and RFLAGS in R11, interrupts are masked by SFMASK
+; Arguments are passed the same as with int 0x69 except the second goes in R10 instead of RCX
+syscall_entry:
+    swapgs ; Kernel GS base always points to the CPU, see GetCPULocal()
+    mov [gs:CPU_SYSCALL_USER_STACK], rsp
+    mov rsp, [gs:CPU_SYSCALL_KERNEL_STACK]
+
+    ; Build the same regs64_t frame as an interrupt so every syscall works with either entry path
+    push qword USER_SS ; SS
+    push qword [gs:CPU_SYSCALL_USER_STACK] ; RSP
+    swapgs
+    push r11 ; RFLAGS
+    push qword USER_CS ; CS
+    push rcx ; RIP
+
+    push rax
+    push rbx
+    push r10 ; RCX
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov rdi, rsp
+    xor rbp, rbp
+    call syscall_handler
+
+    cli ; The handler may have enabled interrupts, we can't be interrupted once the user stack is back
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    add rsp, 8 ; RCX gets clobbered by SYSRET
+    pop rbx
+    pop rax
+
+    pop rcx ; RIP
+    add rsp, 8 ; CS
+    pop r11 ; RFLAGS
+    pop rsp ; RSP
+
+    o64 sysret
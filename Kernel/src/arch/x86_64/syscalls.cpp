@@ -20,6 +20,9 @@
 #include <lock.h>
 #include <smp.h>
 #include <pair.h>
+#include <fs/epoll.h>
+#include <fs/dentrycache.h>
+#include <fs/pagecache.h>
 
 #define SYS_EXIT 1
 #define SYS_EXEC 2
@@ -94,11 +97,31 @@
 #define SYS_GET_FILE_STATUS_FLAGS 73
 #define SYS_SET_FILE_STATUS_FLAGS 74
 #define SYS_SELECT 75
+#define SYS_SET_SCHEDULING 76
+#define SYS_EPOLL_CREATE 77
+#define SYS_EPOLL_CTL 78
+#define SYS_EPOLL_WAIT 79
 
-#define NUM_SYSCALLS 76
+#define SYS_READDIR_BATCH 80
+#define SYS_MAP_FILE 81
+#define SYS_FORK 82
+#define SYS_SET_SOCKET_OPTIONS 83
+#define SYS_GET_SOCKET_OPTIONS 84
+#define SYS_SEND_MMSG 85
+#define SYS_RECV_MMSG 86
+
+#define NUM_SYSCALLS 87
 
 #define EXEC_CHILD 1
 
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+
+#define EFER_SCE 0x1 // SYSCALL Enable
+#define SYSCALL_FLAG_MASK 0x700 // Clear TF, IF and DF on SYSCALL
+
 typedef long(*syscall_t)(regs64_t*);
 
 long SysExit(regs64_t* r){
@@ -128,15 +151,6 @@ long SysExec(regs64_t* r){
 	}
 
 	Log::Info("Loading: %s", (char*)r->rbx);
-	timeval_t tv = Timer::GetSystemUptimeStruct();
-	uint8_t* buffer = (uint8_t*)kmalloc(current_node->size);
-	size_t read = fs::Read(current_node, 0, current_node->size, buffer);
-	if(!read){
-		Log::Warning("Could not read file: %s", filepath);
-		return 0;
-	}
-	timeval_t tvnew = Timer::GetSystemUptimeStruct();
-	Log::Info("Done (took %d ms)", Timer::TimeDifference(tvnew, tv));
 
 	char** kernelArgv = (char**)kmalloc(argc * sizeof(char*));
 	for(int i = 0; i < argc; i++){
@@ -159,17 +173,25 @@ long SysExec(regs64_t* r){
 		}
 	}
 
-	process_t* proc = Scheduler::CreateELFProcess((void*)buffer, argc, kernelArgv, envCount, kernelEnvp);
-	strncpy(proc->name, fs::BaseName(kernelArgv[0]), NAME_MAX);
+	timeval_t tv = Timer::GetSystemUptimeStruct();
+	process_t* proc = Scheduler::CreateELFProcess(current_node, argc, kernelArgv, envCount, kernelEnvp); // Segments are mapped from the page cache, not read in
+	timeval_t tvnew = Timer::GetSystemUptimeStruct();
+	Log::Info("Done (took %d ms)", Timer::TimeDifference(tvnew, tv));
+
+	if(proc){
+		strncpy(proc->name, fs::BaseName(kernelArgv[0]), NAME_MAX);
+	}
 
 	for(int i = 0; i < argc; i++){
 		kfree(kernelArgv[i]);
 	}
 	
 	kfree(kernelArgv);
-	kfree(buffer);
 
-	if(!proc) return 0;
+	if(!proc){
+		Log::Warning("Could not load: %s", filepath);
+		return 0;
+	}
 
 	if(flags & EXEC_CHILD){
 		Scheduler::GetCurrentProcess()->children.add_back(proc);
@@ -178,6 +200,10 @@ long SysExec(regs64_t* r){
 		proc->fileDescriptors[0] = new fs_fd_t(*Scheduler::GetCurrentProcess()->fileDescriptors.get_at(0));
 		proc->fileDescriptors[1] = new fs_fd_t(*Scheduler::GetCurrentProcess()->fileDescriptors.get_at(1));
 		proc->fileDescriptors[2] = new fs_fd_t(*Scheduler::GetCurrentProcess()->fileDescriptors.get_at(2));
+
+		for(int i = 0; i < 3; i++){
+			proc->fileDescriptors[i]->epollEntries = nullptr; // The copies are not in any interest sets
+		}
 	}
 
 	strncpy(proc->workingDir, Scheduler::GetCurrentProcess()->workingDir, PATH_MAX);
@@ -276,7 +302,7 @@ open:
 
 			DirectoryEntry ent;
 			strcpy(ent.name, basename);
-			parent->Create(&ent, flags);
+			fs::Create(parent, &ent, flags);
 
 			kfree(basename);
 
@@ -375,7 +401,7 @@ long SysLink(regs64_t* r){
 
 	DirectoryEntry entry;
 	strcpy(entry.name, linkName);
-	return parentDirectory->Link(file, &entry);
+	return fs::Link(parentDirectory, file, &entry);
 }
 
 long SysUnlink(regs64_t* r){
@@ -403,7 +429,7 @@ long SysUnlink(regs64_t* r){
 
 	DirectoryEntry entry;
 	strcpy(entry.name, linkName);
-	return parentDirectory->Unlink(&entry);
+	return fs::Unlink(parentDirectory, &entry);
 }
 
 long SysChdir(regs64_t* r){
@@ -430,12 +456,16 @@ long SysMapFB(regs64_t *r){
 
 	uint64_t pageCount = (vMode.height * vMode.pitch + 0xFFF) >> 12;
 	uintptr_t fbVirt = (uintptr_t)Memory::Allocate4KPages(pageCount, Scheduler::GetCurrentProcess()->addressSpace);
-	Memory::MapVirtualMemory4K((uintptr_t)HAL::videoMode.physicalAddress,fbVirt,pageCount,Scheduler::GetCurrentProcess()->addressSpace);
+	Memory::MapVirtualMemory4K((uintptr_t)HAL::videoMode.physicalAddress,fbVirt,pageCount,Scheduler::GetCurrentProcess()->addressSpace,PAGE_SHARED);
 
 	mem_region_t memR;
 	memR.base = fbVirt;
 	memR.pageCount = pageCount;
-	Scheduler::GetCurrentProcess()->sharedMemory.add_back(memR);
+
+	process_t* proc = Scheduler::GetCurrentProcess();
+	acquireLock(&proc->sharedMemoryLock);
+	proc->sharedMemory.add_back(memR);
+	releaseLock(&proc->sharedMemoryLock);
 
 	fb_info_t fbInfo;
 	fbInfo.width = vMode.width;
@@ -459,10 +489,7 @@ long SysAlloc(regs64_t* r){
 
 	assert(address);
 
-	for(unsigned i = 0; i < pageCount; i++){
-		Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),address + i * PAGE_SIZE_4K,1,Scheduler::GetCurrentProcess()->addressSpace);
-		memset((void*)(address + i * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
-	}
+	Memory::MapDemandZero4K(address, pageCount, Scheduler::GetCurrentProcess()->addressSpace);
 
 	*addressPointer = address;
 
@@ -473,20 +500,7 @@ long SysChmod(regs64_t* r){
 	return 0;
 }
 
-long SysFStat(regs64_t* r){
-	stat_t* stat = (stat_t*)r->rbx;
-	int fd = r->rcx;
-
-	if(fd >= static_cast<int>(Scheduler::GetCurrentProcess()->fileDescriptors.get_length())){
-		Log::Warning("sys_fstat: Invalid File Descriptor, %d", fd);
-		return -EBADF;
-	}
-	FsNode* node = Scheduler::GetCurrentProcess()->fileDescriptors.get_at(fd)->node;
-	if(!node){
-		Log::Warning("sys_fstat: Invalid File Descriptor, %d", fd);
-		return -EBADF;
-	}
-
+static void FillStat(stat_t* stat, FsNode* node){
 	stat->st_dev = 0;
 	stat->st_ino = node->inode;
 	stat->st_mode = 0;
@@ -505,6 +519,23 @@ long SysFStat(regs64_t* r){
 	stat->st_size = node->size;
 	stat->st_blksize = 0;
 	stat->st_blocks = 0;
+}
+
+long SysFStat(regs64_t* r){
+	stat_t* stat = (stat_t*)r->rbx;
+	int fd = r->rcx;
+
+	if(fd >= static_cast<int>(Scheduler::GetCurrentProcess()->fileDescriptors.get_length())){
+		Log::Warning("sys_fstat: Invalid File Descriptor, %d", fd);
+		return -EBADF;
+	}
+	FsNode* node = Scheduler::GetCurrentProcess()->fileDescriptors.get_at(fd)->node;
+	if(!node){
+		Log::Warning("sys_fstat: Invalid File Descriptor, %d", fd);
+		return -EBADF;
+	}
+
+	FillStat(stat, node);
 
 	return 0;
 }
@@ -531,24 +562,7 @@ long SysStat(regs64_t* r){
 		return -ENOENT;
 	}
 
-	stat->st_dev = 0;
-	stat->st_ino = node->inode;
-	stat->st_mode = 0;
-	
-	if(node->flags == FS_NODE_DIRECTORY) stat->st_mode |= S_IFDIR;
-	if(node->flags == FS_NODE_FILE) stat->st_mode |= S_IFREG;
-	if(node->flags == FS_NODE_BLKDEVICE) stat->st_mode |= S_IFBLK;
-	if(node->flags == FS_NODE_CHARDEVICE) stat->st_mode |= S_IFCHR;
-	if(node->flags == FS_NODE_SYMLINK) stat->st_mode |= S_IFLNK;
-	if(node->flags == FS_NODE_SOCKET) stat->st_mode |= S_IFSOCK;
-
-	stat->st_nlink = 0;
-	stat->st_uid = node->uid;
-	stat->st_gid = 0;
-	stat->st_rdev = 0;
-	stat->st_size = node->size;
-	stat->st_blksize = 0;
-	stat->st_blocks = 0;
+	FillStat(stat, node);
 
 	return 0;
 }
@@ -624,7 +638,7 @@ long SysMkdir(regs64_t* r){
 
 	DirectoryEntry dir;
 	strcpy(dir.name, dirPath);
-	int ret = parentDirectory->CreateDirectory(&dir, mode);
+	int ret = fs::CreateDirectory(parentDirectory, &dir, mode);
 
 	return ret;
 }
@@ -834,7 +848,7 @@ long SysReadDir(regs64_t* r){
 
 long SysSetFsBase(regs64_t* r){
 	asm volatile ("wrmsr" :: "a"(r->rbx & 0xFFFFFFFF) /*Value low*/, "d"((r->rbx >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
-	GetCPULocal()->currentThread->fsBase = r->rbx;
+	GetCurrentThread()->fsBase = r->rbx;
 	return 0;
 }
 
@@ -854,10 +868,7 @@ long SysMmap(regs64_t* r){
 		}
 	} else _address = (uintptr_t)Memory::Allocate4KPages(count, Scheduler::GetCurrentProcess()->addressSpace);
 
-	for(size_t i = 0; i < count; i++){
-		Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), _address + i * PAGE_SIZE_4K, 1, Scheduler::GetCurrentProcess()->addressSpace);
-		memset((void*)(_address + i * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
-	}
+	Memory::MapDemandZero4K(_address, count, Scheduler::GetCurrentProcess()->addressSpace); // Frames are allocated on first access
 
 	*address = _address;
 
@@ -915,8 +926,7 @@ long SysWaitPID(regs64_t* r){
 long SysNanoSleep(regs64_t* r){
 	uint64_t nanoseconds = r->rbx;
 
-	uint64_t ticks = nanoseconds * Timer::GetFrequency() / 1000000000;
-	Timer::SleepCurrentThread(ticks);
+	Timer::SleepCurrentThreadNs(nanoseconds);
 
 	return 0;
 }
@@ -989,10 +999,22 @@ long SysInfo(regs64_t* r){
 		return -1;
 	}
 
-	s->usedMem = Memory::usedPhysicalBlocks * 4;
+	s->usedMem = (Memory::usedPhysicalBlocks - Memory::GetCachedPhysicalBlocks()) * 4;
 	s->totalMem = HAL::mem_info.memory_high + HAL::mem_info.memory_low;
 	s->cpuCount = static_cast<uint16_t>(SMP::processorCount);
 
+	s->pageCacheHits = s->pageCacheRefills = s->pageCacheDrains = 0;
+	for(unsigned i = 0; i < 256; i++){
+		if(!SMP::cpus[i]) continue;
+
+		s->pageCacheHits += SMP::cpus[i]->pageCache.hits;
+		s->pageCacheRefills += SMP::cpus[i]->pageCache.refills;
+		s->pageCacheDrains += SMP::cpus[i]->pageCache.drains;
+	}
+
+	s->dentryCacheHits = fs::DentryCache::hits + fs::DentryCache::negativeHits;
+	s->dentryCacheMisses = fs::DentryCache::misses;
+
 	return 0;
 }
 
@@ -1075,7 +1097,18 @@ long SysUnmapSharedMemory(regs64_t* r){
 	if(!Memory::CheckRegion(address, sMem->pgCount * PAGE_SIZE_4K, Scheduler::GetCurrentProcess()->addressSpace)) // Make sure the process is not screwing with kernel memory
 		return -1;
 
-	Memory::Free4KPages((void*)address, sMem->pgCount, Scheduler::GetCurrentProcess()->addressSpace);
+	process_t* proc = Scheduler::GetCurrentProcess();
+
+	acquireLock(&proc->sharedMemoryLock);
+	for(unsigned i = 0; i < proc->sharedMemory.get_length(); i++){
+		if(proc->sharedMemory[i].base == address){
+			proc->sharedMemory.remove_at(i);
+			break;
+		}
+	}
+	releaseLock(&proc->sharedMemoryLock);
+
+	Memory::Free4KPages((void*)address, sMem->pgCount, proc->addressSpace);
 
 	sMem->mapCount--;
 
@@ -1477,11 +1510,11 @@ long SysPoll(regs64_t* r){
 	unsigned eventCount = 0; // Amount of fds with events
 	for(unsigned i = 0; i < nfds; i++){
 		fds[i].revents = 0;
+		files[i] = nullptr;
 		if(fds[i].fd < 0) continue;
 
 		if((uint64_t)fds[i].fd >= Scheduler::GetCurrentProcess()->fileDescriptors.get_length()){
 			Log::Warning("sys_poll: Invalid File Descriptor: %d", fds[i].fd);
-			files[i] = 0;
 			fds[i].revents |= POLLNVAL;
 			eventCount++;
 			continue;
@@ -1491,7 +1524,6 @@ long SysPoll(regs64_t* r){
 
 		if(!handle || !handle->node){
 			Log::Warning("sys_poll: Invalid File Descriptor: %d", fds[i].fd);
-			files[i] = 0;
 			fds[i].revents |= POLLNVAL;
 			eventCount++;
 			continue;
@@ -1499,83 +1531,37 @@ long SysPoll(regs64_t* r){
 
 		files[i] = handle;
 
-		bool hasEvent = 0;
-
-		if((files[i]->node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET){
-			if(!((Socket*)files[i]->node)->IsConnected()){
-				fds[i].revents |= POLLHUP;
-				hasEvent = true;
-			}
-			
-			if(((Socket*)files[i]->node)->PendingConnections() && (fds[i].events & POLLIN)){
-				fds[i].revents |= POLLIN;
-				hasEvent = true;
-			}
-		}
-
-		if(files[i]->node->CanRead() && (fds[i].events & POLLIN)) { // If readable and the caller requested POLLIN
-			fds[i].revents |= POLLIN;
-			hasEvent = true;
-		}
-		
-		if(files[i]->node->CanWrite() && (fds[i].events & POLLOUT)) { // If writable and the caller requested POLLOUT
-			fds[i].revents |= POLLOUT;
-			hasEvent = true;
+		if((fds[i].revents = fs::Poll(handle->node, fds[i].events))){
+			eventCount++;
 		}
-
-		if(hasEvent) eventCount++;
 	}
 
-	if(!eventCount && timeout){
-		timeval_t tVal = Timer::GetSystemUptimeStruct();
-
+	uint64_t deadline = Timer::GetSystemUptimeNs() + timeout * 1000000;
+	while(!eventCount && timeout){
 		FilesystemWatcher fsWatcher;
 		for(unsigned i = 0; i < nfds; i++){
-			fsWatcher.WatchNode(files[i]->node, fds[i].events);
+			if(files[i]){
+				fsWatcher.WatchNode(files[i]->node, fds[i].events);
+			}
 		}
 
 		if(timeout > 0){
-			fsWatcher.WaitTimeout(timeout);
-		} else {
-			fsWatcher.Wait();
-		}
-
-		do{
-			if(eventCount > 0){
+			uint64_t now = Timer::GetSystemUptimeNs();
+			if(now >= deadline){
 				break;
 			}
 
-			for(unsigned i = 0; i < nfds; i++){
-				if(!files[i] || !files[i]->node) continue;
-
-				bool hasEvent = 0;
-
-				if((files[i]->node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET){
-					if(!((Socket*)files[i]->node)->IsConnected()){
-						fds[i].revents |= POLLHUP;
-						hasEvent = 1;
-					}
-
-					if(((Socket*)files[i]->node)->PendingConnections() && (fds[i].events & POLLIN)){
-						fds[i].revents |= POLLIN;
-						hasEvent = 1;
-					}
-				}
-
-				if(files[i]->node->CanRead() && (fds[i].events & POLLIN)) { // If readable and the caller requested POLLIN
-					fds[i].revents |= POLLIN;
-					hasEvent = 1;
-				}
-				
-				if(files[i]->node->CanWrite() && (fds[i].events & POLLOUT)) { // If writable and the caller requested POLLOUT
-					fds[i].revents |= POLLOUT;
-					hasEvent = 1;
-				}
+			fsWatcher.WaitTimeout((deadline - now) / 1000);
+		} else {
+			fsWatcher.Wait(); // Wait indefinitely
+		}
 
-				if(hasEvent) eventCount++;
+		// Only look again once something has signalled or we have timed out
+		for(unsigned i = 0; i < nfds; i++){
+			if(files[i] && (fds[i].revents = fs::Poll(files[i]->node, fds[i].events))){
+				eventCount++;
 			}
-			Scheduler::Yield();
-		} while(timeout < 0 || Timer::TimeDifference(Timer::GetSystemUptimeStruct(), tVal) < timeout); // Wait until timeout, unless timeout is negative in which wait infinitely
+		}
 	}
 
 	if(files)
@@ -1735,6 +1721,25 @@ long SysSetEUID(regs64_t* r){
 	return -ENOSYS;
 }
 
+// Scheduler statistics of a process for process_info_t
+static void GetSchedulingInfo(process_t* proc, process_info_t* pInfo){
+	uint64_t waitNs = 0;
+	uint64_t maxWaitNs = 0;
+	for(unsigned i = 0; i < proc->threads.get_length(); i++){
+		thread_t* thread = proc->threads[i];
+
+		waitNs += thread->waitNs;
+		if(thread->maxWaitNs > maxWaitNs){
+			maxWaitNs = thread->maxWaitNs;
+		}
+	}
+
+	pInfo->waitUs = waitNs / 1000;
+	pInfo->maxWaitUs = maxWaitNs / 1000;
+	pInfo->schedClass = proc->threads[0]->schedClass;
+	pInfo->nice = proc->threads[0]->nice;
+}
+
 /////////////////////////////
 /// \brief SysGetProcessInfo (pid, pInfo)
 ///
@@ -1770,7 +1775,8 @@ long SysGetProcessInfo(regs64_t* r){
 	strcpy(pInfo->name, reqProcess->name);
 
 	pInfo->runningTime = Timer::GetSystemUptime() - reqProcess->creationTime.seconds;
-	pInfo->activeUs = reqProcess->activeTicks * 1000000 / Timer::GetFrequency();
+	pInfo->activeUs = reqProcess->activeNs / 1000;
+	GetSchedulingInfo(reqProcess, pInfo);
 
 	return 0;
 }
@@ -1821,7 +1827,8 @@ long SysGetNextProcessInfo(regs64_t* r){
 	strcpy(pInfo->name, reqProcess->name);
 
 	pInfo->runningTime = Timer::GetSystemUptime() - reqProcess->creationTime.seconds;
-	pInfo->activeUs = reqProcess->activeTicks * 1000000 / Timer::GetFrequency();
+	pInfo->activeUs = reqProcess->activeNs / 1000;
+	GetSchedulingInfo(reqProcess, pInfo);
 
 	return 0;
 }
@@ -1882,13 +1889,81 @@ long SysSpawnThread(regs64_t* r){
 long SysExitThread(regs64_t* r){
 	Log::Warning("SysExitThread is unimplemented! Hanging!");
 	
-	releaseLock(&GetCPULocal()->currentThread->lock);
+	releaseLock(&GetCurrentThread()->lock);
 
-	GetCPULocal()->currentThread->state = ThreadStateBlocked;
+	GetCurrentThread()->state = ThreadStateBlocked;
 
 	for(;;) Scheduler::Yield();
 }
 
+// Futexes in shared memory are woken from other processes, which map it at a different address, so they are keyed on the physical address
+// and queued here rather than in the process. Threads on these queues are in their waiting list so they are taken off if killed.
+lock_t sharedFutexLock = 0;
+HashMap<uintptr_t, List<thread_t*>*> sharedFutexes;
+
+// Free the queue for key once nobody is waiting on it, sharedFutexLock must be held
+static void ReleaseSharedFutexQueue(uintptr_t key, List<thread_t*>* queue){
+	if(!queue->get_length()){
+		sharedFutexes.remove(key);
+		delete queue;
+	}
+}
+
+class SharedFutexBlocker : public Scheduler::ThreadBlocker {
+public:
+	Timer::TimerEvent event; // Only used to wake straight away if the value changed before we were queued
+	uintptr_t key;
+	int* futex;
+	int expected;
+
+	SharedFutexBlocker(uintptr_t key, int* futex, int expected) : key(key), futex(futex), expected(expected) {}
+
+	// Called with sharedFutexLock held, so a waker can't slip in between checking the value and getting on the queue.
+	// The queue is only looked up here as an empty queue is freed as soon as the lock is dropped.
+	void Block(thread_t* thread) final {
+		if(*futex != expected){
+			event.thread = thread;
+			Timer::AddTimer(&event);
+			return;
+		}
+
+		List<thread_t*>* queue = sharedFutexes.get(key);
+		if(!queue){
+			queue = new List<thread_t*>();
+			sharedFutexes.insert(key, queue);
+		}
+
+		queue->add_back(thread);
+		thread->waiting.add_back(queue);
+	}
+
+	// sharedFutexLock must be held
+	void Remove(thread_t* thread) final {
+		if(List<thread_t*>* queue = sharedFutexes.get(key)){
+			queue->remove(thread);
+			thread->waiting.remove(queue);
+
+			ReleaseSharedFutexQueue(key, queue);
+		}
+	}
+};
+
+// Returns the physical address of the futex if it lies in shared memory, otherwise 0
+static uintptr_t SharedFutexKey(process_t* proc, uintptr_t futex){
+	uintptr_t key = 0;
+
+	acquireLock(&proc->sharedMemoryLock);
+	for(mem_region_t& region : proc->sharedMemory){
+		if(futex >= region.base && futex < region.base + region.pageCount * PAGE_SIZE_4K){
+			key = Memory::GetPhysicalAddress(futex, proc->addressSpace);
+			break;
+		}
+	}
+	releaseLock(&proc->sharedMemoryLock);
+
+	return key;
+}
+
 /////////////////////////////
 /// \brief SysFutexWake(futex) Wake a thread waiting on a futex
 ///
@@ -1905,6 +1980,24 @@ long SysFutexWake(regs64_t* r){
 
 	process_t* currentProcess = Scheduler::GetCurrentProcess();
 
+	if(uintptr_t key = SharedFutexKey(currentProcess, reinterpret_cast<uintptr_t>(futex))){
+		acquireLock(&sharedFutexLock);
+
+		if(List<thread_t*>* queue = sharedFutexes.get(key)){
+			if(queue->get_length()){
+				thread_t* thread = queue->remove_at(0);
+				thread->waiting.remove(queue);
+
+				Scheduler::UnblockThread(thread);
+			}
+
+			ReleaseSharedFutexQueue(key, queue); // Also catches queues left empty by threads that were killed whilst waiting
+		}
+
+		releaseLock(&sharedFutexLock);
+		return 0;
+	}
+
 	Scheduler::FutexThreadBlocker* blocker = currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex));
 
 	if(!blocker){
@@ -1925,7 +2018,8 @@ long SysFutexWake(regs64_t* r){
 /////////////////////////////
 /// \brief SysFutexWait(futex, expected) Wait on a futex.
 ///
-/// Will wait on the futex if the value is equal to expected
+/// Will wait on the futex if the value is equal to expected.
+/// Futexes in shared memory can be woken by any process that has it mapped.
 ///
 /// \param futex (void*) Futex pointer
 /// \param expected (int) Expected futex value
@@ -1947,6 +2041,16 @@ long SysFutexWait(regs64_t* r){
 
 	process_t* currentProcess = Scheduler::GetCurrentProcess();
 
+	if(uintptr_t key = SharedFutexKey(currentProcess, reinterpret_cast<uintptr_t>(futex))){
+		releaseLock(&GetCurrentThread()->lock);
+
+		SharedFutexBlocker blocker(key, futex, expected);
+		Scheduler::BlockCurrentThread(blocker, sharedFutexLock);
+
+		Timer::RemoveTimer(&blocker.event);
+		return 0;
+	}
+
 	Scheduler::FutexThreadBlocker* blocker = currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex));
 
 	if(!blocker){
@@ -1955,7 +2059,7 @@ long SysFutexWait(regs64_t* r){
 		currentProcess->futexWaitQueue.insert(reinterpret_cast<uintptr_t>(futex), blocker);
 	}
 
-	releaseLock(&GetCPULocal()->currentThread->lock);
+	releaseLock(&GetCurrentThread()->lock);
 
 	lock_t temp = 0;
 	Scheduler::BlockCurrentThread(*blocker, temp);
@@ -1981,6 +2085,7 @@ long SysDup(regs64_t* r){
 
 	fs_fd_t* newHandle = new fs_fd_t;
 	*newHandle = *handle;
+	newHandle->epollEntries = nullptr;
 	newHandle->node->handleCount++;
 
 	int newFd = currentProcess->fileDescriptors.get_length();
@@ -2142,9 +2247,23 @@ long SysSelect(regs64_t* r){
 		return evCount;
 	}
 
-	timeval_t timeEnd = {.seconds = timeout->tv_sec + Timer::GetSystemUptimeStruct().seconds, .milliseconds = timeout->tv_nsec / 1000000 + Timer::GetSystemUptimeStruct().milliseconds};
-	while(Timer::GetSystemUptimeStruct() < timeEnd){
-		evCount = 0;
+	uint64_t deadline = Timer::GetSystemUptimeNs() + timeout->tv_sec * 1000000000 + timeout->tv_nsec;
+	for(;;){
+		uint64_t now = Timer::GetSystemUptimeNs();
+		if(now >= deadline){
+			break;
+		}
+
+		FilesystemWatcher fsWatcher;
+		for(auto& handle : readfds){
+			fsWatcher.WatchNode(handle.item1->node, POLLIN);
+		}
+
+		for(auto& handle : writefds){
+			fsWatcher.WatchNode(handle.item1->node, POLLOUT);
+		}
+
+		fsWatcher.WaitTimeout((deadline - now) / 1000);
 
 		for(auto& handle : readfds){
 			if(handle.item1->node->CanRead()){
@@ -2160,18 +2279,621 @@ long SysSelect(regs64_t* r){
 			}
 		}
 
-		//for(fs_fd_t* handle : exceptfds);
-
 		if(evCount){
 			break;
 		}
-
-		Scheduler::Yield();
 	}
 
 	return evCount;
 }
 
+/////////////////////////////
+/// \brief SysSetScheduling (pid, tid, schedClass, nice) Set the scheduling class and nice value of a thread
+///
+/// \param pid - Process ID, 0 for the current process
+/// \param tid - Thread ID
+/// \param schedClass - Scheduling class (SchedulingClassFair or SchedulingClassInteractive)
+/// \param nice - Nice value (-20 to 19)
+///
+/// \return On Success - Return 0
+/// \return On Failure - Return error as negative value
+/////////////////////////////
+long SysSetScheduling(regs64_t* r){
+	uint64_t pid = r->rbx;
+	uint64_t tid = r->rcx;
+	int schedClass = r->rdx;
+	int nice = r->rsi;
+
+	process_t* cProcess = Scheduler::GetCurrentProcess();
+	process_t* reqProcess = pid ? Scheduler::FindProcessByPID(pid) : cProcess;
+	if(!reqProcess){
+		return -ESRCH;
+	}
+
+	if(tid >= reqProcess->threads.get_length()){
+		return -ESRCH;
+	}
+
+	if(reqProcess != cProcess && cProcess->uid != 0 && cProcess->uid != reqProcess->uid){
+		return -EPERM;
+	}
+
+	if((schedClass == SchedulingClassInteractive || nice < 0) && cProcess->uid != 0){
+		return -EPERM; // Only root can get ahead of everyone else
+	}
+
+	return Scheduler::SetThreadScheduling(reqProcess->threads[tid], schedClass, nice);
+}
+
+/////////////////////////////
+/// \brief SysEPollCreate (flags) Create an epoll instance
+///
+/// \param flags - Flags, currently none are supported
+///
+/// \return On Success - Return file descriptor of the epoll instance
+/// \return On Failure - Return error as negative value
+/////////////////////////////
+long SysEPollCreate(regs64_t* r){
+	if(r->rbx){
+		return -EINVAL;
+	}
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	EPoll* epoll = new EPoll();
+	fs_fd_t* handle = fs::Open(epoll, 0);
+
+	int fd = currentProcess->fileDescriptors.get_length();
+	currentProcess->fileDescriptors.add_back(handle);
+
+	return fd;
+}
+
+/////////////////////////////
+/// \brief SysEPollCtl (epfd, op, fd, event) Add, modify or remove a file descriptor from an epoll instance
+///
+/// \param epfd - File descriptor of the epoll instance
+/// \param op - EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+/// \param fd - File descriptor to watch
+/// \param event - (epoll_event_t*) Events to watch for and data to return, ignored for EPOLL_CTL_DEL
+///
+/// \return On Success - Return 0
+/// \return On Failure - Return error as negative value
+/////////////////////////////
+long SysEPollCtl(regs64_t* r){
+	int epfd = r->rbx;
+	int op = r->rcx;
+	int fd = r->rdx;
+	epoll_event_t* event = reinterpret_cast<epoll_event_t*>(r->rsi);
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	fs_fd_t* epollHandle;
+	fs_fd_t* handle;
+	if(static_cast<unsigned>(epfd) >= currentProcess->fileDescriptors.get_length() || !(epollHandle = currentProcess->fileDescriptors[epfd])){
+		return -EBADF;
+	}
+
+	if(static_cast<unsigned>(fd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[fd])){
+		return -EBADF;
+	}
+
+	if((epollHandle->node->flags & FS_NODE_TYPE) != FS_NODE_EPOLL){
+		return -EINVAL;
+	}
+
+	epoll_event_t kEvent = {};
+	if(op != EPOLL_CTL_DEL){
+		if(!Memory::CheckUsermodePointer(r->rsi, sizeof(epoll_event_t), currentProcess->addressSpace)){
+			return -EFAULT;
+		}
+
+		kEvent = *event;
+	}
+
+	return static_cast<EPoll*>(epollHandle->node)->Control(op, fd, handle, &kEvent);
+}
+
+/////////////////////////////
+/// \brief SysEPollWait (epfd, events, maxevents, timeout) Wait for events on an epoll instance
+///
+/// \param epfd - File descriptor of the epoll instance
+/// \param events - (epoll_event_t*) Array to fill with events
+/// \param maxevents - Size of events
+/// \param timeout - Timeout in ms, negative to wait indefinitely
+///
+/// \return On Success - Return amount of events
+/// \return On Failure - Return error as negative value
+/////////////////////////////
+long SysEPollWait(regs64_t* r){
+	int epfd = r->rbx;
+	epoll_event_t* events = reinterpret_cast<epoll_event_t*>(r->rcx);
+	int maxEvents = r->rdx;
+	long timeout = r->rsi;
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	fs_fd_t* epollHandle;
+	if(static_cast<unsigned>(epfd) >= currentProcess->fileDescriptors.get_length() || !(epollHandle = currentProcess->fileDescriptors[epfd])){
+		return -EBADF;
+	}
+
+	if((epollHandle->node->flags & FS_NODE_TYPE) != FS_NODE_EPOLL || maxEvents <= 0){
+		return -EINVAL;
+	}
+
+	if(!Memory::CheckUsermodePointer(r->rcx, maxEvents * sizeof(epoll_event_t), currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	if(maxEvents > EPOLL_WAIT_MAX_EVENTS){
+		maxEvents = EPOLL_WAIT_MAX_EVENTS; // Anything left over is picked up by the next call
+	}
+
+	epoll_event_t kEvents[EPOLL_WAIT_MAX_EVENTS]; // The ready list is locked whilst it is filled in, so don't touch user memory
+	int count = static_cast<EPoll*>(epollHandle->node)->Wait(kEvents, maxEvents, timeout);
+
+	for(int i = 0; i < count; i++){
+		events[i] = kEvents[i];
+	}
+
+	return count;
+}
+
+/////////////////////////////
+/// \brief SysReadDirBatch (fd, buffer, size, flags) Read as many directory entries as will fit into buffer
+///
+/// Entries are read from the position of the file handle, which is advanced past them, so repeated calls walk the whole directory.
+///
+/// \param fd - File descriptor of directory
+/// \param buffer - Buffer to fill with fs_batch_dirent_t entries
+/// \param size - Size of buffer, must be able to hold at least one entry with a name of NAME_MAX
+/// \param flags - READDIR_BATCH_STAT to fill in a stat_t for each entry
+///
+/// \return On Success - Return amount of bytes written to buffer, 0 at the end of the directory
+/// \return On Failure - Return error as negative value
+/////////////////////////////
+long SysReadDirBatch(regs64_t* r){
+	int fd = r->rbx;
+	uint8_t* buffer = reinterpret_cast<uint8_t*>(r->rcx);
+	size_t size = r->rdx;
+	uint64_t flags = r->rsi;
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	fs_fd_t* handle;
+	if(static_cast<unsigned>(fd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[fd])){
+		return -EBADF;
+	}
+
+	if(!handle->node || (handle->node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
+		return -ENOTDIR;
+	}
+
+	if(!Memory::CheckUsermodePointer(r->rcx, size, currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	// Only read an entry when the largest possible one fits, otherwise it would have to be read again by the next call
+	size_t maxRecordLength = (sizeof(fs_batch_dirent_t) + NAME_MAX + 1 + 7) & ~7UL;
+	if(flags & READDIR_BATCH_STAT){
+		maxRecordLength += sizeof(stat_t);
+	}
+
+	if(size < maxRecordLength){
+		return -EINVAL;
+	}
+
+	size_t used = 0;
+	while(size - used >= maxRecordLength){
+		DirectoryEntry dirent;
+		int ret = fs::ReadDir(handle, &dirent, handle->pos);
+		if(ret < 0 && !used){
+			return ret;
+		} else if(ret <= 0){
+			break;
+		}
+
+		handle->pos++;
+
+		fs_batch_dirent_t* ent = reinterpret_cast<fs_batch_dirent_t*>(buffer + used);
+		size_t nameLength = strlen(dirent.name);
+		size_t recordLength = (sizeof(fs_batch_dirent_t) + nameLength + 1 + 7) & ~7UL; // Keep entries 8 byte aligned
+
+		ent->inode = dirent.inode;
+		ent->nameLength = nameLength;
+		ent->type = dirent.flags;
+		ent->reserved = 0;
+		memcpy(ent->name, dirent.name, nameLength);
+		ent->name[nameLength] = 0;
+
+		if(flags & READDIR_BATCH_STAT){
+			stat_t* stat = reinterpret_cast<stat_t*>(buffer + used + recordLength);
+			ent->statOffset = recordLength;
+			recordLength += sizeof(stat_t);
+
+			if(FsNode* node = fs::FindDir(handle->node, dirent.name)){
+				FillStat(stat, node);
+			} else {
+				memset(stat, 0, sizeof(stat_t)); // Removed since it was read
+			}
+		} else {
+			ent->statOffset = 0;
+		}
+
+		ent->recordLength = recordLength;
+		used += recordLength;
+	}
+
+	return used;
+}
+
+/////////////////////////////
+/// \brief SysMapFile (fd, address, count, offset, flags) Map a file into memory
+///
+/// Pages are read in from the page cache of the file when first accessed, every mapping of a file shares the same frames until written to.
+///
+/// \param fd - File descriptor of a regular file
+/// \param address - Pointer to address, if nonzero it is used as the address to map at and must not overlap an existing mapping. Set to the address of the mapping.
+/// \param count - Amount of pages to map
+/// \param offset - Offset in the file, must be page aligned
+/// \param flags - MAP_SHARED (written back to the file when the process exits) or MAP_PRIVATE (copied when written to)
+///
+/// \return On Success - Return 0
+/// \return On Failure - Return error as negative value
+/////////////////////////////
+long SysMapFile(regs64_t* r){
+	int fd = r->rbx;
+	uintptr_t* address = reinterpret_cast<uintptr_t*>(r->rcx);
+	uint64_t count = r->rdx;
+	uint64_t offset = r->rsi;
+	int flags = r->rdi;
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	fs_fd_t* handle;
+	if(static_cast<unsigned>(fd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[fd])){
+		return -EBADF;
+	}
+
+	if(!handle->node || (handle->node->flags & FS_NODE_TYPE) != FS_NODE_FILE){
+		return -EACCES;
+	}
+
+	if(!count || count > PDPT_SIZE / PAGE_SIZE_4K || (offset & (PAGE_SIZE_4K - 1)) || ((flags & (MAP_SHARED | MAP_PRIVATE)) != MAP_SHARED && (flags & (MAP_SHARED | MAP_PRIVATE)) != MAP_PRIVATE)){
+		return -EINVAL;
+	}
+
+	if(!Memory::CheckUsermodePointer(r->rcx, sizeof(uintptr_t), currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	uintptr_t hint = *address;
+	uintptr_t base;
+	if(hint){
+		if(hint & (PAGE_SIZE_4K - 1)){
+			return -EINVAL;
+		}
+
+		if(!Memory::CheckRegion(hint, count * PAGE_SIZE_4K, currentProcess->addressSpace)){
+			return -EINVAL;
+		}
+
+		if(!Memory::Reserve4KPages(hint, count, currentProcess->addressSpace)){
+			return -EEXIST; // Mapping over existing pages would leak their frames and leave the old file mapping in place
+		}
+
+		base = hint;
+	} else if(!(base = reinterpret_cast<uintptr_t>(Memory::Allocate4KPages(count, currentProcess->addressSpace)))){
+		return -ENOMEM;
+	}
+
+	fs::MapFile(currentProcess, handle->node, base, count, offset, flags & (MAP_SHARED | MAP_PRIVATE));
+
+	*address = base;
+	return 0;
+}
+
+/////////////////////////////
+/// \brief SysFork () Create a copy of the current process
+///
+/// Memory is shared copy-on-write until either process writes to it. Only the calling thread is copied.
+/// File descriptors are duplicated, the copies have their own offset.
+///
+/// \return On Success - Return the PID of the child to the parent and 0 to the child
+/// \return On Failure - Negative error code (-ENOMEM if there is not enough memory for the child)
+/////////////////////////////
+long SysFork(regs64_t* r){
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	process_t* proc = Scheduler::CloneProcess(currentProcess, r);
+	if(!proc){
+		return -ENOMEM;
+	}
+
+	return proc->pid;
+}
+
+/////////////////////////////
+/// \brief SysSetSocketOptions (sockfd, level, option, value, len) Set a socket option
+///
+/// \param sockfd Socket file descriptor
+/// \param level Protocol level of the option (e.g. IPPROTO_TCP)
+/// \param option Option to set (e.g. TCP_NODELAY)
+/// \param value Pointer to the new value
+/// \param len Size of value
+///
+/// \return On Success - 0
+/// \return On Failure - Negative error code
+/////////////////////////////
+long SysSetSocketOptions(regs64_t* r){
+	process_t* proc = Scheduler::GetCurrentProcess();
+
+	if(r->rbx >= proc->fileDescriptors.get_length()){
+		return -EBADF;
+	}
+
+	fs_fd_t* handle = proc->fileDescriptors.get_at(r->rbx);
+	if(!handle){
+		return -EBADF;
+	}
+
+	if((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET){
+		return -ENOTSOCK;
+	}
+
+	socklen_t len = r->rdi;
+	if(!Memory::CheckUsermodePointer(r->rsi, len, proc->addressSpace)){
+		return -EFAULT;
+	}
+
+	Socket* sock = (Socket*)handle->node;
+	return sock->SetSocketOptions(r->rcx, r->rdx, (const void*)r->rsi, len);
+}
+
+/////////////////////////////
+/// \brief SysGetSocketOptions (sockfd, level, option, value, len) Get the value of a socket option
+///
+/// \param sockfd Socket file descriptor
+/// \param level Protocol level of the option (e.g. IPPROTO_TCP)
+/// \param option Option to get (e.g. TCP_NODELAY)
+/// \param value Buffer for the value
+/// \param len Pointer to the size of value, set to the size of the option
+///
+/// \return On Success - 0
+/// \return On Failure - Negative error code
+/////////////////////////////
+long SysGetSocketOptions(regs64_t* r){
+	process_t* proc = Scheduler::GetCurrentProcess();
+
+	if(r->rbx >= proc->fileDescriptors.get_length()){
+		return -EBADF;
+	}
+
+	fs_fd_t* handle = proc->fileDescriptors.get_at(r->rbx);
+	if(!handle){
+		return -EBADF;
+	}
+
+	if((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET){
+		return -ENOTSOCK;
+	}
+
+	socklen_t* len = (socklen_t*)r->rdi;
+	if(!Memory::CheckUsermodePointer(r->rdi, sizeof(socklen_t), proc->addressSpace) || !Memory::CheckUsermodePointer(r->rsi, *len, proc->addressSpace)){
+		return -EFAULT;
+	}
+
+	Socket* sock = (Socket*)handle->node;
+	return sock->GetSocketOptions(r->rcx, r->rdx, (void*)r->rsi, len);
+}
+
+// Copy a message header and its iovecs (into iov, which holds IOV_MAX) out of user memory, then check the copies.
+// Only the copies may be used afterwards, other threads can change the originals at any time.
+// Returns the total length of the iovecs, or a negative error code.
+static long CopyMessage(const msghdr* userMsg, msghdr& msg, iovec* iov, process_t* proc){
+	msg = *userMsg;
+
+	if(msg.iovlen > IOV_MAX){
+		return -EMSGSIZE;
+	}
+
+	if(!Memory::CheckUsermodePointer((uintptr_t)msg.iov, sizeof(iovec) * msg.iovlen, proc->addressSpace)){
+		return -EFAULT;
+	}
+
+	memcpy(iov, msg.iov, sizeof(iovec) * msg.iovlen);
+	msg.iov = iov;
+
+	if(msg.name && !Memory::CheckUsermodePointer((uintptr_t)msg.name, msg.namelen, proc->addressSpace)){
+		return -EFAULT;
+	}
+
+	long total = 0;
+	for(unsigned i = 0; i < msg.iovlen; i++){
+		if(!Memory::CheckUsermodePointer((uintptr_t)iov[i].base, iov[i].len, proc->addressSpace)){
+			return -EFAULT;
+		}
+
+		total += iov[i].len;
+	}
+
+	return total;
+}
+
+/////////////////////////////
+/// \brief SysSendMMsg (sockfd, msgvec, vlen, flags) Send several messages through a socket with one syscall
+///
+/// Each message is sent as one datagram. Messages with one iovec are copied straight from the user buffer,
+/// anything else is gathered into a kernel buffer first.
+///
+/// \param sockfd Socket file descriptor
+/// \param msgvec Array of mmsghdr, len is set to the amount of bytes sent
+/// \param vlen Amount of messages, at most MMSG_MAX
+/// \param flags Flags passed to every send
+///
+/// \return On Success - Amount of messages sent
+/// \return On Failure - Negative error code if nothing was sent
+/////////////////////////////
+long SysSendMMsg(regs64_t* r){
+	process_t* proc = Scheduler::GetCurrentProcess();
+
+	if(r->rbx >= proc->fileDescriptors.get_length()){
+		return -EBADF;
+	}
+
+	fs_fd_t* handle = proc->fileDescriptors.get_at(r->rbx);
+	if(!handle){
+		return -EBADF;
+	}
+
+	if((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET){
+		return -ENOTSOCK;
+	}
+
+	mmsghdr* msgvec = (mmsghdr*)r->rcx;
+	unsigned vlen = r->rdx;
+	int flags = r->rsi;
+
+	if(vlen > MMSG_MAX) vlen = MMSG_MAX;
+
+	if(!Memory::CheckUsermodePointer(r->rcx, sizeof(mmsghdr) * vlen, proc->addressSpace)){
+		return -EFAULT;
+	}
+
+	Socket* sock = (Socket*)handle->node;
+	uint8_t* gather = nullptr;
+	iovec* iov = (iovec*)kmalloc(sizeof(iovec) * IOV_MAX);
+
+	long sent = 0;
+	for(; sent < vlen; sent++){
+		msghdr msg;
+
+		long ret = CopyMessage(&msgvec[sent].hdr, msg, iov, proc);
+		if(ret >= 0){
+			if(msg.iovlen == 1){
+				ret = sock->SendTo(iov[0].base, iov[0].len, flags, (sockaddr*)msg.name, msg.namelen);
+			} else if(ret > 0xFFFF){
+				ret = -EMSGSIZE;
+			} else {
+				if(!gather) gather = (uint8_t*)kmalloc(0xFFFF);
+
+				size_t offset = 0;
+				for(unsigned i = 0; i < msg.iovlen; i++){
+					memcpy(gather + offset, iov[i].base, iov[i].len);
+					offset += iov[i].len;
+				}
+
+				ret = sock->SendTo(gather, offset, flags, (sockaddr*)msg.name, msg.namelen);
+			}
+		}
+
+		if(ret < 0){
+			if(!sent){
+				sent = ret; // Only report an error if nothing got sent
+			}
+			break;
+		}
+
+		msgvec[sent].len = ret;
+	}
+
+	if(gather) kfree(gather);
+	kfree(iov);
+
+	return sent;
+}
+
+/////////////////////////////
+/// \brief SysRecvMMsg (sockfd, msgvec, vlen, flags) Receive several messages from a socket with one syscall
+///
+/// Waits for the first message unless flags contains MSG_DONTWAIT, after that only messages that are already queued are returned.
+/// Each message receives one datagram.
+///
+/// \param sockfd Socket file descriptor
+/// \param msgvec Array of mmsghdr, len is set to the amount of bytes received and name to the sender
+/// \param vlen Amount of messages, at most MMSG_MAX
+/// \param flags Flags passed to every receive
+///
+/// \return On Success - Amount of messages received
+/// \return On Failure - Negative error code if nothing was received
+/////////////////////////////
+long SysRecvMMsg(regs64_t* r){
+	process_t* proc = Scheduler::GetCurrentProcess();
+
+	if(r->rbx >= proc->fileDescriptors.get_length()){
+		return -EBADF;
+	}
+
+	fs_fd_t* handle = proc->fileDescriptors.get_at(r->rbx);
+	if(!handle){
+		return -EBADF;
+	}
+
+	if((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET){
+		return -ENOTSOCK;
+	}
+
+	mmsghdr* msgvec = (mmsghdr*)r->rcx;
+	unsigned vlen = r->rdx;
+	int flags = r->rsi;
+
+	if(vlen > MMSG_MAX) vlen = MMSG_MAX;
+
+	if(!Memory::CheckUsermodePointer(r->rcx, sizeof(mmsghdr) * vlen, proc->addressSpace)){
+		return -EFAULT;
+	}
+
+	Socket* sock = (Socket*)handle->node;
+	uint8_t* scatter = nullptr;
+	iovec* iov = (iovec*)kmalloc(sizeof(iovec) * IOV_MAX);
+
+	long received = 0;
+	for(; received < vlen; received++){
+		msghdr msg;
+		int msgFlags = received ? (flags | MSG_DONTWAIT) : flags;
+
+		long ret = CopyMessage(&msgvec[received].hdr, msg, iov, proc);
+		if(ret >= 0){
+			sockaddr* name = (sockaddr*)msg.name;
+			socklen_t* namelen = name ? &msg.namelen : nullptr;
+
+			if(msg.iovlen == 1){
+				ret = sock->ReceiveFrom(iov[0].base, iov[0].len, msgFlags, name, namelen);
+			} else {
+				if(!scatter) scatter = (uint8_t*)kmalloc(0xFFFF);
+
+				size_t size = (ret > 0xFFFF) ? 0xFFFF : ret;
+				ret = sock->ReceiveFrom(scatter, size, msgFlags & ~MSG_TRUNC, name, namelen);
+
+				size_t offset = 0;
+				for(unsigned i = 0; ret > 0 && i < msg.iovlen && offset < (size_t)ret; i++){
+					size_t count = ((size_t)ret - offset < iov[i].len) ? (ret - offset) : iov[i].len;
+					memcpy(iov[i].base, scatter + offset, count);
+					offset += count;
+				}
+			}
+
+			if(ret >= 0 && name){
+				msgvec[received].hdr.namelen = msg.namelen;
+			}
+		}
+
+		if(ret < 0){
+			if(!received){
+				received = ret;
+			}
+			break;
+		}
+
+		msgvec[received].len = ret;
+	}
+
+	if(scatter) kfree(scatter);
+	kfree(iov);
+
+	return received;
+}
+
 syscall_t syscalls[]{
 	SysDebug,
 	SysExit,					// 1
@@ -2249,6 +2971,17 @@ syscall_t syscalls[]{
 	SysGetFileStatusFlags,
 	SysSetFileStatusFlags,
 	SysSelect,
+	SysSetScheduling,
+	SysEPollCreate,
+	SysEPollCtl,
+	SysEPollWait,
+	SysReadDirBatch,			// 80
+	SysMapFile,
+	SysFork,
+	SysSetSocketOptions,
+	SysGetSocketOptions,
+	SysSendMMsg,				// 85
+	SysRecvMMsg,
 };
 
 int lastSyscall = 0;
@@ -2260,11 +2993,38 @@ void SyscallHandler(regs64_t* regs) {
 
 	if(!syscalls[regs->rax]) return;
 
-	acquireLock(&GetCPULocal()->currentThread->lock);
+	acquireLock(&GetCurrentThread()->lock);
 	regs->rax = syscalls[regs->rax](regs); // Call syscall
-	releaseLock(&GetCPULocal()->currentThread->lock);
+	releaseLock(&GetCurrentThread()->lock);
+}
+
+// Called from syscall_entry (syscall.asm)
+extern "C" void syscall_handler(regs64_t* regs){
+	SyscallHandler(regs);
+}
+
+extern "C" void syscall_entry();
+
+void InitializeFastSyscalls(){
+	uint32_t low;
+	uint32_t high;
+
+	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(MSR_EFER));
+	asm volatile("wrmsr" :: "a"(low | EFER_SCE), "d"(high), "c"(MSR_EFER));
+
+	// SYSCALL loads CS from STAR[47:32] and SS from STAR[47:32] + 8,
+	// SYSRET loads SS from STAR[63:48] + 8 and CS from STAR[63:48] + 16
+	uint64_t star = (static_cast<uint64_t>(KERNEL_CS) << 32) | (static_cast<uint64_t>(USER_SS - 8) << 48);
+	asm volatile("wrmsr" :: "a"(star & 0xFFFFFFFF), "d"(star >> 32), "c"(MSR_STAR));
+
+	uint64_t entry = reinterpret_cast<uintptr_t>(syscall_entry);
+	asm volatile("wrmsr" :: "a"(entry & 0xFFFFFFFF), "d"(entry >> 32), "c"(MSR_LSTAR));
+
+	asm volatile("wrmsr" :: "a"(SYSCALL_FLAG_MASK), "d"(0), "c"(MSR_SFMASK)); // Disable interrupts until we are on the kernel stack
 }
 
 void InitializeSyscalls() {
 	IDT::RegisterInterruptHandler(0x69, SyscallHandler);
-}
\ No newline at end of file
+
+	InitializeFastSyscalls(); // Other processors set up SYSCALL when they start
+}
\ No newline at end of file
@@ -8,88 +8,74 @@
 #include <cpu.h>
 #include <logging.h>
 
-namespace Timer{
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATION_MS 50
 
-    int frequency; // Timer frequency
-    int ticks = 0; // Timer tick counter
-    long long uptime = 0; // System uptime in seconds since the timer was initialized
+#define MSR_TSC_DEADLINE 0x6E0
 
-    struct SleepCounter{
-        thread_t* thread;
-        long ticksLeft;
-    };
+#define LOCAL_TIMER_CALIBRATION_MS 10
 
-    lock_t sleepQueueLock = 0; // Prevent deadlocks
+namespace Timer{
 
-    // In the sleep queue, all waiting threads have a counter as an offset from the previous waiting thread.
-    // For example there are 2 threads, thread 1 is waiting for 10 ticks and thread 2 is waiting for 15 ticks.
-    // Thread 1's ticks value will be 10, and as 15 - 10 is 5, thread 2's value will be 5 so it waits 5 ticks after thread 1
-    List<SleepCounter> sleeping;
+    int frequency; // Scheduler tick frequency
 
-    class SleepBlocker : public Scheduler::ThreadBlocker {
-        private:
-            long ticks = 0;
-        public:
-        SleepBlocker(long ticks){
-            this->ticks = ticks;
-        }
+    uint64_t tscFrequency = 0; // TSC ticks per second
+    uint64_t tscBase = 0; // TSC value at boot
+    uint64_t tscToNs = 0; // Nanoseconds per TSC tick as a 32.32 fixed point value
+    uint64_t nsToTSC = 0; // TSC ticks per nanosecond as a 32.32 fixed point value
 
-        void Block(thread_t* thread) final {
-            if(!sleeping.get_length()){
-                sleeping.add_back({.thread = thread, .ticksLeft = ticks}); // No sleeping threads in queue, just add
-                return;
-            }
+    bool useTSCDeadline = false; // Program deadlines directly in TSC ticks instead of counting down the local APIC timer
+    uint64_t nsToAPICTicks = 0; // Local APIC timer ticks per nanosecond as a 32.32 fixed point value
 
-            long total = 0;
-            for(unsigned i = 0; i < sleeping.get_length(); i++){
-                if(total + sleeping[i].ticksLeft >= ticks){ // See if we need to insert in middle of queue
-                    ticks -= total;
-                    sleeping[i].ticksLeft -= ticks;
-                    sleeping.insert({.thread = thread, .ticksLeft = ticks}, i);
-                    return;
-                }
+    uint64_t tickPeriod; // Nanoseconds between scheduler ticks
 
-                total += sleeping[i].ticksLeft;
-            }
+    struct LocalTimer{
+        lock_t lock = 0;
+        TimerEvent* root = nullptr; // Event with the earliest deadline
 
-            sleeping.add_back({.thread = thread, .ticksLeft = ticks - sleeping.get_back().ticksLeft}); // Add to back
-        }
+        bool tick = true; // Whether the processor wants scheduler ticks
+        uint64_t nextTick = 0;
+    };
 
-        void Remove(thread_t* thread) final {
-            for(auto it = sleeping.begin(); it != sleeping.end(); it++){
-                SleepCounter& cnt = *it;
-                if(cnt.thread == thread){
-                    auto next = it;
-                    next++;
+    LocalTimer localTimers[256]; // Indexed by processor ID
 
-                    next->ticksLeft += cnt.ticksLeft;
+    static inline uint64_t ReadTSC(){
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
 
-                    sleeping.remove(it);
-                }
-            }
-        }
-    };
+        return (static_cast<uint64_t>(high) << 32) | low;
+    }
+
+    static inline uint64_t MulShift32(uint64_t value, uint64_t mult){
+        return (static_cast<unsigned __int128>(value) * mult) >> 32;
+    }
+
+    uint64_t GetSystemUptimeNs(){
+        return MulShift32(ReadTSC() - tscBase, tscToNs);
+    }
 
     uint64_t GetSystemUptime(){
-        return uptime;
+        return GetSystemUptimeNs() / 1000000000;
     }
 
     uint32_t GetTicks(){
-        return ticks;
+        return (GetSystemUptimeNs() % 1000000000) / tickPeriod;
     }
 
-    uint32_t GetFrequency(){
-        return frequency;
+    uint64_t GetSystemTicks(){
+        return GetSystemUptimeNs() / tickPeriod;
     }
 
-    inline uint64_t MsToTicks(long ms){
-        return ms * frequency / 1000;
+    uint32_t GetFrequency(){
+        return frequency;
     }
 
     timeval_t GetSystemUptimeStruct(){
+        uint64_t ns = GetSystemUptimeNs();
+
         timeval_t tval;
-        tval.seconds = uptime;
-        tval.milliseconds = ticks * 1000 / frequency;
+        tval.seconds = ns / 1000000000;
+        tval.milliseconds = (ns % 1000000000) / 1000000;
         return tval;
     }
 
@@ -100,60 +86,348 @@ namespace Timer{
         return seconds * 1000 + milliseconds;
     }
 
-    void SleepCurrentThread(timeval_t& time){
-        long ticks = time.seconds * frequency + MsToTicks(time.milliseconds);
-        SleepCurrentThread(ticks);
+    void Wait(long ms){
+        uint64_t end = GetSystemUptimeNs() + ms * 1000000;
+
+        while(GetSystemUptimeNs() < end){
+            asm("pause");
+        }
     }
 
-    void Wait(long ms){
-        uint64_t ticksPerMs = (Timer::GetFrequency() / 1000);
-        uint64_t timeMs = Timer::GetSystemUptime() * 1000 + (Timer::GetTicks() * ticksPerMs);
-    
-        while((Timer::GetSystemUptime() * 1000 + (Timer::GetTicks() * ticksPerMs)) - timeMs <= ms);
+    // Pairing heap, inserts are O(1) and removals are O(log n) amortized without needing to allocate anything
+    static TimerEvent* Meld(TimerEvent* a, TimerEvent* b){
+        if(!a) return b;
+        if(!b) return a;
+
+        if(b->deadline < a->deadline){
+            TimerEvent* temp = a;
+            a = b;
+            b = temp;
+        }
+
+        // b becomes the first child of a
+        b->prev = a;
+        b->sibling = a->child;
+        if(a->child){
+            a->child->prev = b;
+        }
+        a->child = b;
+
+        return a;
+    }
+
+    static TimerEvent* MergePairs(TimerEvent* first){
+        TimerEvent* pairs = nullptr; // Linked in reverse through sibling
+
+        // Meld the children in pairs from left to right
+        while(first){
+            TimerEvent* a = first;
+            TimerEvent* b = a->sibling;
+            first = b ? b->sibling : nullptr;
+
+            a->sibling = a->prev = nullptr;
+            if(b){
+                b->sibling = b->prev = nullptr;
+            }
+
+            a = Meld(a, b);
+            a->sibling = pairs;
+            pairs = a;
+        }
+
+        // Then meld the pairs from right to left
+        TimerEvent* root = nullptr;
+        while(pairs){
+            TimerEvent* next = pairs->sibling;
+            pairs->sibling = nullptr;
+
+            root = Meld(root, pairs);
+            pairs = next;
+        }
+
+        return root;
+    }
+
+    static void Unlink(LocalTimer& timer, TimerEvent* event){
+        if(event == timer.root){
+            timer.root = MergePairs(event->child);
+        } else {
+            if(event->prev->child == event){
+                event->prev->child = event->sibling;
+            } else {
+                event->prev->sibling = event->sibling;
+            }
+
+            if(event->sibling){
+                event->sibling->prev = event->prev;
+            }
+
+            timer.root = Meld(timer.root, MergePairs(event->child));
+        }
+
+        if(timer.root){
+            timer.root->prev = nullptr;
+        }
+
+        event->child = event->sibling = event->prev = nullptr;
+
+        // This has to be the last access to the event, once RemoveTimer sees it the owner is free to destroy the event
+        __atomic_store_n(&event->cpu, -1, __ATOMIC_RELEASE);
+    }
+
+    // Program the local APIC timer for the next event or tick, timer.lock must be held
+    static void Arm(LocalTimer& timer){
+        uint64_t deadline = UINT64_MAX;
+        if(timer.root){
+            deadline = timer.root->deadline;
+        }
+
+        if(timer.tick && timer.nextTick < deadline){
+            deadline = timer.nextTick;
+        }
+
+        if(useTSCDeadline){
+            uint64_t tsc = (deadline == UINT64_MAX) ? 0 : tscBase + MulShift32(deadline, nsToTSC); // Writing 0 disarms the timer
+
+            asm volatile("wrmsr" :: "a"(tsc & 0xFFFFFFFF), "d"(tsc >> 32), "c"(MSR_TSC_DEADLINE));
+            return;
+        }
+
+        uint64_t count = 0; // An initial count of 0 stops the timer
+        if(deadline != UINT64_MAX){
+            uint64_t now = GetSystemUptimeNs();
+            count = (deadline > now) ? MulShift32(deadline - now, nsToAPICTicks) : 0;
+
+            if(count < 1){
+                count = 1;
+            } else if(count > UINT32_MAX){
+                count = UINT32_MAX; // We will wake up early and rearm
+            }
+        }
+
+        APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, count);
+    }
+
+    void AddTimer(TimerEvent* event){
+        CPU* cpu = GetCPULocal();
+        LocalTimer& timer = localTimers[cpu->id];
+
+        acquireLock(&timer.lock);
+
+        event->child = event->sibling = event->prev = nullptr;
+        event->cpu = cpu->id;
+
+        timer.root = Meld(timer.root, event);
+
+        if(timer.root == event){
+            Arm(timer); // New earliest deadline
+        }
+
+        releaseLock(&timer.lock);
+    }
+
+    bool RemoveTimer(TimerEvent* event){
+        int intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        int cpu = __atomic_load_n(&event->cpu, __ATOMIC_ACQUIRE);
+        if(cpu < 0){
+            if(intsEnabled) asm("sti");
+            return false; // Not queued, or the handler has fired it and is done with it
+        }
+
+        LocalTimer& timer = localTimers[cpu];
+        acquireLock(&timer.lock);
+
+        bool removed = false;
+        if(event->cpu == cpu){ // Make sure it didn't fire whilst we were waiting on the lock
+            Unlink(timer, event);
+            removed = true;
+        }
+
+        // The queue may belong to another processor, in which case it wakes up early and rearms itself
+        releaseLock(&timer.lock);
+
+        if(intsEnabled) asm("sti");
+        return removed;
+    }
+
+    class SleepBlocker : public Scheduler::ThreadBlocker {
+        public:
+        TimerEvent event;
+
+        SleepBlocker(uint64_t deadline){
+            event.deadline = deadline;
+        }
+
+        void Block(thread_t* thread) final {
+            event.thread = thread;
+            AddTimer(&event);
+        }
+
+        void Remove(thread_t* thread) final {
+            RemoveTimer(&event);
+        }
+    };
+
+    void SleepCurrentThreadNs(uint64_t ns){
+        SleepBlocker blocker = SleepBlocker(GetSystemUptimeNs() + ns);
+        Scheduler::BlockCurrentThread(blocker);
+    }
+
+    void SleepCurrentThread(timeval_t& time){
+        SleepCurrentThreadNs(time.seconds * 1000000000 + time.milliseconds * 1000000);
     }
 
     void SleepCurrentThread(long ticks){
-        SleepBlocker blocker = SleepBlocker(ticks);
-        Scheduler::BlockCurrentThread(blocker, sleepQueueLock);
+        SleepCurrentThreadNs(ticks * tickPeriod);
+    }
+
+    void SetLocalTick(bool tick){
+        LocalTimer& timer = localTimers[GetCPULocal()->id];
+
+        if(tick == timer.tick){
+            return;
+        }
+
+        acquireLock(&timer.lock);
+
+        timer.tick = tick;
+        if(tick){
+            timer.nextTick = GetSystemUptimeNs() + tickPeriod;
+        }
+
+        Arm(timer);
+
+        releaseLock(&timer.lock);
     }
 
-    // Timer handler
+    // Local APIC timer handler
     void Handler(regs64_t *r) {
-        ticks++;
-        if(ticks >= frequency){
-            uptime++;
-            ticks -= frequency;
+        LocalTimer& timer = localTimers[GetCPULocal()->id];
+        uint64_t now = GetSystemUptimeNs();
+
+        bool reschedule = false;
+
+        acquireLock(&timer.lock);
+
+        while(timer.root && timer.root->deadline <= now){
+            TimerEvent* event = timer.root;
+            thread_t* thread = event->thread; // Events can live on the stack of the thread, don't touch it once it is unlinked
+            Unlink(timer, event);
+
+            Scheduler::UnblockThread(thread);
+            reschedule = true; // Don't make a thread we just woke wait for the next tick
         }
 
-        if(sleeping.get_length() && !(acquireTestLock(&sleepQueueLock))){
-            sleeping.get_front().ticksLeft--;
+        if(timer.tick && timer.nextTick <= now){
+            timer.nextTick = now + tickPeriod;
+            reschedule = true;
+        }
 
-            while(sleeping.get_length() && sleeping.get_front().ticksLeft <= 0){
-                Scheduler::UnblockThread(sleeping.remove_at(0).thread);
-            }
+        Arm(timer); // Schedule may not return so do this first
 
-            releaseLock(&sleepQueueLock);
+        releaseLock(&timer.lock);
+
+        if(reschedule){
+            Scheduler::Tick(r);
         }
+    }
 
-        Scheduler::Tick(r);
+    // Busy wait on PIT channel 2 to find out how fast the TSC runs
+    static uint64_t CalibrateTSC(){
+        uint16_t count = PIT_FREQUENCY * PIT_CALIBRATION_MS / 1000;
+
+        outportb(0x61, (inportb(0x61) & ~0x02) | 0x01); // Enable the channel 2 gate, disconnect the speaker
+
+        outportb(0x43, 0xB0); // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+        outportb(0x42, count & 0xFF);
+        outportb(0x42, count >> 8);
+
+        uint64_t start = ReadTSC();
+        while(!(inportb(0x61) & 0x20)); // Output goes high once the count reaches 0
+        uint64_t end = ReadTSC();
+
+        return (end - start) * 1000 / PIT_CALIBRATION_MS;
     }
 
     // Initialize
     void Initialize(uint32_t freq) {
-        IDT::RegisterInterruptHandler(IRQ0, Handler);
-
         frequency = freq;
-        uint32_t divisor = 1193182 / freq;
+        tickPeriod = 1000000000 / freq;
+
+        int intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        // Stop the PIT from interrupting, mode 0 without a reload raises IRQ0 once and we mask it before that happens.
+        // The local APIC timers take over once they are up.
+        outportb(0x21, inportb(0x21) | 0x01);
+        outportb(0x43, 0x30); // Channel 0, lobyte/hibyte, mode 0
+        outportb(0x40, 1);
+        outportb(0x40, 0);
+
+        tscFrequency = CalibrateTSC();
+        tscBase = ReadTSC();
+
+        tscToNs = (1000000000ULL << 32) / tscFrequency;
+        nsToTSC = (tscFrequency << 32) / 1000000000ULL;
 
-        // Send the command byte.
-        outportb(0x43, 0x36);
+        if(intsEnabled) asm("sti");
+
+        uint32_t edx;
+        asm volatile("cpuid" : "=d"(edx) : "a"(0x80000007) : "ebx", "ecx");
+        if(!(edx & (1 << 8))){
+            Log::Warning("[Timer] TSC is not invariant, timekeeping may drift if the processor changes frequency");
+        }
+
+        Log::Info("[Timer] TSC Frequency: %d MHz", tscFrequency / 1000000);
+    }
+
+    void InitializeLocalTimers(){
+        IDT::RegisterInterruptHandler(IRQ_LOCAL_TIMER, Handler);
+
+        if(CPUID().features_ecx & CPUID_ECX_TSC_DEADLINE){
+            useTSCDeadline = true;
+
+            Log::Info("[Timer] Using TSC-deadline mode");
+            return;
+        }
+
+        // Count how many local APIC timer ticks pass against the TSC
+        APIC::Local::Write(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+        APIC::Local::Write(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_LVT_MASKED | LOCAL_APIC_TIMER_MODE_ONE_SHOT);
+        APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, UINT32_MAX);
+
+        Wait(LOCAL_TIMER_CALIBRATION_MS);
+
+        uint64_t elapsed = UINT32_MAX - APIC::Local::Read(LOCAL_APIC_TIMER_CURRENT_COUNT);
+        APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, 0);
+
+        uint64_t apicFrequency = elapsed * 1000 / LOCAL_TIMER_CALIBRATION_MS;
+        nsToAPICTicks = (apicFrequency << 32) / 1000000000ULL;
+
+        Log::Info("[Timer] Local APIC Timer Frequency: %d kHz", apicFrequency / 1000);
+    }
+
+    void EnableLocalTimer(){
+        asm("cli");
+
+        LocalTimer& timer = localTimers[GetCPULocal()->id];
+
+        if(useTSCDeadline){
+            APIC::Local::Write(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_TIMER_MODE_TSC_DEADLINE | IRQ_LOCAL_TIMER);
+            asm volatile("mfence" ::: "memory"); // Make sure the LVT write lands before the deadline MSR is written
+        } else {
+            APIC::Local::Write(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+            APIC::Local::Write(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_TIMER_MODE_ONE_SHOT | IRQ_LOCAL_TIMER);
+        }
 
-        // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-        uint8_t l = (uint8_t)(divisor & 0xFF);
-        uint8_t h = (uint8_t)( (divisor>>8) & 0xFF );
+        acquireLock(&timer.lock);
+        timer.tick = true; // Tick until the scheduler tells us otherwise
+        timer.nextTick = GetSystemUptimeNs() + tickPeriod;
+        Arm(timer);
+        releaseLock(&timer.lock);
 
-        // Send the frequency divisor.
-        outportb(0x40, l);
-        outportb(0x40, h);
+        asm("sti");
     }
 }
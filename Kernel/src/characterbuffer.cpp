@@ -68,7 +68,7 @@ size_t CharacterBuffer::Read(char* _buffer, size_t count){
         if(buffer[i] == '\n') lines--;
     }
 
-    for(unsigned i = 0; i < bufferSize - count; i++){
+    for(unsigned i = 0; i < bufferPos - count; i++){
         buffer[i] = buffer[count + i];
     }
 
@@ -0,0 +1,518 @@
+#include <fs/blockcache.h>
+
+#include <scheduler.h>
+#include <timer.h>
+#include <logging.h>
+#include <string.h>
+
+namespace fs{
+    List<BlockCache*>* blockCaches = nullptr;
+    Semaphore blockCachesLock = Semaphore(1); // Sleeping lock, held by the cache thread while it does disk I/O
+    Semaphore blockCacheWork = Semaphore(0); // Signalled when read-ahead is queued
+
+    // Does read-ahead as it is queued and writes back dirty blocks every BLOCK_CACHE_FLUSH_INTERVAL
+    void BlockCacheThread(){
+        uint64_t nextFlush = Timer::GetSystemUptimeNs() + BLOCK_CACHE_FLUSH_INTERVAL * 1000000ULL;
+
+        for(;;){
+            uint64_t now = Timer::GetSystemUptimeNs();
+            if(now < nextFlush){
+                blockCacheWork.WaitTimeout((nextFlush - now) / 1000);
+            }
+
+            blockCachesLock.Wait();
+            for(BlockCache* cache : *blockCaches){
+                cache->RunPrefetches();
+            }
+
+            if(Timer::GetSystemUptimeNs() >= nextFlush){
+                for(BlockCache* cache : *blockCaches){
+                    if(cache->dirtyCount){
+                        cache->Flush();
+                    }
+                }
+
+                nextFlush = Timer::GetSystemUptimeNs() + BLOCK_CACHE_FLUSH_INTERVAL * 1000000ULL;
+            }
+            blockCachesLock.Signal();
+        }
+    }
+
+    BlockCache::BlockCache(PartitionDevice* part, uint32_t blockSize, size_t maxSize){
+        this->part = part;
+        this->blockSize = blockSize;
+        lbaPerBlock = blockSize / part->parentDisk->blocksize;
+
+        capacity = maxSize / blockSize;
+        if(capacity < 16) capacity = 16;
+
+        entries = new CachedBlock[capacity];
+
+        blockCachesLock.Wait();
+        if(!blockCaches){
+            blockCaches = new List<BlockCache*>();
+
+            process_t* thread = Scheduler::CreateProcess((void*)BlockCacheThread);
+            strcpy(thread->name, "KeBlockCache");
+        }
+        blockCaches->add_back(this);
+        blockCachesLock.Signal();
+    }
+
+    BlockCache::~BlockCache(){
+        blockCachesLock.Wait(); // Waits for the cache thread to be done with us
+        blockCaches->remove(this);
+        blockCachesLock.Signal();
+
+        Flush();
+
+        for(unsigned i = 0; i < capacity; i++){
+            if(entries[i].data){
+                kfree(entries[i].data);
+            }
+        }
+
+        delete[] entries;
+    }
+
+    BlockCache::CachedBlock* BlockCache::Lookup(uint32_t block){
+        return index.get(block);
+    }
+
+    // Sleep until an I/O in progress finishes, lock must be held and is held again on return
+    void BlockCache::WaitForIO(){
+        Semaphore done = Semaphore(0);
+        ioWaiters.add_back(&done);
+
+        releaseLock(&lock);
+        done.Wait();
+        acquireLock(&lock); // Signalled with the lock held, so done is no longer used once we have it
+    }
+
+    // Wake everyone waiting for a busy entry, lock must be held
+    void BlockCache::WakeIOWaiters(){
+        while(ioWaiters.get_length()){
+            ioWaiters.remove_at(0)->Signal();
+        }
+    }
+
+    // Get the entry of a block that is not busy, or if it is not cached an entry to read it into.
+    // Lock must be held, it may be dropped while waiting for disk I/O.
+    BlockCache::CachedBlock* BlockCache::Get(uint32_t block, bool& found){
+        for(;;){
+            if(CachedBlock* entry = Lookup(block)){
+                if(entry->busy){
+                    WaitForIO();
+                    continue;
+                }
+
+                found = true;
+                return entry;
+            }
+
+            if(CachedBlock* entry = Evict()){
+                found = false;
+                return entry;
+            } // Otherwise the lock was dropped, look again
+        }
+    }
+
+    // Find an entry to reuse, lock must be held.
+    // Returns nullptr if the lock had to be dropped to write a block back or wait for busy entries.
+    BlockCache::CachedBlock* BlockCache::Evict(){
+        for(unsigned i = 0; i < capacity * 2; i++){ // Twice round so every entry loses its second chance
+            CachedBlock* entry = &entries[clockHand];
+            clockHand = (clockHand + 1) % capacity;
+
+            if(entry->busy){
+                continue;
+            }
+
+            if(!entry->valid){
+                if(!entry->data){
+                    entry->data = (uint8_t*)kmalloc(blockSize);
+                }
+                return entry;
+            }
+
+            if(entry->referenced){ // Give it a second chance
+                entry->referenced = false;
+                continue;
+            }
+
+            if(entry->dirty){
+                if(int e = WriteBack(entry); e && entry->dirty){
+                    // The cache has the only copy so keep it, pass it over this time round and let Flush() report the error
+                    Log::Error("[BlockCache] Disk error (%d) writing back block %d", e, entry->block);
+                    entry->referenced = true;
+                    writeError = e;
+                }
+
+                return nullptr;
+            }
+
+            index.remove(entry->block);
+            entry->valid = false;
+            return entry;
+        }
+
+        WaitForIO(); // Everything is busy
+        return nullptr;
+    }
+
+    // Write a dirty entry to disk, lock must be held and is dropped for the write.
+    // The entry stays dirty (and so can't be dropped) until the write has completed.
+    int BlockCache::WriteBack(CachedBlock* entry){
+        entry->busy = true;
+        releaseLock(&lock);
+
+        int e = part->Write(static_cast<uint64_t>(entry->block) * lbaPerBlock, blockSize, entry->data);
+
+        acquireLock(&lock);
+        entry->busy = false;
+
+        if(!e){
+            entry->dirty = false;
+            dirtyCount--;
+            writebacks++;
+        }
+
+        WakeIOWaiters();
+        return e;
+    }
+
+    int BlockCache::Read(uint32_t block, void* buffer){
+        acquireLock(&lock);
+
+        bool found;
+        CachedBlock* entry = Get(block, found);
+        if(found){
+            hits++;
+        } else {
+            misses++;
+
+            entry->block = block;
+            entry->valid = true;
+            entry->dirty = false;
+            entry->busy = true;
+            index.insert(block, entry);
+
+            releaseLock(&lock);
+            int e = part->Read(static_cast<uint64_t>(block) * lbaPerBlock, blockSize, entry->data);
+            acquireLock(&lock);
+
+            entry->busy = false;
+            WakeIOWaiters();
+
+            if(e){
+                index.remove(block);
+                entry->valid = false;
+
+                releaseLock(&lock);
+                return e;
+            }
+        }
+
+        entry->referenced = true;
+        memcpy(buffer, entry->data, blockSize);
+
+        releaseLock(&lock);
+        return 0;
+    }
+
+    int BlockCache::Write(uint32_t block, void* buffer){
+        acquireLock(&lock);
+
+        bool found;
+        CachedBlock* entry = Get(block, found);
+        if(!found){ // The whole block gets overwritten so there is no need to read it first
+            entry->block = block;
+            entry->valid = true;
+            entry->dirty = false;
+            index.insert(block, entry);
+        }
+
+        memcpy(entry->data, buffer, blockSize);
+        entry->referenced = true;
+
+        if(!entry->dirty){
+            entry->dirty = true;
+            dirtyCount++;
+        }
+
+        releaseLock(&lock);
+        return 0;
+    }
+
+    int BlockCache::ReadUncached(uint32_t block, void* buffer){
+        acquireLock(&lock);
+
+        CachedBlock* entry;
+        while((entry = Lookup(block)) && entry->busy){
+            WaitForIO();
+        }
+
+        if(entry){
+            hits++;
+            memcpy(buffer, entry->data, blockSize);
+
+            releaseLock(&lock);
+            return 0;
+        }
+
+        releaseLock(&lock);
+        return part->Read(static_cast<uint64_t>(block) * lbaPerBlock, blockSize, buffer);
+    }
+
+    int BlockCache::ReadBlocks(uint32_t block, unsigned count, void* buffer){
+        uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+
+        while(count){
+            acquireLock(&lock);
+
+            CachedBlock* entry;
+            while(count && (entry = Lookup(block))){ // Anything cached may be newer than what is on disk
+                if(entry->busy){
+                    WaitForIO();
+                    continue;
+                }
+
+                memcpy(out, entry->data, blockSize);
+                entry->referenced = true;
+                hits++;
+
+                block++;
+                count--;
+                out += blockSize;
+            }
+
+            if(!count){
+                releaseLock(&lock);
+                break;
+            }
+
+            unsigned run = 1;
+            while(run < count && !Lookup(block + run)){
+                run++;
+            }
+
+            misses += run;
+            releaseLock(&lock);
+
+            if(int e = part->Read(static_cast<uint64_t>(block) * lbaPerBlock, run * blockSize, out)){
+                return e;
+            }
+
+            // Blocks written into the cache while we were reading are newer than what we got from disk
+            acquireLock(&lock);
+            for(unsigned i = 0; i < run; i++){
+                CachedBlock* entry;
+                while((entry = Lookup(block + i)) && entry->busy){
+                    WaitForIO();
+                }
+
+                if(entry){
+                    memcpy(out + i * blockSize, entry->data, blockSize);
+                }
+            }
+            releaseLock(&lock);
+
+            block += run;
+            count -= run;
+            out += run * blockSize;
+        }
+
+        return 0;
+    }
+
+    void BlockCache::Prefetch(uint32_t block, unsigned count){
+        if(count > capacity / 4){
+            count = capacity / 4; // Don't let read-ahead push everything else out
+        }
+
+        acquireLock(&lock);
+        if(prefetchCount >= BLOCK_CACHE_PREFETCH_QUEUE){
+            releaseLock(&lock);
+            return; // Read-ahead is only a hint
+        }
+
+        prefetchQueue[(prefetchHead + prefetchCount++) % BLOCK_CACHE_PREFETCH_QUEUE] = {block, count};
+        releaseLock(&lock);
+
+        blockCacheWork.Signal();
+    }
+
+    void BlockCache::RunPrefetches(){
+        acquireLock(&lock);
+        while(prefetchCount){
+            PrefetchRequest request = prefetchQueue[prefetchHead];
+            prefetchHead = (prefetchHead + 1) % BLOCK_CACHE_PREFETCH_QUEUE;
+            prefetchCount--;
+
+            releaseLock(&lock);
+            ReadAhead(request.block, request.count);
+            acquireLock(&lock);
+        }
+        releaseLock(&lock);
+    }
+
+    // Read a run of blocks into the cache
+    void BlockCache::ReadAhead(uint32_t block, unsigned count){
+        CachedBlock** reserved = new CachedBlock*[count];
+
+        // Claim entries for the blocks we don't have, anyone else wanting them waits for the read
+        acquireLock(&lock);
+        for(unsigned i = 0; i < count; i++){
+            bool found;
+            CachedBlock* entry = Get(block + i, found);
+            if(found){
+                reserved[i] = nullptr; // Keep what we have, it may be dirty
+                continue;
+            }
+
+            entry->block = block + i;
+            entry->valid = true;
+            entry->dirty = false;
+            entry->referenced = false; // Evict first if it never gets used
+            entry->busy = true;
+            index.insert(block + i, entry);
+
+            reserved[i] = entry;
+        }
+        releaseLock(&lock);
+
+        uint8_t* buffer = (uint8_t*)kmalloc(count * blockSize);
+        int e = part->Read(static_cast<uint64_t>(block) * lbaPerBlock, count * blockSize, buffer);
+
+        acquireLock(&lock);
+        for(unsigned i = 0; i < count; i++){
+            CachedBlock* entry = reserved[i];
+            if(!entry){
+                continue;
+            }
+
+            entry->busy = false;
+            if(e){ // Read-ahead is only a hint, the actual read will report the error
+                index.remove(entry->block);
+                entry->valid = false;
+                continue;
+            }
+
+            memcpy(entry->data, buffer + i * blockSize, blockSize);
+            readAheads++;
+        }
+
+        WakeIOWaiters();
+        releaseLock(&lock);
+
+        kfree(buffer);
+        delete[] reserved;
+    }
+
+    int BlockCache::WriteThrough(uint32_t block, void* buffer){
+        acquireLock(&lock);
+
+        // Put the new data in the cache and keep it busy until it is on disk, so nobody can read
+        // the old contents from disk in the meantime and no write back of them can land after ours
+        bool found;
+        CachedBlock* entry = Get(block, found);
+        if(!found){
+            entry->block = block;
+            entry->valid = true;
+            entry->dirty = false;
+            index.insert(block, entry);
+        }
+
+        memcpy(entry->data, buffer, blockSize);
+        entry->referenced = true;
+        entry->busy = true;
+
+        releaseLock(&lock);
+
+        int e = part->Write(static_cast<uint64_t>(block) * lbaPerBlock, blockSize, entry->data);
+
+        acquireLock(&lock);
+        entry->busy = false;
+
+        if(!e && entry->dirty){
+            entry->dirty = false;
+            dirtyCount--;
+        } else if(e && !entry->dirty){
+            entry->dirty = true; // The cache has the only copy, write it back later
+            dirtyCount++;
+        }
+
+        WakeIOWaiters();
+        releaseLock(&lock);
+
+        return e;
+    }
+
+    void BlockCache::Invalidate(uint32_t block){
+        acquireLock(&lock);
+
+        CachedBlock* entry;
+        while((entry = Lookup(block)) && entry->busy){
+            WaitForIO();
+        }
+
+        if(entry){
+            index.remove(block);
+
+            if(entry->dirty){
+                dirtyCount--;
+            }
+
+            entry->valid = entry->dirty = entry->referenced = false;
+        }
+
+        releaseLock(&lock);
+    }
+
+    int BlockCache::Flush(uint32_t block){
+        acquireLock(&lock);
+
+        int e = 0;
+        CachedBlock* entry;
+        while((entry = Lookup(block)) && entry->dirty){
+            if(entry->busy){ // Already being written back, wait for it to land
+                WaitForIO();
+                continue;
+            }
+
+            e = WriteBack(entry);
+            break;
+        }
+
+        releaseLock(&lock);
+        return e;
+    }
+
+    int BlockCache::Flush(){
+        acquireLock(&lock);
+
+        int error = writeError;
+        writeError = 0;
+
+        for(unsigned i = 0; i < capacity;){
+            CachedBlock& entry = entries[i];
+
+            if(entry.valid && entry.dirty && entry.busy){ // Already being written back, make sure it has finished before we return
+                WaitForIO();
+                continue;
+            }
+
+            if(entry.valid && entry.dirty){
+                if(int e = WriteBack(&entry)){
+                    Log::Error("[BlockCache] Disk error (%d) writing back block %d", e, entry.block);
+                    error = e; // Still dirty, we try again later
+                }
+            }
+
+            i++;
+        }
+        releaseLock(&lock);
+
+        return error;
+    }
+}
@@ -0,0 +1,194 @@
+#include <fs/dentrycache.h>
+
+#include <hash.h>
+#include <list.h>
+#include <spin.h>
+#include <string.h>
+#include <liballoc.h>
+
+namespace fs::DentryCache{
+    struct Dentry{
+        FsNode* parent;
+        FsNode* node; // nullptr for negative entries
+        char* name;
+        unsigned hash;
+
+        Dentry* chain; // Next in the bucket
+        Dentry* next; // LRU list
+        Dentry* prev;
+    };
+
+    uint64_t hits = 0;
+    uint64_t negativeHits = 0;
+    uint64_t misses = 0;
+
+    lock_t cacheLock = 0;
+    volatile uint64_t generation = 0; // Incremented on every invalidation
+    unsigned changesInProgress = 0; // Nothing is cached while a directory is being changed
+
+    Dentry* buckets[DENTRY_CACHE_BUCKETS];
+    FastList<Dentry*> lru; // Least recently used at the front
+
+    static inline unsigned HashEntry(FsNode* parent, const char* name){
+        return hash(name) ^ hash(static_cast<unsigned>(reinterpret_cast<uintptr_t>(parent) >> 4));
+    }
+
+    // cacheLock must be held
+    static Dentry* Find(FsNode* parent, const char* name, unsigned h){
+        for(Dentry* d = buckets[h % DENTRY_CACHE_BUCKETS]; d; d = d->chain){
+            if(d->hash == h && d->parent == parent && !strcmp(d->name, name)){
+                return d;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Take d out of the cache, cacheLock must be held. The caller frees it with Release() once the lock is dropped.
+    static void Unlink(Dentry* d){
+        Dentry** link = &buckets[d->hash % DENTRY_CACHE_BUCKETS];
+        while(*link != d){
+            link = &(*link)->chain;
+        }
+        *link = d->chain;
+
+        lru.remove(d);
+    }
+
+    // Give back the references taken by Insert and free d.
+    // Only our own reference is dropped, nodes are never closed through the cache as others may hold them without a handle
+    // (e.g. mount points or the result of a lookup). Entries are always dropped before the filesystem removes anything,
+    // so it sees the real handle count.
+    static void Release(Dentry* d){
+        if(d->node){
+            d->node->handleCount--;
+        }
+        d->parent->handleCount--;
+
+        kfree(d->name);
+        delete d;
+    }
+
+    uint64_t Generation(){
+        return generation;
+    }
+
+    bool Lookup(FsNode* parent, const char* name, FsNode*& node){
+        unsigned h = HashEntry(parent, name);
+
+        acquireLock(&cacheLock);
+
+        Dentry* d = Find(parent, name, h);
+        if(!d){
+            misses++;
+            releaseLock(&cacheLock);
+            return false;
+        }
+
+        lru.remove(d);
+        lru.add_back(d);
+
+        node = d->node;
+        if(node){
+            hits++;
+        } else {
+            negativeHits++;
+        }
+
+        releaseLock(&cacheLock);
+        return true;
+    }
+
+    void Insert(FsNode* parent, const char* name, FsNode* node, uint64_t gen){
+        unsigned h = HashEntry(parent, name);
+
+        // Allocate before taking the lock
+        Dentry* d = new Dentry;
+        d->parent = parent;
+        d->node = node;
+        d->hash = h;
+        d->name = strdup(name);
+
+        Dentry* evicted = nullptr;
+
+        acquireLock(&cacheLock);
+
+        if(gen != generation || changesInProgress || Find(parent, name, h)){
+            releaseLock(&cacheLock); // Stale lookup, the directory is changing or someone else got there first
+
+            kfree(d->name);
+            delete d;
+            return;
+        }
+
+        if(lru.get_length() >= DENTRY_CACHE_MAX_ENTRIES){
+            evicted = lru.get_front();
+            Unlink(evicted);
+        }
+
+        parent->handleCount++;
+        if(node){
+            node->handleCount++;
+        }
+
+        d->chain = buckets[h % DENTRY_CACHE_BUCKETS];
+        buckets[h % DENTRY_CACHE_BUCKETS] = d;
+        lru.add_back(d);
+
+        releaseLock(&cacheLock);
+
+        if(evicted){
+            Release(evicted);
+        }
+    }
+
+    void BeginChange(FsNode* parent, const char* name){
+        unsigned h = HashEntry(parent, name);
+        Dentry* dropped = nullptr; // Linked through chain
+
+        acquireLock(&cacheLock);
+        generation++;
+        changesInProgress++;
+
+        Dentry* d = Find(parent, name, h);
+        if(d){
+            Unlink(d);
+            d->chain = nullptr;
+            dropped = d;
+
+            if(d->node && (d->node->flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY){
+                // Anything cached under a directory that has gone away is stale.
+                // Directories are rarely removed so just go through every bucket.
+                for(unsigned i = 0; i < DENTRY_CACHE_BUCKETS; i++){
+                    Dentry* child = buckets[i];
+                    while(child){
+                        Dentry* nextChild = child->chain;
+
+                        if(child->parent == d->node){
+                            Unlink(child);
+                            child->chain = dropped;
+                            dropped = child;
+                        }
+
+                        child = nextChild;
+                    }
+                }
+            }
+        }
+
+        releaseLock(&cacheLock);
+
+        while(dropped){
+            Dentry* next = dropped->chain;
+            Release(dropped);
+            dropped = next;
+        }
+    }
+
+    void EndChange(){
+        acquireLock(&cacheLock);
+        generation++; // Lookups that started during the change may have seen it half done
+        changesInProgress--;
+        releaseLock(&cacheLock);
+    }
+}
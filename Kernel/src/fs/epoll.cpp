@@ -0,0 +1,263 @@
+#include <fs/epoll.h>
+
+#include <timer.h>
+#include <errno.h>
+#include <assert.h>
+
+lock_t EPoll::handlesLock = 0;
+
+void EPollEntry::Signal(){
+    epoll->OnReady(this);
+}
+
+EPoll::EPoll(){
+    flags = FS_NODE_EPOLL;
+}
+
+EPoll::~EPoll(){
+    acquireLock(&handlesLock);
+    acquireLock(&ctlLock);
+    while(entries.get_length()){
+        RemoveEntry(entries.get_front());
+    }
+    releaseLock(&ctlLock);
+    releaseLock(&handlesLock);
+}
+
+void EPoll::OnReady(Entry* entry){
+    acquireLock(&readyLock);
+
+    if(entry->ready || !(entry->events & ~(EPOLLONESHOT | EPOLLET))){
+        releaseLock(&readyLock);
+        return; // Already on the ready list or disabled
+    }
+
+    entry->ready = true;
+    readyList.add_back(entry);
+
+    if(readyList.get_length() == 1){
+        while(watching.get_length()){
+            watching.remove_at(0)->Signal(); // Wake anything waiting on us
+        }
+    }
+
+    releaseLock(&readyLock);
+}
+
+// Register the entry with its node, nodes drop their watchers once they have signalled so this is done every time an entry leaves the ready list.
+// If the node is already ready it will signal straight away. ctlLock must be held.
+void EPoll::Arm(Entry* entry){
+    entry->node->Unwatch(*entry);
+
+    if(entry->events & ~(EPOLLONESHOT | EPOLLET)){
+        entry->node->Watch(*entry, entry->events);
+    }
+}
+
+void EPoll::RemoveEntry(Entry* entry){
+    // Nodes signal their watchers with the same lock Unwatch takes, so once this returns nobody can still be signalling the entry
+    entry->node->Unwatch(*entry);
+
+    for(Entry** link = &entry->handle->epollEntries; *link; link = &(*link)->handleNext){
+        if(*link == entry){
+            *link = entry->handleNext;
+            break;
+        }
+    }
+
+    acquireLock(&readyLock);
+    if(entry->ready){
+        readyList.remove(entry);
+        entry->ready = false;
+    }
+    releaseLock(&readyLock);
+
+    for(auto it = entries.begin(); it != entries.end(); it++){
+        if(*it == entry){
+            entries.remove(it);
+            break;
+        }
+    }
+
+    delete entry;
+}
+
+int EPoll::Control(int op, int fd, fs_fd_t* handle, epoll_event_t* event){
+    if(handle->node == this){
+        return -EINVAL;
+    }
+
+    acquireLock(&handlesLock);
+    acquireLock(&ctlLock);
+
+    Entry* entry = nullptr;
+    for(Entry* e : entries){
+        if(e->fd == fd && e->handle == handle){
+            entry = e;
+            break;
+        }
+    }
+
+    int ret = 0;
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        if(entry){
+            ret = -EEXIST;
+            break;
+        }
+
+        entry = new Entry(this, handle, fd, *event);
+        entries.add_back(entry);
+
+        entry->handleNext = handle->epollEntries;
+        handle->epollEntries = entry;
+
+        Arm(entry);
+        break;
+    case EPOLL_CTL_MOD:
+        if(!entry){
+            ret = -ENOENT;
+            break;
+        }
+
+        acquireLock(&readyLock);
+        if(entry->ready){
+            readyList.remove(entry);
+            entry->ready = false;
+        }
+        entry->events = event->events;
+        entry->data = event->data;
+        releaseLock(&readyLock);
+
+        Arm(entry);
+        break;
+    case EPOLL_CTL_DEL:
+        if(!entry){
+            ret = -ENOENT;
+            break;
+        }
+
+        RemoveEntry(entry);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    releaseLock(&ctlLock);
+    releaseLock(&handlesLock);
+    return ret;
+}
+
+int EPoll::Harvest(epoll_event_t* events, int maxEvents){
+    acquireLock(&ctlLock);
+    acquireLock(&readyLock);
+
+    int count = 0;
+    Entry* rearm = nullptr;
+
+    // Level triggered entries go back on the end of the list, so only look at what is there now
+    for(unsigned i = readyList.get_length(); i > 0 && count < maxEvents; i--){
+        Entry* entry = readyList.get_front();
+        readyList.remove(entry);
+        entry->ready = false;
+
+        int revents = fs::Poll(entry->node, entry->events) & (entry->events | EPOLLHUP | EPOLLERR);
+        if(!revents){
+            entry->rearmNext = rearm; // Not ready after all
+            rearm = entry;
+            continue;
+        }
+
+        events[count].events = revents;
+        events[count].data = entry->data;
+        count++;
+
+        if(entry->events & EPOLLONESHOT){
+            entry->events &= EPOLLONESHOT | EPOLLET; // Disabled until EPOLL_CTL_MOD
+        } else if(entry->events & EPOLLET){
+            entry->rearmNext = rearm;
+            rearm = entry;
+        } else {
+            entry->ready = true; // Level triggered, check it again next time
+            readyList.add_back(entry);
+        }
+    }
+
+    releaseLock(&readyLock);
+
+    // Watch may signal straight away, which needs readyLock
+    while(rearm){
+        Entry* next = rearm->rearmNext;
+        Arm(rearm);
+        rearm = next;
+    }
+
+    releaseLock(&ctlLock);
+
+    return count;
+}
+
+int EPoll::Wait(epoll_event_t* events, int maxEvents, long timeout){
+    uint64_t deadline = Timer::GetSystemUptimeNs() + timeout * 1000000;
+
+    for(;;){
+        int count = Harvest(events, maxEvents);
+        if(count || !timeout){
+            return count;
+        }
+
+        FilesystemWatcher fsWatcher;
+        fsWatcher.WatchNode(this, POLLIN);
+
+        if(timeout < 0){
+            fsWatcher.Wait();
+        } else {
+            uint64_t now = Timer::GetSystemUptimeNs();
+            if(now >= deadline){
+                return 0;
+            }
+
+            fsWatcher.WaitTimeout((deadline - now) / 1000);
+        }
+    }
+}
+
+void EPoll::Close(){
+    if(!(--handleCount)){
+        delete this;
+    }
+}
+
+void EPoll::Watch(FilesystemWatcher& watcher, int events){
+    acquireLock(&readyLock);
+
+    if(readyList.get_length()){
+        releaseLock(&readyLock);
+        watcher.Signal();
+        return;
+    }
+
+    watching.add_back(&watcher);
+    releaseLock(&readyLock);
+}
+
+void EPoll::Unwatch(FilesystemWatcher& watcher){
+    acquireLock(&readyLock);
+    watching.remove(&watcher);
+    releaseLock(&readyLock);
+}
+
+void EPoll::OnHandleClose(fs_fd_t* handle){
+    acquireLock(&handlesLock); // Interest sets can't be destroyed whilst we hold this
+
+    while(Entry* entry = handle->epollEntries){
+        EPoll* epoll = entry->epoll;
+
+        acquireLock(&epoll->ctlLock);
+        epoll->RemoveEntry(entry);
+        releaseLock(&epoll->ctlLock);
+    }
+
+    releaseLock(&handlesLock);
+}
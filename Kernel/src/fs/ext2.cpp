@@ -94,6 +94,8 @@ namespace fs::Ext2{
             inodeSize = 128;
         }
 
+        blockCache = new BlockCache(part, blocksize);
+
         ext2_inode_t root;
         if(ReadInode(EXT2_ROOT_INODE_INDEX, root)){
             Log::Error("[Ext2] Disk Error Initializing Volume");
@@ -115,7 +117,7 @@ namespace fs::Ext2{
         uint8_t buffer[blocksize];
 
         uint32_t superindex = LocationToBlock(EXT2_SUPERBLOCK_LOCATION);
-        if(ReadBlock(superindex, buffer)){
+        if(ReadBlockCached(superindex, buffer)){
             Log::Info("[Ext2] WriteBlock: Error reading block %d", superindex);
             return;
         }
@@ -133,14 +135,14 @@ namespace fs::Ext2{
         uint32_t block = firstBlockGroup + LocationToBlock(index * sizeof(ext2_blockgrp_desc_t));
         uint8_t buffer[blocksize];
         
-        if(ReadBlock(block, buffer)){
+        if(ReadBlockCached(block, buffer)){
             Log::Info("[Ext2] WriteBlock: Error reading block %d", block);
             return;
         }
 
         memcpy(buffer + ((index * sizeof(ext2_blockgrp_desc_t)) % blocksize), &blockGroups[index], sizeof(ext2_blockgrp_desc_t));
         
-        if(WriteBlock(block, buffer)){
+        if(WriteBlockCached(block, buffer)){
             Log::Info("[Ext2] WriteBlock: Error writing block %d", block);
             return;
         }
@@ -336,16 +338,22 @@ namespace fs::Ext2{
     }
 
     int Ext2Volume::ReadInode(uint32_t num, ext2_inode_t& inode){
-        uint8_t buf[part->parentDisk->blocksize];
-        uint64_t lba = InodeLBA(num);
+        uint8_t buf[blocksize];
+
+        int e;
+        if(blockCache){
+            e = ReadBlockCached(InodeBlock(num), buf);
+        } else {
+            e = ReadBlock(InodeBlock(num), buf); // Still mounting, the root inode is read before the cache exists
+        }
 
-        if(int e = part->Read(lba, part->parentDisk->blocksize, buf)){
+        if(e){
             Log::Error("[Ext2] Disk Error (%d) Reading Inode %d", e, num);
             error = DiskReadError;
             return e;
         }
 
-        inode = *(ext2_inode_t*)(buf + (ResolveInodeBlockGroupIndex(num) * inodeSize) % part->parentDisk->blocksize);
+        inode = *(ext2_inode_t*)(buf + InodeBlockOffset(num));
         return 0;
     }
 
@@ -353,7 +361,14 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return -1;
 
-        if(int e = part->Read(BlockToLBA(block), blocksize, buffer)){
+        int e;
+        if(blockCache){
+            e = blockCache->ReadUncached(block, buffer); // Make sure we see any dirty cached copy
+        } else {
+            e = part->Read(BlockToLBA(block), blocksize, buffer);
+        }
+
+        if(e){
             Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
             return e;
         }
@@ -365,8 +380,8 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return -1;
 
-        if(int e = part->Write(BlockToLBA(block), blocksize, buffer)){
-            Log::Error("[Ext2] Disk error (%e) reading block %d (blocksize: %d)", e, block, blocksize);
+        if(int e = blockCache->WriteThrough(block, buffer)){
+            Log::Error("[Ext2] Disk error (%d) writing block %d (blocksize: %d)", e, block, blocksize);
             return e;
         }
 
@@ -377,20 +392,11 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return -1;
 
-        uint8_t* cachedBlock;
-        if((cachedBlock = blockCache.get(block))){
-            memcpy(buffer, cachedBlock, blocksize);
-        } else {
-            cachedBlock = (uint8_t*)kmalloc(blocksize);
-            if(int e = part->Read(BlockToLBA(block), blocksize, cachedBlock)){
-                Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-                return e;
-            }
-            blockCache.insert(block, cachedBlock);
-            blockCacheMemoryUsage += blocksize;
-            
-            memcpy(buffer, cachedBlock, blocksize);
+        if(int e = blockCache->Read(block, buffer)){
+            Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
+            return e;
         }
+
         return 0;
     }
     
@@ -398,17 +404,7 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return -1;
 
-        uint8_t* cachedBlock;
-        if((cachedBlock = blockCache.get(block))){
-            memcpy(cachedBlock, buffer, blocksize);
-        }
-        
-        if(int e = part->Write(BlockToLBA(block), blocksize, buffer)){
-            Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-            return e;
-        }
-
-        return 0;
+        return blockCache->Write(block, buffer);
     }
     
     uint32_t Ext2Volume::AllocateBlock(){
@@ -422,7 +418,7 @@ namespace fs::Ext2{
             if(uint8_t* cachedBitmap = bitmapCache.get(group.blockBitmap)){
                 memcpy(bitmap, cachedBitmap, blocksize);
             } else {
-                if(int e = ReadBlock(group.blockBitmap, bitmap)){
+                if(int e = ReadBlockCached(group.blockBitmap, bitmap)){
                     Log::Error("[Ext2] Disk error (%d) reading block bitmap (group %d)", e, i);
                     error = DiskReadError;
                     return 0;
@@ -454,7 +450,7 @@ namespace fs::Ext2{
                 memcpy(cachedBitmap, bitmap, blocksize);
             }
 
-            if(int e = WriteBlock(group.blockBitmap, bitmap)){
+            if(int e = WriteBlockCached(group.blockBitmap, bitmap)){
                 Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, i);
                 error = DiskWriteError;
                 return 0;
@@ -482,7 +478,7 @@ namespace fs::Ext2{
         if(uint8_t* cachedBitmap = bitmapCache.get(group.blockBitmap)){
             memcpy(bitmap, cachedBitmap, blocksize);
         } else {
-            if(int e = ReadBlock(group.blockBitmap, bitmap)){
+            if(int e = ReadBlockCached(group.blockBitmap, bitmap)){
                 Log::Error("[Ext2] Disk error (%d) reading block bitmap (group %d)", e, block / super.blocksPerGroup);
                 error = DiskReadError;
                 return -1;
@@ -497,7 +493,7 @@ namespace fs::Ext2{
             memcpy(cachedBitmap, bitmap, blocksize);
         }
 
-        if(int e = WriteBlock(group.blockBitmap, bitmap)){
+        if(int e = WriteBlockCached(group.blockBitmap, bitmap)){
             Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, block / super.blocksPerGroup);
             error = DiskWriteError;
             return -1;
@@ -592,9 +588,7 @@ namespace fs::Ext2{
         for(unsigned i = 0; i < e2inode.blockCount * (blocksize / 512); i++){
             uint32_t block = GetInodeBlock(i, e2inode);
             FreeBlock(block);
-            if(blockCache.get(block)){
-                blockCache.remove(block);
-            }
+            blockCache->Invalidate(block);
         }
         
         if(e2inode.blocks[EXT2_SINGLY_INDIRECT_INDEX]){
@@ -610,9 +604,7 @@ namespace fs::Ext2{
                 
                 for(unsigned i = 0; i < (blocksize / sizeof(uint32_t)) && blockPointers[i] != 0; i++){
                     FreeBlock(blockPointers[i]);
-                    if(blockCache.get(blockPointers[i])){
-                        blockCache.remove(blockPointers[i]);
-                    }
+                    blockCache->Invalidate(blockPointers[i]);
                 }
 
                 FreeBlock(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX]);
@@ -630,7 +622,7 @@ namespace fs::Ext2{
         if(uint8_t* cachedBitmap = bitmapCache.get(group.inodeBitmap)){
             memcpy(bitmap, cachedBitmap, blocksize);
         } else {
-            if(int e = ReadBlock(group.inodeBitmap, bitmap)){
+            if(int e = ReadBlockCached(group.inodeBitmap, bitmap)){
                 Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, inode / super.inodesPerGroup);
                 error = DiskReadError;
                 return -1;
@@ -645,7 +637,7 @@ namespace fs::Ext2{
             memcpy(cachedBitmap, bitmap, blocksize);
         }
 
-        if(int e = WriteBlock(group.blockBitmap, bitmap)){
+        if(int e = WriteBlockCached(group.blockBitmap, bitmap)){
             Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, inode / super.inodesPerGroup);
             error = DiskWriteError;
             return -1;
@@ -659,331 +651,604 @@ namespace fs::Ext2{
         return 0;
     }
     
-    int Ext2Volume::ListDir(Ext2Node* node, List<DirectoryEntry>& entries){
-        if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
-            Log::Warning("[Ext2] ListDir: Not a directory (inode %d)", node->inode);
-            error = MiscError;
+    int Ext2Volume::ReadDirBlock(Ext2Node* node, uint32_t index, uint8_t* buffer){
+        if(index >= DirBlockCount(node)){
+            Log::Warning("[Ext2] ReadDirBlock: Block %d out of range (inode %d)", index, node->inode);
             return -1;
         }
 
-        if(node->inode < 1){
-            Log::Warning("[Ext2] ReadDir: Invalid inode: %d", node->inode);
-            error = InvalidInodeError;
-            return -1;
+        if(int e = ReadBlockCached(GetInodeBlock(index, node->e2inode), buffer)){
+            Log::Info("[Ext2] Failed to read block %d", GetInodeBlock(index, node->e2inode));
+            error = DiskReadError;
+            return e;
         }
 
-        ext2_inode_t& ino = node->e2inode;
+        return 0;
+    }
 
-        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
+    int Ext2Volume::WriteDirBlock(Ext2Node* node, uint32_t index, uint8_t* buffer){
+        if(int e = WriteBlockCached(GetInodeBlock(index, node->e2inode), buffer)){
+            Log::Error("[Ext2] Failed to write directory block");
+            error = DiskWriteError;
+            return e;
+        }
 
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
+        node->dirCursor = 0; // Entries may have moved
+        return 0;
+    }
 
-        if(ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)){
-            Log::Info("[Ext2] ListDir: Error reading block %d", ino.blocks[currentBlockIndex]);
-            error = DiskReadError;
-            return -1;
-        }
+    // Space taken up by an entry with a name of nameLength, rounded up to a multiple of 4
+    static inline uint16_t DirectoryRecordLength(size_t nameLength){
+        return (sizeof(ext2_directory_entry_t) + nameLength + 3) & ~3U;
+    }
 
-        for(;;){
-            if(e2dirent->recordLength == 0) break;
+    static ext2_directory_entry_t* FindInDirBlock(uint8_t* block, uint32_t blocksize, const char* name, ext2_directory_entry_t** prev){
+        size_t nameLength = strlen(name);
+        ext2_directory_entry_t* last = nullptr;
 
-            DirectoryEntry dirent;
-            dirent.flags = e2dirent->fileType;
-            strncpy(dirent.name, e2dirent->name, e2dirent->nameLength);
-            dirent.name[e2dirent->nameLength] = 0;
-            dirent.inode = e2dirent->inode;
+        for(uint32_t offset = 0; offset < blocksize;){
+            ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(block + offset);
+            if(e2dirent->recordLength < sizeof(ext2_directory_entry_t) || offset + e2dirent->recordLength > blocksize){
+                Log::Warning("[Ext2] Corrupt directory entry (record length %d)", e2dirent->recordLength);
+                return nullptr;
+            }
 
-            entries.add_back(dirent);
+            if(e2dirent->inode && e2dirent->nameLength == nameLength && !strncmp(e2dirent->name, name, nameLength)){
+                if(prev){
+                    *prev = last;
+                }
+                return e2dirent;
+            }
 
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
+            last = e2dirent;
+            offset += e2dirent->recordLength;
+        }
 
-            if(blockOffset >= blocksize){
-                currentBlockIndex++;
+        return nullptr;
+    }
 
-                if(currentBlockIndex > ino.blockCount / (blocksize / 512)){
-                    // End of dir
-                    break;
-                }
+    // Put an entry in the first gap big enough to hold it, either an unused entry or the slack at the end of an entry
+    static bool InsertInDirBlock(uint8_t* block, uint32_t blocksize, DirectoryEntry& ent, uint8_t fileType){
+        size_t nameLength = strlen(ent.name);
+        uint16_t needed = DirectoryRecordLength(nameLength);
 
-                blockOffset = 0;
-                if(ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    error = DiskReadError;
-                    return -1;
+        for(uint32_t offset = 0; offset < blocksize;){
+            ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(block + offset);
+            if(e2dirent->recordLength < sizeof(ext2_directory_entry_t) || offset + e2dirent->recordLength > blocksize){
+                Log::Warning("[Ext2] Corrupt directory entry (record length %d)", e2dirent->recordLength);
+                return false;
+            }
+
+            uint16_t used = e2dirent->inode ? DirectoryRecordLength(e2dirent->nameLength) : 0;
+            if(e2dirent->recordLength - used >= needed){
+                if(used){ // Split the entry
+                    ext2_directory_entry_t* newDirent = (ext2_directory_entry_t*)(block + offset + used);
+                    newDirent->recordLength = e2dirent->recordLength - used;
+                    e2dirent->recordLength = used;
+                    e2dirent = newDirent;
                 }
+
+                e2dirent->inode = ent.inode;
+                e2dirent->nameLength = nameLength;
+                e2dirent->fileType = fileType;
+                memcpy(e2dirent->name, ent.name, nameLength);
+                return true;
             }
 
-            e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
+            offset += e2dirent->recordLength;
         }
 
-        return 0;
+        return false;
     }
 
-    int Ext2Volume::WriteDir(Ext2Node* node, List<DirectoryEntry>& entries){
-        if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
-            return -ENOTDIR;
+    static inline uint32_t RotateLeft(uint32_t value, unsigned shift){
+        return (value << shift) | (value >> (32 - shift));
+    }
+
+    static void TEATransform(uint32_t buf[4], const uint32_t in[4]){
+        uint32_t sum = 0;
+        uint32_t b0 = buf[0], b1 = buf[1];
+
+        for(int n = 0; n < 16; n++){
+            sum += 0x9E3779B9;
+            b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+            b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
         }
 
-        if(node->inode < 1){
-            Log::Warning("[Ext2] WriteDir: Invalid inode: %d", node->inode);
-            return -1;
+        buf[0] += b0;
+        buf[1] += b1;
+    }
+
+    static void HalfMD4Transform(uint32_t buf[4], const uint32_t in[8]){
+        uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+        #define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+        #define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+        #define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+        #define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = RotateLeft(a, s))
+        const uint32_t k2 = 013240474631U;
+        const uint32_t k3 = 015666365641U;
+
+        MD4_ROUND(MD4_F, a, b, c, d, in[0], 3);
+        MD4_ROUND(MD4_F, d, a, b, c, in[1], 7);
+        MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+        MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+        MD4_ROUND(MD4_F, a, b, c, d, in[4], 3);
+        MD4_ROUND(MD4_F, d, a, b, c, in[5], 7);
+        MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+        MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+
+        MD4_ROUND(MD4_G, a, b, c, d, in[1] + k2, 3);
+        MD4_ROUND(MD4_G, d, a, b, c, in[3] + k2, 5);
+        MD4_ROUND(MD4_G, c, d, a, b, in[5] + k2, 9);
+        MD4_ROUND(MD4_G, b, c, d, a, in[7] + k2, 13);
+        MD4_ROUND(MD4_G, a, b, c, d, in[0] + k2, 3);
+        MD4_ROUND(MD4_G, d, a, b, c, in[2] + k2, 5);
+        MD4_ROUND(MD4_G, c, d, a, b, in[4] + k2, 9);
+        MD4_ROUND(MD4_G, b, c, d, a, in[6] + k2, 13);
+
+        MD4_ROUND(MD4_H, a, b, c, d, in[3] + k3, 3);
+        MD4_ROUND(MD4_H, d, a, b, c, in[7] + k3, 9);
+        MD4_ROUND(MD4_H, c, d, a, b, in[2] + k3, 11);
+        MD4_ROUND(MD4_H, b, c, d, a, in[6] + k3, 15);
+        MD4_ROUND(MD4_H, a, b, c, d, in[1] + k3, 3);
+        MD4_ROUND(MD4_H, d, a, b, c, in[5] + k3, 9);
+        MD4_ROUND(MD4_H, c, d, a, b, in[0] + k3, 11);
+        MD4_ROUND(MD4_H, b, c, d, a, in[4] + k3, 15);
+
+        #undef MD4_F
+        #undef MD4_G
+        #undef MD4_H
+        #undef MD4_ROUND
+
+        buf[0] += a;
+        buf[1] += b;
+        buf[2] += c;
+        buf[3] += d;
+    }
+
+    // Pack up to num words of the name into buf, padded with the length
+    static void NameToHashBuffer(const char* name, int length, uint32_t* buf, int num, bool isUnsigned){
+        uint32_t pad = (uint32_t)length | ((uint32_t)length << 8);
+        pad |= pad << 16;
+
+        uint32_t val = pad;
+        if(length > num * 4){
+            length = num * 4;
         }
 
-        ext2_inode_t& ino = node->e2inode;
+        for(int i = 0; i < length; i++){
+            int c = isUnsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+            val = c + (val << 8);
 
-        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
+            if((i % 4) == 3){
+                *buf++ = val;
+                val = pad;
+                num--;
+            }
+        }
+
+        if(--num >= 0){
+            *buf++ = val;
+        }
 
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)kmalloc(sizeof(ext2_directory_entry_t) + NAME_MAX);
+        while(--num >= 0){
+            *buf++ = pad;
+        }
+    }
 
-        unsigned lastIndex = entries.get_length() - 1;
-        for(unsigned i = 0; i < entries.get_length(); i++){
-            DirectoryEntry ent = entries[i];
+    static uint32_t LegacyDirectoryHash(const char* name, int length, bool isUnsigned){
+        uint32_t hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
 
-            //Log::Info("[Ext2] Writing entry: %s", ent.name);
+        for(int i = 0; i < length; i++){
+            int c = isUnsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+            hash = hash1 + (hash0 ^ (c * 7152373));
 
-            e2dirent->fileType = ent.flags;
-            e2dirent->inode = ent.inode;
-            strncpy(e2dirent->name, ent.name, strlen(ent.name));
-            e2dirent->nameLength = strlen(ent.name);
-            
-            if(i == lastIndex){
-                e2dirent->recordLength = blocksize - blockOffset;
-            } else {
-                if(strlen(entries[i + 1].name) + sizeof(ext2_directory_entry_t) + blockOffset > blocksize){
-                    e2dirent->recordLength = blocksize - blockOffset; // Directory entries cannot span multiple blocks
-                } else {
-                    e2dirent->recordLength = sizeof(ext2_directory_entry_t) + e2dirent->nameLength;
-                    if(e2dirent->recordLength % 4){
-                        memset(((uint8_t*)e2dirent) + e2dirent->recordLength, 0, 4 - (e2dirent->recordLength % 4)); // Pad with zeros
-                        e2dirent->recordLength += 4 - (e2dirent->recordLength % 4); // Round up to nearest multiple of 4
-                    }
-                }
+            if(hash & 0x80000000){
+                hash -= 0x7FFFFFFF;
             }
 
-            memcpy((buffer + blockOffset), e2dirent, sizeof(ext2_directory_entry_t) + e2dirent->nameLength);
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
+            hash1 = hash0;
+            hash0 = hash;
+        }
 
-            if(blockOffset >= blocksize){
-                if(WriteBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    Log::Error("[Ext2] WriteDir: Failed to write directory block");
-                    error = DiskWriteError;
-                    return -1;
-                }
+        return hash0 << 1;
+    }
 
-                currentBlockIndex++;
+    // Same hashes as Linux (fs/ext4/hash.c) so that we can read directories indexed by it
+    static uint32_t DirectoryHash(const char* name, uint8_t version, const uint32_t seed[4]){
+        uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+        uint32_t in[8];
+        uint32_t hash = 0;
+        int length = strlen(name);
 
-                if(currentBlockIndex > ino.blockCount / (blocksize / 512)){
-                    // Allocate a new block
-                    SetInodeBlock(currentBlockIndex, node->e2inode, AllocateBlock());
-                    node->e2inode.blockCount += blocksize / 512;
-                    WriteSuperblock();
-                }
+        if(seed[0] || seed[1] || seed[2] || seed[3]){
+            memcpy(buf, seed, sizeof(buf));
+        }
 
-                blockOffset = 0;
+        bool isUnsigned = version >= EXT2_HASH_LEGACY_UNSIGNED;
+        switch(version){
+        case EXT2_HASH_LEGACY:
+        case EXT2_HASH_LEGACY_UNSIGNED:
+            hash = LegacyDirectoryHash(name, length, isUnsigned);
+            break;
+        case EXT2_HASH_HALF_MD4:
+        case EXT2_HASH_HALF_MD4_UNSIGNED:
+            for(const char* p = name; length > 0; length -= 32, p += 32){
+                NameToHashBuffer(p, length, in, 8, isUnsigned);
+                HalfMD4Transform(buf, in);
             }
-            
-            node->e2inode.size = totalOffset;
-            node->size = node->e2inode.size;
+            hash = buf[1];
+            break;
+        case EXT2_HASH_TEA:
+        case EXT2_HASH_TEA_UNSIGNED:
+            for(const char* p = name; length > 0; length -= 16, p += 16){
+                NameToHashBuffer(p, length, in, 4, isUnsigned);
+                TEATransform(buf, in);
+            }
+            hash = buf[0];
+            break;
         }
 
-        kfree(buffer);
-        kfree(e2dirent);
+        hash &= ~1U; // The lowest bit marks hash collisions in the index
+        if(hash == (0x7FFFFFFFU << 1)){
+            hash = (0x7FFFFFFFU - 1) << 1;
+        }
 
-        SyncNode(node);
+        return hash;
+    }
 
-        return 0;
+    // Check the count and limit of an index block and fill in frame, false if it is corrupt
+    bool Ext2Volume::HTreeReadNode(Ext2Node* node, ext2_dx_frame_t& frame, ext2_dx_entry_t* entries){
+        ext2_dx_countlimit_t* countLimit = (ext2_dx_countlimit_t*)entries;
+        if(!countLimit->count || countLimit->count > countLimit->limit || (uint8_t*)(entries + countLimit->limit) > frame.buffer + blocksize){
+            Log::Warning("[Ext2] Invalid hash tree node (inode %d)", node->inode);
+            return false;
+        }
+
+        frame.entries = entries;
+        frame.entry = entries;
+        frame.end = entries + countLimit->count;
+        return true;
     }
 
-    int Ext2Volume::InsertDir(Ext2Node* node, List<DirectoryEntry>& newEntries){
-        List<DirectoryEntry> entries;
-        ListDir(node, entries);
+    // Walk the hash tree down to the index entry for the leaf block that name belongs in.
+    // buffer has room for EXT2_DX_MAX_LEVELS blocks, frames is filled in with the path through the index blocks.
+    // Returns nullptr if the index can't be used, in which case the directory can still be searched linearly.
+    ext2_dx_entry_t* Ext2Volume::HTreeLookup(Ext2Node* node, const char* name, uint8_t* buffer, uint32_t& hash, ext2_dx_frame_t* frames, unsigned& levels){
+        if(ReadDirBlock(node, 0, buffer)){
+            return nullptr;
+        }
+
+        ext2_dx_root_info_t* info = (ext2_dx_root_info_t*)(buffer + EXT2_DX_ROOT_INFO_OFFSET);
+        if(info->reserved || info->infoLength != sizeof(ext2_dx_root_info_t) || info->hashVersion > EXT2_HASH_TEA || info->indirectLevels >= EXT2_DX_MAX_LEVELS){
+            Log::Warning("[Ext2] Invalid hash tree root (inode %d)", node->inode);
+            return nullptr;
+        }
+
+        uint8_t version = info->hashVersion;
+        if(superext.flags & EXT2_FLAGS_UNSIGNED_HASH){
+            version += EXT2_HASH_LEGACY_UNSIGNED;
+        }
+
+        uint32_t seed[4]; // Can't pass a pointer into the packed superblock
+        memcpy(seed, superext.hashSeed, sizeof(seed));
+        hash = DirectoryHash(name, version, seed);
+
+        levels = info->indirectLevels + 1;
+
+        frames[0].buffer = buffer;
+        ext2_dx_entry_t* entries = (ext2_dx_entry_t*)(buffer + EXT2_DX_ROOT_INFO_OFFSET + info->infoLength);
+        for(unsigned level = 0;; level++){
+            ext2_dx_frame_t& frame = frames[level];
+            if(!HTreeReadNode(node, frame, entries)){
+                return nullptr;
+            }
 
+            // Find the last entry with a hash no greater than ours, the first entry has no hash and covers everything below the second
+            unsigned low = 1;
+            unsigned high = frame.end - entries;
+            while(low < high){
+                unsigned mid = (low + high) / 2;
 
-        for(DirectoryEntry& newEnt : newEntries){
-            for(DirectoryEntry& ent : entries){
-                if(strcmp(ent.name, newEnt.name) == 0){
-                    Log::Info("[Ext2] InsertDir: Entry %s already exists!", newEnt.name);
-                    return -EEXIST;
+                if(entries[mid].hash > hash){
+                    high = mid;
+                } else {
+                    low = mid + 1;
                 }
             }
-            entries.add_back(newEnt);
+
+            frame.entry = &entries[low - 1];
+            if((frame.entry->block & EXT2_DX_BLOCK_MASK) >= DirBlockCount(node)){
+                Log::Warning("[Ext2] Hash tree entry out of range (inode %d)", node->inode);
+                return nullptr;
+            }
+
+            if(level + 1 >= levels){
+                return frame.entry;
+            }
+
+            frames[level + 1].buffer = frame.buffer + blocksize;
+            if(ReadDirBlock(node, frame.entry->block & EXT2_DX_BLOCK_MASK, frames[level + 1].buffer)){
+                return nullptr;
+            }
+
+            entries = (ext2_dx_entry_t*)(frames[level + 1].buffer + EXT2_DX_NODE_ENTRIES_OFFSET);
         }
+    }
 
-        for(DirectoryEntry& ent : entries){
-            Log::Info("Entry: %s", ent.name);
+    // Move to the leaf after the one frames currently point to, as long as it carries on the run of names with this hash.
+    // A leaf continues the run when the lowest bit of its hash is set, this can cross into the next index block.
+    ext2_dx_entry_t* Ext2Volume::HTreeNextLeaf(Ext2Node* node, uint32_t hash, ext2_dx_frame_t* frames, unsigned levels){
+        unsigned level = levels - 1;
+        while(++frames[level].entry >= frames[level].end){
+            if(!level--){
+                return nullptr;
+            }
         }
 
-        return WriteDir(node, entries);
-    }
-    
-    int Ext2Volume::InsertDir(Ext2Node* node, DirectoryEntry& ent){
-        List<DirectoryEntry> ents;
-        ents.add_back(ent);
+        uint32_t next = frames[level].entry->hash;
+        if(!(next & 1) || (next & ~1U) != hash){
+            return nullptr;
+        }
 
-        return InsertDir(node, ents);
-    }
+        // Start from the first entry of every index block below the one we moved along
+        for(; level + 1 < levels; level++){
+            uint32_t block = frames[level].entry->block & EXT2_DX_BLOCK_MASK;
+            if(block >= DirBlockCount(node) || ReadDirBlock(node, block, frames[level + 1].buffer)){
+                return nullptr;
+            }
 
-    int Ext2Volume::ReadDir(Ext2Node* node, DirectoryEntry* dirent, uint32_t index){
-        if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
-            return -ENOTDIR;
+            if(!HTreeReadNode(node, frames[level + 1], (ext2_dx_entry_t*)(frames[level + 1].buffer + EXT2_DX_NODE_ENTRIES_OFFSET))){
+                return nullptr;
+            }
         }
 
-        if(node->inode < 1){
-            Log::Warning("[Ext2] ReadDir: Invalid inode: %d", node->inode);
-            return -1;
+        ext2_dx_entry_t* entry = frames[levels - 1].entry;
+        if((entry->block & EXT2_DX_BLOCK_MASK) >= DirBlockCount(node)){
+            return nullptr;
         }
 
-        ext2_inode_t& ino = node->e2inode;
+        return entry;
+    }
 
-        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
+    // Find the entry for name, on success buffer holds the directory block it is in.
+    // prev is set to the entry before it in the block, nullptr if it is the first.
+    ext2_directory_entry_t* Ext2Volume::LookupDir(Ext2Node* node, const char* name, uint8_t* buffer, uint32_t& blockIndex, ext2_directory_entry_t** prev){
+        if(node->e2inode.flags & EXT2_INDEX_FL){
+            uint8_t indexBuffer[blocksize * EXT2_DX_MAX_LEVELS];
+            ext2_dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+            unsigned levels;
+            uint32_t hash;
+
+            if(ext2_dx_entry_t* entry = HTreeLookup(node, name, indexBuffer, hash, frames, levels)){
+                for(;;){
+                    blockIndex = entry->block & EXT2_DX_BLOCK_MASK;
+                    if(ReadDirBlock(node, blockIndex, buffer)){
+                        return nullptr;
+                    }
 
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
+                    if(ext2_directory_entry_t* e2dirent = FindInDirBlock(buffer, blocksize, name, prev)){
+                        return e2dirent;
+                    }
 
-        if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-            Log::Info("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
-            error = DiskReadError;
-            return -1;
+                    // Names with the same hash can carry on into the next leaf
+                    if(!(entry = HTreeNextLeaf(node, hash, frames, levels))){
+                        return nullptr;
+                    }
+                }
+            }
         }
 
-        for(unsigned i = 0; i < index; i++){
-            if(e2dirent->recordLength == 0) return 0;
+        // The index blocks look like empty entries so unindexed lookups still work on indexed directories
+        for(blockIndex = 0; blockIndex < DirBlockCount(node); blockIndex++){
+            if(ReadDirBlock(node, blockIndex, buffer)){
+                return nullptr;
+            }
 
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
+            if(ext2_directory_entry_t* e2dirent = FindInDirBlock(buffer, blocksize, name, prev)){
+                return e2dirent;
+            }
+        }
 
-            if(blockOffset >= blocksize){
-                currentBlockIndex++;
+        return nullptr;
+    }
 
-                if(currentBlockIndex >= ino.blockCount / (blocksize / 512)){
-                    // End of dir
-                    return 0;
+    int Ext2Volume::InsertDir(Ext2Node* node, DirectoryEntry& ent){
+        uint8_t buffer[blocksize];
+        uint8_t fileType = filetype ? ent.flags : 0;
+
+        if(node->e2inode.flags & EXT2_INDEX_FL){
+            uint8_t indexBuffer[blocksize * EXT2_DX_MAX_LEVELS];
+            ext2_dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+            unsigned levels;
+            uint32_t hash;
+
+            if(ext2_dx_entry_t* entry = HTreeLookup(node, ent.name, indexBuffer, hash, frames, levels)){
+                uint32_t leaf = entry->block & EXT2_DX_BLOCK_MASK;
+                if(ReadDirBlock(node, leaf, buffer)){
+                    return -EIO;
                 }
 
-                blockOffset = 0;
-                if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    Log::Info("[Ext2] Failed to read block");
-                    return -1;
+                if(InsertInDirBlock(buffer, blocksize, ent, fileType)){
+                    return WriteDirBlock(node, leaf, buffer) ? -EIO : 0;
                 }
             }
 
-            e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
+            // We can't split leaves so if the leaf is full (or the index is broken) drop the index.
+            // The directory stays valid, lookups just go back to being linear.
+            node->e2inode.flags &= ~EXT2_INDEX_FL;
+            SyncNode(node);
         }
 
-        strncpy(dirent->name, e2dirent->name, e2dirent->nameLength);
-        dirent->name[e2dirent->nameLength] = 0; // Null terminate
-        dirent->flags = e2dirent->fileType;
+        uint32_t blockCount = DirBlockCount(node);
+        for(uint32_t i = 0; i < blockCount; i++){
+            if(ReadDirBlock(node, i, buffer)){
+                return -EIO;
+            }
 
-        return 1;
+            if(InsertInDirBlock(buffer, blocksize, ent, fileType)){
+                return WriteDirBlock(node, i, buffer) ? -EIO : 0;
+            }
+        }
+
+        // No space, add a block to the directory
+        uint32_t block = blockCount ? 0 : node->e2inode.blocks[0]; // New inodes are given one block to start with
+        if(!block){
+            if(!(block = AllocateBlock())){
+                return -ENOSPC;
+            }
+
+            SetInodeBlock(blockCount, node->e2inode, block);
+            node->e2inode.blockCount += blocksize / 512;
+            WriteSuperblock();
+        }
+
+        node->e2inode.size += blocksize;
+        node->size = node->e2inode.size;
+
+        memset(buffer, 0, blocksize);
+        ((ext2_directory_entry_t*)buffer)->recordLength = blocksize; // One empty entry spanning the block
+        InsertInDirBlock(buffer, blocksize, ent, fileType);
+
+        SyncNode(node);
+        return WriteDirBlock(node, blockCount, buffer) ? -EIO : 0;
     }
 
-    FsNode* Ext2Volume::FindDir(Ext2Node* node, char* name){
+    int Ext2Volume::ReadDir(Ext2Node* node, DirectoryEntry* dirent, uint32_t index){
         if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
-            return nullptr;
+            return -ENOTDIR;
         }
 
         if(node->inode < 1){
             Log::Warning("[Ext2] ReadDir: Invalid inode: %d", node->inode);
-            return nullptr;
+            return -1;
         }
 
-        ext2_inode_t& ino = node->e2inode;
-
-        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        memset(buffer, 0, blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
+        // Carry on from the last call if we can instead of walking from the start every time
+        uint64_t cursor = node->dirCursor;
+        uint32_t current = 0;
+        uint32_t offset = 0;
+        if((cursor >> 32) <= index){
+            current = cursor >> 32;
+            offset = cursor & 0xFFFFFFFF;
+        }
 
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
+        uint8_t buffer[blocksize];
+        uint32_t blockIndex = UINT32_MAX; // Block currently in the buffer
+        uint32_t blockCount = DirBlockCount(node);
 
-        if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-            Log::Info("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
-            return nullptr;
-        }
+        while(offset / blocksize < blockCount){
+            if(offset / blocksize != blockIndex){
+                blockIndex = offset / blocksize;
 
-        while(totalOffset < ino.size && currentBlockIndex < ino.blockCount / (blocksize / 512)){
-            /*char buf[e2dirent->nameLength + 1];
-            strncpy(buf, e2dirent->name, e2dirent->nameLength);
-            buf[e2dirent->nameLength] = 0;
-            Log::Info("Checking name %s, inode %d, len %d (parent inode: %d)", buf, e2dirent->inode, e2dirent->recordLength, node->inode);*/
+                if(ReadDirBlock(node, blockIndex, buffer)){
+                    return -1;
+                }
+            }
 
-            if(strlen(name) == e2dirent->nameLength && strncmp(name, e2dirent->name, e2dirent->nameLength) == 0){
-                break;
+            uint32_t blockOffset = offset % blocksize;
+            ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
+            if(e2dirent->recordLength < sizeof(ext2_directory_entry_t) || blockOffset + e2dirent->recordLength > blocksize){
+                Log::Warning("[Ext2] ReadDir: Corrupt directory entry (inode %d)", node->inode);
+                return -1;
             }
 
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
+            offset += e2dirent->recordLength;
 
-            if(totalOffset > ino.size) return nullptr;
+            if(!e2dirent->inode || current++ < index){
+                continue; // Unused entries and hash tree index blocks have no inode
+            }
 
-            if(blockOffset >= blocksize){
-                currentBlockIndex++;
-                
-                if(currentBlockIndex >= ino.blockCount / (blocksize / 512)){
-                    // End of dir
-                    kfree(buffer);
-                    return nullptr;
-                }
+            strncpy(dirent->name, e2dirent->name, e2dirent->nameLength);
+            dirent->name[e2dirent->nameLength] = 0; // Null terminate
+            dirent->flags = e2dirent->fileType;
+            dirent->inode = e2dirent->inode;
 
-                blockOffset = 0;
+            node->dirCursor = (static_cast<uint64_t>(index + 1) << 32) | offset;
+            return 1;
+        }
 
-                if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    Log::Info("[Ext2] Failed to read block");
-                    return nullptr;
-                }
-            }
+        return 0;
+    }
 
-            e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
+    FsNode* Ext2Volume::FindDir(Ext2Node* node, char* name){
+        if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
+            return nullptr;
         }
 
-        if(strlen(name) != e2dirent->nameLength || strncmp(e2dirent->name, name, e2dirent->nameLength) != 0){
-            // Not found
-            kfree(buffer);
+        if(node->inode < 1){
+            Log::Warning("[Ext2] FindDir: Invalid inode: %d", node->inode);
             return nullptr;
         }
 
-        if(!e2dirent->inode || e2dirent->inode > super.inodeCount){
-            Log::Error("[Ext2] Directory Entry %s contains invalid inode %d", name, e2dirent->inode);
-            kfree(buffer);
+        uint8_t buffer[blocksize];
+        uint32_t blockIndex;
+
+        ext2_directory_entry_t* e2dirent = LookupDir(node, name, buffer, blockIndex);
+        if(!e2dirent){
+            return nullptr; // Not found
+        }
+
+        uint32_t inode = e2dirent->inode;
+        if(inode > super.inodeCount){
+            Log::Error("[Ext2] Directory Entry %s contains invalid inode %d", name, inode);
             return nullptr;
         }
 
-        Ext2Node* returnNode = inodeCache.get(e2dirent->inode);
+        Ext2Node* returnNode = inodeCache.get(inode);
 
         if(!returnNode){ // Could not locate inode in cache
             ext2_inode_t direntInode;
-            if(ReadInode(e2dirent->inode, direntInode)){
-                Log::Error("[Ext2] Failed to read inode of directory (inode %d) entry %s", node->inode, e2dirent->name);
+            if(ReadInode(inode, direntInode)){
+                Log::Error("[Ext2] Failed to read inode of directory (inode %d) entry %s", node->inode, name);
                 return nullptr; // Could not read inode
             }
 
-            returnNode = new Ext2Node(this, direntInode, e2dirent->inode);
+            returnNode = new Ext2Node(this, direntInode, inode);
 
-            inodeCache.insert(e2dirent->inode, returnNode);
+            inodeCache.insert(inode, returnNode);
         }
 
-        kfree(buffer);
         return returnNode;
     }
 
     ssize_t Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8_t *buffer){
         if(offset > node->size) return -1;
         if(offset + size > node->size) size = node->size - offset;
+        if(!size) return 0;
 
         uint32_t blockIndex = LocationToBlock(offset);
-        uint32_t blockLimit = LocationToBlock(offset + size);
+        uint32_t blockLimit = LocationToBlock(offset + size - 1); // Last block we need
+        uint32_t blockCount = blockLimit - blockIndex + 1;
+        uint32_t fileBlockCount = LocationToBlock(node->size - 1) + 1;
         uint8_t blockBuffer[blocksize];
 
+        // Grow the read-ahead window while access stays sequential
+        if(offset == node->readAheadOffset && offset){
+            node->readAheadWindow = node->readAheadWindow ? node->readAheadWindow * 2 : EXT2_READ_AHEAD_MIN;
+            if(node->readAheadWindow > EXT2_READ_AHEAD_MAX) node->readAheadWindow = EXT2_READ_AHEAD_MAX;
+        } else {
+            node->readAheadWindow = 0;
+            node->readAheadEnd = 0;
+        }
+        node->readAheadOffset = offset + size;
+
+        uint32_t readAheadStart = blockLimit + 1;
+        if(node->readAheadEnd > readAheadStart){
+            readAheadStart = node->readAheadEnd; // Already read ahead up to here
+        }
+
+        uint32_t readAheadCount = 0;
+        if(node->readAheadWindow){
+            uint32_t readAheadLimit = blockLimit + 1 + node->readAheadWindow / blocksize;
+            if(readAheadLimit > fileBlockCount) readAheadLimit = fileBlockCount;
+
+            if(readAheadLimit > readAheadStart){
+                readAheadCount = readAheadLimit - readAheadStart;
+            }
+        }
+
         //Log::Info("[Ext2] Reading: Block index: %d, Blockcount: %d, Offset: %d, Size: %d", blockIndex, blockCount, offset, size);
 
         #ifdef EXT2_ENABLE_TIMER
@@ -991,52 +1256,76 @@ namespace fs::Ext2{
         #endif
 
         ssize_t ret = size;
-        Vector<uint32_t> blocks = GetInodeBlocks(blockIndex, blockLimit - blockIndex + 1, node->e2inode);
+        Vector<uint32_t> blocks = GetInodeBlocks(blockIndex, blockCount, node->e2inode);
+        if(blocks.get_length() < blockCount){
+            Log::Info("[Ext2] Error retrieving blocks for inode %d", node->inode);
+            error = DiskReadError;
+            return -1;
+        }
         
         #ifdef EXT2_ENABLE_TIMER
         timeval_t blktv2 = Timer::GetSystemUptimeStruct();
         timeval_t readtv1 = Timer::GetSystemUptimeStruct();
         #endif
 
-        for(uint32_t block : blocks){
-            if(size <= 0) break;
-            
-            if(offset % blocksize){
+        uint32_t maxRun = EXT2_READ_RUN_MAX / blocksize;
+        for(uint32_t i = 0; i < blockCount && size;){
+            uint32_t block = blocks[i];
+            size_t blockOffset = offset % blocksize;
+
+            size_t readSize = blocksize - blockOffset;
+            if(readSize > size) readSize = size;
+
+            if(!block){ // Sparse file, hole reads as zeros
+                memset(buffer, 0, readSize);
+            } else if(readSize < blocksize){ // Partial block, go through the cache
                 if(ReadBlockCached(block, blockBuffer)){
                     Log::Info("[Ext2] Error reading block %d", block);
                     error = DiskReadError;
                     return -1;
                 }
 
-                size_t readSize = blocksize - (offset % blocksize);
-                size_t readOffset = (offset % blocksize);
-
-                if(readSize > size) readSize = size;
-
-                memcpy(buffer, blockBuffer + readOffset, readSize);
+                memcpy(buffer, blockBuffer + blockOffset, readSize);
+            } else {
+                // Coalesce physically contiguous whole blocks into one request straight into the caller's buffer
+                uint32_t run = 1;
+                while(i + run < blockCount && run < maxRun && blocks[i + run] == block + run && (run + 1) * blocksize <= size){
+                    run++;
+                }
 
-                size -= readSize;
-                buffer += readSize;
-                offset += readSize;
-            } else if(size >= blocksize){
-                if(ReadBlockCached(block, buffer)){
-                    Log::Info("[Ext2] Error reading block %d", block);
+                if(block > super.blockCount || blockCache->ReadBlocks(block, run, buffer)){
+                    Log::Info("[Ext2] Error reading blocks %d-%d", block, block + run - 1);
                     error = DiskReadError;
                     return -1;
                 }
-                size -= blocksize;
-                buffer += blocksize;
-                offset += blocksize;
-            } else {
-                if(ReadBlockCached(block, blockBuffer)){
-                    Log::Info("[Ext2] Error reading block %d", block);
-                    error = DiskReadError;
-                    return -1;
+
+                readSize = run * blocksize;
+                i += run - 1;
+            }
+
+            size -= readSize;
+            buffer += readSize;
+            offset += readSize;
+            i++;
+        }
+
+        if(readAheadCount){
+            Vector<uint32_t> readAheadBlocks = GetInodeBlocks(readAheadStart, readAheadCount, node->e2inode);
+
+            for(uint32_t i = 0; i < readAheadBlocks.get_length();){
+                uint32_t run = 1;
+                while(i + run < readAheadBlocks.get_length() && readAheadBlocks[i + run] == readAheadBlocks[i] + run){
+                    run++;
                 }
-                memcpy(buffer, blockBuffer, size);
-                size = 0;
-                break;
+
+                if(readAheadBlocks[i] && readAheadBlocks[i] + run - 1 <= super.blockCount){
+                    blockCache->Prefetch(readAheadBlocks[i], run);
+                }
+
+                i += run;
             }
+
+            node->readAheadEnd = readAheadStart + readAheadCount;
         }
 
         #ifdef EXT2_ENABLE_TIMER
@@ -1136,18 +1425,18 @@ namespace fs::Ext2{
     }
 
     void Ext2Volume::SyncInode(ext2_inode_t& e2inode, uint32_t inode){
-        uint8_t buf[part->parentDisk->blocksize];
-        uint64_t lba = InodeLBA(inode);
+        uint8_t buf[blocksize];
+        uint32_t block = InodeBlock(inode);
 
-        if(int e = part->Read(lba, part->parentDisk->blocksize, buf)){
+        if(int e = ReadBlockCached(block, buf)){
             Log::Error("[Ext2] Sync: Disk Error (%d) Reading Inode %d", e, inode);
             error = DiskReadError;
             return;
         }
 
-        *(ext2_inode_t*)(buf + (ResolveInodeBlockGroupIndex(inode) * inodeSize) % part->parentDisk->blocksize) = e2inode;
+        *(ext2_inode_t*)(buf + InodeBlockOffset(inode)) = e2inode;
 
-        if(int e = part->Write(lba, part->parentDisk->blocksize, buf)){
+        if(int e = WriteBlockCached(block, buf)){
             Log::Error("[Ext2] Sync: Disk Error (%d) Writing Inode %d", e, inode);
             error = DiskWriteError;
             return;
@@ -1158,10 +1447,78 @@ namespace fs::Ext2{
         SyncInode(node->e2inode, node->inode);
     }
 
+    // Write back an indirect block and the indirect blocks below it
+    int Ext2Volume::FlushIndirect(uint32_t block, unsigned levels){
+        if(!block || block > super.blockCount){
+            return 0;
+        }
+
+        int error = blockCache->Flush(block);
+        if(levels <= 1){
+            return error; // Points at data blocks, which are flushed separately
+        }
+
+        uint32_t pointers[blocksize / sizeof(uint32_t)];
+        if(int e = ReadBlockCached(block, pointers)){
+            return e;
+        }
+
+        for(uint32_t pointer : pointers){
+            if(int e = FlushIndirect(pointer, levels - 1)){
+                error = e;
+            }
+        }
+
+        return error;
+    }
+
+    // Write back the cached blocks of a node (its data, indirect blocks and inode) rather than the whole cache
+    int Ext2Volume::FlushNode(Ext2Node* node){
+        int error = 0;
+
+        uint32_t blockCount = (node->size + blocksize - 1) / blocksize;
+        Vector<uint32_t> blocks = GetInodeBlocks(0, blockCount, node->e2inode);
+        for(unsigned i = 0; i < blocks.get_length(); i++){
+            if(blocks[i] && blocks[i] <= super.blockCount){
+                if(int e = blockCache->Flush(blocks[i])){
+                    error = e;
+                }
+            }
+        }
+
+        for(unsigned i = 0; i < 3; i++){
+            if(int e = FlushIndirect(node->e2inode.blocks[EXT2_SINGLY_INDIRECT_INDEX + i], i + 1)){
+                error = e;
+            }
+        }
+
+        if(int e = blockCache->Flush(InodeBlock(node->inode))){
+            error = e;
+        }
+
+        if(error){
+            Log::Error("[Ext2] Disk error (%d) flushing inode %d", error, node->inode);
+            this->error = DiskWriteError;
+        }
+
+        return error;
+    }
+
+    int Ext2Volume::FlushCache(){
+        if(int e = blockCache->Flush()){
+            error = DiskWriteError;
+            return e;
+        }
+
+        return 0;
+    }
+
     int Ext2Volume::Create(Ext2Node* node, DirectoryEntry* ent, uint32_t mode){
         if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY) return -ENOTDIR;
 
-        if(FindDir(node, ent->name)){
+        uint8_t buffer[blocksize];
+        uint32_t blockIndex;
+        if(LookupDir(node, ent->name, buffer, blockIndex)){
             Log::Info("[Ext2] Create: Entry %s already exists!", ent->name);
             return -EEXIST;
         }
@@ -1195,7 +1552,9 @@ namespace fs::Ext2{
             return -ENOTDIR;
         }
 
-        if(FindDir(node, ent->name)){
+        uint8_t buffer[blocksize];
+        uint32_t blockIndex;
+        if(LookupDir(node, ent->name, buffer, blockIndex)){
             Log::Info("[Ext2] CreateDirectory: Entry %s already exists!", ent->name);
             return -EEXIST;
         }
@@ -1230,11 +1589,11 @@ namespace fs::Ext2{
         parentEnt.flags = EXT2_FT_DIR;
         node->e2inode.linkCount++;
 
-        List<DirectoryEntry> entries;
-        entries.add_back(currentEnt);
-        entries.add_back(parentEnt);
+        if(int e = InsertDir(dir, currentEnt)){
+            return e;
+        }
 
-        if(int e = InsertDir(dir, entries)){
+        if(int e = InsertDir(dir, parentEnt)){
             return e;
         }
 
@@ -1272,59 +1631,85 @@ namespace fs::Ext2{
             return -EINVAL;
         }
 
-        List<DirectoryEntry> entries;
-        if(int e = ListDir(node, entries)){
-            Log::Error("[Ext2] Link: Error listing directory!", ent->inode);
-            return e;
+        uint8_t buffer[blocksize];
+        uint32_t blockIndex;
+        if(LookupDir(node, ent->name, buffer, blockIndex)){
+            Log::Error("[Ext2] Link: Directory entry %s already exists!", ent->name);
+            return -EEXIST;
         }
 
-        for(DirectoryEntry& dirent : entries){
-            if(strcmp(dirent.name, ent->name) == 0){
-                Log::Error("[Ext2] Link: Directory entry %s already exists!", ent->name);
-                return -EEXIST;
-            }
+        switch(file->flags & FS_NODE_TYPE){
+        case FS_NODE_DIRECTORY:
+            ent->flags = EXT2_FT_DIR;
+            break;
+        case FS_NODE_SYMLINK:
+            ent->flags = EXT2_FT_SYMLINK;
+            break;
+        case FS_NODE_CHARDEVICE:
+            ent->flags = EXT2_FT_CHRDEV;
+            break;
+        case FS_NODE_BLKDEVICE:
+            ent->flags = EXT2_FT_BLKDEV;
+            break;
+        default:
+            ent->flags = EXT2_FT_REG_FILE;
+            break;
         }
 
-        entries.add_back(*ent);
+        if(int e = InsertDir(node, *ent)){
+            return e;
+        }
 
         file->nlink++;
         file->e2inode.linkCount++;
 
         SyncNode(file);
 
-        return WriteDir(node, entries);
+        return 0;
     }
 
     int Ext2Volume::Unlink(Ext2Node* node, DirectoryEntry* ent, bool unlinkDirectories){
-        List<DirectoryEntry> entries;
-        if(int e = ListDir(node, entries)){
-            Log::Error("[Ext2] Unlink: Error listing directory!", ent->inode);
-            return e;
+        uint8_t buffer[blocksize];
+        uint32_t blockIndex;
+        ext2_directory_entry_t* prev;
+
+        ext2_directory_entry_t* e2dirent = LookupDir(node, ent->name, buffer, blockIndex, &prev);
+        if(!e2dirent){
+            Log::Error("[Ext2] Unlink: Directory entry %s does not exist!", ent->name);
+            return -ENOENT;
         }
 
-        for(unsigned i = 0; i < entries.get_length(); i++) {
-            if(strcmp(entries[i].name, ent->name) == 0){
-                ent->inode = entries.remove_at(i).inode;
-                goto found;
+        ent->inode = e2dirent->inode;
+
+        Ext2Node* file = inodeCache.get(ent->inode);
+        ext2_inode_t e2inode;
+        if(file){
+            if((file->flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY && !unlinkDirectories){
+                return -EISDIR;
+            }
+        } else {
+            if(ReadInode(ent->inode, e2inode)){
+                Log::Error("[Ext2] Unlink: Error reading inode %d", ent->inode);
+                return -1;
+            }
+
+            if((e2inode.mode & EXT2_S_IFMT) == EXT2_S_IFDIR && !unlinkDirectories){
+                return -EISDIR;
             }
         }
-        
-        Log::Error("[Ext2] Unlink: Directory entry %s does not exist!", ent->name);
-        return -ENOENT;
 
-    found:
-        if(!ent->inode){
-            Log::Error("[Ext2] Unlink: Invalid inode %d", ent->inode);
-            return -EINVAL;
+        // Remove the entry in place, merge it into the previous entry or mark it unused if it is the first in the block
+        if(prev){
+            prev->recordLength += e2dirent->recordLength;
+        } else {
+            e2dirent->inode = 0;
         }
 
-        if(Ext2Node* file = inodeCache.get(ent->inode)){
-            if((file->flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY){
-                if(!unlinkDirectories){
-                    return -EISDIR;
-                }
-            }
+        if(WriteDirBlock(node, blockIndex, buffer)){
+            return -EIO;
+        }
 
+        if(file){
             file->nlink--;
             file->e2inode.linkCount--;
 
@@ -1333,18 +1718,6 @@ namespace fs::Ext2{
                 CleanNode(file);
             }
         } else {
-            ext2_inode_t e2inode;
-            if(ReadInode(ent->inode, e2inode)){
-                Log::Error("[Ext2] Link: Error reading inode %d", ent->inode);
-                return -1;
-            }
-
-            if((e2inode.mode & EXT2_S_IFMT) == EXT2_S_IFDIR){
-                if(!unlinkDirectories){
-                    return -EISDIR;
-                }
-            }
-            
             e2inode.linkCount--;
 
             if(e2inode.linkCount){
@@ -1354,7 +1727,7 @@ namespace fs::Ext2{
             }
         }
 
-        return WriteDir(node, entries);
+        return 0;
     }
 
     int Ext2Volume::Truncate(Ext2Node* node, off_t length){
@@ -1397,6 +1770,7 @@ namespace fs::Ext2{
     Ext2Node::Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode){
         this->vol = vol;
         volumeID = vol->volumeID;
+        cacheDentries = true;
 
         uid = ino.uid;
         size = ino.size;
@@ -1504,6 +1878,7 @@ namespace fs::Ext2{
 
     void Ext2Node::Sync(){
         vol->SyncNode(this);
+        vol->FlushNode(this);
     }
 
     void Ext2Node::Close(){
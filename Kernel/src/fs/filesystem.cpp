@@ -1,6 +1,10 @@
 #include <fs/filesystem.h>
 
 #include <fs/fsvolume.h>
+#include <fs/dentrycache.h>
+#include <fs/pagecache.h>
+#include <fs/epoll.h>
+#include <net/socket.h>
 #include <logging.h>
 #include <errno.h>
 
@@ -130,7 +134,7 @@ namespace fs{
 
 				currentNode = FollowLink(currentNode);
 
-				if(!node){
+				if(!currentNode){
 					Log::Warning("ResolvePath: Unresolved symlink!");
 					kfree(tempPath);
 					return currentNode;
@@ -159,6 +163,7 @@ namespace fs{
 			FsNode* node = fs::FindDir(currentNode,file);
 			if(!node) {
 				Log::Warning("%s not found!", path);
+				kfree(tempPath);
 				return nullptr;
 			}
 
@@ -186,9 +191,12 @@ namespace fs{
 
 			if((file = strtok(NULL, "/"))){
 				Log::Warning("Found file in the path however we were not finished");
+				kfree(tempPath);
 				return nullptr;
 			}
 
+			currentNode = node;
+
 			amountOfSymlinks = 0;
 			while(followSymlinks && ((currentNode->flags & FS_NODE_TYPE) == FS_NODE_SYMLINK)){ // Check for symlinks
 				if(amountOfSymlinks++ > MAXIMUM_SYMLINK_AMOUNT){
@@ -198,7 +206,7 @@ namespace fs{
 
 				currentNode = FollowLink(currentNode);
 
-				if(!node){
+				if(!currentNode){
 					Log::Warning("ResolvePath: Unresolved symlink!");
 					kfree(tempPath);
 					return currentNode;
@@ -364,6 +372,9 @@ namespace fs{
 
 		if((node->flags & FS_NODE_TYPE) == FS_NODE_SYMLINK) return Read(node->link, offset, size, buffer);
 
+		// The file system copies into the buffer with its locks held, a fault on a file mapping would need them too
+		if(!Memory::PrefaultUserBuffer(reinterpret_cast<uintptr_t>(buffer), size, true)) return -EFAULT;
+
         return node->Read(offset,size,buffer);
     }
 
@@ -372,7 +383,14 @@ namespace fs{
 
 		if((node->flags & FS_NODE_TYPE) == FS_NODE_SYMLINK) return Write(node->link, offset, size, buffer);
 
-        return node->Write(offset,size,buffer);
+		if(!Memory::PrefaultUserBuffer(reinterpret_cast<uintptr_t>(buffer), size, false)) return -EFAULT;
+
+        ssize_t ret = node->Write(offset,size,buffer);
+		if(ret > 0 && node->pageCache){
+			node->pageCache->Update(offset, ret, buffer); // Keep memory mappings of the file in sync
+		}
+
+        return ret;
     }
 
     fs_fd_t* Open(FsNode* node, uint32_t flags){
@@ -400,14 +418,68 @@ namespace fs{
 		assert(dir);
 		assert(link);
 
-		return dir->Link(link, ent);
+		bool cached = dir->cacheDentries;
+		if(cached){
+			DentryCache::BeginChange(dir, ent->name);
+		}
+
+		int ret = dir->Link(link, ent);
+		if(cached){
+			DentryCache::EndChange();
+		}
+
+		return ret;
 	}
 
     int Unlink(FsNode* dir, DirectoryEntry* ent, bool unlinkDirectories){
 		assert(dir);
 		assert(ent);
 
-		return dir->Unlink(ent, unlinkDirectories);
+		bool cached = dir->cacheDentries;
+		if(cached){
+			DentryCache::BeginChange(dir, ent->name);
+		}
+
+		int ret = dir->Unlink(ent, unlinkDirectories);
+		if(cached){
+			DentryCache::EndChange();
+		}
+
+		return ret;
+	}
+
+    int Create(FsNode* dir, DirectoryEntry* ent, uint32_t mode){
+		assert(dir);
+		assert(ent);
+
+		bool cached = dir->cacheDentries;
+		if(cached){
+			DentryCache::BeginChange(dir, ent->name);
+		}
+
+		int ret = dir->Create(ent, mode);
+		if(cached){
+			DentryCache::EndChange();
+		}
+
+		return ret;
+	}
+
+    int CreateDirectory(FsNode* dir, DirectoryEntry* ent, uint32_t mode){
+		assert(dir);
+		assert(ent);
+
+		bool cached = dir->cacheDentries;
+		if(cached){
+			DentryCache::BeginChange(dir, ent->name);
+		}
+
+		int ret = dir->CreateDirectory(ent, mode);
+		if(cached){
+			DentryCache::EndChange();
+		}
+
+		return ret;
 	}
 
     void Close(FsNode* node){
@@ -417,12 +489,42 @@ namespace fs{
     void Close(fs_fd_t* fd){
 		if(!fd) return;
 
+		EPoll::OnHandleClose(fd);
+
         fd->node->Close();
 		fd->node = nullptr;
 
 		kfree(fd);
     }
 
+    int Poll(FsNode* node, int events){
+		int revents = 0;
+
+		if((node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET){
+			Socket* sock = (Socket*)node;
+
+			if(sock->IsListening()){ // Listening sockets are never connected, they are readable when there is someone to accept
+				if(sock->PendingConnections() && (events & POLLIN)){
+					revents |= POLLIN;
+				}
+
+				return revents;
+			} else if(!sock->IsConnected()){
+				revents |= POLLHUP;
+			}
+		}
+
+		if(node->CanRead() && (events & POLLIN)){
+			revents |= POLLIN;
+		}
+
+		if(node->CanWrite() && (events & POLLOUT)){
+			revents |= POLLOUT;
+		}
+
+		return revents;
+	}
+
     int ReadDir(FsNode* node, DirectoryEntry* dirent, uint32_t index){
 		assert(node);
 
@@ -435,8 +537,21 @@ namespace fs{
 		assert(node);
 
 		if((node->flags & FS_NODE_TYPE) == FS_NODE_SYMLINK) return FindDir(node->link, name);
-            
-		return node->FindDir(name);
+
+		if(!node->cacheDentries){
+			return node->FindDir(name);
+		}
+
+		FsNode* result;
+		if(DentryCache::Lookup(node, name, result)){
+			return result;
+		}
+
+		uint64_t generation = DentryCache::Generation(); // Anything that changes the directory from here on makes the result stale
+		result = node->FindDir(name);
+		DentryCache::Insert(node, name, result, generation);
+
+		return result;
     }
 	
     ssize_t Read(fs_fd_t* handle, size_t size, uint8_t *buffer){
@@ -458,6 +573,10 @@ namespace fs{
 
 			if(ret >= 0){
 				handle->pos += ret;
+
+				if(handle->mode & (O_SYNC | O_DSYNC)){
+					handle->node->Sync();
+				}
 			}
 			
 			return ret;
@@ -530,23 +649,23 @@ namespace fs{
 			assert(oldpathParent); // If this is null something went horribly wrong
 
 			if(newnode){
-				if(auto e = newpathParent->Unlink(&newpathDirent)){
+				if(auto e = fs::Unlink(newpathParent, &newpathDirent)){
 					return e; // Unlink error
 				}
 			}
 
-			if(auto e = newpathParent->Link(oldnode, &newpathDirent)){
+			if(auto e = fs::Link(newpathParent, oldnode, &newpathDirent)){
 				return e; // Link error
 			}
 			
-			if(auto e = oldpathParent->Unlink(&oldpathDirent)){
+			if(auto e = fs::Unlink(oldpathParent, &oldpathDirent)){
 				return e; // Unlink error
 			}
 		} else if((oldnode->flags & FS_NODE_TYPE) != FS_NODE_SYMLINK) { // Aight we have to copy it
 			FsNode* oldpathParent = fs::ResolveParent(oldpath, olddir);
 			assert(oldpathParent); // If this is null something went horribly wrong
 
-			if(auto e = newpathParent->Create(&newpathDirent, 0)){
+			if(auto e = fs::Create(newpathParent, &newpathDirent, 0)){
 				return e; // Create error
 			}
 
@@ -570,7 +689,7 @@ namespace fs{
 				return wret;
 			}
 			
-			if(auto e = oldpathParent->Unlink(&oldpathDirent)){
+			if(auto e = fs::Unlink(oldpathParent, &oldpathDirent)){
 				return e; // Unlink error
 			}
 		} else {
@@ -580,4 +699,4 @@ namespace fs{
 
 		return 0;
 	}
-}
\ No newline at end of file
+}
\ No newline at end of file
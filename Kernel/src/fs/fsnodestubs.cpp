@@ -1,10 +1,13 @@
 #include <fs/filesystem.h>
+#include <fs/pagecache.h>
 
 #include <errno.h>
 #include <logging.h>
 
 FsNode::~FsNode(){
-    
+    if(pageCache){
+        delete pageCache;
+    }
 }
 
 ssize_t FsNode::Read(size_t, size_t, uint8_t *){
@@ -21,6 +24,7 @@ fs_fd_t* FsNode::Open(size_t flags){
     fDesc->pos = 0;
     fDesc->mode = flags;
     fDesc->node = this;
+    fDesc->epollEntries = nullptr;
 
     handleCount++;
 
@@ -0,0 +1,211 @@
+#include <fs/pagecache.h>
+
+#include <paging.h>
+#include <physicalallocator.h>
+#include <cpu.h>
+#include <string.h>
+#include <logging.h>
+#include <hash.h>
+#include <scheduler.h>
+
+namespace fs{
+    lock_t pageCacheCreateLock = 0;
+
+    PageCache::PageCache(FsNode* node){
+        this->node = node;
+
+        for(unsigned i = 0; i < PAGE_CACHE_BUCKETS; i++){
+            buckets[i] = nullptr;
+        }
+    }
+
+    PageCache::~PageCache(){
+        for(unsigned i = 0; i < PAGE_CACHE_BUCKETS; i++){
+            CachedPage* page = buckets[i];
+            while(page){
+                CachedPage* next = page->next;
+
+                Memory::KernelFree4KPages(page->virt, 1);
+                Memory::FreePhysicalMemoryBlock(page->phys);
+                delete page;
+
+                page = next;
+            }
+        }
+    }
+
+    // lock must be held
+    PageCache::CachedPage* PageCache::Find(uint64_t index){
+        CachedPage* page = buckets[hash((unsigned)index) % PAGE_CACHE_BUCKETS];
+        while(page && page->index != index){
+            page = page->next;
+        }
+
+        return page;
+    }
+
+    uint64_t PageCache::Lookup(uint64_t index, uint8_t** virt){
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&lock);
+
+        uint64_t phys = 0;
+        if(CachedPage* page = Find(index)){
+            phys = page->phys;
+            if(virt) *virt = page->virt;
+        }
+
+        releaseLock(&lock);
+        if(interruptsEnabled) asm("sti");
+
+        return phys;
+    }
+
+    uint64_t PageCache::GetPage(uint64_t index, uint8_t** virt){
+        if(uint64_t phys = Lookup(index, virt)){
+            hits++;
+            return phys;
+        }
+
+        misses++;
+
+        // Read the page in without the lock held, if someone else gets there first ours is thrown away
+        CachedPage* page = new CachedPage;
+        page->index = index;
+        page->phys = Memory::AllocatePhysicalMemoryBlock();
+        page->virt = (uint8_t*)Memory::KernelAllocate4KPages(1);
+        Memory::KernelMapVirtualMemory4K(page->phys, (uintptr_t)page->virt, 1);
+        memset(page->virt, 0, PAGE_SIZE_4K); // Anything past the end of the file reads as zero
+
+        ssize_t ret = node->Read(index * PAGE_SIZE_4K, PAGE_SIZE_4K, page->virt);
+
+        CachedPage* existing = nullptr;
+        if(ret >= 0){
+            int interruptsEnabled = CheckInterrupts();
+            asm("cli");
+            acquireLock(&lock);
+
+            existing = Find(index);
+            if(!existing){
+                CachedPage*& bucket = buckets[hash((unsigned)index) % PAGE_CACHE_BUCKETS];
+                page->next = bucket;
+                bucket = page;
+            }
+
+            releaseLock(&lock);
+            if(interruptsEnabled) asm("sti");
+        } else {
+            Log::Warning("[PageCache] Error %d reading page %x of inode %d", -ret, index, node->inode);
+        }
+
+        if(ret < 0 || existing){
+            Memory::KernelFree4KPages(page->virt, 1);
+            Memory::FreePhysicalMemoryBlock(page->phys);
+            delete page;
+
+            if(!existing){
+                return 0;
+            }
+
+            page = existing;
+        }
+
+        if(virt) *virt = page->virt;
+        return page->phys;
+    }
+
+    void PageCache::Update(size_t off, size_t size, uint8_t* buffer){
+        while(size){
+            uint64_t pageOffset = off & (PAGE_SIZE_4K - 1);
+            size_t count = PAGE_SIZE_4K - pageOffset;
+            if(count > size) count = size;
+
+            uint8_t* virt;
+            if(Lookup(off / PAGE_SIZE_4K, &virt)){
+                memcpy(virt + pageOffset, buffer, count);
+            }
+
+            off += count;
+            buffer += count;
+            size -= count;
+        }
+    }
+
+    void PageCache::WriteBack(uint64_t index, uint64_t count){
+        for(uint64_t i = index; i < index + count; i++){
+            size_t off = i * PAGE_SIZE_4K;
+            if(off >= node->size){
+                break; // Mappings can't grow the file
+            }
+
+            uint8_t* virt;
+            if(!Lookup(i, &virt)){
+                continue;
+            }
+
+            size_t size = node->size - off;
+            if(size > PAGE_SIZE_4K) size = PAGE_SIZE_4K;
+
+            ssize_t ret = node->Write(off, size, virt);
+            if(ret < 0){
+                Log::Warning("[PageCache] Error %d writing back page %x of inode %d", -ret, i, node->inode);
+            }
+        }
+    }
+
+    PageCache* GetPageCache(FsNode* node){
+        if(node->pageCache){
+            return node->pageCache;
+        }
+
+        PageCache* cache = new PageCache(node);
+
+        acquireLock(&pageCacheCreateLock);
+        if(node->pageCache){
+            releaseLock(&pageCacheCreateLock);
+
+            delete cache; // Someone else got there first
+            return node->pageCache;
+        }
+
+        node->pageCache = cache;
+        releaseLock(&pageCacheCreateLock);
+
+        return cache;
+    }
+
+    void MapFile(process* proc, FsNode* node, uintptr_t base, uint64_t pageCount, uint64_t offset, int flags){
+        GetPageCache(node);
+
+        file_mapping_t* mapping = new file_mapping_t;
+        mapping->base = base;
+        mapping->pageCount = pageCount;
+        mapping->node = node;
+        mapping->offset = offset;
+        mapping->flags = flags;
+
+        node->handleCount++; // Keep the node (and its page cache) around for as long as it is mapped
+
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&proc->addressSpace->faultLock);
+        proc->fileMappings.add_back(mapping);
+        releaseLock(&proc->addressSpace->faultLock);
+        if(interruptsEnabled) asm("sti");
+
+        Memory::MapFile4K(base, pageCount, proc->addressSpace);
+    }
+
+    void UnmapFiles(process* proc){
+        while(proc->fileMappings.get_length()){
+            file_mapping_t* mapping = proc->fileMappings.remove_at(0);
+
+            if(mapping->flags & MAP_SHARED){
+                mapping->node->pageCache->WriteBack(mapping->offset / PAGE_SIZE_4K, mapping->pageCount);
+            }
+
+            fs::Close(mapping->node);
+            delete mapping;
+        }
+    }
+}
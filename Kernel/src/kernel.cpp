@@ -31,9 +31,9 @@ video_mode_t videoMode;
 extern "C"
 void IdleProcess(){
 	for(;;) {
-		asm("sti");
+		asm("cli"); // Anything that wakes up once we have checked the run queue will interrupt the hlt
 		Scheduler::Yield();
-		asm("hlt");
+		asm("sti; hlt");
 	}
 }
 
@@ -71,11 +71,8 @@ void KernelProcess(){
 		}
 	}
 
-	void* initElf = (void*)kmalloc(initFsNode->size);
-	fs::Read(initFsNode, 0, initFsNode->size, (uint8_t*)initElf);
-
 	char* argv[] = {"init.lef"};
-	process_t* initProc = Scheduler::CreateELFProcess(initElf, 1, argv);
+	process_t* initProc = Scheduler::CreateELFProcess(initFsNode, 1, argv);
 
 	strcpy(initProc->workingDir, "/");
 	strcpy(initProc->name, "Init");
@@ -87,7 +84,7 @@ void KernelProcess(){
 	}
 
 	for(;;) {
-		GetCPULocal()->currentThread->state = ThreadStateBlocked;
+		GetCurrentThread()->state = ThreadStateBlocked;
 		Scheduler::Yield();
 	}
 }
@@ -134,6 +131,9 @@ extern "C"
 
 	//Log::Info("System RAM: %d MB", (HAL::multibootInfo.memoryHi + HAL::multibootInfo.memoryLo) / 1024);
 	Log::Info("Reserved RAM: %d MB", Memory::usedPhysicalBlocks * 4096 / 1024 / 1024);
+
+	if(HAL::debugMode)
+		Memory::PhysicalAllocatorSelfTest();
 	
 	Log::Info("Initializing Ramdisk...");
 	
@@ -45,7 +45,7 @@ void* liballoc_alloc(size_t pages) {
 
 int liballoc_free(void* addr, size_t pages) {
 	for(size_t i = 0; i < pages; i++){
-		uint64_t phys = Memory::VirtualToPhysicalAddress((uintptr_t)addr + i);
+		uint64_t phys = Memory::VirtualToPhysicalAddress((uintptr_t)addr + i * PAGE_SIZE_4K);
 		Memory::FreePhysicalMemoryBlock(phys);
 	}
 	Memory::KernelFree4KPages(addr, pages);
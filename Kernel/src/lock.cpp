@@ -13,16 +13,58 @@ void Semaphore::Wait(){
     }
 }
 
-void Semaphore::WaitTimeout(long timeout){
-    if(value < 0){
-        thread_t* cThread = GetCPULocal()->currentThread;
-        acquireLock(&cThread->stateLock);
-        blocked.add_back(cThread);
-        if(value > 0){
-            releaseLock(&cThread->stateLock);
-            return;
+class SemaphoreTimeoutBlocker : public Scheduler::ThreadBlocker {
+    public:
+    Timer::TimerEvent event;
+    List<thread_t*>& blocked;
+    lock_t& value;
+
+    SemaphoreTimeoutBlocker(List<thread_t*>& blocked, lock_t& value, uint64_t deadline) : blocked(blocked), value(value){
+        event.deadline = deadline;
+    }
+
+    void Block(thread_t* thread) final {
+        blocked.add_back(thread);
+
+        if(value >= 0){
+            event.deadline = 0; // Signalled before we were on the list, wake up straight away
+        }
+
+        event.thread = thread;
+        Timer::AddTimer(&event);
+    }
+
+    void Remove(thread_t* thread) final {
+        Timer::RemoveTimer(&event);
+    }
+};
+
+bool Semaphore::WaitTimeout(long timeout){
+    if(__sync_sub_and_fetch(&value, 1) >= 0){
+        return true;
+    }
+
+    SemaphoreTimeoutBlocker blocker = SemaphoreTimeoutBlocker(blocked, value, Timer::GetSystemUptimeNs() + timeout * 1000);
+    Scheduler::BlockCurrentThread(blocker, blockedLock);
+
+    Timer::RemoveTimer(&blocker.event);
+
+    thread_t* cThread = GetCurrentThread();
+    bool signalled = true;
+
+    acquireLock(&blockedLock);
+    for(auto it = blocked.begin(); it != blocked.end(); it++){
+        if(*it == cThread){ // Nobody woke us so either the timer went off or a signal came before we were on the list
+            blocked.remove(it);
+
+            if(value < 0){
+                __sync_fetch_and_add(&value, 1);
+                signalled = false;
+            }
+            break;
         }
-        releaseLock(&cThread->stateLock);
-        Timer::SleepCurrentThread(timeout); // TODO: Find a better way to do this
     }
-}
\ No newline at end of file
+    releaseLock(&blockedLock);
+
+    return signalled;
+}
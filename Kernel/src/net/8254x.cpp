@@ -9,6 +9,8 @@
 #include <timer.h>
 #include <acpi.h>
 #include <apic.h>
+#include <cpu.h>
+#include <assert.h>
 #include <net/net.h>
 
 namespace Network{
@@ -93,43 +95,66 @@ namespace Network{
     }
 
     void Intel8254x::Interrupt(){
-        uint32_t status = ReadMem32(I8254_REGISTER_INT_READ);
-        Log::Info("Net Interrupt, Status: %x", status);
+        uint32_t status = ReadMem32(I8254_REGISTER_INT_READ); // Reading clears the cause
 
-        if(status & 0x4){
+        if(status & ICR_LSC){
             Log::Info("[i8254x] Initializing Link...");
 
             WriteMem32(I8254_REGISTER_CTRL, ReadMem32(I8254_REGISTER_CTRL) | CTRL_SLU | CTRL_ASDE);
 
             UpdateLink();
-        } else if(status & 0x80){
+        }
+        
+        if(status & (ICR_RXT0 | ICR_RXDMT0 | ICR_RXO)){
+            ReceivePackets();
+        }
 
-            do {
-                rxTail = ReadMem32(I8254_REGISTER_RDESC_TAIL);
-                if(rxTail == ReadMem32(I8254_REGISTER_RDESC_HEAD)) return;
-                rxTail = (rxTail + 1) % RX_DESC_COUNT;
+        if(status & ICR_TXDW){
+            acquireLock(&txLock);
+            ReclaimTx();
+            releaseLock(&txLock);
+        }
+    }
 
-                if(!(rxDescriptors[rxTail].status & 0x1)) break;
+    // Pass filled buffers up the stack and give the descriptors fresh ones, nothing gets copied
+    // If we are out of buffers the packet is dropped and its buffer reused
+    void Intel8254x::ReceivePackets(){
+        unsigned last = RX_DESC_COUNT;
 
-                Log::Info("Recieved Packet");
+        while(rxDescriptors[rxNext].status & RSTATUS_DD){
+            r_desc_t* rxd = &rxDescriptors[rxNext];
+            NetworkPacket* replacement = nullptr;
 
-                rxDescriptors[rxTail].status = 0;
+            if((rxd->status & RSTATUS_EOP) && !rxd->errors && (replacement = AllocatePacket())){
+                NetworkPacket* packet = rxPackets[rxNext];
+                packet->length = rxd->length;
 
-                NetworkPacket pack;
-                pack.data = kmalloc(rxDescriptors[rxTail].length);
-                pack.length = rxDescriptors[rxTail].length;
-                memcpy(pack.data, rxDescriptorsVirt[rxTail], pack.length);
+                rxPackets[rxNext] = replacement;
+                rxd->addr = replacement->phys;
 
-                queue.add_back(pack);
+                EnqueuePacket(packet);
+            } else {
+                rxDropped++;
+            }
 
-                Log::Info("Ethertype: %x", (*((uint16_t*)pack.data + 12)));
+            rxd->status = 0;
 
-                WriteMem32(I8254_REGISTER_RDESC_TAIL, rxTail);
-            } while(1);
+            last = rxNext;
+            rxNext = (rxNext + 1) % RX_DESC_COUNT;
+        }
 
-            for(auto& t : blocker.blocked){
-                Scheduler::UnblockThread(t);
-            }
+        if(last < RX_DESC_COUNT){
+            WriteMem32(I8254_REGISTER_RDESC_TAIL, last); // Hand the descriptors back to the card
+        }
+    }
+
+    // Release packets the card has finished sending, txLock must be held
+    void Intel8254x::ReclaimTx(){
+        while(txClean != txTail && (txDescriptors[txClean].status & TSTATUS_DD)){
+            ReleasePacket(txPackets[txClean]);
+            txPackets[txClean] = nullptr;
+
+            txClean = (txClean + 1) % TX_DESC_COUNT;
         }
     }
 
@@ -157,7 +182,7 @@ namespace Network{
     }
 
     void Intel8254x::UpdateLink(){
-        int _link =  (ReadMem32(I8254_REGISTER_STATUS) | STATUS_LINK_UP);
+        int _link =  (ReadMem32(I8254_REGISTER_STATUS) & STATUS_LINK_UP);
         Log::Info("[i8254x] Link %s, Speed: %d", (_link) ? "Up" : "Down", GetSpeed());
         
         if(_link){
@@ -173,11 +198,23 @@ namespace Network{
         rxDescriptors = (r_desc_t*)Memory::GetIOMapping(rxDescPhys);
         uint32_t rxLow = rxDescPhys & 0xFFFFFFFF;
         uint32_t rxHigh = rxDescPhys >> 32;
-        uint32_t rxLen = 4096; // Memory block size
+        uint32_t rxLen = RX_DESC_COUNT * sizeof(r_desc_t);
         uint32_t rxHead = 0;
-        uint32_t _rxTail = RX_DESC_COUNT; // Offset from base
+        uint32_t _rxTail = RX_DESC_COUNT - 1; // Every descriptor belongs to the card
 
-        rxDescriptorsVirt = (void**)kmalloc(RX_DESC_COUNT * sizeof(void*));
+        rxPackets = (NetworkPacket**)kmalloc(RX_DESC_COUNT * sizeof(NetworkPacket*));
+
+        for(int i = 0; i < RX_DESC_COUNT; i++){
+            r_desc_t* rxd = &rxDescriptors[i];
+
+            rxPackets[i] = AllocatePacket();
+            assert(rxPackets[i]);
+
+            rxd->addr = rxPackets[i]->phys;
+            rxd->status = 0;
+        }
+
+        rxNext = 0;
 
         WriteMem32(I8254_REGISTER_RDESC_LO, rxLow);
         WriteMem32(I8254_REGISTER_RDESC_HI, rxHigh);
@@ -185,17 +222,11 @@ namespace Network{
         WriteMem32(I8254_REGISTER_RDESC_HEAD, rxHead);
         WriteMem32(I8254_REGISTER_RDESC_TAIL, _rxTail);
 
-        for(int i = 0; i < RX_DESC_COUNT; i++){
-            r_desc_t* rxd = &rxDescriptors[i];
-            uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
-            rxd->addr = phys;
-            rxd->status = 0;
+        WriteMem32(I8254_REGISTER_RDTR, I8254_RX_DELAY);
+        WriteMem32(I8254_REGISTER_RADV, I8254_RX_ABSOLUTE_DELAY);
 
-            rxDescriptorsVirt[i] = Memory::KernelAllocate4KPages(1);
-            Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)rxDescriptorsVirt[i], 1);
-        }
-
-        WriteMem32(I8254_REGISTER_TCTRL, (TCTRL_ENABLE | TCTRL_PSP));
+        // Packet buffers are 2KB and long packets are not accepted so every packet fits in one descriptor
+        WriteMem32(I8254_REGISTER_RCTRL, (RCTRL_ENABLE | RCTRL_UPE | RCTRL_MPE | RCTRL_BAM | RCTRL_SECRC | BSIZE_2048));
     }
     
     void Intel8254x::InitializeTx(){
@@ -203,11 +234,21 @@ namespace Network{
         txDescriptors = (t_desc_t*)Memory::GetIOMapping(txDescPhys);
         uint32_t txLow = txDescPhys & 0xFFFFFFFF;
         uint32_t txHigh = txDescPhys >> 32;
-        uint32_t txLen = 4096; // Memory block size
+        uint32_t txLen = TX_DESC_COUNT * sizeof(t_desc_t);
         uint32_t txHead = 0;
-        uint32_t _txTail = RX_DESC_COUNT; // Offset from base
+        uint32_t _txTail = 0; // Ring is empty
+
+        txPackets = (NetworkPacket**)kmalloc(TX_DESC_COUNT * sizeof(NetworkPacket*));
+
+        for(int i = 0; i < TX_DESC_COUNT; i++){
+            t_desc_t* txd = &txDescriptors[i];
+            txd->addr = 0;
+            txd->status = 0;
+
+            txPackets[i] = nullptr;
+        }
 
-        txDescriptorsVirt = (void**)kmalloc(TX_DESC_COUNT * sizeof(void*));
+        txTail = txClean = 0;
 
         WriteMem32(I8254_REGISTER_TDESC_LO, txLow);
         WriteMem32(I8254_REGISTER_TDESC_HI, txHigh);
@@ -215,21 +256,14 @@ namespace Network{
         WriteMem32(I8254_REGISTER_TDESC_HEAD, txHead);
         WriteMem32(I8254_REGISTER_TDESC_TAIL, _txTail);
 
-        for(int i = 0; i < TX_DESC_COUNT; i++){
-            t_desc_t* txd = &txDescriptors[i];
-            uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
-            txd->addr = phys;
-            txd->status = 0;
-
-            txDescriptorsVirt[i] = Memory::KernelAllocate4KPages(1);
-            Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)txDescriptorsVirt[i], 1);
-        }
+        WriteMem32(I8254_REGISTER_TIDV, I8254_TX_DELAY);
+        WriteMem32(I8254_REGISTER_TADV, I8254_TX_ABSOLUTE_DELAY);
 
-        WriteMem32(I8254_REGISTER_RCTRL, (RCTRL_ENABLE | RCTRL_SBP | RCTRL_UPE | RCTRL_MPE | RCTRL_LPE | RCTRL_BAM | RCTRL_SECRC | BSIZE_4096));
+        WriteMem32(I8254_REGISTER_TCTRL, (TCTRL_ENABLE | TCTRL_PSP));
     }
 
     Intel8254x::Intel8254x(uint16_t vendorID, uint16_t deviceID){
-        txTail = rxTail = 0;
+        txTail = txClean = rxNext = 0;
         card = this;
 
         device.vendorID = vendorID;
@@ -309,23 +343,44 @@ namespace Network{
         InitializeRx();
         InitializeTx();
 
-        WriteMem32(I8254_REGISTER_INT_MASK, 0x1F6DF); // Set the interrupt mask to enable all interrupts
+        WriteMem32(I8254_REGISTER_ITR, I8254_ITR_INTERVAL);
+        WriteMem32(I8254_REGISTER_INT_MASK, ICR_TXDW | ICR_LSC | ICR_RXDMT0 | ICR_RXO | ICR_RXT0);
         UpdateLink();
     }
     
-    void Intel8254x::SendPacket(void* data, size_t len){
-        t_desc_t* txd = &(txDescriptors[txTail]);
+    // The card reads straight out of the packet buffer, the packet is released from the interrupt handler once it has been sent
+    void Intel8254x::SendPacket(NetworkPacket* packet){
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&txLock);
+
+        unsigned next = (txTail + 1) % TX_DESC_COUNT;
+        if(next == txClean){
+            ReclaimTx(); // Ring is full, see if anything has finished since the last interrupt
+        }
 
-        Log::Info("Sending Packet, Tx tail %d", txTail);
+        if(next == txClean){
+            txDropped++;
 
-        memcpy(txDescriptorsVirt[txTail], data, len);
-        txd->length = len;
-        txd->cmd = TCMD_EOP | TCMD_IFCS | TCMD_RS;
-        
-        txTail = (txTail + 1) % TX_DESC_COUNT;
+            releaseLock(&txLock);
+            if(interruptsEnabled) asm("sti");
+
+            ReleasePacket(packet);
+            return;
+        }
+
+        t_desc_t* txd = &(txDescriptors[txTail]);
+        txd->addr = packet->phys;
+        txd->length = packet->length;
+        txd->cmd = TCMD_EOP | TCMD_IFCS | TCMD_RS | TCMD_IDE;
+        txd->status = 0;
+
+        txPackets[txTail] = packet;
+        txTail = next;
 
         WriteMem32(I8254_REGISTER_TDESC_TAIL, txTail);
 
-        while(!txd->status);
+        releaseLock(&txLock);
+        if(interruptsEnabled) asm("sti");
     }
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include <net/net.h>
 #include <net/networkadapter.h>
+#include <net/loopback.h>
 #include <net/dhcp.h>
+#include <net/socket.h>
+#include <net/tcp.h>
 
 #include <scheduler.h>
 #include <logging.h>
@@ -9,12 +12,154 @@
 #include <errno.h>
 
 namespace Network::Interface{
-	IPv4Address gateway = {0, 0, 0, 0};
-	IPv4Address subnet = {255, 255, 255, 255};
+	IPv4Address address = {10, 0, 2, 15}; // Address QEMU user networking hands out until we have DHCP
+	IPv4Address gateway = {10, 0, 2, 2};
+	IPv4Address subnet = {255, 255, 255, 0};
 
+	static MACAddress broadcastMAC = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+	struct ARPEntry {
+		IPv4Address ip;
+		MACAddress mac;
+		bool resolved = false;
+		uint64_t time = 0; // Uptime (in seconds) of the reply, or of the last request if unresolved
+	};
+
+	static ARPEntry arpCache[ARP_CACHE_SIZE];
+	static lock_t arpLock = 0;
+
+	static inline uint32_t AddressValue(IPv4Address& ip){
+		return *((uint32_t*)ip.data);
+	}
+
+	// arpLock must be held, reuses the oldest entry if ip is not in the cache
+	static ARPEntry& ARPGetEntry(IPv4Address& ip){
+		ARPEntry* oldest = &arpCache[0];
+		for(ARPEntry& entry : arpCache){
+			if(entry.time && entry.ip == ip){
+				return entry;
+			}
+
+			if(entry.time < oldest->time){
+				oldest = &entry;
+			}
+		}
+
+		oldest->ip = ip;
+		oldest->resolved = false;
+		oldest->time = 0;
+		return *oldest;
+	}
+
+	static void SendARP(uint16_t opcode, MACAddress& destMAC, IPv4Address& destIP){
+		NetworkPacket* packet = AllocatePacket();
+		if(!packet){
+			return;
+		}
+
+		memset(packet->data, 0, ETHERNET_MIN_FRAME_SIZE);
+
+		EthernetFrame* frame = (EthernetFrame*)packet->data;
+		frame->dest = (opcode == ARPRequest) ? broadcastMAC : destMAC;
+		frame->src = mainAdapter->mac;
+		frame->etherType = EtherTypeARP;
+
+		ARPHeader* arp = (ARPHeader*)frame->data;
+		arp->hwType = ARPHardwareEthernet;
+		arp->prType = EtherTypeIPv4;
+		arp->hLength = 6;
+		arp->pLength = 4;
+		arp->opcode = opcode;
+		arp->srcHwAddr = mainAdapter->mac;
+		arp->srcPrAddr = address;
+		if(opcode == ARPReply){
+			arp->destHwAddr = destMAC;
+		} // Left zeroed in a request
+		arp->destPrAddr = destIP;
+
+		packet->length = ETHERNET_MIN_FRAME_SIZE; // The ARP packet is shorter than the minimum frame
+		mainAdapter->SendPacket(packet);
+	}
+
+	// Returns the hardware address to send a frame for ip to.
+	// Until the reply to our request comes in the frame is broadcast, the destination still picks it up so nothing has to be held back.
 	MACAddress IPLookup(IPv4Address& ip){
-		Log::Warning("[Network] IPLookup not implemented");
-		return {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};	
+		if(AddressValue(ip) == 0xFFFFFFFF || (AddressValue(ip) | AddressValue(subnet)) == 0xFFFFFFFF){
+			return broadcastMAC; // Limited or subnet broadcast
+		}
+
+		IPv4Address nextHop = ip;
+		if(AddressValue(gateway) && (AddressValue(ip) & AddressValue(subnet)) != (AddressValue(address) & AddressValue(subnet))){
+			nextHop = gateway; // Off our subnet
+		}
+
+		uint64_t now = Timer::GetSystemUptime();
+
+		acquireLock(&arpLock);
+		ARPEntry& entry = ARPGetEntry(nextHop);
+
+		if(entry.resolved && now - entry.time < ARP_ENTRY_LIFETIME){
+			MACAddress mac = entry.mac;
+			releaseLock(&arpLock);
+			return mac;
+		}
+
+		bool request = !entry.time || now - entry.time >= ARP_REQUEST_INTERVAL;
+		if(request){
+			entry.resolved = false;
+			entry.time = now ? now : 1; // Zero marks an unused entry
+		}
+		releaseLock(&arpLock);
+
+		if(request){
+			SendARP(ARPRequest, broadcastMAC, nextHop);
+		}
+
+		return broadcastMAC;
+	}
+
+	void OnReceiveARP(void* data, size_t length){
+		if(length < sizeof(ARPHeader)){
+			Log::Warning("[Network] [ARP] Discarding packet (too short)");
+			return;
+		}
+
+		ARPHeader* arp = (ARPHeader*)data;
+		if(arp->hwType != ARPHardwareEthernet || arp->prType != EtherTypeIPv4 || arp->hLength != 6 || arp->pLength != 4){
+			return; // Not Ethernet and IPv4
+		}
+
+		IPv4Address sender = arp->srcPrAddr;
+		MACAddress senderMAC = arp->srcHwAddr;
+		IPv4Address target = arp->destPrAddr;
+
+		if(AddressValue(sender)){ // Probes come from 0.0.0.0
+			uint64_t now = Timer::GetSystemUptime();
+
+			acquireLock(&arpLock);
+			ARPEntry& entry = ARPGetEntry(sender);
+			entry.mac = senderMAC;
+			entry.resolved = true;
+			entry.time = now ? now : 1;
+			releaseLock(&arpLock);
+		}
+
+		if(arp->opcode == ARPRequest && target == address){
+			SendARP(ARPReply, senderMAC, sender);
+		}
+	}
+
+	// 127.0.0.0/8 and our own address never leave the machine
+	static inline bool IsLocal(IPv4Address& destination){
+		return destination.data[0] == 127 || destination == address;
+	}
+
+	IPv4Address SourceAddress(IPv4Address& destination){
+		if(destination.data[0] == 127){
+			return IPv4Address(127, 0, 0, 1);
+		}
+
+		return address;
 	}
 
 	void OnReceiveICMP(void* data, size_t length){
@@ -27,18 +172,37 @@ namespace Network::Interface{
 		Log::Info("[Network] [ICMP] Received packet, Type: %d, Code: %d", header->type, header->code);
 	}
 
-	void OnReceiveUDP(IPv4Header& ipHeader, void* data, size_t length){
+	void OnReceiveUDP(NetworkPacket* p, IPv4Header& ipHeader, void* data, size_t length){
 		if(length < sizeof(UDPHeader)){
 			Log::Warning("[Network] [UDP] Discarding packet (too short)");
 			return;
 		}
 
 		UDPHeader* header = (UDPHeader*)data;
-		
-		Log::Info("[Network] [UDP] Receiving Packet (Source port: %d, Destination port: %d)", header->srcPort, header->destPort);
+
+		size_t udpLength = header->length;
+		if(udpLength < sizeof(UDPHeader) || udpLength > length){
+			Log::Warning("[Network] [UDP] Discarding packet (invalid length)");
+			return;
+		}
+
+		// A checksum of zero means the sender did not calculate one
+		if(header->checksum.value && CaclulateChecksum(data, udpLength, PseudoHeaderSum(ipHeader.sourceIP, ipHeader.destIP, IPv4ProtocolUDP, udpLength)).value){
+			Log::Warning("[Network] [UDP] Discarding packet (invalid checksum)");
+			return;
+		}
+
+		// Hold the port table lock so the socket can't be unbound and freed under us
+		acquireLock(&udpPorts.lock);
+
+		if(UDPSocket* sock = (UDPSocket*)udpPorts.Get(header->destPort)){
+			sock->OnReceive(p, ipHeader.sourceIP, header->srcPort, header->data, udpLength - sizeof(UDPHeader));
+		}
+
+		releaseLock(&udpPorts.lock);
 	}
 
-    void OnReceiveIPv4(void* data, size_t length){
+    void OnReceiveIPv4(NetworkPacket* p, void* data, size_t length){
 		if(length < sizeof(IPv4Header)){
 			Log::Warning("[Network] [IPv4] Discarding packet (too short)");
 			return;
@@ -51,20 +215,72 @@ namespace Network::Interface{
 			return;
 		}
 
+		// Short frames are padded, go by the lengths in the header
+		size_t headerLength = header->ihl * 4;
+		size_t totalLength = header->length;
+		if(headerLength < sizeof(IPv4Header) || totalLength < headerLength || totalLength > length){
+			Log::Warning("[Network] [IPv4] Discarding packet (invalid length)");
+			return;
+		}
+
+		uint8_t* payload = (uint8_t*)data + headerLength;
+		size_t payloadLength = totalLength - headerLength;
+
 		switch(header->protocol){
 			case IPv4ProtocolICMP:
-				OnReceiveICMP(header->data, length - sizeof(IPv4Header));
+				OnReceiveICMP(payload, payloadLength);
 				break;
 			case IPv4ProtocolUDP:
-				OnReceiveUDP(*header, header->data, length - sizeof(IPv4Header));
+				OnReceiveUDP(p, *header, payload, payloadLength);
 				break;
 			case IPv4ProtocolTCP:
+				TCP::OnReceive(*header, payload, payloadLength);
+				break;
 			default:
 				Log::Warning("[Network] [IPv4] Discarding packet (invalid protocol %x)", header->protocol);
 				break;
 		}
 	}
 
+	void OnReceiveEthernet(NetworkAdapter* adapter, NetworkPacket* p){
+		if(p->length < sizeof(EthernetFrame)){
+			Log::Warning("[Network] Discarding packet (too short)");
+			return;
+		}
+
+		EthernetFrame* etherFrame = (EthernetFrame*)p->data;
+
+		if(etherFrame->dest != adapter->mac && etherFrame->dest != broadcastMAC){
+			Log::Warning("[Network] Discarding packet (invalid MAC address %x:%x:%x:%x:%x:%x)", etherFrame->dest[0], etherFrame->dest[1], etherFrame->dest[2], etherFrame->dest[3], etherFrame->dest[4], etherFrame->dest[5]);
+		}
+		
+		switch (etherFrame->etherType)
+		{
+		case EtherTypeIPv4:
+			OnReceiveIPv4(p, etherFrame->data, p->length - sizeof(EthernetFrame));
+			break;
+		case EtherTypeARP:
+			if(adapter != loopback){
+				OnReceiveARP(etherFrame->data, p->length - sizeof(EthernetFrame));
+			}
+			break;
+		default:
+			Log::Warning("[Network] Discarding packet (invalid EtherType %x)", etherFrame->etherType);
+			break;
+		}
+	}
+
+	[[noreturn]] void ReceivePackets(NetworkAdapter* adapter){
+		for(;;){
+			NetworkPacket* p;
+			while((p = adapter->DequeueBlocking())){
+				OnReceiveEthernet(adapter, p); // Packets are handled in the driver's buffer
+
+				ReleasePacket(p);
+			}
+		}
+	}
+
 	[[noreturn]] void InterfaceProcess(){
 		Log::Info("[Network] Initializing network interface layer...");
 
@@ -72,90 +288,106 @@ namespace Network::Interface{
 
 		while(mainAdapter->GetLink() != LinkUp) Scheduler::Yield();
 
-		for(;;){
-			NetworkPacket p;
-			while((p = mainAdapter->DequeueBlocking()).length){
-				if(p.length < sizeof(EthernetFrame)){
-					Log::Warning("[Network] Discarding packet (too short)");
-					continue;
-				}
-
-				EthernetFrame* etherFrame = (EthernetFrame*)p.data;
-
-				if(etherFrame->dest != mainAdapter->mac){
-					Log::Warning("[Network] Discarding packet (invalid MAC address %x:%x:%x:%x:%x:%x)", etherFrame->dest[0], etherFrame->dest[1], etherFrame->dest[2], etherFrame->dest[3], etherFrame->dest[4], etherFrame->dest[5]);
-				}
-				
-				switch (etherFrame->etherType)
-				{
-				case EtherTypeIPv4:
-					OnReceiveIPv4(etherFrame->data, p.length - sizeof(EthernetFrame));
-					break;
-				default:
-					Log::Warning("[Network] Discarding packet (invalid EtherType %x)", etherFrame->etherType);
-					break;
-				}
-			}
-		}
+		ReceivePackets(mainAdapter);
+	}
+
+	// Loopback gets its own thread so sending never waits on the receive side
+	[[noreturn]] void LoopbackProcess(){
+		ReceivePackets(loopback);
 	}
 
 	void Initialize(){
-		auto proc = Scheduler::CreateProcess((void*)InterfaceProcess);
-		strcpy(proc->name, "KeNetworkInterface");
+		auto proc = Scheduler::CreateProcess((void*)LoopbackProcess);
+		strcpy(proc->name, "KeLoopback");
+
+		if(mainAdapter){
+			proc = Scheduler::CreateProcess((void*)InterfaceProcess);
+			strcpy(proc->name, "KeNetworkInterface");
+		}
 	}
 
 	void Send(void* data, size_t length){
-		mainAdapter->SendPacket(data, length);
+		if(mainAdapter){
+			mainAdapter->SendPacket(data, length);
+		}
 	}
 
-    int SendIPv4(void* data, size_t length, IPv4Address& destination, uint8_t protocol){
-		uint8_t buffer[1600]; // The maxmium Ethernet frame size is 1518 so this will do
-
-		if(length > 1518 - sizeof(EthernetFrame) - sizeof(IPv4Header)){
+    int SendIPv4(NetworkPacket* packet, size_t length, IPv4Address& destination, uint8_t protocol){
+		if(length > 1518 - sizeof(EthernetFrame) - sizeof(IPv4Header)){ // The maxmium Ethernet frame size is 1518
+			ReleasePacket(packet);
 			return -EMSGSIZE;
 		}
 
-		EthernetFrame* ethFrame = (EthernetFrame*)buffer;
+		bool local = IsLocal(destination);
+		NetworkAdapter* adapter = local ? loopback : mainAdapter;
+		if(!adapter){
+			ReleasePacket(packet);
+			return -ENETUNREACH;
+		}
+
+		EthernetFrame* ethFrame = (EthernetFrame*)packet->data;
 		ethFrame->etherType = EtherTypeIPv4;
-		ethFrame->src = mainAdapter->mac;
-		ethFrame->dest = IPLookup(destination);
+		ethFrame->src = adapter->mac;
+		ethFrame->dest = local ? adapter->mac : IPLookup(destination);
 
 		IPv4Header* ipHeader = (IPv4Header*)ethFrame->data;
 		ipHeader->ihl = 5; // 5 dwords (20 bytes)
 		ipHeader->version = 4; // Internet Protocol version 4
+		ipHeader->ecn = 0;
+		ipHeader->dscp = 0;
 		ipHeader->length = length + sizeof(IPv4Header);
+		ipHeader->id = 0;
+		ipHeader->fragmentOffset = 0;
 		ipHeader->flags = 0;
 		ipHeader->ttl = 64;
 		ipHeader->protocol = protocol;
 		ipHeader->headerChecksum = 0;
 		ipHeader->destIP = destination;
-		ipHeader->sourceIP = gateway;
+		ipHeader->sourceIP = SourceAddress(destination);
 
 		ipHeader->headerChecksum = CaclulateChecksum(ipHeader, sizeof(IPv4Header));
 
-		memcpy(ipHeader->data, data, length);
-
-		Send(ethFrame, sizeof(EthernetFrame) + sizeof(IPv4Header) + length);
+		packet->length = sizeof(EthernetFrame) + sizeof(IPv4Header) + length;
+		adapter->SendPacket(packet);
 
 		return 0;
 	}
 
-    int SendUDP(void* data, size_t length, IPv4Address& destination, BigEndianUInt16 sourcePort, BigEndianUInt16 destinationPort){
-		uint8_t buffer[1600];
+    int SendIPv4(void* data, size_t length, IPv4Address& destination, uint8_t protocol){
+		if(length > 1518 - sizeof(EthernetFrame) - sizeof(IPv4Header)){
+			return -EMSGSIZE;
+		}
+
+		// Build the frame in a packet buffer, the card sends it from there
+		NetworkPacket* packet = AllocatePacket();
+		if(!packet){
+			return -ENOBUFS;
+		}
 
-		if(length > 1518){
+		memcpy((uint8_t*)packet->data + IPV4_PAYLOAD_OFFSET, data, length);
+
+		return SendIPv4(packet, length, destination, protocol);
+	}
+
+    int SendUDP(void* data, size_t length, IPv4Address& destination, BigEndianUInt16 sourcePort, BigEndianUInt16 destinationPort){
+		if(length > 1518 - sizeof(EthernetFrame) - sizeof(IPv4Header) - sizeof(UDPHeader)){
 			return -EMSGSIZE;
 		}
 
-		UDPHeader* header = (UDPHeader*)buffer;
+		// Build the datagram straight in a packet buffer so it is only copied once
+		NetworkPacket* packet = AllocatePacket();
+		if(!packet){
+			return -ENOBUFS;
+		}
+
+		UDPHeader* header = (UDPHeader*)((uint8_t*)packet->data + IPV4_PAYLOAD_OFFSET);
 		header->destPort = destinationPort;
 		header->srcPort = sourcePort;
 		header->length = sizeof(UDPHeader) + length;
-		header->checksum = 0;
-		header->checksum = CaclulateChecksum(header, sizeof(UDPHeader));
+		header->checksum = 0; // Optional over IPv4
 
 		memcpy(header->data, data, length);
 
-		return SendIPv4(header, header->length, destination, IPv4ProtocolUDP);
+		return SendIPv4(packet, sizeof(UDPHeader) + length, destination, IPv4ProtocolUDP);
 	}
 }
\ No newline at end of file
@@ -12,8 +12,17 @@ IPSocket::~IPSocket(){
 	
 }
 
-int64_t IPSocket::IPReceiveFrom(void* buffer, size_t len){
-	return -ENOSYS;
+void IPSocket::FillAddress(sockaddr* src, socklen_t* addrlen, IPv4Address& address, BigEndianUInt16 port){
+	if(!src || !addrlen || *addrlen < sizeof(sockaddr_in)){
+		return;
+	}
+
+	sockaddr_in* inetAddr = (sockaddr_in*)src;
+	inetAddr->sin_family = InternetProtocol;
+	inetAddr->sin_port = port.value;
+	inetAddr->in_addr.s_addr = *((uint32_t*)address.data);
+
+	*addrlen = sizeof(sockaddr_in);
 }
 
 Socket* IPSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
@@ -21,6 +30,76 @@ Socket* IPSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
 }
 
 int IPSocket::Bind(const sockaddr* addr, socklen_t addrlen){
+	return -ENOSYS;
+}
+
+int IPSocket::Connect(const sockaddr* addr, socklen_t addrlen){
+	return -ENOSYS;
+}
+
+int IPSocket::Listen(int backlog){
+	return -EOPNOTSUPP;
+}
+
+fs_fd_t* IPSocket::Open(size_t flags){
+	fs_fd_t* fDesc = (fs_fd_t*)kmalloc(sizeof(fs_fd_t));
+
+	fDesc->pos = 0;
+	fDesc->mode = flags;
+	fDesc->node = this;
+	fDesc->epollEntries = nullptr;
+
+	handleCount++;
+
+	return fDesc;
+}
+    
+int64_t IPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen){
+	return -ENOSYS;
+}
+
+int64_t IPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen){
+	return -ENOSYS;
+}
+
+UDPSocket::UDPSocket(int type, int protocol) : IPSocket(type, protocol){
+	assert(type == DatagramSocket);
+}
+
+UDPSocket::~UDPSocket(){
+	while(queueHead != queueTail){
+		Network::ReleasePacket(queue[queueHead++ % UDP_RECEIVE_QUEUE_SIZE].packet);
+	}
+}
+
+void UDPSocket::OnReceive(NetworkPacket* packet, IPv4Address& source, BigEndianUInt16 sourcePort, uint8_t* data, size_t length){
+	acquireLock(&queueLock);
+
+	if(queueTail - queueHead >= UDP_RECEIVE_QUEUE_SIZE){
+		dropped++;
+
+		releaseLock(&queueLock);
+		return;
+	}
+
+	Network::ReferencePacket(packet);
+
+	Datagram& datagram = queue[queueTail % UDP_RECEIVE_QUEUE_SIZE];
+	datagram.packet = packet;
+	datagram.data = data;
+	datagram.length = length;
+	datagram.source = source;
+	datagram.sourcePort = sourcePort;
+	queueTail++;
+
+	while(watching.get_length()){
+		watching.remove_at(0)->Signal();
+	}
+
+	releaseLock(&queueLock);
+}
+
+int UDPSocket::Bind(const sockaddr* addr, socklen_t addrlen){
 	const sockaddr_in* inetAddr = (const sockaddr_in*)addr;
 
 	if(addr->family != InternetProtocol){
@@ -33,53 +112,108 @@ int IPSocket::Bind(const sockaddr* addr, socklen_t addrlen){
 		return -EINVAL;
 	}
 
+	if(port){
+		return -EINVAL; // Already bound
+	}
+
+	BigEndianUInt16 requested;
+	requested.value = inetAddr->sin_port; // Should already be big endian
+
+	if(!requested){
+		requested = Network::udpPorts.Allocate(*this);
+		if(!requested){
+			return -EADDRINUSE;
+		}
+	} else if(int e = Network::udpPorts.Acquire(*this, requested)){
+		return e;
+	}
+
 	address = inetAddr->in_addr.s_addr;
-	port.value = inetAddr->sin_port; // Should already be big endian
+	port = requested;
 
 	return 0;
 }
 
-int IPSocket::Connect(const sockaddr* addr, socklen_t addrlen){
-	return -ENOSYS;
-}
+int UDPSocket::Connect(const sockaddr* addr, socklen_t addrlen){
+	const sockaddr_in* inetAddr = (const sockaddr_in*)addr;
 
-int IPSocket::Listen(int backlog){
-	return -ENOSYS;
-}
-    
-int64_t IPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen){
-	if(flags & SOCK_NONBLOCK && !pQueue.get_length()){
-		return -EAGAIN;
+	if(addr->family != InternetProtocol){
+		Log::Warning("[UDPSocket] Invalid address family (not IPv4)");
+		return -EAFNOSUPPORT;
+	}
+	
+	if(addrlen < sizeof(sockaddr_in)){
+		Log::Warning("[UDPSocket] Invalid address length");
+		return -EINVAL;
 	}
 
-	return -ENOSYS;
+	if(!port){
+		port = Network::udpPorts.Allocate(*this);
+		if(!port){
+			return -EADDRINUSE;
+		}
+	}
 
-	while(!pQueue.get_length()) Scheduler::Yield();
+	// Sets the default destination, datagrams are still accepted from anyone
+	peerAddress = inetAddr->in_addr.s_addr;
+	destinationPort.value = inetAddr->sin_port;
+	connected = true;
 
-	if(src && addrlen){
-		src->family = InternetProtocol;
-		
-	}
+	return 0;
 }
 
-int64_t IPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen){
-	return -ENOSYS;
-}
+void UDPSocket::Close(){
+	if(handleCount && --handleCount){
+		return;
+	}
 
-void IPSocket::Close(){
 	if(port){
-		Network::ReleasePort(port);
+		Network::udpPorts.Release(port); // Waits for anyone delivering to us
 	}
 
-	Socket::Close();
+	delete this;
 }
 
-UDPSocket::UDPSocket(int type, int protocol) : IPSocket(type, protocol){
-	assert(type == DatagramSocket);
-}
+int64_t UDPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen){
+	acquireLock(&queueLock);
 
-int64_t UDPSocket::IPReceiveFrom(void* buffer, size_t len){
-	return -ENOSYS;
+	while(queueHead == queueTail){
+		if(flags & MSG_DONTWAIT){
+			releaseLock(&queueLock);
+			return -EAGAIN;
+		}
+
+		FilesystemWatcher watcher;
+		watching.add_back(&watcher);
+
+		releaseLock(&queueLock);
+		watcher.Wait();
+		acquireLock(&queueLock);
+
+		watching.remove(&watcher);
+	}
+
+	Datagram datagram = queue[queueHead % UDP_RECEIVE_QUEUE_SIZE];
+	if(flags & MSG_PEEK){
+		Network::ReferencePacket(datagram.packet); // Stays queued, keep it alive whilst we copy
+	} else {
+		queueHead++;
+	}
+
+	releaseLock(&queueLock);
+
+	size_t count = (len < datagram.length) ? len : datagram.length; // The rest of the datagram is discarded
+	memcpy(buffer, datagram.data, count);
+
+	FillAddress(src, addrlen, datagram.source, datagram.sourcePort);
+
+	Network::ReleasePacket(datagram.packet);
+
+	if(flags & MSG_TRUNC){
+		return datagram.length;
+	}
+
+	return count;
 }
 
 int64_t UDPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen){
@@ -101,17 +235,19 @@ int64_t UDPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* s
 
 		sendIPAddress = inetAddr->in_addr.s_addr;
 		destPort.value = inetAddr->sin_port; // Should already be big endian
-	} else {
-		sendIPAddress = address;
+	} else if(connected) {
+		sendIPAddress = peerAddress;
 		destPort = destinationPort;
+	} else {
+		return -EDESTADDRREQ;
 	}
 
 	if(!port){
-		port = Network::AllocatePort(*this);
+		port = Network::udpPorts.Allocate(*this);
 
 		if(!port){
 			Log::Warning("[UDPSocket] Failed to allocate temporary port!");
-			return -1;
+			return -EADDRINUSE;
 		}
 	}
 
@@ -120,4 +256,23 @@ int64_t UDPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* s
 	}
 
 	return len;
-}
\ No newline at end of file
+}
+
+void UDPSocket::Watch(FilesystemWatcher& watcher, int events){
+	acquireLock(&queueLock);
+
+	if((events & POLLOUT) || (CanRead() && (events & (POLLIN | POLLPRI)))){
+		releaseLock(&queueLock);
+		watcher.Signal(); // Sending never blocks
+		return;
+	}
+
+	watching.add_back(&watcher);
+	releaseLock(&queueLock);
+}
+
+void UDPSocket::Unwatch(FilesystemWatcher& watcher){
+	acquireLock(&queueLock);
+	watching.remove(&watcher);
+	releaseLock(&queueLock);
+}
@@ -0,0 +1,21 @@
+#include <net/loopback.h>
+
+#include <cpu.h>
+
+namespace Network {
+    NetworkAdapter* loopback = nullptr;
+
+    LoopbackAdapter::LoopbackAdapter() : NetworkAdapter("lo") {
+        linkState = LinkUp;
+
+        uint8_t zero[6] = {0, 0, 0, 0, 0, 0};
+        mac = zero;
+    }
+
+    void LoopbackAdapter::SendPacket(NetworkPacket* packet){
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli"); // queueLock is shared with interrupt handlers
+        EnqueuePacket(packet); // The receiving side takes over our reference
+        if(interruptsEnabled) asm("sti");
+    }
+}
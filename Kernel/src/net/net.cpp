@@ -2,59 +2,80 @@
 
 #include <net/networkadapter.h>
 #include <net/8254x.h>
+#include <net/loopback.h>
 #include <net/socket.h>
+#include <net/tcp.h>
 
 #include <endian.h>
+#include <errno.h>
 #include <logging.h>
 
 namespace Network {
-    Socket* ports[PORT_MAX + 1];
+    PortTable tcpPorts;
+    PortTable udpPorts;
 
     void InitializeDrivers(){
+        InitializePacketPool();
+
+        loopback = new LoopbackAdapter();
+
 	    Intel8254x::DetectAndInitialize();
     }
 
     void InitializeConnections(){
         if(!mainAdapter) {
-            Log::Info("No network adapter found!");
-            return;
+            Log::Info("No network adapter found, only loopback is available");
         }
 
         Interface::Initialize();
+        TCP::Initialize();
     }
 
-    unsigned short AllocatePort(Socket& sock){
-        int port = EPHEMERAL_PORT_RANGE_START;
+    unsigned short PortTable::Allocate(Socket& sock){
+        const unsigned rangeSize = EPHEMERAL_PORT_RANGE_END - EPHEMERAL_PORT_RANGE_START + 1;
+
+        acquireLock(&lock);
 
-        while(port <= EPHEMERAL_PORT_RANGE_END && AcquirePort(sock, port)) port++;
+        // Ports tend to be released in the order they were handed out, so the next one is usually free
+        for(unsigned i = 0; i < rangeSize; i++){
+            unsigned short port = nextEphemeral;
+            nextEphemeral = (port == EPHEMERAL_PORT_RANGE_END) ? EPHEMERAL_PORT_RANGE_START : port + 1;
 
-        if(port > EPHEMERAL_PORT_RANGE_END){
-            Log::Warning("[Network] Could not allocate ephemeral port!");
-            return 0;
+            if(!ports[port]){
+                ports[port] = &sock;
+
+                releaseLock(&lock);
+                return port;
+            }
         }
 
-        return port;
+        releaseLock(&lock);
+
+        Log::Warning("[Network] Could not allocate ephemeral port!");
+        return 0;
     }
 
-    int AcquirePort(Socket& sock, unsigned short port){
-        if(port > PORT_MAX){
-            Log::Warning("[Network] AcquirePort: Invalid port: %d", port);
-            return -1;
+    int PortTable::Acquire(Socket& sock, unsigned short port){
+        if(!port){
+            return -EINVAL;
         }
 
+        acquireLock(&lock);
+
         if(ports[port]){
-            Log::Warning("[Network] AcquirePort: Port %d in use!", port);
-            return -2;
+            releaseLock(&lock);
+            return -EADDRINUSE;
         }
 
         ports[port] = &sock;
-        
+
+        releaseLock(&lock);
         return 0;
     }
 
-    void ReleasePort(unsigned short port){
-        assert(port <= PORT_MAX);
-
+    void PortTable::Release(unsigned short port){
+        acquireLock(&lock);
         ports[port] = nullptr;
+        releaseLock(&lock);
     }
 }
\ No newline at end of file
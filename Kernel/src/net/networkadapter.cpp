@@ -3,6 +3,7 @@
 #include <list.h>
 #include <logging.h>
 #include <assert.h>
+#include <cpu.h>
 
 namespace Network {
     NetworkAdapter* mainAdapter;
@@ -34,7 +35,60 @@ namespace Network {
         SetName(buf);
     }
 
-    void NetworkAdapter::SendPacket(void* data, size_t len){
+    NetworkAdapter::NetworkAdapter(const char* name) : Device(name, TypeNetworkAdapterDevice) {
+        flags = FS_NODE_CHARDEVICE;
+    }
+
+    void NetworkAdapter::EnqueuePacket(NetworkPacket* packet){
+        acquireLock(&queueLock);
+        queue.add_back(packet);
+        releaseLock(&queueLock);
+
+        packetsQueued.Signal(); // Only wakes a thread if one is waiting
+    }
+
+    NetworkPacket* NetworkAdapter::Dequeue(){
+        NetworkPacket* packet = nullptr;
+
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queueLock);
+
+        if(queue.get_length()){
+            packet = queue.remove_at(0);
+        }
+
+        releaseLock(&queueLock);
+        if(interruptsEnabled) asm("sti");
+
+        return packet;
+    }
+
+    NetworkPacket* NetworkAdapter::DequeueBlocking(){
+        packetsQueued.Wait(); // Signalled once for every packet queued
+
+        return Dequeue();
+    }
+
+    void NetworkAdapter::SendPacket(NetworkPacket* packet){
         assert(!"NetworkAdapter: Base class SendPacket has been called");
     }
+
+    void NetworkAdapter::SendPacket(void* data, size_t len){
+        if(len > NETWORK_PACKET_SIZE){
+            Log::Warning("[Network] Packet too large (%d bytes)", len);
+            return;
+        }
+
+        NetworkPacket* packet = AllocatePacket();
+        if(!packet){
+            Log::Warning("[Network] Out of packet buffers, dropping packet");
+            return;
+        }
+
+        memcpy(packet->data, data, len);
+        packet->length = len;
+
+        SendPacket(packet);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include <net/net.h>
+
+#include <paging.h>
+#include <physicalallocator.h>
+#include <list.h>
+#include <spin.h>
+#include <cpu.h>
+#include <assert.h>
+#include <logging.h>
+
+namespace Network {
+    NetworkPacket* packetPool = nullptr;
+    FastList<NetworkPacket*> freePackets;
+    lock_t packetPoolLock = 0; // Only held with interrupts disabled, drivers allocate from their interrupt handlers
+
+    void InitializePacketPool(){
+        const unsigned packetsPerPage = PAGE_SIZE_4K / NETWORK_PACKET_SIZE;
+        const unsigned pageCount = NETWORK_PACKET_POOL_SIZE / packetsPerPage;
+
+        packetPool = new NetworkPacket[NETWORK_PACKET_POOL_SIZE];
+        uint8_t* buffers = (uint8_t*)Memory::KernelAllocate4KPages(pageCount);
+
+        for(unsigned i = 0; i < pageCount; i++){
+            uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
+            Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)buffers + i * PAGE_SIZE_4K, 1);
+
+            for(unsigned j = 0; j < packetsPerPage; j++){
+                NetworkPacket* packet = &packetPool[i * packetsPerPage + j];
+                packet->data = buffers + i * PAGE_SIZE_4K + j * NETWORK_PACKET_SIZE;
+                packet->phys = phys + j * NETWORK_PACKET_SIZE;
+                packet->length = 0;
+
+                freePackets.add_back(packet);
+            }
+        }
+
+        Log::Info("[Network] %d packet buffers (%d KB)", NETWORK_PACKET_POOL_SIZE, NETWORK_PACKET_POOL_SIZE * NETWORK_PACKET_SIZE / 1024);
+    }
+
+    NetworkPacket* AllocatePacket(){
+        NetworkPacket* packet = nullptr;
+
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&packetPoolLock);
+
+        if(freePackets.get_length()){
+            packet = freePackets.remove_at(0);
+        }
+
+        releaseLock(&packetPoolLock);
+        if(interruptsEnabled) asm("sti");
+
+        if(packet){
+            packet->length = 0;
+            packet->refCount = 1;
+        }
+
+        return packet;
+    }
+
+    void ReferencePacket(NetworkPacket* packet){
+        __sync_fetch_and_add(&packet->refCount, 1);
+    }
+
+    void ReleasePacket(NetworkPacket* packet){
+        assert(packet->refCount > 0);
+
+        if(__sync_sub_and_fetch(&packet->refCount, 1)){
+            return;
+        }
+
+        int interruptsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&packetPoolLock);
+
+        freePackets.add_back(packet);
+
+        releaseLock(&packetPoolLock);
+        if(interruptsEnabled) asm("sti");
+    }
+}
@@ -1,4 +1,5 @@
 #include <net/socket.h>
+#include <net/tcp.h>
 
 #include <logging.h>
 #include <assert.h>
@@ -25,6 +26,8 @@ Socket* Socket::CreateSocket(int domain, int type, int protocol){
     } else if (domain == InternetProtocol){
         if(type == DatagramSocket){
             return new UDPSocket(type, protocol);
+        } else if(type == StreamSocket){
+            return new TCPSocket(type, protocol);
         }
     }
 
@@ -104,6 +107,7 @@ fs_fd_t* Socket::Open(size_t flags){
     fDesc->pos = 0;
     fDesc->mode = flags;
     fDesc->node = this;
+    fDesc->epollEntries = nullptr;
 
     return fDesc;
 }
@@ -113,6 +117,14 @@ void Socket::Close(){
         delete this;
 }
 
+int Socket::SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength){
+    return -ENOPROTOOPT;
+}
+
+int Socket::GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength){
+    return -ENOPROTOOPT;
+}
+
 void Socket::Watch(FilesystemWatcher& watcher, int events){
     assert(!"Socket::Watch called from socket base");
 }
@@ -121,6 +133,8 @@ void Socket::Unwatch(FilesystemWatcher& watcher){
     assert(!"Socket::Unwatch called from socket base");
 }
 
+lock_t LocalSocket::peerLock = 0;
+
 LocalSocket::LocalSocket(int type, int protocol) : Socket(type, protocol){
     domain = UnixDomain;
     flags = FS_NODE_SOCKET;
@@ -135,9 +149,7 @@ int LocalSocket::ConnectTo(Socket* client){
 
     pending.add_back(client);
 
-    while(watching.get_length()){
-        watching.remove_at(0)->Signal();
-    }
+    SignalWatchers();
 
     while(!client->connected){
         // TODO: Actually block the task
@@ -160,10 +172,14 @@ void LocalSocket::DisconnectPeer(){
 void LocalSocket::OnDisconnect(){
     connected = false;
 
-    while(watching.get_length()){
-        watching.remove_at(0)->Signal(); // Signal all watching on disconnect
+    if(type == StreamSocket){
+        // Wake anyone blocked reading or waiting for space, nobody is coming to drain or fill the streams
+        static_cast<DataStream*>(inbound)->HangUp();
+        static_cast<DataStream*>(outbound)->HangUp();
     }
 
+    SignalWatchers(); // Signal all watching on disconnect
+
     peer = nullptr;
 }
 
@@ -182,14 +198,17 @@ Socket* LocalSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
 
     LocalSocket* client = (LocalSocket*) next;
 
-    LocalSocket* sock = new LocalSocket(*client);
+    LocalSocket* sock = new LocalSocket(client->type, 0);
     sock->outbound = client->inbound; // Outbound to client
     sock->inbound = client->outbound; // Inbound to server
     sock->role = ServerRole;
+
+    acquireLock(&peerLock);
     sock->peer = client;
     client->peer = sock;
 
     sock->connected = client->connected = true;
+    releaseLock(&peerLock);
 
     return sock;
 }
@@ -245,8 +264,8 @@ int LocalSocket::Connect(const sockaddr* addr, socklen_t addrlen){
         inbound = new PacketStream();
         outbound = new PacketStream();
     } else {
-        inbound = new DataStream(1024);
-        outbound = new DataStream(1024);
+        inbound = new DataStream(STREAM_MAX_BUFSIZE);
+        outbound = new DataStream(STREAM_MAX_BUFSIZE);
     } 
 
     role = ClientRole;
@@ -301,17 +320,26 @@ int64_t LocalSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr*
         return -ENOTCONN;
     }
 
-    if(inbound->Empty() && (flags & MSG_DONTWAIT)){
+    if(inbound->Empty() && connected && (flags & MSG_DONTWAIT)){
         return -EAGAIN;
     } else while(inbound->Empty()){
+        if(!connected){
+            return 0; // Peer has gone away and everything it sent has been read
+        }
+
         inbound->Wait();
     }
 
     if(flags & MSG_PEEK){
         return inbound->Peek(buffer, len);
-    } else {
-        return inbound->Read(buffer, len);
     }
+
+    int64_t ret = inbound->Read(buffer, len);
+    if(ret > 0 && type == StreamSocket){
+        SignalPeer(); // There is space for the peer to write into again
+    }
+
+    return ret;
 }
 
 int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen){
@@ -330,18 +358,37 @@ int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr*
         return -ENOTCONN;
     }
 
-    if(type == StreamSocket && (flags & MSG_DONTWAIT) && outbound->Pos() + len >= STREAM_MAX_BUFSIZE){
-        return -EAGAIN;
-    } else while(type == StreamSocket && outbound->Pos() + len >= STREAM_MAX_BUFSIZE)  {
-        Scheduler::Yield();
+    if(type != StreamSocket){
+        int64_t written = outbound->Write(buffer, len);
+
+        if(written > 0){
+            SignalPeer();
+        }
+
+        return written;
     }
 
-    int64_t written = outbound->Write(buffer, len);
+    DataStream* stream = static_cast<DataStream*>(outbound);
+
+    size_t written = 0;
+    for(;;){
+        int64_t count = stream->Write(reinterpret_cast<uint8_t*>(buffer) + written, len - written);
+        written += count;
 
-    if(peer && peer->CanRead()){
-        while(peer->watching.get_length()){
-            peer->watching.remove_at(0)->Signal();
+        if(count > 0){
+            SignalPeer();
         }
+
+        if(written >= len || !connected){
+            break;
+        } else if(flags & MSG_DONTWAIT){
+            if(!written){
+                return -EAGAIN;
+            }
+            break; // Partial write
+        }
+
+        stream->WaitForSpace();
     }
 
     return written;
@@ -353,6 +400,7 @@ fs_fd_t* LocalSocket::Open(size_t flags){
     fDesc->pos = 0;
     fDesc->mode = flags;
     fDesc->node = this;
+    fDesc->epollEntries = nullptr;
 
     handleCount++;
 
@@ -360,27 +408,86 @@ fs_fd_t* LocalSocket::Open(size_t flags){
 }
 
 void LocalSocket::Close(){
+    if(handleCount && --handleCount){
+        return;
+    }
+
+    acquireLock(&peerLock);
     if(peer){
-        DisconnectPeer();
+        DisconnectPeer(); // The peer can still read whatever is left, the streams are freed once it closes too
+        releaseLock(&peerLock);
+    } else {
+        releaseLock(&peerLock);
+
+        // Last one out frees the streams
+        if(inbound){
+            delete inbound;
+            inbound = nullptr;
+        }
+
+        if(outbound){
+            delete outbound;
+            outbound = nullptr;
+        }
     }
 
     Socket::Close();
 }
 
-void LocalSocket::Watch(FilesystemWatcher& watcher, int events){
-    if(!(events & (POLLIN | POLLPRI))){
-        return;
+// Watchers are only signalled with slock held, so once Unwatch returns the watcher can be freed
+void LocalSocket::SignalWatchers(){
+    acquireLock(&slock);
+    while(watching.get_length()){
+        watching.remove_at(0)->Signal();
+    }
+    releaseLock(&slock);
+}
+
+void LocalSocket::SignalPeer(){
+    acquireLock(&peerLock); // Keep the peer from being freed whilst we signal it
+
+    if(peer){
+        peer->SignalWatchers();
     }
 
-    if(CanRead() | !IsConnected()){ // POLLHUP does not care if it is requested
+    releaseLock(&peerLock);
+}
+
+void LocalSocket::Watch(FilesystemWatcher& watcher, int events){
+    acquireLock(&slock);
+
+    if(passive){
+        if(pending.get_length()){
+            releaseLock(&slock);
+            watcher.Signal(); // Ready to accept
+            return;
+        }
+    } else if(!IsConnected() || (CanWrite() && (events & POLLOUT)) || (CanRead() && (events & (POLLIN | POLLPRI)))){ // POLLHUP does not care if it is requested
+        releaseLock(&slock);
+        watcher.Signal();
         return;
     }
 
     watching.add_back(&watcher);
+    releaseLock(&slock);
 }
 
 void LocalSocket::Unwatch(FilesystemWatcher& watcher){
+    acquireLock(&slock);
     watching.remove(&watcher);
+    releaseLock(&slock);
+}
+
+bool LocalSocket::CanWrite(){
+    if(!connected || !outbound){
+        return false;
+    }
+
+    if(type == StreamSocket){
+        return static_cast<DataStream*>(outbound)->Space();
+    }
+
+    return true; // Datagrams are queued without a limit
 }
 
 namespace SocketManager{
@@ -0,0 +1,1316 @@
+#include <net/tcp.h>
+
+#include <net/net.h>
+#include <scheduler.h>
+#include <timer.h>
+#include <hash.h>
+#include <errno.h>
+#include <logging.h>
+#include <assert.h>
+
+using namespace Network;
+
+// Lock order is connectionsLock, then a listener, then a connection
+static lock_t connectionsLock = 0;
+static TCPSocket* connections[TCP_CONNECTION_BUCKETS];
+static List<TCPSocket*> listeners;
+
+static uint32_t isnCounter = 0;
+
+static inline uint64_t UptimeMs(){
+    return Timer::GetSystemUptimeNs() / 1000000;
+}
+
+static inline unsigned ConnectionBucket(IPv4Address& peer, uint16_t peerPort, uint16_t localPort){
+    return hash(*((uint32_t*)peer.data) ^ (((uint32_t)peerPort << 16) | localPort)) % TCP_CONNECTION_BUCKETS;
+}
+
+// Initial sequence numbers follow a 4us clock (RFC 793) with a per connection offset so reused ports don't line up
+static inline uint32_t GenerateISN(){
+    return (uint32_t)(Timer::GetSystemUptimeNs() / 4000) + __sync_add_and_fetch(&isnCounter, 64000);
+}
+
+static uint16_t ParseMSS(TCPHeader* header){
+    uint8_t* option = header->data;
+    uint8_t* end = (uint8_t*)header + header->dataOffset * 4;
+
+    while(option < end){
+        if(*option == TCP_OPTION_END){
+            break;
+        } else if(*option == TCP_OPTION_NOP){
+            option++;
+            continue;
+        }
+
+        if(option + 1 >= end || option[1] < 2){
+            break; // Malformed
+        }
+
+        if(*option == TCP_OPTION_MSS && option[1] == 4 && option + 4 <= end){
+            uint16_t mss = (option[2] << 8) | option[3];
+            if(mss > TCP_MSS_MAX) mss = TCP_MSS_MAX;
+
+            return mss ? mss : TCP_MSS_DEFAULT;
+        }
+
+        option += option[1];
+    }
+
+    return TCP_MSS_DEFAULT;
+}
+
+// RFC 5681 initial window
+static inline uint32_t InitialWindow(uint16_t mss){
+    uint32_t window = 2 * mss;
+    if(window < 4380) window = 4380;
+    if(window > 4U * mss) window = 4 * mss;
+
+    return window;
+}
+
+// Build and send a segment without data, used for ACKs and resets
+static void SendControlSegment(IPv4Address& destination, BigEndianUInt16 sourcePort, BigEndianUInt16 destinationPort, uint32_t sequence, uint32_t acknowledgement, uint8_t flags, uint16_t window){
+    NetworkPacket* packet = AllocatePacket();
+    if(!packet){
+        return; // The peer will retransmit
+    }
+
+    TCPHeader* header = (TCPHeader*)((uint8_t*)packet->data + IPV4_PAYLOAD_OFFSET);
+    header->srcPort = sourcePort;
+    header->destPort = destinationPort;
+    header->sequence = sequence;
+    header->acknowledgement = acknowledgement;
+    header->reserved = 0;
+    header->dataOffset = sizeof(TCPHeader) / 4;
+    header->flags = flags;
+    header->windowSize = window;
+    header->checksum = 0;
+    header->urgentPointer = 0;
+
+    IPv4Address source = Interface::SourceAddress(destination);
+    header->checksum = CaclulateChecksum(header, sizeof(TCPHeader), PseudoHeaderSum(source, destination, IPv4ProtocolTCP, sizeof(TCPHeader)));
+
+    Interface::SendIPv4(packet, sizeof(TCPHeader), destination, IPv4ProtocolTCP);
+}
+
+// Reply to a segment that does not belong to any connection (RFC 793 page 36)
+static void SendReset(IPv4Header& ipHeader, TCPHeader* header, size_t dataLength){
+    if(header->flags & TCP_FLAG_RST){
+        return; // Never reset a reset
+    }
+
+    if(header->flags & TCP_FLAG_ACK){
+        SendControlSegment(ipHeader.sourceIP, header->destPort, header->srcPort, header->acknowledgement, 0, TCP_FLAG_RST, 0);
+    } else {
+        uint32_t segmentLength = dataLength + ((header->flags & TCP_FLAG_SYN) ? 1 : 0) + ((header->flags & TCP_FLAG_FIN) ? 1 : 0);
+        SendControlSegment(ipHeader.sourceIP, header->destPort, header->srcPort, 0, header->sequence + segmentLength, TCP_FLAG_RST | TCP_FLAG_ACK, 0);
+    }
+}
+
+// connectionsLock must be held
+static void InsertConnection(TCPSocket* sock, IPv4Address& peer, uint16_t peerPort, uint16_t localPort, TCPSocket*& hashNext){
+    TCPSocket*& bucket = connections[ConnectionBucket(peer, peerPort, localPort)];
+    hashNext = bucket;
+    bucket = sock;
+}
+
+TCPSocket::TCPSocket(int type, int protocol) : IPSocket(type, protocol){
+    assert(type == StreamSocket);
+
+    // Listeners never receive data, the buffer is allocated in Connect or when a connection is accepted
+}
+
+TCPSocket::~TCPSocket(){
+    ReleaseSegments();
+
+    delete receiveBuffer;
+
+    if(portAcquired){
+        tcpPorts.Release(port);
+    }
+}
+
+void TCPSocket::SignalWatchers(){
+    while(watching.get_length()){
+        watching.remove_at(0)->Signal();
+    }
+}
+
+// lock must be held, it is dropped whilst we sleep
+void TCPSocket::WaitForChange(){
+    FilesystemWatcher watcher;
+    watching.add_back(&watcher);
+
+    releaseLock(&lock);
+    watcher.Wait();
+    acquireLock(&lock);
+
+    watching.remove(&watcher);
+}
+
+uint16_t TCPSocket::ReceiveWindow(){
+    if(!receiveBuffer){
+        return 0;
+    }
+
+    size_t space = receiveBuffer->Space();
+    return (space > 0xFFFF) ? 0xFFFF : space;
+}
+
+// Queue a segment at the end of the send queue. FIN is set on the last segment if it has not been sent yet.
+TCPSocket::Segment* TCPSocket::QueueSegment(uint8_t flags){
+    if(flags & TCP_FLAG_FIN){
+        finQueued = true;
+    }
+
+    Segment* tail = segments.get_back();
+    if(flags == TCP_FLAG_FIN && tail && !tail->sentAt && !(tail->flags & TCP_FLAG_SYN)){
+        tail->flags |= TCP_FLAG_FIN;
+        sendQueued++;
+
+        return tail;
+    }
+
+    NetworkPacket* packet = AllocatePacket();
+    if(!packet){
+        return nullptr;
+    }
+
+    Segment* segment = new Segment;
+    segment->packet = packet;
+    segment->sequence = sendQueued;
+    segment->length = 0;
+    segment->flags = flags;
+
+    sendQueued = segment->End();
+    segments.add_back(segment);
+
+    return segment;
+}
+
+// Fill in the header and hand the segment to the card, it stays in the send queue until it is acknowledged.
+// Returns false if the card still holds the buffer from the last time it was sent.
+bool TCPSocket::TransmitSegment(Segment* segment){
+    NetworkPacket* packet = segment->packet;
+    if(packet->refCount > 1){
+        return false;
+    }
+
+    size_t headerLength = sizeof(TCPHeader) + ((segment->flags & TCP_FLAG_SYN) ? 4 : 0); // SYN carries our MSS
+    uint16_t window = ReceiveWindow();
+
+    TCPHeader* header = (TCPHeader*)((uint8_t*)packet->data + IPV4_PAYLOAD_OFFSET);
+    header->srcPort = port;
+    header->destPort = destinationPort;
+    header->sequence = segment->sequence;
+    header->acknowledgement = (state == TCPStateSynSent) ? 0 : receiveNext;
+    header->reserved = 0;
+    header->dataOffset = headerLength / 4;
+    header->flags = segment->flags | ((state == TCPStateSynSent) ? 0 : TCP_FLAG_ACK) | (segment->length ? TCP_FLAG_PSH : 0);
+    header->windowSize = window;
+    header->checksum = 0;
+    header->urgentPointer = 0;
+
+    if(segment->flags & TCP_FLAG_SYN){
+        header->data[0] = TCP_OPTION_MSS;
+        header->data[1] = 4;
+        header->data[2] = TCP_MSS_MAX >> 8;
+        header->data[3] = TCP_MSS_MAX & 0xFF;
+    }
+
+    size_t length = headerLength + segment->length;
+    IPv4Address source = Interface::SourceAddress(peerAddress);
+    header->checksum = CaclulateChecksum(header, length, PseudoHeaderSum(source, peerAddress, IPv4ProtocolTCP, length));
+
+    uint64_t now = UptimeMs();
+    if(segment->sentAt){
+        segment->retransmitted = true;
+    } else {
+        segment->sentAt = now;
+    }
+
+    // Every segment acknowledges everything we have received
+    advertisedEdge = receiveNext + window;
+    ackPending = false;
+    unacknowledgedSegments = 0;
+
+    ReferencePacket(packet); // The card drops its reference once the frame has gone out
+    Interface::SendIPv4(packet, length, peerAddress, IPv4ProtocolTCP);
+
+    return true;
+}
+
+void TCPSocket::SendControl(uint8_t flags, uint32_t sequence){
+    uint16_t window = ReceiveWindow();
+
+    advertisedEdge = receiveNext + window;
+    ackPending = false;
+    unacknowledgedSegments = 0;
+
+    SendControlSegment(peerAddress, port, destinationPort, sequence, receiveNext, flags, window);
+}
+
+void TCPSocket::SendAck(){
+    SendControl(TCP_FLAG_ACK, sendNext);
+}
+
+// Send whatever the congestion and peer windows allow
+void TCPSocket::Output(){
+    if(state == TCPStateClosed || state == TCPStateListen || state == TCPStateTimeWait){
+        return;
+    }
+
+    uint32_t window = (congestionWindow < sendWindow) ? congestionWindow : sendWindow;
+    bool blocked = false;
+
+    Segment* segment = segments.get_front();
+    for(unsigned i = 0; i < segments.get_length(); i++, segment = segment->next){
+        if(TCP_SEQ_LT(segment->sequence, sendNext)){
+            continue; // Already sent
+        }
+
+        uint32_t inFlight = sendNext - sendUnacknowledged;
+        if(segment->length && inFlight + segment->length > window){
+            blocked = true;
+            break;
+        }
+
+        // Nagle, hold back a small segment whilst data is outstanding, it may still grow
+        if(!noDelay && segment == segments.get_back() && segment->length < mss && !(segment->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) && inFlight){
+            break;
+        }
+
+        if(!TransmitSegment(segment)){
+            break;
+        }
+
+        sendNext = segment->End();
+    }
+
+    if(!retransmitDeadline && (sendNext != sendUnacknowledged || blocked)){
+        retransmitDeadline = UptimeMs() + rto; // Also probes a zero window
+    }
+}
+
+// Send the oldest unacknowledged segment again
+void TCPSocket::Retransmit(){
+    Segment* segment = segments.get_front();
+    if(!segment){
+        return;
+    }
+
+    if(TransmitSegment(segment) && TCP_SEQ_LT(sendNext, segment->End())){
+        sendNext = segment->End();
+    }
+
+    retransmitDeadline = UptimeMs() + rto;
+}
+
+void TCPSocket::OnAcknowledgement(uint32_t ack, bool duplicate){
+    uint64_t now = UptimeMs();
+
+    if(TCP_SEQ_LEQ(ack, sendUnacknowledged)){
+        if(!duplicate){
+            return;
+        }
+
+        // NewReno (RFC 6582), three duplicate ACKs mean a segment was lost
+        if(fastRecovery){
+            congestionWindow += mss; // Another segment has left the network
+            Output();
+        } else if(++duplicateAcks == 3){
+            uint32_t inFlight = sendNext - sendUnacknowledged;
+
+            slowStartThreshold = (inFlight / 2 > 2U * mss) ? inFlight / 2 : 2 * mss;
+            congestionWindow = slowStartThreshold + 3 * mss;
+            fastRecovery = true;
+            recover = sendNext;
+
+            Retransmit();
+        }
+
+        return;
+    }
+
+    uint32_t acked = ack - sendUnacknowledged;
+    sendUnacknowledged = ack;
+    if(TCP_SEQ_LT(sendNext, ack)){
+        sendNext = ack; // We went back after a timeout but the originals got there
+    }
+
+    retransmits = 0;
+    duplicateAcks = 0;
+
+    long rtt = -1;
+    while(segments.get_length()){
+        Segment* segment = segments.get_front();
+        if(TCP_SEQ_GT(segment->End(), ack)){
+            break;
+        }
+
+        if(!segment->retransmitted && segment->sentAt){
+            rtt = now - segment->sentAt;
+        }
+
+        segments.remove(segment);
+        queuedBytes -= segment->length;
+
+        ReleasePacket(segment->packet);
+        delete segment;
+    }
+
+    // RFC 6298, only segments that were sent once are timed (Karn's algorithm)
+    if(rtt >= 0){
+        if(!smoothedRTT && !rttVariance){
+            smoothedRTT = rtt;
+            rttVariance = rtt / 2;
+        } else {
+            uint32_t delta = (smoothedRTT > rtt) ? (smoothedRTT - rtt) : (rtt - smoothedRTT);
+            rttVariance = (3 * rttVariance + delta) / 4;
+            smoothedRTT = (7 * smoothedRTT + rtt) / 8;
+        }
+
+        rto = smoothedRTT + ((4 * rttVariance > TCP_TIMER_INTERVAL) ? 4 * rttVariance : TCP_TIMER_INTERVAL);
+        if(rto < TCP_RTO_MIN) rto = TCP_RTO_MIN;
+        if(rto > TCP_RTO_MAX) rto = TCP_RTO_MAX;
+    }
+
+    if(fastRecovery){
+        if(TCP_SEQ_GEQ(ack, recover)){
+            fastRecovery = false;
+            congestionWindow = slowStartThreshold; // Deflate the window
+        } else {
+            // Partial ACK, the next segment was lost too
+            congestionWindow -= (acked < congestionWindow) ? acked : congestionWindow;
+            congestionWindow += mss;
+
+            Retransmit();
+        }
+    } else if(congestionWindow < slowStartThreshold){
+        congestionWindow += (acked < mss) ? acked : mss; // Slow start
+    } else {
+        uint32_t increase = mss * mss / congestionWindow; // Congestion avoidance, about one MSS per RTT
+        congestionWindow += increase ? increase : 1;
+    }
+
+    if(!fastRecovery || TCP_SEQ_GEQ(ack, recover)){
+        retransmitDeadline = (sendNext != sendUnacknowledged) ? now + rto : 0;
+    }
+
+    SignalWatchers(); // There is space to send more
+}
+
+void TCPSocket::OnData(TCPHeader* header, uint8_t* data, size_t length){
+    uint32_t sequence = header->sequence;
+
+    if(TCP_SEQ_GT(sequence, receiveNext)){
+        SendAck(); // Out of order, we don't keep it. The duplicate ACK tells the peer something went missing.
+        return;
+    }
+
+    uint32_t skip = receiveNext - sequence; // Already have the start of the segment
+    if(skip < length){
+        size_t written = receiveBuffer->Write(data + skip, length - skip);
+        receiveNext += written;
+
+        if(written){
+            SignalWatchers();
+        }
+    }
+
+    if((header->flags & TCP_FLAG_FIN) && receiveNext == sequence + length){
+        return; // FIN is acknowledged straight away by OnSegment
+    }
+
+    // Delayed ACK (RFC 1122), acknowledge at least every second full sized segment
+    if(++unacknowledgedSegments >= 2 || skip >= length){
+        SendAck();
+    } else if(!ackPending){
+        ackPending = true;
+        delayedAckDeadline = UptimeMs() + TCP_DELAYED_ACK_TIMEOUT;
+    }
+}
+
+void TCPSocket::OnSegment(IPv4Header& ipHeader, TCPHeader* header, size_t length){
+    uint8_t* data = (uint8_t*)header + header->dataOffset * 4;
+    size_t dataLength = length - header->dataOffset * 4;
+
+    uint32_t sequence = header->sequence;
+    uint32_t ack = header->acknowledgement;
+    uint8_t flags = header->flags;
+
+    if(state == TCPStateClosed){
+        SendReset(ipHeader, header, dataLength);
+        return;
+    }
+
+    if(state == TCPStateSynSent){
+        bool ackAcceptable = (flags & TCP_FLAG_ACK) && TCP_SEQ_GT(ack, sendUnacknowledged) && TCP_SEQ_LEQ(ack, sendNext);
+        if((flags & TCP_FLAG_ACK) && !ackAcceptable){
+            SendReset(ipHeader, header, dataLength);
+            return;
+        }
+
+        if(flags & TCP_FLAG_RST){
+            if(ackAcceptable){
+                Reset(-ECONNREFUSED);
+            }
+            return;
+        }
+
+        if(!(flags & TCP_FLAG_SYN)){
+            return;
+        }
+
+        receiveNext = sequence + 1;
+        mss = ParseMSS(header);
+        congestionWindow = InitialWindow(mss);
+
+        if(ackAcceptable){
+            OnAcknowledgement(ack, false);
+
+            sendWindow = header->windowSize;
+            sendWL1 = sequence;
+            sendWL2 = ack;
+
+            state = TCPStateEstablished;
+            connected = true;
+
+            SendAck();
+            SignalWatchers();
+        } else {
+            state = TCPStateSynReceived; // Simultaneous open, the SYN goes out again with an ACK
+            sendNext = sendUnacknowledged;
+            Output();
+        }
+        return;
+    }
+
+    // Is any of the segment in our receive window? (RFC 793 page 69)
+    uint32_t segmentLength = dataLength + ((flags & TCP_FLAG_SYN) ? 1 : 0) + ((flags & TCP_FLAG_FIN) ? 1 : 0);
+    uint32_t window = ReceiveWindow();
+    bool acceptable;
+    if(!segmentLength){
+        acceptable = window ? (TCP_SEQ_GEQ(sequence, receiveNext) && TCP_SEQ_LT(sequence, receiveNext + window)) : (sequence == receiveNext);
+    } else {
+        acceptable = window && ((TCP_SEQ_GEQ(sequence, receiveNext) && TCP_SEQ_LT(sequence, receiveNext + window))
+            || (TCP_SEQ_GEQ(sequence + segmentLength - 1, receiveNext) && TCP_SEQ_LT(sequence + segmentLength - 1, receiveNext + window)));
+    }
+
+    if(!acceptable){
+        if(!(flags & TCP_FLAG_RST)){
+            SendAck();
+        }
+        return;
+    }
+
+    if(flags & TCP_FLAG_RST){
+        if(state == TCPStateSynReceived || state == TCPStateClosing || state == TCPStateLastAck || state == TCPStateTimeWait){
+            Reset(0);
+        } else {
+            Reset(-ECONNRESET);
+        }
+        return;
+    }
+
+    if(flags & TCP_FLAG_SYN){
+        SendAck(); // Challenge ACK (RFC 5961), a real peer will reset
+        return;
+    }
+
+    if(!(flags & TCP_FLAG_ACK)){
+        return;
+    }
+
+    if(state == TCPStateSynReceived){
+        if(!TCP_SEQ_GT(ack, sendUnacknowledged) || !TCP_SEQ_LEQ(ack, sendNext)){
+            SendReset(ipHeader, header, dataLength);
+            return;
+        }
+
+        state = TCPStateEstablished;
+        connected = true;
+
+        sendWindow = header->windowSize;
+        sendWL1 = sequence;
+        sendWL2 = ack;
+
+        if(listener){
+            listener->halfOpen--;
+            listener->pending.add_back(this);
+            listener->SignalWatchers();
+        }
+    }
+
+    if(TCP_SEQ_GT(ack, sendQueued)){
+        SendAck(); // Acknowledges something we haven't sent
+        return;
+    }
+
+    bool duplicate = !segmentLength && ack == sendUnacknowledged && header->windowSize == sendWindow && sendNext != sendUnacknowledged;
+    OnAcknowledgement(ack, duplicate);
+
+    if(TCP_SEQ_LT(sendWL1, sequence) || (sendWL1 == sequence && TCP_SEQ_LEQ(sendWL2, ack))){
+        sendWindow = header->windowSize;
+        sendWL1 = sequence;
+        sendWL2 = ack;
+    }
+
+    bool finAcknowledged = finQueued && sendUnacknowledged == sendQueued;
+    switch(state){
+    case TCPStateFinWait1:
+        if(finAcknowledged){
+            state = TCPStateFinWait2;
+            if(orphaned){
+                timeWaitDeadline = UptimeMs() + TCP_TIME_WAIT_TIMEOUT; // Don't wait forever for a peer that never closes
+            }
+        }
+        break;
+    case TCPStateClosing:
+        if(finAcknowledged){
+            state = TCPStateTimeWait;
+            timeWaitDeadline = UptimeMs() + TCP_TIME_WAIT_TIMEOUT;
+        }
+        break;
+    case TCPStateLastAck:
+        if(finAcknowledged){
+            Reset(0);
+            return;
+        }
+        break;
+    case TCPStateTimeWait:
+        if(flags & TCP_FLAG_FIN){
+            SendAck(); // Our ACK of their FIN was lost
+            timeWaitDeadline = UptimeMs() + TCP_TIME_WAIT_TIMEOUT;
+        }
+        return;
+    }
+
+    if(dataLength && (state == TCPStateEstablished || state == TCPStateFinWait1 || state == TCPStateFinWait2)){
+        OnData(header, data, dataLength);
+    }
+
+    if((flags & TCP_FLAG_FIN) && !finReceived && receiveNext == sequence + dataLength){
+        receiveNext++;
+        finReceived = true;
+
+        SendAck();
+
+        if(state == TCPStateEstablished || state == TCPStateSynReceived){
+            state = TCPStateCloseWait;
+        } else if(state == TCPStateFinWait1){
+            state = TCPStateClosing;
+        } else if(state == TCPStateFinWait2){
+            state = TCPStateTimeWait;
+            timeWaitDeadline = UptimeMs() + TCP_TIME_WAIT_TIMEOUT;
+        }
+
+        SignalWatchers();
+    }
+
+    if(state == TCPStateTimeWait){
+        connected = false;
+        ReleaseSegments();
+    }
+
+    Output();
+}
+
+// A segment for a listening socket, listeners take SYNs and nothing else.
+// connectionsLock must be held as the new connection is added to the table.
+void TCPSocket::OnListenSegment(IPv4Header& ipHeader, TCPHeader* header, size_t length){
+    uint8_t flags = header->flags;
+    size_t dataLength = length - header->dataOffset * 4;
+
+    if(flags & TCP_FLAG_RST){
+        return;
+    }
+
+    if(flags & TCP_FLAG_ACK){
+        SendReset(ipHeader, header, dataLength);
+        return;
+    }
+
+    if(!(flags & TCP_FLAG_SYN)){
+        return;
+    }
+
+    if(halfOpen + pending.get_length() >= backlog){
+        return; // Full, the peer will try again
+    }
+
+    uint32_t iss = GenerateISN();
+
+    TCPSocket* sock = new TCPSocket(type, 0);
+    sock->state = TCPStateSynReceived;
+    sock->listener = this;
+    sock->role = ServerRole;
+    sock->receiveBuffer = new DataStream(TCP_RECEIVE_BUFFER);
+
+    sock->address = ipHeader.destIP;
+    sock->port = port;
+    sock->peerAddress = ipHeader.sourceIP;
+    sock->destinationPort = header->srcPort;
+
+    sock->receiveNext = (uint32_t)header->sequence + 1;
+    sock->mss = ParseMSS(header);
+    sock->congestionWindow = InitialWindow(sock->mss);
+
+    sock->sendUnacknowledged = sock->sendNext = sock->sendQueued = iss;
+    sock->sendWindow = header->windowSize;
+    sock->sendWL1 = header->sequence;
+    sock->sendWL2 = iss;
+
+    if(!sock->QueueSegment(TCP_FLAG_SYN)){
+        delete sock;
+        return;
+    }
+
+    InsertConnection(sock, sock->peerAddress, sock->destinationPort, port, sock->hashNext);
+    sock->hashed = true;
+    halfOpen++;
+
+    sock->Output();
+}
+
+void TCPSocket::OnRetransmitTimeout(){
+    if(++retransmits > TCP_MAX_RETRANSMITS){
+        SendControl(TCP_FLAG_RST, sendNext);
+        Reset(-ETIMEDOUT);
+        return;
+    }
+
+    // Back to slow start (RFC 5681) and back off the timer
+    uint32_t inFlight = sendNext - sendUnacknowledged;
+    slowStartThreshold = (inFlight / 2 > 2U * mss) ? inFlight / 2 : 2 * mss;
+    congestionWindow = mss;
+    fastRecovery = false;
+    duplicateAcks = 0;
+
+    rto = (rto * 2 > TCP_RTO_MAX) ? TCP_RTO_MAX : rto * 2;
+
+    // Everything after the first segment is sent again as the window opens back up
+    if(Segment* segment = segments.get_front()){
+        sendNext = segment->sequence;
+    }
+
+    Retransmit();
+}
+
+// lock must be held
+void TCPSocket::OnTimer(uint64_t now){
+    if(retransmitDeadline && now >= retransmitDeadline){
+        retransmitDeadline = 0;
+
+        if(segments.get_length()){
+            OnRetransmitTimeout();
+        }
+    }
+
+    if(ackPending && now >= delayedAckDeadline){
+        SendAck();
+    }
+
+    if(timeWaitDeadline && now >= timeWaitDeadline && (state == TCPStateTimeWait || (state == TCPStateFinWait2 && orphaned))){
+        timeWaitDeadline = 0;
+        Reset(0);
+    }
+}
+
+// Close the connection without telling the peer, lock (and that of the listener) must be held
+void TCPSocket::Reset(int error){
+    if(state == TCPStateSynReceived && listener){
+        listener->halfOpen--;
+    } else if(listener){
+        listener->pending.remove(this); // Never accepted
+    }
+
+    if(listener){
+        listener = nullptr;
+        orphaned = true; // Nobody has a handle to us
+    }
+
+    state = TCPStateClosed;
+    connected = false;
+    this->error = error;
+
+    ReleaseSegments();
+    retransmitDeadline = 0;
+    ackPending = false;
+
+    SignalWatchers();
+}
+
+void TCPSocket::ReleaseSegments(){
+    while(segments.get_length()){
+        Segment* segment = segments.remove_at(0);
+
+        ReleasePacket(segment->packet);
+        delete segment;
+    }
+
+    queuedBytes = 0;
+}
+
+void TCPSocket::OnReceive(IPv4Header& ipHeader, void* data, size_t length){
+    if(length < sizeof(TCPHeader)){
+        Log::Warning("[Network] [TCP] Discarding packet (too short)");
+        return;
+    }
+
+    TCPHeader* header = (TCPHeader*)data;
+    size_t headerLength = header->dataOffset * 4;
+    if(headerLength < sizeof(TCPHeader) || headerLength > length){
+        Log::Warning("[Network] [TCP] Discarding packet (invalid header length)");
+        return;
+    }
+
+    if(CaclulateChecksum(data, length, PseudoHeaderSum(ipHeader.sourceIP, ipHeader.destIP, IPv4ProtocolTCP, length)).value){
+        Log::Warning("[Network] [TCP] Discarding packet (invalid checksum)");
+        return;
+    }
+
+    uint16_t peerPort = header->srcPort;
+    uint16_t localPort = header->destPort;
+
+    acquireLock(&connectionsLock);
+
+    TCPSocket* sock = connections[ConnectionBucket(ipHeader.sourceIP, peerPort, localPort)];
+    while(sock){
+        if(!memcmp(sock->peerAddress.data, ipHeader.sourceIP.data, 4) && sock->destinationPort.value == header->srcPort.value && sock->port.value == header->destPort.value){
+            break;
+        }
+
+        sock = sock->hashNext;
+    }
+
+    if(sock){
+        TCPSocket* parent = sock->listener; // Needed if the connection gets established or reset
+        if(parent) acquireLock(&parent->lock);
+        acquireLock(&sock->lock);
+        releaseLock(&connectionsLock);
+
+        sock->OnSegment(ipHeader, header, length);
+
+        releaseLock(&sock->lock);
+        if(parent) releaseLock(&parent->lock);
+        return;
+    }
+
+    for(TCPSocket* l : listeners){
+        if(l->port.value == header->destPort.value){
+            acquireLock(&l->lock);
+            l->OnListenSegment(ipHeader, header, length);
+            releaseLock(&l->lock);
+
+            releaseLock(&connectionsLock);
+            return;
+        }
+    }
+
+    releaseLock(&connectionsLock);
+
+    SendReset(ipHeader, header, length - headerLength);
+}
+
+void TCPSocket::OnTimers(){
+    uint64_t now = UptimeMs();
+    TCPSocket* dead = nullptr;
+
+    acquireLock(&connectionsLock);
+
+    for(unsigned i = 0; i < TCP_CONNECTION_BUCKETS; i++){
+        TCPSocket** link = &connections[i];
+
+        while(TCPSocket* sock = *link){
+            TCPSocket* parent = sock->listener;
+            if(parent) acquireLock(&parent->lock);
+            acquireLock(&sock->lock);
+
+            sock->OnTimer(now);
+            bool finished = sock->state == TCPStateClosed && sock->orphaned;
+
+            releaseLock(&sock->lock);
+            if(parent) releaseLock(&parent->lock);
+
+            if(finished){
+                *link = sock->hashNext; // Anyone still using it had its lock, which we have just had
+                sock->hashNext = dead;
+                dead = sock;
+            } else {
+                link = &sock->hashNext;
+            }
+        }
+    }
+
+    releaseLock(&connectionsLock);
+
+    while(dead){
+        TCPSocket* next = dead->hashNext;
+        delete dead;
+        dead = next;
+    }
+}
+
+Socket* TCPSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
+    acquireLock(&lock);
+
+    while(!pending.get_length()){
+        if(state != TCPStateListen || (mode & O_NONBLOCK)){
+            releaseLock(&lock);
+            return nullptr;
+        }
+
+        WaitForChange();
+    }
+
+    TCPSocket* sock = (TCPSocket*)pending.remove_at(0);
+    sock->listener = nullptr;
+
+    releaseLock(&lock);
+
+    FillAddress(addr, addrlen, sock->peerAddress, sock->destinationPort);
+
+    return sock;
+}
+
+int TCPSocket::Bind(const sockaddr* addr, socklen_t addrlen){
+    const sockaddr_in* inetAddr = (const sockaddr_in*)addr;
+
+    if(addr->family != InternetProtocol){
+        Log::Warning("[TCPSocket] Invalid address family (not IPv4)");
+        return -EAFNOSUPPORT;
+    }
+
+    if(addrlen < sizeof(sockaddr_in)){
+        Log::Warning("[TCPSocket] Invalid address length");
+        return -EINVAL;
+    }
+
+    acquireLock(&lock);
+
+    if(portAcquired || state != TCPStateClosed){
+        releaseLock(&lock);
+        return -EINVAL;
+    }
+
+    BigEndianUInt16 requested;
+    requested.value = inetAddr->sin_port; // Should already be big endian
+
+    if(!requested){
+        requested = tcpPorts.Allocate(*this);
+        if(!requested){
+            releaseLock(&lock);
+            return -EADDRINUSE;
+        }
+    } else if(int e = tcpPorts.Acquire(*this, requested)){
+        releaseLock(&lock);
+        return e;
+    }
+
+    address = inetAddr->in_addr.s_addr;
+    port = requested;
+    portAcquired = true;
+
+    releaseLock(&lock);
+    return 0;
+}
+
+int TCPSocket::Connect(const sockaddr* addr, socklen_t addrlen){
+    const sockaddr_in* inetAddr = (const sockaddr_in*)addr;
+
+    if(addr->family != InternetProtocol){
+        Log::Warning("[TCPSocket] Invalid address family (not IPv4)");
+        return -EAFNOSUPPORT;
+    }
+
+    if(addrlen < sizeof(sockaddr_in)){
+        Log::Warning("[TCPSocket] Invalid address length");
+        return -EINVAL;
+    }
+
+    acquireLock(&connectionsLock);
+    acquireLock(&lock);
+
+    if(state != TCPStateClosed || hashed){
+        int ret = (state == TCPStateSynSent) ? -EALREADY : -EISCONN;
+
+        releaseLock(&lock);
+        releaseLock(&connectionsLock);
+        return ret;
+    }
+
+    if(!portAcquired){
+        port = tcpPorts.Allocate(*this);
+        if(!port){
+            releaseLock(&lock);
+            releaseLock(&connectionsLock);
+            return -EADDRINUSE;
+        }
+
+        portAcquired = true;
+    }
+
+    peerAddress = inetAddr->in_addr.s_addr;
+    destinationPort.value = inetAddr->sin_port; // Should already be big endian
+    role = ClientRole;
+
+    if(!receiveBuffer){
+        receiveBuffer = new DataStream(TCP_RECEIVE_BUFFER);
+    }
+
+    uint32_t iss = GenerateISN();
+    sendUnacknowledged = sendNext = sendQueued = iss;
+
+    if(!QueueSegment(TCP_FLAG_SYN)){
+        releaseLock(&lock);
+        releaseLock(&connectionsLock);
+        return -ENOBUFS;
+    }
+
+    state = TCPStateSynSent;
+
+    InsertConnection(this, peerAddress, destinationPort, port, hashNext);
+    hashed = true;
+
+    releaseLock(&connectionsLock);
+
+    Output();
+
+    while(state == TCPStateSynSent || state == TCPStateSynReceived){
+        WaitForChange();
+    }
+
+    int ret = 0;
+    if(state == TCPStateClosed){
+        ret = error ? error : -ECONNREFUSED;
+    }
+
+    releaseLock(&lock);
+    return ret;
+}
+
+int TCPSocket::Listen(int backlog){
+    acquireLock(&connectionsLock);
+    acquireLock(&lock);
+
+    if(state == TCPStateListen){
+        // Already listening, only the backlog changes
+    } else if(state != TCPStateClosed || hashed){
+        releaseLock(&lock);
+        releaseLock(&connectionsLock);
+        return -EISCONN;
+    } else {
+        if(!portAcquired){
+            port = tcpPorts.Allocate(*this);
+            if(!port){
+                releaseLock(&lock);
+                releaseLock(&connectionsLock);
+                return -EADDRINUSE;
+            }
+
+            portAcquired = true;
+        }
+
+        state = TCPStateListen;
+        passive = true;
+        role = ServerRole;
+        listeners.add_back(this);
+    }
+
+    if(backlog <= 0) backlog = 1;
+    if(backlog > CONNECTION_BACKLOG) backlog = CONNECTION_BACKLOG;
+    this->backlog = backlog;
+
+    releaseLock(&lock);
+    releaseLock(&connectionsLock);
+    return 0;
+}
+
+void TCPSocket::Close(){
+    if(handleCount && --handleCount){
+        return;
+    }
+
+    acquireLock(&connectionsLock);
+    acquireLock(&lock);
+
+    orphaned = true;
+
+    if(state == TCPStateListen){
+        listeners.remove(this);
+
+        // Reset connections nobody has accepted yet
+        for(unsigned i = 0; i < TCP_CONNECTION_BUCKETS; i++){
+            for(TCPSocket* sock = connections[i]; sock; sock = sock->hashNext){
+                if(sock->listener != this){
+                    continue;
+                }
+
+                acquireLock(&sock->lock);
+                sock->SendControl(TCP_FLAG_RST | TCP_FLAG_ACK, sock->sendNext);
+                sock->Reset(0);
+                releaseLock(&sock->lock);
+            }
+        }
+
+        state = TCPStateClosed;
+    } else if(state == TCPStateSynSent){
+        Reset(0);
+    } else if(receiveBuffer && receiveBuffer->Pos() && (state == TCPStateEstablished || state == TCPStateCloseWait)){
+        SendControl(TCP_FLAG_RST | TCP_FLAG_ACK, sendNext); // Unread data would be lost, tell the peer (RFC 2525)
+        Reset(0);
+    } else if(state == TCPStateSynReceived || state == TCPStateEstablished || state == TCPStateCloseWait){
+        if(QueueSegment(TCP_FLAG_FIN)){
+            state = (state == TCPStateCloseWait) ? TCPStateLastAck : TCPStateFinWait1;
+            Output();
+        } else {
+            SendControl(TCP_FLAG_RST | TCP_FLAG_ACK, sendNext); // No buffers for the FIN
+            Reset(0);
+        }
+    }
+
+    bool unused = !hashed; // Connections are freed by the timer once they have closed
+
+    releaseLock(&lock);
+    releaseLock(&connectionsLock);
+
+    if(unused){
+        delete this;
+    }
+}
+
+int64_t TCPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen){
+    FillAddress(src, addrlen, peerAddress, destinationPort);
+
+    acquireLock(&lock);
+
+    while(!receiveBuffer || receiveBuffer->Empty()){ // Only Listen and Closed sockets have no buffer
+        if(error){
+            int e = error;
+            error = 0; // Reported once, after that reads return EOF
+
+            releaseLock(&lock);
+            return e;
+        }
+
+        if(finReceived || (state == TCPStateClosed && hashed)){
+            releaseLock(&lock);
+            return 0;
+        }
+
+        if(state == TCPStateClosed || state == TCPStateListen){
+            releaseLock(&lock);
+            return -ENOTCONN;
+        }
+
+        if(flags & MSG_DONTWAIT){
+            releaseLock(&lock);
+            return -EAGAIN;
+        }
+
+        WaitForChange();
+    }
+
+    // Read into a kernel buffer and copy to the user once the lock is dropped,
+    // touching the user buffer can fault and block on disk
+    if(len > (size_t)receiveBuffer->Pos()) len = receiveBuffer->Pos();
+    uint8_t* bounce = (uint8_t*)kmalloc(len);
+
+    int64_t ret;
+    if(flags & MSG_PEEK){
+        ret = receiveBuffer->Peek(bounce, len);
+    } else {
+        ret = receiveBuffer->Read(bounce, len);
+
+        // Let the peer know once the window has opened up by a useful amount, avoiding silly window syndrome
+        uint32_t edge = receiveNext + ReceiveWindow();
+        if(connected && !finReceived && (edge - advertisedEdge >= 2U * mss || edge - advertisedEdge >= TCP_RECEIVE_BUFFER / 2)){
+            SendAck();
+        }
+    }
+
+    releaseLock(&lock);
+
+    if(ret > 0){
+        memcpy(buffer, bounce, ret);
+    }
+    kfree(bounce);
+
+    return ret;
+}
+
+// Data is copied from the user into a kernel buffer without the lock held, as touching the user buffer can fault and block on disk.
+// From there it goes into packet buffers, which the card sends from and which are retransmitted in place.
+int64_t TCPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen){
+    uint8_t* bounce = (uint8_t*)kmalloc((len < TCP_SEND_BUFFER) ? len : TCP_SEND_BUFFER);
+
+    size_t written = 0;
+    int64_t ret = 0;
+    while(written < len && !ret){
+        size_t chunk = (len - written < TCP_SEND_BUFFER) ? (len - written) : TCP_SEND_BUFFER;
+        memcpy(bounce, (uint8_t*)buffer + written, chunk);
+
+        acquireLock(&lock);
+
+        size_t copied = 0;
+        while(copied < chunk){
+            if(state == TCPStateSynSent || state == TCPStateSynReceived){
+                WaitForChange();
+                continue;
+            }
+
+            if(state != TCPStateEstablished && state != TCPStateCloseWait){
+                if(error){
+                    ret = error;
+                } else {
+                    ret = hashed ? -EPIPE : -ENOTCONN;
+                }
+                break;
+            }
+
+            if(queuedBytes >= TCP_SEND_BUFFER){
+                Output();
+
+                if(flags & MSG_DONTWAIT){
+                    ret = -EAGAIN;
+                    break;
+                }
+
+                WaitForChange();
+                continue;
+            }
+
+            Segment* segment = segments.get_back();
+            if(!segment || segment->sentAt || (segment->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) || segment->length >= mss){
+                segment = QueueSegment(0);
+
+                if(!segment){
+                    ret = -ENOBUFS;
+                    break;
+                }
+            }
+
+            size_t count = chunk - copied;
+            if(count > (size_t)(mss - segment->length)) count = mss - segment->length;
+            if(count > TCP_SEND_BUFFER - queuedBytes) count = TCP_SEND_BUFFER - queuedBytes;
+
+            memcpy((uint8_t*)segment->packet->data + IPV4_PAYLOAD_OFFSET + sizeof(TCPHeader) + segment->length, bounce + copied, count);
+
+            segment->length += count;
+            sendQueued += count;
+            queuedBytes += count;
+            copied += count;
+
+            if(segment->length >= mss){
+                Output(); // Get full segments moving whilst we copy the rest
+            }
+        }
+
+        Output();
+
+        releaseLock(&lock);
+        written += copied;
+    }
+
+    kfree(bounce);
+
+    if(written){
+        return written;
+    }
+
+    return ret;
+}
+
+int TCPSocket::SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength){
+    if(level != IPPROTO_TCP || opt != TCP_NODELAY){
+        return -ENOPROTOOPT;
+    }
+
+    if(optLength < sizeof(int)){
+        return -EINVAL;
+    }
+
+    acquireLock(&lock);
+
+    noDelay = *((const int*)optValue);
+    if(noDelay){
+        Output(); // Anything held back by Nagle can go now
+    }
+
+    releaseLock(&lock);
+    return 0;
+}
+
+int TCPSocket::GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength){
+    if(level != IPPROTO_TCP || opt != TCP_NODELAY){
+        return -ENOPROTOOPT;
+    }
+
+    if(*optLength < sizeof(int)){
+        return -EINVAL;
+    }
+
+    *((int*)optValue) = noDelay;
+    *optLength = sizeof(int);
+
+    return 0;
+}
+
+void TCPSocket::Watch(FilesystemWatcher& watcher, int events){
+    acquireLock(&lock);
+
+    bool ready;
+    if(state == TCPStateListen){
+        ready = pending.get_length();
+    } else {
+        ready = !connected || (CanRead() && (events & (POLLIN | POLLPRI))) || (CanWrite() && (events & POLLOUT));
+    }
+
+    if(ready){
+        releaseLock(&lock);
+        watcher.Signal();
+        return;
+    }
+
+    watching.add_back(&watcher);
+    releaseLock(&lock);
+}
+
+void TCPSocket::Unwatch(FilesystemWatcher& watcher){
+    acquireLock(&lock);
+    watching.remove(&watcher);
+    releaseLock(&lock);
+}
+
+// CanRead and CanWrite are used by poll without the lock
+bool TCPSocket::CanRead(){
+    if(state == TCPStateListen){
+        return pending.get_length();
+    }
+
+    return (receiveBuffer && !receiveBuffer->Empty()) || finReceived || error || state == TCPStateClosed;
+}
+
+bool TCPSocket::CanWrite(){
+    return (state == TCPStateEstablished || state == TCPStateCloseWait) && queuedBytes < TCP_SEND_BUFFER;
+}
+
+namespace Network::TCP {
+    [[noreturn]] void TimerProcess(){
+        for(;;){
+            TCPSocket::OnTimers();
+
+            Timer::SleepCurrentThreadNs(TCP_TIMER_INTERVAL * 1000000ULL);
+        }
+    }
+
+    void Initialize(){
+        auto proc = Scheduler::CreateProcess((void*)TimerProcess);
+        strcpy(proc->name, "KeTCPTimer");
+    }
+
+    void OnReceive(IPv4Header& ipHeader, void* data, size_t length){
+        TCPSocket::OnReceive(ipHeader, data, length);
+    }
+}
@@ -101,13 +101,15 @@ namespace Memory {
         } else mapping = Memory::Allocate4KPages(sMem->pgCount, proc->addressSpace);
 
         for(unsigned i = 0; i < sMem->pgCount; i++){
-            Memory::MapVirtualMemory4K(sMem->pages[i], (uintptr_t)mapping + i * PAGE_SIZE_4K, 1, proc->addressSpace);
+            Memory::MapVirtualMemory4K(sMem->pages[i], (uintptr_t)mapping + i * PAGE_SIZE_4K, 1, proc->addressSpace, PAGE_SHARED);
         }
 
         mem_region_t mReg;
         mReg.base = (uintptr_t)mapping;
         mReg.pageCount = sMem->pgCount;
+        acquireLock(&proc->sharedMemoryLock);
         proc->sharedMemory.add_back(mReg);
+        releaseLock(&proc->sharedMemoryLock);
         
         releaseLock(&lock);
 
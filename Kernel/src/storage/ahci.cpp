@@ -5,6 +5,9 @@
 #include <logging.h>
 #include <memory.h>
 #include <timer.h>
+#include <idt.h>
+#include <apic.h>
+#include <hal.h>
 
 namespace AHCI{
 
@@ -34,6 +37,18 @@ namespace AHCI{
 		true, // Is a generic driver
 	};
 
+	void InterruptHandler(regs64_t* r){
+		uint32_t is = ahciHBA->is;
+
+		for(int i = 0; i < 32; i++){
+			if((is >> i) & 1 && ports[i]){
+				ports[i]->OnInterrupt();
+			}
+		}
+
+		ahciHBA->is = is;
+	}
+
 	int Init(){
 		controllerDevice.classCode = PCI_CLASS_STORAGE; // Storage Device
 		controllerDevice.subclass = 0x6; // AHCI Controller
@@ -98,6 +113,25 @@ namespace AHCI{
 			}
 		}
 
+		int irqNum = controllerDevice.header0.interruptLine;
+		APIC::IO::MapLegacyIRQ(irqNum);
+		IDT::RegisterInterruptHandler(IRQ0 + irqNum, InterruptHandler);
+
+		ahciHBA->is = 0xffffffff;
+		ahciHBA->ghc |= AHCI_GHC_IE;
+
+		for(int i = 0; i < 32; i++){
+			if(ports[i]){
+				ports[i]->EnableInterrupts();
+
+				if(HAL::debugMode){
+					ports[i]->Benchmark();
+				}
+			}
+		}
+
+		Log::Info("[AHCI] Using IRQ %d", irqNum);
+
 		return 0;
 	}
 }
\ No newline at end of file
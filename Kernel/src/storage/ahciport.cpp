@@ -6,8 +6,9 @@
 #include <gpt.h>
 #include <ata.h>
 #include <timer.h>
-
-#define HBA_PxIS_TFES   (1 << 30)
+#include <scheduler.h>
+#include <cpu.h>
+#include <math.h>
 
 namespace AHCI{
 	Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem){
@@ -40,7 +41,12 @@ namespace AHCI{
 		fis = reinterpret_cast<void*>(Memory::GetIOMapping(static_cast<uintptr_t>(registers->fb)));
         memset(fis, 0, PAGE_SIZE_4K);
 
-        for(int i = 0; i < 8 /*Support for 8 command slots*/; i++){
+        addressing64 = hbaMem->cap & AHCI_CAP_S64A;
+
+        slotCount = AHCI_CAP_NCS(hbaMem->cap);
+        InitializeSlots(slotCount);
+
+        for(unsigned i = 0; i < slotCount; i++){
             commandList[i].prdtl = 1;
 
             phys = Memory::AllocatePhysicalMemoryBlock();
@@ -136,6 +142,23 @@ namespace AHCI{
 
         Identify();
 
+        uint16_t* identify = reinterpret_cast<uint16_t*>(bufVirt);
+        sectorCount = *reinterpret_cast<uint64_t*>(&identify[ATA_IDENTIFY_LBA48_SECTORS]);
+
+        if((hbaMem->cap & AHCI_CAP_NCQ) && (identify[ATA_IDENTIFY_SATA_CAP] & ATA_IDENTIFY_SATA_CAP_NCQ)){
+            ncq = true;
+
+            unsigned queueDepth = (identify[ATA_IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1;
+            if(queueDepth < slotCount){
+                slotCount = queueDepth;
+                slotMask = (slotCount >= 32) ? 0xFFFFFFFFU : ((1U << slotCount) - 1);
+            }
+        }
+
+        registers->is = registers->is;
+        registers->ie = HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_DPS | HBA_PxIS_ERROR;
+
+        Log::Info("[AHCI] Sectors: %u, Command slots: %u, NCQ: %Y, 64-bit DMA: %Y", sectorCount, slotCount, ncq, addressing64);
         Log::Info("[AHCI] Port - SSTS: %x, SCTL: %x, SERR: %x, SACT: %x, Cmd/Status: %x, FBS: %x, IE: %x", registers->ssts, registers->sctl, registers->serr, registers->sact, registers->cmd, registers->fbs, registers->ie);
 
         switch(GPT::Parse(this)){
@@ -152,131 +175,156 @@ namespace AHCI{
     }
 
     int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer){
-        uint64_t blockCount = ((count + 511) / 512);
-        
-        while(blockCount >= 8 && count){
-            uint64_t size;
-            if(count < 512 * 8) size = count;
-            else size = 512 * 8;
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+    }
+    
+    int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
+    }
 
-            if(!size) continue;
+    int Port::Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write){
+        if(uint32_t tail = count % 512){ // Partial sector at the end, read-modify-write it through a full sector
+            uint8_t sector[512];
+            uint64_t tailLBA = lba + count / 512;
 
-            if(Access(lba, 8, 0)){ // LBA, 2 blocks, read
-                return 1; // Error Reading Sectors
+            if(int e = Transfer(tailLBA, 512, sector, false)){
+                return e;
             }
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba += 8;
-            blockCount -= 8;
-            count -= size;
-        }
-
-        while(blockCount >= 2 && count){
-            uint64_t size;
-            if(count < 512 * 2) size = count;
-            else size = 512 * 2;
+            if(write){
+                memcpy(sector, buffer + (count - tail), tail);
 
-            if(!size) continue;
-
-            if(Access(lba, 2, 0)){ // LBA, 2 blocks, read
-                return 1; // Error Reading Sectors
+                if(int e = Transfer(tailLBA, 512, sector, true)){
+                    return e;
+                }
+            } else {
+                memcpy(buffer + (count - tail), sector, tail);
             }
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba += 2;
-            blockCount -= 2;
-            count -= size;
+            count -= tail;
         }
 
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+        DiskRequest req;
+        int error = 0;
 
-            if(!size) continue;
+        // Keep as many commands in flight as we can get slots for
+        while(count && !error){
+            uint32_t size = (count > AHCI_MAX_TRANSFER) ? AHCI_MAX_TRANSFER : count;
 
-            if(Access(lba, 1, 0)){ // LBA, 1 block, read
-                return 1; // Error Reading Sectors
+            int submitted = Submit(req, lba, size, buffer, write);
+            if(submitted < 0){
+                error = 1;
+                break;
+            } else if(!submitted){ // Out of slots, wait for ours to complete
+                error = Wait(req);
+                continue;
             }
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba++;
+            lba += submitted / 512;
+            buffer += submitted;
+            count -= submitted;
         }
 
-        return 0;
-    }
+        if(Wait(req)){
+            error = 1;
+        }
 
-    
-    int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
-        uint64_t blockCount = ((count / 512 * 512) < count) ? ((count / 512) + 1) : (count / 512);
+        return error;
+    }
 
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+    int Port::BuildPRDT(hba_cmd_tbl_t* commandTable, uint8_t* buffer, uint32_t size){
+        if(reinterpret_cast<uintptr_t>(buffer) & 1){
+            return 0; // Data base address must be word aligned
+        }
 
-            if(!size) continue;
+        hba_prdt_entry_t* prdt = commandTable->prdt_entry;
+        unsigned entries = 0;
 
-            memcpy(bufVirt, buffer, size);
+        uintptr_t lastEnd = 0;
+        bool mapped = ForEachBufferPage(buffer, size, [&](uintptr_t phys, uint32_t chunk) -> bool {
+            if(!addressing64 && phys + chunk > 0x100000000ULL){
+                return false;
+            }
 
-            if(Access(lba, 1, 1)){ // LBA, 1 block, write
-                return 1; // Error Reading Sectors
+            if(entries && phys == lastEnd && prdt[entries - 1].dbc + 1 + chunk <= 0x400000){ // Physically contiguous, extend the last entry (4MB max)
+                prdt[entries - 1].dbc += chunk;
+            } else {
+                if(entries >= AHCI_PRDT_MAX_ENTRIES){
+                    return false;
+                }
+
+                prdt[entries].dba = phys & 0xFFFFFFFF;
+                prdt[entries].dbau = (phys >> 32) & 0xFFFFFFFF;
+                prdt[entries].rsv0 = 0;
+                prdt[entries].dbc = chunk - 1;
+                prdt[entries].rsv1 = 0;
+                prdt[entries].i = 0;
+                entries++;
             }
 
-            buffer += size;
-            lba++;
-        }
+            lastEnd = phys + chunk;
+            return true;
+        });
 
-        return 0;
+        return mapped ? entries : 0;
     }
 
-    int Port::Access(uint64_t lba, uint32_t count, int write){
-        registers->ie = 0xffffffff; 
-        registers->is = 0; 
-        int spin = 0;
-
-        registers->tfd = 0;
+    int Port::Submit(DiskRequest& req, uint64_t lba, uint32_t size, uint8_t* buffer, bool write){
+        int slot = AcquireSlot(req);
+        if(slot < 0){
+            return 0;
+        }
 
-        int slot = FindCmdSlot();
-        if(slot == -1){
-            Log::Warning("[SATA] Could not find command slot!");
-            return 2;
+        hba_cmd_tbl_t* commandTable = commandTables[slot];
+        memset(commandTable, 0, sizeof(hba_cmd_tbl_t) - sizeof(hba_prdt_entry_t));
+
+        int entries = BuildPRDT(commandTable, buffer, size);
+        if(entries <= 0){ // The HBA can't reach the buffer, go through the bounce page for this slot
+            size = Bounce(req, slot, buffer, size, write);
+
+            commandTable->prdt_entry[0].dba = bouncePhys[slot] & 0xFFFFFFFF;
+            commandTable->prdt_entry[0].dbau = (bouncePhys[slot] >> 32) & 0xFFFFFFFF;
+            commandTable->prdt_entry[0].rsv0 = 0;
+            commandTable->prdt_entry[0].dbc = size - 1;
+            commandTable->prdt_entry[0].rsv1 = 0;
+            commandTable->prdt_entry[0].i = 0;
+            entries = 1;
         }
 
+        uint32_t sectors = size / 512;
+
         hba_cmd_header_t* commandHeader = &commandList[slot];
 
         commandHeader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
 
         commandHeader->a = 0;
         commandHeader->w = write;
-        commandHeader->c = 1;
-        commandHeader->p = 1;
+        commandHeader->c = 0;
+        commandHeader->p = !ncq; // Prefetching is not allowed with queued commands
 
+        commandHeader->prdtl = entries;
         commandHeader->prdbc = 0;
         commandHeader->pmp = 0;
 
-        hba_cmd_tbl_t* commandTable = commandTables[slot];
-        memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
-
-        commandTable->prdt_entry[0].dba = bufPhys & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbau = (bufPhys >> 32) & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbc = 512 * count - 1; // 512 bytes per sector
-        commandTable->prdt_entry[0].i = 1;
-
-        fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis); 
-        memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
+        fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis);
 
         cmdfis->fis_type = FIS_TYPE_REG_H2D;
         cmdfis->c = 1;  // Command
         cmdfis->pmport = 0; // Port multiplier
 
-        if(write){
-            cmdfis->command = ATA_CMD_WRITE_DMA_EX;
+        if(ncq){
+            cmdfis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+
+            // FPDMA commands take the sector count in the feature register and the tag in the count register
+            cmdfis->featurel = sectors & 0xFF;
+            cmdfis->featureh = (sectors >> 8) & 0xFF;
+            cmdfis->countl = slot << 3;
+            cmdfis->counth = 0;
         } else {
-            cmdfis->command = ATA_CMD_READ_DMA_EX;
+            cmdfis->command = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
+
+            cmdfis->countl = sectors & 0xFF;
+            cmdfis->counth = (sectors >> 8) & 0xFF;
         }
  
         cmdfis->lba0 = lba & 0xFF;
@@ -287,47 +335,147 @@ namespace AHCI{
         cmdfis->lba3 = (lba >> 24) & 0xFF;
         cmdfis->lba4 = (lba >> 32) & 0xFF;
         cmdfis->lba5 = (lba >> 40) & 0xFF;
- 
-        cmdfis->countl = count & 0xff;
-        cmdfis->counth = count >> 8;
 
         cmdfis->control = 0;
 
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000) {
-            spin++;
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queueLock);
+
+        Issue(req, slot);
+        issuedSlots |= 1U << slot;
+
+        if(ncq){
+            registers->sact = 1U << slot;
         }
+        registers->ci = 1U << slot;
 
-        if(spin >= 1000000){
-            Log::Warning("[SATA] Port Hung");
-            return 3;
+        releaseLock(&queueLock);
+        if(intsEnabled) asm("sti");
+
+        return size;
+    }
+
+    // queueLock must be held with interrupts disabled
+    void Port::ProcessCompletions(){
+        uint32_t interruptStatus = registers->is;
+        registers->is = interruptStatus;
+
+        if(interruptStatus & HBA_PxIS_ERROR){
+            HandleError();
+            return;
         }
 
-        registers->ie = registers->is = 0xffffffff;
+        uint32_t completed = issuedSlots & ~(registers->ci | registers->sact);
+        while(completed){
+            int slot = __builtin_ctz(completed);
+            completed &= ~(1U << slot);
 
-        registers->ci |= 1 << slot;
+            issuedSlots &= ~(1U << slot);
+            Complete(slot);
+        }
+    }
 
-        //Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
+    // queueLock must be held with interrupts disabled
+    void Port::HandleError(){
+        Log::Warning("[AHCI] Disk Error (TFD: %x, SERR: %x, CI: %x, SACT: %x)", registers->tfd, registers->serr, registers->ci, registers->sact);
 
-        while(registers->ci & (1 << slot)) {
-            if (registers->is & HBA_PxIS_TFES)   // Task file error
-            {
-                Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-                return 1;
+        uint32_t failed = issuedSlots & (registers->ci | registers->sact); // Anything else completed before the error
+
+        stopCMD(registers); // Clears CI and SACT
+        registers->serr = registers->serr;
+        registers->is = registers->is;
+        startCMD(registers);
+
+        for(uint32_t slots = issuedSlots; slots;){
+            int slot = __builtin_ctz(slots);
+            slots &= ~(1U << slot);
+
+            if(slotRequests[slot] && (failed & (1U << slot))){
+                slotRequests[slot]->error = 1;
             }
+
+            Complete(slot);
         }
 
-        spin = 0;
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000) {
-            spin++;
+        issuedSlots = 0;
+    }
+
+    void Port::EnableInterrupts(){
+        useInterrupts = true;
+    }
+
+    void Port::OnInterrupt(){
+        acquireLock(&queueLock);
+        ProcessCompletions();
+        releaseLock(&queueLock);
+    }
+
+    void Port::Benchmark(){
+        const int seconds = 2; // Signed like Timer::TimeDifference
+        const uint64_t testSectors = (sectorCount > 0x200000) ? 0x200000 : sectorCount; // Random reads over the first 1GB
+
+        if(testSectors < 2048){
+            return;
         }
-        
-       // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
-        
-        if (registers->is & HBA_PxIS_TFES) {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-            return 1;
+
+        uint8_t* buffer = (uint8_t*)Memory::KernelAllocate4KPages(AHCI_MAX_TRANSFER / PAGE_SIZE_4K);
+        for(unsigned i = 0; i < AHCI_MAX_TRANSFER / PAGE_SIZE_4K; i++){
+            Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), (uintptr_t)buffer + i * PAGE_SIZE_4K, 1);
+        }
+
+        // Sequential 128KB reads
+        {
+            uint64_t bytes = 0;
+            uint64_t lba = 0;
+
+            timeval_t start = Timer::GetSystemUptimeStruct();
+            while(Timer::TimeDifference(Timer::GetSystemUptimeStruct(), start) < seconds * 1000){
+                if(Transfer(lba, 0x20000, buffer, false)){
+                    Log::Warning("[AHCI] Benchmark: Disk error");
+                    break;
+                }
+
+                bytes += 0x20000;
+                lba += 0x20000 / 512;
+                if(lba + 0x20000 / 512 > testSectors) lba = 0;
+            }
+
+            Log::Info("[AHCI] Sequential read: %u KB/s", bytes / 1024 / seconds);
+        }
+
+        // Random 4KB reads, one at a time and with the queue kept full
+        unsigned depths[] = {1, slotCount};
+        for(unsigned depth : depths){
+            uint64_t ios = 0;
+
+            timeval_t start = Timer::GetSystemUptimeStruct();
+            while(Timer::TimeDifference(Timer::GetSystemUptimeStruct(), start) < seconds * 1000){
+                DiskRequest req;
+
+                for(unsigned i = 0; i < depth; i++){
+                    uint64_t lba = (rand() % (testSectors / 8)) * 8;
+
+                    if(Submit(req, lba, PAGE_SIZE_4K, buffer + (i % (AHCI_MAX_TRANSFER / PAGE_SIZE_4K)) * PAGE_SIZE_4K, false) <= 0){
+                        break;
+                    }
+
+                    ios++;
+                }
+
+                if(Wait(req)){
+                    Log::Warning("[AHCI] Benchmark: Disk error");
+                    break;
+                }
+            }
+
+            Log::Info("[AHCI] Random 4K read (queue depth %u): %u IOPS", depth, ios / seconds);
+        }
+
+        for(unsigned i = 0; i < AHCI_MAX_TRANSFER / PAGE_SIZE_4K; i++){
+            Memory::FreePhysicalMemoryBlock(Memory::VirtualToPhysicalAddress((uintptr_t)buffer + i * PAGE_SIZE_4K));
         }
-        return 0;
+        Memory::KernelFree4KPages(buffer, AHCI_MAX_TRANSFER / PAGE_SIZE_4K);
     }
 
     void Port::Identify(){
@@ -426,7 +574,7 @@ namespace AHCI{
     int Port::FindCmdSlot(){
         // If not set in SACT and CI, the slot is free
         uint32_t slots = (registers->sact | registers->ci);
-        for (int i=0; i<8; i++)
+        for (unsigned i = 0; i < slotCount; i++)
         {
             if ((slots&1) == 0)
                 return i;
@@ -0,0 +1,145 @@
+#include <diskqueue.h>
+
+#include <physicalallocator.h>
+#include <scheduler.h>
+#include <cpu.h>
+#include <string.h>
+
+uintptr_t BufferPhysicalAddress(uintptr_t addr){
+    thread_t* thread = GetCurrentThread();
+    return Memory::GetPhysicalAddress(addr, thread ? thread->parent->addressSpace : nullptr);
+}
+
+void DiskQueue::InitializeSlots(unsigned count){
+    slotMask = (count >= 32) ? 0xFFFFFFFFU : ((1U << count) - 1);
+
+    for(unsigned i = 0; i < count; i++){
+        bouncePhys[i] = Memory::AllocatePhysicalMemoryBlock();
+        bounceVirt[i] = reinterpret_cast<uint8_t*>(Memory::GetIOMapping(bouncePhys[i]));
+
+        slotRequests[i] = nullptr;
+    }
+}
+
+bool DiskQueue::CanBlock(){
+    return useInterrupts && CheckInterrupts() && GetCurrentThread();
+}
+
+int DiskQueue::AcquireSlot(DiskRequest& req){
+    for(;;){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queueLock);
+
+        if(uint32_t free = ~reservedSlots & slotMask){
+            int slot = __builtin_ctz(free);
+
+            reservedSlots |= 1U << slot;
+            req.slots |= 1U << slot;
+
+            releaseLock(&queueLock);
+            if(intsEnabled) asm("sti");
+            return slot;
+        }
+
+        releaseLock(&queueLock);
+        if(intsEnabled) asm("sti");
+
+        if(req.slots){
+            return -1; // The caller has to wait on its own commands first
+        }
+
+        // Every slot belongs to someone else, they get released once their owners have been woken
+        if(CanBlock()){
+            Scheduler::Yield();
+        } else {
+            asm("pause");
+        }
+    }
+}
+
+uint32_t DiskQueue::Bounce(DiskRequest& req, int slot, uint8_t* buffer, uint32_t size, bool write){
+    if(size > PAGE_SIZE_4K) size = PAGE_SIZE_4K;
+
+    if(write){
+        memcpy(bounceVirt[slot], buffer, size);
+    } else {
+        auto& bounce = req.bounces[req.bounceCount++];
+        bounce.slot = slot;
+        bounce.buffer = buffer;
+        bounce.size = size;
+    }
+
+    return size;
+}
+
+void DiskQueue::Issue(DiskRequest& req, int slot){
+    slotRequests[slot] = &req;
+    req.pending++;
+}
+
+void DiskQueue::Complete(int slot){
+    DiskRequest* req = slotRequests[slot];
+    slotRequests[slot] = nullptr;
+
+    if(req && --req->pending == 0 && req->waiter){
+        Scheduler::UnblockThread(req->waiter);
+    }
+}
+
+int DiskQueue::Wait(DiskRequest& req){
+    bool block = CanBlock();
+
+    for(;;){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queueLock);
+
+        if(!block){
+            ProcessCompletions();
+        }
+
+        if(!req.pending){
+            releaseLock(&queueLock);
+            if(intsEnabled) asm("sti");
+            break;
+        }
+
+        if(block){
+            // The interrupt handler unblocks us once the last command completes, we still hold queueLock so it can't be missed
+            thread_t* thread = GetCurrentThread();
+            req.waiter = thread;
+
+            acquireLock(&thread->stateLock);
+            thread->state = ThreadStateBlocked;
+            releaseLock(&thread->stateLock);
+
+            releaseLock(&queueLock);
+            Scheduler::Yield();
+        } else {
+            releaseLock(&queueLock);
+        }
+
+        if(intsEnabled) asm("sti");
+    }
+
+    for(unsigned i = 0; i < req.bounceCount; i++){
+        memcpy(req.bounces[i].buffer, bounceVirt[req.bounces[i].slot], req.bounces[i].size);
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&queueLock);
+    reservedSlots &= ~req.slots;
+    releaseLock(&queueLock);
+    if(intsEnabled) asm("sti");
+
+    int error = req.error;
+
+    req.slots = 0;
+    req.bounceCount = 0;
+    req.error = 0;
+    req.waiter = nullptr;
+
+    return error;
+}
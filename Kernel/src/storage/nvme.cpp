@@ -1,10 +1,577 @@
+#include <nvme.h>
+
 #include <pci.h>
+#include <paging.h>
+#include <physicalallocator.h>
 #include <logging.h>
+#include <memory.h>
+#include <liballoc.h>
+#include <devicemanager.h>
+#include <gpt.h>
+#include <timer.h>
+#include <idt.h>
+#include <apic.h>
+#include <smp.h>
+#include <cpu.h>
 
 namespace NVMe{
     pci_device_t device;
     char* deviceName = "Generic NVMe Controller";
 
+    Controller* controller = nullptr;
+
+    void InterruptHandler(regs64_t* r){
+        if(controller){
+            controller->OnInterrupt();
+        }
+    }
+
+    Queue::Queue(Controller* controller, uint16_t id, uint16_t depth) : id(id), depth(depth), controller(controller){
+        // Queues are limited to a single page so they are physically contiguous
+        sqPhys = Memory::AllocatePhysicalMemoryBlock();
+        sq = reinterpret_cast<nvme_command_t*>(Memory::GetIOMapping(sqPhys));
+        memset(sq, 0, PAGE_SIZE_4K);
+
+        cqPhys = Memory::AllocatePhysicalMemoryBlock();
+        cq = reinterpret_cast<volatile nvme_completion_t*>(Memory::GetIOMapping(cqPhys));
+        memset((void*)cq, 0, PAGE_SIZE_4K);
+
+        sqDoorbell = controller->Doorbell(id, false);
+        cqDoorbell = controller->Doorbell(id, true);
+
+        unsigned slots = depth - 1;
+        InitializeSlots(slots);
+
+        for(unsigned i = 0; i < slots; i++){
+            prpListPhys[i] = Memory::AllocatePhysicalMemoryBlock();
+            prpLists[i] = reinterpret_cast<uint64_t*>(Memory::GetIOMapping(prpListPhys[i]));
+        }
+    }
+
+    uint32_t Queue::BuildPRP(Request& req, int slot, nvme_command_t& cmd, uint8_t* buffer, uint32_t size, bool write){
+        uint64_t* list = prpLists[slot];
+        unsigned pages = 0;
+
+        bool mapped = !(reinterpret_cast<uintptr_t>(buffer) & 0x3) // Data pointers must be dword aligned
+            && ForEachBufferPage(buffer, size, [&](uintptr_t phys, uint32_t) -> bool {
+                if(!pages){
+                    cmd.prp1 = phys;
+                } else if(pages - 1 < PAGE_SIZE_4K / sizeof(uint64_t)){
+                    list[pages - 1] = phys;
+                } else {
+                    return false;
+                }
+
+                pages++;
+                return true;
+            });
+
+        if(!mapped){ // The controller can't reach the buffer, go through the bounce page for this slot
+            cmd.prp1 = bouncePhys[slot];
+            cmd.prp2 = 0;
+            return Bounce(req, slot, buffer, size, write);
+        }
+
+        if(pages <= 1){
+            cmd.prp2 = 0;
+        } else if(pages == 2){ // Two pages, PRP2 points straight at the second
+            cmd.prp2 = list[0];
+        } else { // Any more and PRP2 points to a list of the remaining pages
+            cmd.prp2 = prpListPhys[slot];
+        }
+
+        return size;
+    }
+
+    void Queue::Submit(Request& req, int slot, nvme_command_t& cmd){
+        cmd.cid = slot;
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queueLock);
+
+        Issue(req, slot);
+
+        // We never have more commands than entries in flight so the queue can't be full
+        memcpy(&sq[sqTail], &cmd, sizeof(nvme_command_t));
+        if(++sqTail >= depth){
+            sqTail = 0;
+        }
+
+        asm volatile("" ::: "memory");
+        *sqDoorbell = sqTail;
+
+        releaseLock(&queueLock);
+        if(intsEnabled) asm("sti");
+    }
+
+    // queueLock must be held with interrupts disabled
+    void Queue::ProcessCompletions(){
+        bool processed = false;
+
+        for(;;){
+            volatile nvme_completion_t* completion = &cq[cqHead];
+            if((completion->status & 0x1) != phase){
+                break; // Not written by the controller yet
+            }
+
+            uint16_t cid = completion->cid;
+            uint16_t status = completion->status >> 1;
+            uint32_t result = completion->result;
+
+            if(++cqHead >= depth){
+                cqHead = 0;
+                phase ^= 1; // The controller inverts the phase tag every time it wraps around
+            }
+            processed = true;
+
+            if(cid >= depth - 1){
+                continue;
+            }
+
+            if(Request* req = static_cast<Request*>(slotRequests[cid])){ // Every request on an NVMe queue is an NVMe::Request
+                if(status){
+                    req->error = status;
+                }
+                req->result = result;
+            }
+
+            Complete(cid);
+        }
+
+        if(processed){
+            *cqDoorbell = cqHead;
+        }
+    }
+
+    void Queue::OnInterrupt(){
+        acquireLock(&queueLock);
+        ProcessCompletions();
+        releaseLock(&queueLock);
+    }
+
+    Controller::Controller(const pci_device_t& device){
+        pciDevice = device;
+
+        for(unsigned i = 0; i < 256; i++){
+            cpuQueues[i] = nullptr;
+        }
+    }
+
+    int Controller::Enable(bool enable){
+        uint32_t cc = ReadRegister(NVME_REG_CC);
+        if(enable){
+            cc |= NVME_CC_ENABLE;
+        } else {
+            cc &= ~NVME_CC_ENABLE;
+        }
+        WriteRegister(NVME_REG_CC, cc);
+
+        for(unsigned i = 0; i < timeout; i++){
+            uint32_t status = ReadRegister(NVME_REG_CSTS);
+            if(enable && (status & NVME_CSTS_FATAL)){
+                return 1;
+            } else if(!!(status & NVME_CSTS_READY) == enable){
+                return 0;
+            }
+
+            Timer::Wait(1);
+        }
+
+        return 1;
+    }
+
+    int Controller::AdminCommand(nvme_command_t& cmd, uint32_t* result){
+        Request req;
+        req.queue = adminQueue;
+
+        int slot = adminQueue->AcquireSlot(req);
+        adminQueue->Submit(req, slot, cmd);
+
+        int error = adminQueue->Wait(req);
+        if(error){
+            Log::Warning("[NVMe] Admin command %x failed (status: %x)", cmd.opcode, error);
+        } else if(result){
+            *result = req.result;
+        }
+
+        return error;
+    }
+
+    int Controller::Identify(uint8_t cns, uint32_t nsID){
+        nvme_command_t cmd;
+        memset(&cmd, 0, sizeof(nvme_command_t));
+
+        cmd.opcode = NVME_ADMIN_IDENTIFY;
+        cmd.nsid = nsID;
+        cmd.prp1 = identifyPhys;
+        cmd.cdw10 = cns;
+
+        return AdminCommand(cmd);
+    }
+
+    int Controller::Initialize(){
+        PCI::Config_WriteWord(pciDevice.bus, pciDevice.slot, pciDevice.func, 0x4, pciDevice.header0.command | PCI_CMD_BUS_MASTER | PCI_CMD_MEMORY_SPACE);
+
+        uintptr_t base = PCI::GetBaseAddressRegister(pciDevice, 0);
+        if(base >= 0x100000000ULL){
+            Log::Error("[NVMe] Registers are mapped above 4GB, not supported");
+            return 1;
+        }
+
+        registers = reinterpret_cast<uint8_t*>(Memory::GetIOMapping(base));
+
+        capabilities = *reinterpret_cast<volatile uint64_t*>(registers + NVME_REG_CAP);
+        doorbellStride = 4 << NVME_CAP_DSTRD(capabilities);
+        timeout = NVME_CAP_TIMEOUT(capabilities) * 500;
+        if(timeout < 500) timeout = 500;
+
+        uint32_t version = ReadRegister(NVME_REG_VS);
+        Log::Info("[NVMe] Base Address: %x, Version: %d.%d, Max Queue Entries: %d", base, version >> 16, (version >> 8) & 0xFF, NVME_CAP_MQES(capabilities) + 1);
+
+        if(NVME_CAP_MPSMIN(capabilities)){
+            Log::Error("[NVMe] Controller does not support 4KB pages");
+            return 1;
+        }
+
+        if(Enable(false)){
+            Log::Error("[NVMe] Timed out disabling controller");
+            return 1;
+        }
+
+        adminQueue = new Queue(this, 0, NVME_ADMIN_QUEUE_DEPTH);
+
+        WriteRegister(NVME_REG_AQA, (NVME_ADMIN_QUEUE_DEPTH - 1) | ((NVME_ADMIN_QUEUE_DEPTH - 1) << 16));
+        WriteRegister(NVME_REG_ASQ, adminQueue->sqPhys & 0xFFFFFFFF);
+        WriteRegister(NVME_REG_ASQ + 4, adminQueue->sqPhys >> 32);
+        WriteRegister(NVME_REG_ACQ, adminQueue->cqPhys & 0xFFFFFFFF);
+        WriteRegister(NVME_REG_ACQ + 4, adminQueue->cqPhys >> 32);
+
+        WriteRegister(NVME_REG_CC, NVME_CC_CSS_NVM | NVME_CC_MPS(0) | NVME_CC_AMS_RR | NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4));
+        if(Enable(true)){
+            Log::Error("[NVMe] Failed to enable controller (Status: %x)", ReadRegister(NVME_REG_CSTS));
+            return 1;
+        }
+
+        identifyPhys = Memory::AllocatePhysicalMemoryBlock();
+        identifyVirt = reinterpret_cast<uint8_t*>(Memory::GetIOMapping(identifyPhys));
+
+        if(Identify(NVME_IDENTIFY_CONTROLLER, 0)){
+            Log::Error("[NVMe] Failed to identify controller");
+            return 1;
+        }
+
+        char model[41];
+        memcpy(model, identifyVirt + 24, 40);
+        model[40] = 0;
+        for(int i = 39; i >= 0 && model[i] == ' '; i--){
+            model[i] = 0;
+        }
+
+        if(uint8_t mdts = identifyVirt[77]){ // Maximum data transfer size in minimum page size units
+            uint64_t limit = static_cast<uint64_t>(PAGE_SIZE_4K) << mdts;
+            if(limit < maxTransfer){
+                maxTransfer = limit;
+            }
+        }
+
+        Log::Info("[NVMe] Model: %s, Max Transfer: %d KB", model, maxTransfer / 1024);
+
+        InitializeInterrupts();
+
+        if(CreateIOQueues()){
+            Log::Error("[NVMe] Failed to create IO queues");
+            return 1;
+        }
+
+        InitializeNamespaces();
+
+        return 0;
+    }
+
+    void Controller::InitializeInterrupts(){
+        int vector = -1;
+        if(PCI::FindCapability(pciDevice, PCI_CAP_MSIX) || PCI::FindCapability(pciDevice, PCI_CAP_MSI)){
+            vector = IDT::ReserveUnusedInterrupt();
+        }
+
+        // All queues share a single vector, with MSI-X each queue's entry is pointed at the processor that owns the queue
+        if(vector >= 0 && PCI::InitializeMSIX(pciDevice, msix)){
+            useMSIX = true;
+            perCPUVectors = msix.size > 1;
+
+            Log::Info("[NVMe] Using MSI-X (Vector %d, %d table entries)", vector, msix.size);
+        } else if(vector >= 0 && PCI::EnableMSI(pciDevice, vector, GetCPULocal()->id)){
+            Log::Info("[NVMe] Using MSI (Vector %d)", vector);
+        } else if(pciDevice.header0.interruptPin){
+            int irqNum = pciDevice.header0.interruptLine;
+            APIC::IO::MapLegacyIRQ(irqNum);
+            vector = IRQ0 + irqNum;
+
+            Log::Info("[NVMe] Using IRQ %d", irqNum);
+        } else {
+            Log::Warning("[NVMe] No usable interrupts, polling for completions");
+            return;
+        }
+
+        interruptVector = vector;
+        IDT::RegisterInterruptHandler(interruptVector, InterruptHandler);
+    }
+
+    int Controller::CreateIOQueues(){
+        unsigned wanted = SMP::processorCount;
+        if(wanted > NVME_MAX_IO_QUEUES) wanted = NVME_MAX_IO_QUEUES;
+        if(perCPUVectors && wanted > msix.size - 1u) wanted = msix.size - 1; // MSI-X entry 0 belongs to the admin queue
+
+        nvme_command_t cmd;
+        memset(&cmd, 0, sizeof(nvme_command_t));
+
+        uint32_t allocated;
+        cmd.opcode = NVME_ADMIN_SET_FEATURES;
+        cmd.cdw10 = NVME_FEATURE_NUMBER_OF_QUEUES;
+        cmd.cdw11 = (wanted - 1) | ((wanted - 1) << 16);
+        if(AdminCommand(cmd, &allocated)){
+            return 1;
+        }
+
+        // Both counts are 0's based, use whichever is smaller
+        if((allocated & 0xFFFF) + 1 < wanted) wanted = (allocated & 0xFFFF) + 1;
+        if((allocated >> 16) + 1 < wanted) wanted = (allocated >> 16) + 1;
+
+        uint16_t depth = NVME_IO_QUEUE_DEPTH;
+        if(NVME_CAP_MQES(capabilities) + 1 < depth){
+            depth = NVME_CAP_MQES(capabilities) + 1;
+        }
+
+        for(unsigned i = 0; i < 256 && ioQueueCount < wanted; i++){
+            CPU* cpu = SMP::cpus[i];
+            if(!cpu){
+                continue;
+            }
+
+            uint16_t qid = ioQueueCount + 1;
+            Queue* queue = new Queue(this, qid, depth);
+
+            if(perCPUVectors){
+                queue->vector = qid;
+                PCI::SetMSIXVector(msix, qid, interruptVector, cpu->id);
+            } else if(useMSIX && ioQueueCount == 0){
+                PCI::SetMSIXVector(msix, 0, interruptVector, GetCPULocal()->id);
+            }
+
+            memset(&cmd, 0, sizeof(nvme_command_t));
+            cmd.opcode = NVME_ADMIN_CREATE_CQ;
+            cmd.prp1 = queue->cqPhys;
+            cmd.cdw10 = ((depth - 1) << 16) | qid;
+            cmd.cdw11 = (queue->vector << 16) | NVME_QUEUE_PHYS_CONTIGUOUS | ((interruptVector >= 0) ? NVME_CQ_INTERRUPTS_ENABLED : 0);
+            if(AdminCommand(cmd)){
+                delete queue;
+                break;
+            }
+
+            memset(&cmd, 0, sizeof(nvme_command_t));
+            cmd.opcode = NVME_ADMIN_CREATE_SQ;
+            cmd.prp1 = queue->sqPhys;
+            cmd.cdw10 = ((depth - 1) << 16) | qid;
+            cmd.cdw11 = (qid << 16) | NVME_QUEUE_PHYS_CONTIGUOUS; // Completion queue ID
+            if(AdminCommand(cmd)){
+                delete queue;
+                break;
+            }
+
+            queue->useInterrupts = interruptVector >= 0;
+
+            ioQueues[ioQueueCount++] = queue;
+            cpuQueues[cpu->id] = queue;
+        }
+
+        if(!ioQueueCount){
+            return 1;
+        }
+
+        Log::Info("[NVMe] Created %d IO queues (depth %d) for %d processors", ioQueueCount, depth, SMP::processorCount);
+        return 0;
+    }
+
+    void Controller::InitializeNamespaces(){
+        uint32_t namespaceCount = *reinterpret_cast<uint32_t*>(identifyVirt + 516);
+
+        // The active namespace list was only added in NVMe 1.1, otherwise try every namespace ID
+        uint32_t* namespaceIDs = nullptr;
+        unsigned idCount = 0;
+        if(!Identify(NVME_IDENTIFY_ACTIVE_NAMESPACES, 0)){
+            namespaceIDs = reinterpret_cast<uint32_t*>(kmalloc(PAGE_SIZE_4K));
+            memcpy(namespaceIDs, identifyVirt, PAGE_SIZE_4K);
+
+            while(idCount < PAGE_SIZE_4K / sizeof(uint32_t) && namespaceIDs[idCount]){
+                idCount++;
+            }
+        } else {
+            idCount = namespaceCount;
+        }
+
+        for(unsigned i = 0; i < idCount; i++){
+            uint32_t nsID = namespaceIDs ? namespaceIDs[i] : (i + 1);
+
+            if(Identify(NVME_IDENTIFY_NAMESPACE, nsID)){
+                continue;
+            }
+
+            uint64_t blockCount = *reinterpret_cast<uint64_t*>(identifyVirt); // Namespace size
+            if(!blockCount){
+                continue; // Inactive
+            }
+
+            uint8_t format = identifyVirt[26] & 0xF;
+            uint8_t* lbaFormat = identifyVirt + 128 + format * 4;
+            uint16_t metadataSize = *reinterpret_cast<uint16_t*>(lbaFormat);
+            unsigned lbaShift = lbaFormat[2];
+
+            if(lbaShift < 9 || lbaShift > 12 || metadataSize){
+                Log::Warning("[NVMe] Namespace %d has an unsupported format (Block size: %d, Metadata: %d)", nsID, 1 << lbaShift, metadataSize);
+                continue;
+            }
+
+            Namespace* ns = new Namespace(this, nsID, blockCount, lbaShift);
+            namespaces.add_back(ns);
+
+            DeviceManager::RegisterDevice(*ns);
+        }
+
+        if(namespaceIDs){
+            kfree(namespaceIDs);
+        }
+    }
+
+    Queue* Controller::GetIOQueue(){
+        uint64_t cpu = GetCPULocal()->id;
+        if(Queue* queue = cpuQueues[cpu]){
+            return queue;
+        }
+
+        return ioQueues[cpu % ioQueueCount];
+    }
+
+    void Controller::OnInterrupt(){
+        if(perCPUVectors){
+            if(Queue* queue = cpuQueues[GetCPULocal()->id]){
+                queue->OnInterrupt();
+                return;
+            }
+        }
+
+        // Single vector for everything (or a misrouted interrupt), check every queue
+        adminQueue->OnInterrupt();
+        for(unsigned i = 0; i < ioQueueCount; i++){
+            ioQueues[i]->OnInterrupt();
+        }
+    }
+
+    Namespace::Namespace(Controller* controller, uint32_t nsID, uint64_t blockCount, unsigned lbaShift) : controller(controller), nsID(nsID), blockCount(blockCount), lbaShift(lbaShift){
+        blocksize = 1 << lbaShift;
+
+        Log::Info("[NVMe] Namespace %d: %u blocks (Block size: %d)", nsID, blockCount, blocksize);
+
+        switch(GPT::Parse(this)){
+        case 0:
+            Log::Error("[NVMe] Disk has a corrupted or non-existant GPT. MBR disks are NOT supported.");
+            break;
+        case -1:
+            Log::Error("[NVMe] Disk Error while Parsing GPT for NVMe Namespace");
+            break;
+        }
+        Log::Info("[NVMe] Found %d partitions!", partitions.get_length());
+
+        InitializePartitions();
+    }
+
+    int Namespace::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+    }
+
+    int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
+    }
+
+    int Namespace::Submit(Request& req, uint64_t lba, uint32_t size, uint8_t* buffer, bool write){
+        Queue* queue = req.queue;
+
+        int slot = queue->AcquireSlot(req);
+        if(slot < 0){
+            return 0;
+        }
+
+        nvme_command_t cmd;
+        memset(&cmd, 0, sizeof(nvme_command_t));
+
+        size = queue->BuildPRP(req, slot, cmd, buffer, size, write);
+
+        cmd.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+        cmd.nsid = nsID;
+        cmd.cdw10 = lba & 0xFFFFFFFF;
+        cmd.cdw11 = lba >> 32;
+        cmd.cdw12 = (size >> lbaShift) - 1; // Number of blocks (0's based)
+
+        queue->Submit(req, slot, cmd);
+        return size;
+    }
+
+    int Namespace::Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write){
+        if(lba + ((count + blocksize - 1) >> lbaShift) > blockCount){
+            return 1;
+        }
+
+        if(uint32_t tail = count & (blocksize - 1)){ // Partial block at the end, read-modify-write it through a full block
+            uint8_t* block = reinterpret_cast<uint8_t*>(kmalloc(blocksize));
+            uint64_t tailLBA = lba + (count >> lbaShift);
+
+            int e = Transfer(tailLBA, blocksize, block, false);
+            if(!e && write){
+                memcpy(block, buffer + (count - tail), tail);
+                e = Transfer(tailLBA, blocksize, block, true);
+            } else if(!e){
+                memcpy(buffer + (count - tail), block, tail);
+            }
+
+            kfree(block);
+            if(e){
+                return e;
+            }
+
+            count -= tail;
+        }
+
+        Request req;
+        req.queue = controller->GetIOQueue();
+
+        int error = 0;
+
+        // Keep as many commands in flight as we can get slots for
+        while(count && !error){
+            uint32_t size = (count > controller->maxTransfer) ? controller->maxTransfer : count;
+
+            int submitted = Submit(req, lba, size, buffer, write);
+            if(!submitted){ // Out of slots, wait for ours to complete
+                error = req.queue->Wait(req);
+                continue;
+            }
+
+            lba += submitted >> lbaShift;
+            buffer += submitted;
+            count -= submitted;
+        }
+
+        if(int e = req.queue->Wait(req)){
+            error = e;
+        }
+
+        if(error){
+            Log::Warning("[NVMe] Disk Error (Namespace: %d, Status: %x)", nsID, error);
+        }
+
+        return error;
+    }
+
     void Initialize(){
         device.classCode = PCI_CLASS_STORAGE;
         device.subclass = 0x08; // Non-volatile memory controller subclass
@@ -19,6 +586,10 @@ namespace NVMe{
         }
 
         Log::Info("Initializing NVMe Controller...");
-        
+
+        controller = new Controller(device);
+        if(controller->Initialize()){
+            Log::Error("[NVMe] Failed to initialize controller");
+        }
     }
-}
\ No newline at end of file
+}
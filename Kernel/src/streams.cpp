@@ -3,6 +3,9 @@
 #include <assert.h>
 #include <logging.h>
 #include <timer.h>
+#include <cpu.h>
+#include <paging.h>
+#include <errno.h>
 
 int64_t Stream::Read(void* buffer, size_t len){
     assert(!"Stream::Read called from base class");
@@ -35,10 +38,13 @@ Stream::~Stream(){
 }
 
 DataStream::DataStream(size_t bufSize){
-    bufferSize = bufSize;
-    bufferPos = 0;
+    bufferSize = 1;
+    while(bufferSize < bufSize){
+        bufferSize <<= 1; // Keep it a power of two so positions can be masked
+    }
+    bufferMask = bufferSize - 1;
 
-    buffer = kmalloc(bufferSize);
+    buffer = (uint8_t*)kmalloc(bufferSize);
 }
 
 DataStream::~DataStream(){
@@ -46,82 +52,159 @@ DataStream::~DataStream(){
 }
 
 int64_t DataStream::Read(void* data, size_t len){
-    acquireLock(&streamLock);
+    // A fault on the buffer can block on the disk, don't let it happen with readLock or writeLock held
+    if(!Memory::PrefaultUserBuffer(reinterpret_cast<uintptr_t>(data), len < bufferSize ? len : bufferSize, true)){
+        return -EFAULT;
+    }
 
-    if(len >= bufferPos) len = bufferPos;
+    acquireLock(&readLock);
 
-    if(!len) {
-        releaseLock(&streamLock);
-        return 0;
+    len = Peek(data, len);
+    if(len){
+        __atomic_store_n(&readPos, readPos + len, __ATOMIC_RELEASE); // Hand the space back to the writer
     }
 
-    memcpy(data, buffer, len);
-    
-    memcpy(buffer, buffer + len, bufferPos - len);
-    bufferPos -= len;
+    releaseLock(&readLock);
 
-    releaseLock(&streamLock);
+    if(len){
+        WakeWriters();
+    }
     
     return len;
 }
 
 int64_t DataStream::Peek(void* data, size_t len){
-    acquireLock(&streamLock);
+    size_t pos = readPos;
+    size_t available = __atomic_load_n(&writePos, __ATOMIC_ACQUIRE) - pos;
 
-    if(len >= bufferPos) len = bufferPos;
+    if(len > available) len = available;
 
     if(!len) {
-        releaseLock(&streamLock);
         return 0;
     }
 
-    memcpy(data, buffer, len);
+    size_t offset = pos & bufferMask;
+    size_t first = (len > bufferSize - offset) ? (bufferSize - offset) : len; // Up to the end of the buffer
 
-    releaseLock(&streamLock);
+    memcpy(data, buffer + offset, first);
+    memcpy((uint8_t*)data + first, buffer, len - first);
     
     return len;
 }
 
 int64_t DataStream::Write(void* data, size_t len){
-    acquireLock(&streamLock);
-    if(bufferPos + len >= bufferSize){
-        void* oldBuffer = buffer;
+    if(!Memory::PrefaultUserBuffer(reinterpret_cast<uintptr_t>(data), len < bufferSize ? len : bufferSize, false)){
+        return -EFAULT;
+    }
 
-        while(bufferPos + len >= bufferSize)
-            bufferSize *= 2;
+    acquireLock(&writeLock);
 
-        buffer = kmalloc(bufferSize);
+    size_t pos = writePos;
+    size_t space = bufferSize - (pos - __atomic_load_n(&readPos, __ATOMIC_ACQUIRE));
 
-        memcpy(buffer, oldBuffer, bufferPos);
+    if(len > space) len = space;
 
-        kfree(oldBuffer);
-    }
+    if(len){
+        size_t offset = pos & bufferMask;
+        size_t first = (len > bufferSize - offset) ? (bufferSize - offset) : len;
 
-    memcpy(buffer + bufferPos, data, len);
-    bufferPos += len;
+        memcpy(buffer + offset, data, first);
+        memcpy(buffer, (uint8_t*)data + first, len - first);
 
-    if(bufferPos > 0 && waiting.get_length() > 0) {
-        while(waiting.get_length()){
-            Scheduler::UnblockThread(waiting.remove_at(0));
-        }
+        __atomic_store_n(&writePos, pos + len, __ATOMIC_RELEASE); // Publish the data to the reader
     }
 
-    releaseLock(&streamLock);
+    releaseLock(&writeLock);
+
+    if(len){
+        WakeReaders();
+    }
 
     return len;
 }
 
+void DataStream::Flush(){
+    acquireLock(&readLock);
+    __atomic_store_n(&readPos, __atomic_load_n(&writePos, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    releaseLock(&readLock);
+
+    WakeWriters();
+}
+
 int64_t DataStream::Empty(){
-    return !bufferPos;
+    return __atomic_load_n(&writePos, __ATOMIC_ACQUIRE) == __atomic_load_n(&readPos, __ATOMIC_ACQUIRE);
+}
+
+// Sleepers announce themselves in waitCount and then check the condition again.
+// The other side updates its position and then checks waitCount, with a full barrier
+// in between on both sides one of them is guaranteed to see the other.
+void DataStream::Block(Scheduler::GenericThreadBlocker& blocker, unsigned& waitCount, bool forSpace){
+    thread_t* thread = GetCurrentThread();
+
+    acquireLock(&waitLock);
+    __atomic_add_fetch(&waitCount, 1, __ATOMIC_SEQ_CST);
+
+    if(HungUp() || (forSpace ? Space() : !Empty())){
+        __atomic_sub_fetch(&waitCount, 1, __ATOMIC_SEQ_CST);
+        releaseLock(&waitLock);
+        return;
+    }
+
+    acquireLock(&thread->stateLock);
+    blocker.Block(thread);
+    thread->state = ThreadStateBlocked;
+    releaseLock(&thread->stateLock);
+
+    releaseLock(&thread->lock); // Don't hold the syscall lock while blocked so the process can still be killed
+    releaseLock(&waitLock);
+
+    Scheduler::Yield();
+}
+
+void DataStream::WakeReaders(){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&waitingReaders, __ATOMIC_RELAXED)){
+        return; // Nobody is waiting, don't touch the lock
+    }
+
+    acquireLock(&waitLock);
+    while(readers.blocked.get_length()){
+        Scheduler::UnblockThread(readers.blocked.remove_at(0));
+    }
+    waitingReaders = 0;
+    releaseLock(&waitLock);
+}
+
+void DataStream::WakeWriters(){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&waitingWriters, __ATOMIC_RELAXED)){
+        return;
+    }
+
+    acquireLock(&waitLock);
+    while(writers.blocked.get_length()){
+        Scheduler::UnblockThread(writers.blocked.remove_at(0));
+    }
+    waitingWriters = 0;
+    releaseLock(&waitLock);
+}
+
+void DataStream::HangUp(){
+    __atomic_store_n(&hungUp, true, __ATOMIC_SEQ_CST);
+
+    WakeReaders();
+    WakeWriters();
 }
 
 void DataStream::Wait(){
-    if(!Empty()) return;
-    
-    Scheduler::BlockCurrentThread(waiting, streamLock);
+    while(Empty() && !HungUp()){
+        Block(readers, waitingReaders, false);
+    }
+}
 
-    while(Empty()){
-        Scheduler::Yield();
+void DataStream::WaitForSpace(){
+    while(!Space() && !HungUp()){
+        Block(writers, waitingWriters, true);
     }
 }
 
@@ -108,6 +108,14 @@ int PTYDevice::Ioctl(uint64_t cmd, uint64_t arg){
 	return 0;
 }
 
+void PTYDevice::Close(){
+	handleCount--;
+
+	if(!handleCount && device == PTYMasterDevice){
+		pty->master.HangUp(); // Nobody is left to read the output, don't leave the slave waiting for space
+	}
+}
+
 void PTYDevice::Watch(FilesystemWatcher& watcher, int events){
 	if(device == PTYMasterDevice){
 		pty->WatchMaster(watcher, events);
@@ -130,7 +138,7 @@ void PTYDevice::Unwatch(FilesystemWatcher& watcher){
 
 bool PTYDevice::CanRead() {
 	if(device == PTYMasterDevice){
-		return !!pty->master.bufferPos;
+		return !pty->master.Empty();
 	} else if(device == PTYSlaveDevice){
 		if(pty->IsCanonical())
 			return !!pty->slave.lines;
@@ -148,7 +156,6 @@ PTY::PTY(){
 	strcpy(slaveFile.dirent.name + strlen(slaveFile.dirent.name), _name);
 	GetNextPTY();
 
-	master.ignoreBackspace = true;
 	slave.ignoreBackspace = false;
 	master.Flush();
 	slave.Flush();
@@ -195,40 +202,46 @@ size_t PTY::Master_Write(char* buffer, size_t count){
 		}
 	}
 
-	if(Echo() && ret){
+	if(Echo() && ret){ // Never block on echo, the master may be the one writing
 		for(unsigned i = 0; i < count; i++){
 			if(buffer[i] == '\e'){ // Escape
-				master.Write("^[", 2);
+				master.Write((void*)"^[", 2);
 			} else {
 				master.Write(&buffer[i], 1);
 			}
 		}
 	}
 
-	if(IsCanonical()){
-		if(slave.lines && watchingSlave.get_length()){
-			while(watchingSlave.get_length()){
-				watchingSlave.remove_at(0)->Signal(); // Signal all watching
-			}
-		}
-	} else {
-		if(slave.bufferPos && watchingSlave.get_length()){
-			while(watchingSlave.get_length()){
-				watchingSlave.remove_at(0)->Signal(); // Signal all watching
-			}
+	if(IsCanonical() ? slave.lines : slave.bufferPos){
+		acquireLock(&watcherLock);
+		while(watchingSlave.get_length()){
+			watchingSlave.remove_at(0)->Signal(); // Signal all watching
 		}
+		releaseLock(&watcherLock);
 	}
 
 	return ret;
 }
 
 size_t PTY::Slave_Write(char* buffer, size_t count){
-	size_t written = master.Write(buffer, count);
+	size_t written = 0;
+
+	for(;;){
+		written += master.Write(buffer + written, count - written);
 
-	if(master.bufferPos && watchingMaster.get_length()){
-		while(watchingMaster.get_length()){
-			watchingMaster.remove_at(0)->Signal(); // Signal all watching
+		if(!master.Empty()){
+			acquireLock(&watcherLock);
+			while(watchingMaster.get_length()){
+				watchingMaster.remove_at(0)->Signal(); // Signal all watching
+			}
+			releaseLock(&watcherLock);
+		}
+
+		if(written >= count || master.HungUp()){
+			break; // Stop waiting once the master has been closed, nothing will drain the buffer
 		}
+
+		master.WaitForSpace(); // Wait for the master to catch up
 	}
 	
 	return written;
@@ -238,30 +251,44 @@ void PTY::WatchMaster(FilesystemWatcher& watcher, int events){
 	if(!(events & (POLLIN))){ // We don't really block on writes and nothing else applies except POLLIN
 		watcher.Signal();
 		return;
-	} else if(masterFile.CanRead()){
+	}
+
+	acquireLock(&watcherLock);
+	if(masterFile.CanRead()){
+		releaseLock(&watcherLock);
 		watcher.Signal();
 		return;
 	}
 
 	watchingMaster.add_back(&watcher);
+	releaseLock(&watcherLock);
 }
 
 void PTY::WatchSlave(FilesystemWatcher& watcher, int events){
 	if(!(events & (POLLIN))){ // We don't really block on writes and nothing else applies except POLLIN
 		watcher.Signal();
 		return;
-	} else if(slaveFile.CanRead()){
+	}
+
+	acquireLock(&watcherLock);
+	if(slaveFile.CanRead()){
+		releaseLock(&watcherLock);
 		watcher.Signal();
 		return;
 	}
 
 	watchingSlave.add_back(&watcher);
+	releaseLock(&watcherLock);
 }
 
 void PTY::UnwatchMaster(FilesystemWatcher& watcher){
+	acquireLock(&watcherLock);
 	watchingMaster.remove(&watcher);
+	releaseLock(&watcherLock);
 }
 
 void PTY::UnwatchSlave(FilesystemWatcher& watcher){
+	acquireLock(&watcherLock);
 	watchingSlave.remove(&watcher);
+	releaseLock(&watcherLock);
 }
\ No newline at end of file
@@ -15,6 +15,7 @@
 #define LEMON_MESSAGE_PROTOCOL_WMEVENT 1
 #define LEMON_MESSAGE_PROTOCOL_WMCMD 2
 #define LEMON_MESSAGE_PROTOCOL_SHELLCMD 3
+#define LEMON_MESSAGE_PROTOCOL_RING 4 // Shared memory ring setup and doorbells, handled by MessageClient/MessageServer and never returned
 
 #include <stddef.h>
 
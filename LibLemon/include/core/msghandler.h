@@ -1,7 +1,10 @@
 #pragma once
 
 #include <core/message.h>
+#include <core/msgring.h>
 #include <string.h>
+#include <unordered_set>
+#include <unordered_map>
 
 namespace Lemon{
     struct LemonMessageInfo {
@@ -12,6 +15,9 @@ namespace Lemon{
     class MessageHandler {
     public:
         virtual std::vector<pollfd> GetFileDescriptors() = 0;
+
+        // Called before the multiplexer sleeps, returns true if there are already messages waiting
+        virtual bool ArmDoorbells() { return false; }
     protected:
         friend class MessageMultiplexer;
 
@@ -20,16 +26,46 @@ namespace Lemon{
 
     class MessageClient : public MessageHandler{
         std::deque<std::shared_ptr<LemonMessage>> queue;
+        std::shared_ptr<LemonMessage> current; // Last message returned by Next from the queue
         
         pollfd sock;
 
+        MessageRing* ring = nullptr;
+        MessageRing* pendingRing = nullptr; // Sent to the server, waiting for an answer
+
+        bool Receive(int flags);
+        void SendRing(const LemonMessage* msg);
+        void SendRingRequest(uint32_t type, uint64_t key = 0);
+
         std::vector<pollfd> GetFileDescriptors();
+        bool ArmDoorbells();
     public:
         MessageClient();
         ~MessageClient();
 
         void Connect(sockaddr_un& address, socklen_t len);
 
+        /////////////////////////////
+        /// \brief Ask the server to move the connection to a shared memory ring, call after Connect
+        ///
+        /// \return true if the server accepted
+        /////////////////////////////
+        bool UseSharedRing();
+
+        /////////////////////////////
+        /// \brief Get the next message without copying it out of the ring
+        ///
+        /// \return Message valid until the next call to Next, Poll, PollSync, Wait or MessageMultiplexer::PollSync. nullptr if there are none.
+        /////////////////////////////
+        const LemonMessage* Next();
+
+        /////////////////////////////
+        /// \brief Wait for a message of a protocol (e.g. the response to a request), earlier messages of other protocols stay queued
+        ///
+        /// \return Message valid until the next call to Next, Poll, PollSync, Wait, WaitFor or MessageMultiplexer::PollSync. nullptr if the connection is closed.
+        /////////////////////////////
+        const LemonMessage* WaitFor(unsigned int protocol);
+
         std::shared_ptr<LemonMessage> Poll();
         std::shared_ptr<LemonMessage> PollSync();
         void Wait();
@@ -40,12 +76,31 @@ namespace Lemon{
     class MessageServer : public MessageHandler{
         std::vector<pollfd> fds;
         std::deque<std::shared_ptr<LemonMessageInfo>> queue;
+        std::shared_ptr<LemonMessageInfo> current; // Last message returned by Next from the queue
+
+        std::unordered_map<int, MessageRing*> rings; // Clients using a shared memory ring, by file descriptor
 
         pollfd sock;
 
+        void OnRingRequest(int fd, const LemonMessage& msg);
+        void RemoveRing(int fd);
+        bool SendRing(int fd, MessageRing* ring, const LemonMessage* msg);
+        void SendRingRequest(int fd, uint32_t type);
+
         std::vector<pollfd> GetFileDescriptors();
+        bool ArmDoorbells();
     public:
         MessageServer(sockaddr_un& address, socklen_t len);
+        ~MessageServer();
+
+        /////////////////////////////
+        /// \brief Get the next message without copying it out of the ring
+        ///
+        /// \param clientFd Set to the client that sent the message
+        ///
+        /// \return Message valid until the next call to Next, Poll or MessageMultiplexer::PollSync. nullptr if there are none.
+        /////////////////////////////
+        const LemonMessage* Next(int& clientFd);
 
         std::shared_ptr<LemonMessageInfo> Poll();
         void Send(LemonMessage* msg, int fd);
@@ -54,8 +109,15 @@ namespace Lemon{
 
     class MessageMultiplexer {
         std::vector<MessageHandler*> handlers;
+
+        int epollFd = -1;
+        std::unordered_set<int> watching; // File descriptors added to the epoll instance
     public:
+        ~MessageMultiplexer();
+
         void AddSource(MessageHandler& handler);
+
+        // Wait up to 200ms for any of the sources to have something to read, returns true if any do
         bool PollSync();
     };
 
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <core/message.h>
+
+#include <atomic>
+#include <stdint.h>
+
+#define LEMON_MESSAGE_RING_MAGIC 0x474E4952 // 'RING'
+#define LEMON_MESSAGE_RING_SIZE 0x20000 // Bytes in each direction, must be a power of two and hold the largest message
+
+namespace Lemon {
+    enum {
+        MessageRingSetup, // Client to server, key is the shared memory to attach
+        MessageRingAccepted, // Server to client, every message after this one goes through the ring
+        MessageRingRejected, // Server to client, carry on using the socket
+        MessageRingDoorbell, // There are messages in the ring for a reader that is waiting on the socket
+    };
+
+    struct MessageRingRequest {
+        uint32_t type;
+        uint64_t key = 0;
+    };
+
+    enum {
+        MessageRingNotWaiting,
+        MessageRingWaitingFutex, // Reader is sleeping on readerWaiting
+        MessageRingWaitingSocket, // Reader is waiting on the socket (e.g. through epoll) and needs a MessageRingDoorbell
+    };
+
+    // Indices of one direction of the ring. They are free running byte counts, the writer and reader halves are kept on
+    // separate cache lines so the two processes aren't fighting over the same line.
+    struct MessageRingControl {
+        alignas(64) std::atomic<uint32_t> head; // Only written by the writer
+        std::atomic<int> writerWaiting; // Futex, set by the writer when the ring is full
+        std::atomic<int> writerOnSocket; // The ring filled up and the writer moved to the socket, read it once the ring is empty
+        alignas(64) std::atomic<uint32_t> tail; // Only written by the reader
+        std::atomic<int> readerWaiting; // Futex, one of the MessageRingWaiting values
+    };
+
+    // Start of the shared memory, followed by the client to server data then the server to client data.
+    // The server reads the first ring so a client lying about a message length can't send it off the end of the mapping.
+    struct MessageRingHeader {
+        uint32_t magic;
+        uint32_t size; // Of each direction
+        std::atomic<int> closed;
+        MessageRingControl toServer;
+        MessageRingControl toClient;
+    };
+
+    // One end of a single producer, single consumer ring of LemonMessages in shared memory.
+    // Messages are padded to 8 bytes and read in place, so once both sides are busy
+    // sending a message costs a copy into the ring and nothing else.
+    class MessageRing {
+        MessageRingHeader* header = nullptr;
+        uint64_t key = 0;
+        bool broken = false; // The writer sent us garbage
+
+        MessageRingControl* tx = nullptr;
+        uint8_t* txData = nullptr;
+        MessageRingControl* rx = nullptr;
+        uint8_t* rxData = nullptr;
+        uint32_t size = 0;
+
+        uint32_t pending = 0; // Size of the message last returned by Read, consumed on the next call
+        LemonMessage* scratch = nullptr; // Messages that wrap around the end of the ring are copied here
+
+        void Map(bool server);
+        void Release();
+    public:
+        enum {
+            WriteOk,
+            WriteDoorbell, // Written, the reader is waiting on the socket
+            WriteFull,
+            WriteClosed,
+        };
+
+        ~MessageRing();
+
+        /////////////////////////////
+        /// \brief Create the shared memory for a new ring, as the client
+        ///
+        /// \return true on success
+        /////////////////////////////
+        bool Create();
+
+        /////////////////////////////
+        /// \brief Map a ring created by a client, as the server
+        ///
+        /// \return true on success
+        /////////////////////////////
+        bool Attach(uint64_t key);
+
+        inline uint64_t Key() const { return key; }
+        inline bool Closed() const { return header->closed.load(std::memory_order_relaxed); }
+
+        /////////////////////////////
+        /// \brief Tell the other end we are gone, waking it if it is waiting on us
+        /////////////////////////////
+        void Close();
+
+        /////////////////////////////
+        /// \brief Copy a message into the ring
+        ///
+        /// \param msg Message to copy, including the header. The magic is set by the caller.
+        /// \param block Wait for the reader to make space if the ring is full
+        ///
+        /// \return One of the Write values
+        /////////////////////////////
+        int Write(const LemonMessage* msg, bool block);
+
+        /////////////////////////////
+        /// \brief Send everything after this through the socket instead, for a writer that can't wait on a full ring
+        ///
+        /// The reader is woken if it is waiting on us, it reads what is left in the ring before looking at the socket.
+        /////////////////////////////
+        void FallBackToSocket();
+
+        inline bool SendsOnSocket() const { return tx->writerOnSocket.load(std::memory_order_relaxed); }
+        inline bool ReceivesOnSocket() const { return rx->writerOnSocket.load(std::memory_order_relaxed); }
+
+        /////////////////////////////
+        /// \brief Get the next message
+        ///
+        /// \return Message in place in the ring, valid until the next call to Read or Wait. nullptr if there are none.
+        /////////////////////////////
+        const LemonMessage* Read();
+
+        /////////////////////////////
+        /// \brief Sleep until there are messages to read, the ring is closed or the writer has moved to the socket
+        /////////////////////////////
+        void Wait();
+
+        /////////////////////////////
+        /// \brief Ask the writer to send a MessageRingDoorbell through the socket for the next message
+        ///
+        /// \return false if there are already messages to read
+        /////////////////////////////
+        bool ArmSocketDoorbell();
+    };
+}
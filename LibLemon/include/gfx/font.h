@@ -1,11 +1,30 @@
 #pragma once
 
 #include <exception>
+#include <stdint.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
 namespace Lemon::Graphics{
+    struct Glyph{
+        bool cached = false; // Has been rasterised into the atlas
+        int advance; // Pixels
+        int top; // Distance from the baseline to the top of the bitmap
+        int width, height;
+        int atlasX, atlasY;
+    };
+
+    // Alpha bitmap holding every glyph a font has rasterised, packed in rows (shelves)
+    struct GlyphAtlas{
+        uint8_t* buffer = nullptr;
+        int width = 0;
+        int height = 0;
+
+        int shelfX = 0, shelfY = 0; // Next free spot
+        int shelfHeight = 0;
+    };
+
     struct Font{
         bool monospace = false;
         FT_Face face;
@@ -13,6 +32,10 @@ namespace Lemon::Graphics{
         int width;
         int tabWidth = 4;
         char* id;
+
+        // A face only ever has one pixel size so glyphs are cached by character alone
+        Glyph glyphs[256];
+        GlyphAtlas atlas;
     };
 
     class FontException : public std::exception{
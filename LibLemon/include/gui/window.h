@@ -14,6 +14,8 @@
 
 #define WINDOW_MENUBAR_HEIGHT 20
 
+#define WINDOW_MAX_DAMAGE_RECTS 16
+
 namespace Lemon::GUI {
     __attribute__((unused)) static const char* wmSocketAddress = "lemonwm";
 
@@ -104,6 +106,20 @@ namespace Lemon::GUI {
         uint64_t buffer2Offset;
         uint32_t drawing; // Is being drawn?
         uint32_t dirty; // Does it need to be drawn?
+        uint32_t damageCount; // Number of rects in damage, 0 means the whole window
+        uint32_t damageLock; // Held by whoever is reading or writing dirty, damageCount and damage
+        rect_t damage[WINDOW_MAX_DAMAGE_RECTS]; // Parts of the window that changed since the window manager last drew it
+
+        // The client and the window manager are separate processes so this has to be a plain atomic in the shared buffer
+        inline void LockDamage(){
+            while(__atomic_exchange_n(&damageLock, 1, __ATOMIC_ACQUIRE)){
+                while(__atomic_load_n(&damageLock, __ATOMIC_RELAXED)) __builtin_ia32_pause();
+            }
+        }
+
+        inline void UnlockDamage(){
+            __atomic_store_n(&damageLock, 0, __ATOMIC_RELEASE);
+        }
     };
 
     enum WindowType {
@@ -136,6 +152,9 @@ namespace Lemon::GUI {
         int windowType = WindowType::Basic;
 
         timespec lastClick;
+
+        std::vector<rect_t> damage; // Reported with the next buffer swap
+        bool backBufferStale = false; // Last swap was of the whole window so the back buffer is a frame behind
     public:
         vector2i_t lastMousePos = {0, 0};
         WindowMenuBar* menuBar = nullptr;
@@ -154,8 +173,15 @@ namespace Lemon::GUI {
 
         void UpdateFlags(uint32_t flags);
 
+        // Have the window manager send window events (creation, title changes, etc.) to this window, used by the shell
+        void InitializeShellConnection();
+
         void Paint();
         void SwapBuffers();
+        
+        // Only have the window manager redraw rect on the next SwapBuffers instead of the whole window.
+        // Call before drawing into rect, the rest of the surface is kept in sync with what is on screen.
+        void Damage(rect_t rect);
 
         bool PollEvent(LemonEvent& ev);
         void WaitEvent();
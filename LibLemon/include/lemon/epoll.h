@@ -0,0 +1,30 @@
+#pragma once
+
+#ifndef __lemon__
+    #error "Lemon OS Only"
+#endif
+
+#include <stdint.h>
+#include <poll.h>
+
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLPRI POLLPRI
+#define EPOLLHUP POLLHUP
+#define EPOLLERR POLLERR
+#define EPOLLRDHUP POLLRDHUP
+#define EPOLLONESHOT (1U << 30)
+#define EPOLLET (1U << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef struct lemon_epoll_event {
+    uint32_t events;
+    uint64_t data;
+} __attribute__((packed)) lemon_epoll_event_t;
+
+int lemon_epoll_create(int flags);
+int lemon_epoll_ctl(int epfd, int op, int fd, lemon_epoll_event_t* event);
+int lemon_epoll_wait(int epfd, lemon_epoll_event_t* events, int maxEvents, int timeout);
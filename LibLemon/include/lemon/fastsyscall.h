@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef __lemon__
+    #error "Lemon OS Only"
+#endif
+
+#include <stdint.h>
+
+/////////////////////////////
+/// \brief Make a system call with SYSCALL instead of int 0x69
+///
+/// Takes the same arguments as syscall() from lemon/syscall.h.
+/// SYSCALL clobbers RCX and R11, so the kernel expects the second argument in R10.
+///
+/// \return Return value of the system call
+/////////////////////////////
+static inline long _fast_syscall(uint64_t call, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4){
+    long ret;
+    register uint64_t r10 asm("r10") = arg1;
+
+    asm volatile("syscall" : "=a"(ret) : "a"(call), "b"(arg0), "r"(r10), "d"(arg2), "S"(arg3), "D"(arg4) : "rcx", "r11", "memory");
+    return ret;
+}
+
+#define fast_syscall(call, arg0, arg1, arg2, arg3, arg4) _fast_syscall((uint64_t)(call), (uint64_t)(arg0), (uint64_t)(arg1), (uint64_t)(arg2), (uint64_t)(arg3), (uint64_t)(arg4))
@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <limits.h>
 #include <stdint.h>
+#include <sys/stat.h>
 
 #define FS_NODE_FILE 0x1
 #define FS_NODE_DIRECTORY 0x2
@@ -23,6 +24,26 @@ typedef struct lemon_dirent {
 	char name[NAME_MAX]; // Filename
 } lemon_dirent_t;
 
+#define LEMON_READDIR_STAT 0x1 // Fill in a struct stat for each entry
+
+// Variable length entry filled in by lemon_readdir_batch
+typedef struct lemon_batch_dirent {
+	uint64_t inode; // Inode number
+	uint16_t recordLength; // Size of the entry, the next one starts straight after it
+	uint16_t nameLength; // Length of the name, not including the null terminator
+	uint16_t statOffset; // Offset of the struct stat from the start of the entry, 0 if it was not requested
+	uint8_t type;
+	uint8_t reserved;
+	char name[]; // Null terminated filename
+} lemon_batch_dirent_t;
+
+// Smallest buffer lemon_readdir_batch will accept with LEMON_READDIR_STAT set
+#define LEMON_READDIR_BATCH_MIN (((sizeof(lemon_batch_dirent_t) + NAME_MAX + 1 + 7) & ~7UL) + sizeof(struct stat))
+
+static inline struct stat* lemon_batch_dirent_stat(lemon_batch_dirent_t* ent){
+	return ent->statOffset ? (struct stat*)((uint8_t*)ent + ent->statOffset) : NULL;
+}
+
 int lemon_open(const char* filename, int flags);
 void lemon_close(int fd);
 int lemon_read(int fd, void* buffer, size_t count);
@@ -30,4 +51,17 @@ int lemon_write(int fd, const void* buffer, size_t count);
 off_t lemon_seek(int fd, off_t offset, int whence);
 int lemon_readdir(int fd, uint64_t count, lemon_dirent_t* dirent);
 
+// Read as many entries as fit into buffer starting from the position of fd, which is advanced past them.
+// Returns the amount of bytes filled in, 0 at the end of the directory or -1 on error.
+// Walk the entries with recordLength.
+ssize_t lemon_readdir_batch(int fd, void* buffer, size_t size, int flags);
+
+#define LEMON_MAP_SHARED 0x1 // Writes are seen by every mapping of the file and written back when the process exits
+#define LEMON_MAP_PRIVATE 0x2 // Writes are private to this mapping
+
+// Map size bytes of fd from offset (which must be page aligned) into memory, pages are read in when first accessed.
+// If hint is not NULL the file is mapped there.
+// Returns the address of the mapping or NULL on error.
+void* lemon_map_file(int fd, size_t size, off_t offset, int flags, void* hint);
+
 #endif
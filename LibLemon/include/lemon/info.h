@@ -10,6 +10,11 @@ typedef struct {
 	uint64_t totalMem;
 	uint64_t usedMem;
 	uint16_t cpuCount;
+	uint64_t pageCacheHits; // Physical page allocations/frees served by per-CPU caches
+	uint64_t pageCacheRefills; // Batches of pages taken from the global allocator
+	uint64_t pageCacheDrains; // Batches of pages returned to the global allocator
+	uint64_t dentryCacheHits; // Path lookups served by the dentry cache, including names found not to exist
+	uint64_t dentryCacheMisses; // Path lookups that had to search the directory
 } lemon_sysinfo_t;
 
 namespace Lemon{
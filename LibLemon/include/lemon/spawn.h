@@ -8,4 +8,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 
-pid_t lemon_spawn(const char* path, int argc, char* const argv[], int flags = 0);
\ No newline at end of file
+pid_t lemon_spawn(const char* path, int argc, char* const argv[], int flags = 0);
+
+// Returns the PID of the child to the parent and 0 to the child, memory is copied when either writes to it
+pid_t lemon_fork();
\ No newline at end of file
@@ -22,8 +22,18 @@ typedef struct {
 
 	uint64_t runningTime; // Amount of time in seconds that the process has been running
     uint64_t activeUs; // Microseconds the process has been active for
+
+    uint64_t waitUs; // Microseconds the process's threads have spent runnable but waiting for a processor
+    uint64_t maxWaitUs; // Longest any thread has waited for a processor in microseconds
+    uint8_t schedClass; // Scheduling class of the main thread
+    int8_t nice; // Nice value of the main thread
 } lemon_process_info_t;
 
+enum {
+    SchedulingClassFair, // Threads share the processor according to their nice value
+    SchedulingClassInteractive, // Runs before and preempts fair threads, for latency sensitive threads such as input and compositing
+};
+
 namespace Lemon{
     /////////////////////////////
     /// \brief Yields CPU timeslice to next process
@@ -62,4 +72,18 @@ namespace Lemon{
     /// \param list Reference to a std::vector<lemon_process_info_t>
     /////////////////////////////
     void GetProcessList(std::vector<lemon_process_info_t>& list);
+
+    /////////////////////////////
+    /// \brief Set the scheduling class and nice value of a thread
+    ///
+    /// SchedulingClassInteractive and negative nice values require root
+    ///
+    /// \param pid Process ID, 0 for the calling process
+    /// \param tid Thread ID, 0 for the main thread
+    /// \param schedClass SchedulingClassFair or SchedulingClassInteractive
+    /// \param nice Nice value from -20 to 19, lower gets more processor time
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    int SetScheduling(uint64_t pid, uint64_t tid, int schedClass, int nice);
 }
\ No newline at end of file
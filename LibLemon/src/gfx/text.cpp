@@ -6,7 +6,14 @@
 #include FT_FREETYPE_H
 
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 #include <list.h>
+#include <algorithm>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
 
 extern uint8_t font_default[];
 
@@ -14,6 +21,135 @@ namespace Lemon::Graphics{
     extern int fontState;
     extern Font* mainFont;
 
+    // Rasterise c into the font's atlas the first time it gets used
+    static Glyph* GetGlyph(Font* font, unsigned char c){
+        Glyph& glyph = font->glyphs[c];
+        if(glyph.cached) return &glyph;
+
+        if(int err = FT_Load_Char(font->face, c, FT_LOAD_RENDER)) {
+            printf("Freetype Error (%d)\n", err);
+            fontState = 0;
+            return nullptr;
+        }
+
+        FT_GlyphSlot slot = font->face->glyph;
+        GlyphAtlas& atlas = font->atlas;
+
+        if(!atlas.buffer){
+            atlas.width = std::max(font->height, 8) * 16; // Fits a row of 16 glyphs
+        }
+
+        glyph.advance = slot->advance.x >> 6;
+        glyph.top = slot->bitmap_top;
+        glyph.width = std::min(static_cast<int>(slot->bitmap.width), atlas.width);
+        glyph.height = slot->bitmap.rows;
+
+        if(atlas.shelfX + glyph.width > atlas.width){ // Start a new shelf
+            atlas.shelfY += atlas.shelfHeight;
+            atlas.shelfX = 0;
+            atlas.shelfHeight = 0;
+        }
+
+        if(atlas.shelfY + glyph.height > atlas.height || !atlas.buffer){
+            int newHeight = std::max({atlas.height * 2, atlas.shelfY + glyph.height, font->height * 2});
+
+            atlas.buffer = (uint8_t*)realloc(atlas.buffer, atlas.width * newHeight);
+            atlas.height = newHeight;
+        }
+
+        glyph.atlasX = atlas.shelfX;
+        glyph.atlasY = atlas.shelfY;
+
+        for(int i = 0; i < glyph.height; i++){
+            memcpy(atlas.buffer + (glyph.atlasY + i) * atlas.width + glyph.atlasX, slot->bitmap.buffer + i * slot->bitmap.pitch, glyph.width);
+        }
+
+        atlas.shelfX += glyph.width;
+        atlas.shelfHeight = std::max(atlas.shelfHeight, glyph.height);
+
+        glyph.cached = true;
+        return &glyph;
+    }
+
+    #ifdef __SSE2__
+    // (src * a + dest * (255 - a)) / 255 on 16-bit channels
+    static inline __m128i BlendChannels(__m128i src, __m128i dest, __m128i alpha){
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(src, alpha), _mm_mullo_epi16(dest, _mm_sub_epi16(_mm_set1_epi16(255), alpha)));
+        t = _mm_add_epi16(t, _mm_set1_epi16(128));
+
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+    #endif
+
+    // Blend colour into count pixels using the glyph coverage values
+    static inline void BlendSpan(uint32_t* dest, const uint8_t* coverage, int count, uint32_t colour){
+        int i = 0;
+
+        #ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i src = _mm_unpacklo_epi8(_mm_set1_epi32(colour), zero); // Two pixels of 16-bit channels
+
+        for(; i + 4 <= count; i += 4){
+            uint32_t a4;
+            memcpy(&a4, coverage + i, 4);
+
+            if(!a4){
+                continue;
+            } else if(a4 == 0xFFFFFFFF){
+                _mm_storeu_si128((__m128i*)(dest + i), _mm_set1_epi32(colour));
+                continue;
+            }
+
+            __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a4), zero);
+            a = _mm_unpacklo_epi16(a, a);
+            __m128i aLow = _mm_unpacklo_epi32(a, a); // Coverage of pixels 0 and 1 in each of their channels
+            __m128i aHigh = _mm_unpackhi_epi32(a, a); // Pixels 2 and 3
+
+            __m128i d = _mm_loadu_si128((__m128i*)(dest + i));
+            __m128i dLow = BlendChannels(src, _mm_unpacklo_epi8(d, zero), aLow);
+            __m128i dHigh = BlendChannels(src, _mm_unpackhi_epi8(d, zero), aHigh);
+
+            _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(dLow, dHigh));
+        }
+        #endif
+
+        for(; i < count; i++){
+            unsigned a = coverage[i];
+            if(!a){
+                continue;
+            } else if(a == 255){
+                dest[i] = colour;
+                continue;
+            }
+
+            uint32_t result = 0;
+            for(int shift = 0; shift < 32; shift += 8){
+                unsigned t = ((colour >> shift) & 0xFF) * a + ((dest[i] >> shift) & 0xFF) * (255 - a) + 128;
+                result |= ((t + (t >> 8)) >> 8) << shift;
+            }
+            dest[i] = result;
+        }
+    }
+
+    // Blend a glyph from the atlas into the surface, (x, y) is the top left of the line
+    static void DrawGlyph(Font* font, Glyph* glyph, int x, int y, uint32_t colour, surface_t* surface, rect_t limits){
+        int top = y + font->height - glyph->top;
+
+        int left = std::max({x, limits.x, 0});
+        int right = std::min({x + glyph->width, limits.x + limits.width, surface->width});
+        int rowTop = std::max({top, limits.y, 0});
+        int rowBottom = std::min({top + glyph->height, y + font->height /* Anything past the line is cut off */, limits.y + limits.height, surface->height});
+
+        if(left >= right) return;
+
+        uint32_t* buffer = (uint32_t*)surface->buffer;
+        GlyphAtlas& atlas = font->atlas;
+
+        for(int row = rowTop; row < rowBottom; row++){
+            BlendSpan(buffer + row * surface->width + left, atlas.buffer + (glyph->atlasY + row - top) * atlas.width + glyph->atlasX + (left - x), right - left, colour);
+        }
+    }
+
     int DrawChar(char character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, rect_t limits, Font* font){
         if (!isprint(character)) {
             return 0;
@@ -37,39 +173,12 @@ namespace Lemon::Graphics{
             return 8;
         }
 
-        uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
-        uint32_t* buffer = (uint32_t*)surface->buffer; 
-        if(int err = FT_Load_Char(font->face, character, FT_LOAD_RENDER)) {
-            printf("Freetype Error (%d)\n", err);
-            fontState = 0;
-            return 0;
-        }
-
-        int maxHeight = font->height - (font->height - font->face->glyph->bitmap_top);
+        Glyph* glyph = GetGlyph(font, character);
+        if(!glyph) return 0;
 
-        if(y + maxHeight >= limits.y + limits.height){
-            maxHeight = limits.y + limits.height - y;
-        }
+        DrawGlyph(font, glyph, x, y, 0xFF000000 | (r << 16) | (g << 8) | b, surface, limits);
 
-        if(y + maxHeight >= surface->height){
-            maxHeight = surface->height - y;
-        }
-        
-        for(int i = 0; i < static_cast<int>(font->face->glyph->bitmap.rows) && i < maxHeight; i++){
-            if(y + i < 0) continue;
-
-            uint32_t yOffset = (i + y + (font->height - font->face->glyph->bitmap_top)) * (surface->width);
-            for(unsigned int j = 0; j < font->face->glyph->bitmap.width && static_cast<long>(j) + x < surface->width; j++){
-                if(x + static_cast<long>(j) < 0) continue;
-                if(font->face->glyph->bitmap.buffer[i * font->face->glyph->bitmap.width + j] == 255)
-                    buffer[yOffset + (j + x)] = colour_i;
-                else if(font->face->glyph->bitmap.buffer[i * font->face->glyph->bitmap.width + j] > 0){
-                    double val = font->face->glyph->bitmap.buffer[i * font->face->glyph->bitmap.width + j] * 1.0 / 255;
-                    buffer[yOffset + (j + x)] = AlphaBlend(buffer[yOffset + (j + x)], r, g, b, val);
-                }
-            }
-        }
-        return font->face->glyph->advance.x >> 6;
+        return glyph->advance;
     }
 
     int DrawChar(char character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, Font* font){
@@ -99,21 +208,6 @@ namespace Lemon::Graphics{
         }
 
         uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
-        uint32_t* buffer = (uint32_t*)surface->buffer; 
-
-        unsigned int maxHeight = font->height;
-
-        if(y < 0 && static_cast<unsigned>(-y) > maxHeight){
-            return 0;
-        }
-
-        if(y + static_cast<int>(maxHeight) >= limits.y + limits.height){
-            maxHeight = limits.y + limits.height - y;
-        }
-
-        if(y + static_cast<int>(maxHeight) >= surface->height){
-            maxHeight = surface->height - y;
-        }
 
         int xOffset = 0;
         while (*str != 0) {
@@ -124,37 +218,12 @@ namespace Lemon::Graphics{
                 continue;
             }
 
-            if(int err = FT_Load_Char(font->face, *str, FT_LOAD_RENDER)) {
-                printf("Freetype Error (%d)\n", err);
-                fontState = 0;
-                return 0;
-            }
-
-            unsigned i = 0;
-            if(y < 0){
-                i = -y;
-            }
+            Glyph* glyph = GetGlyph(font, *str);
+            if(!glyph) return 0;
 
-            for(; i < font->face->glyph->bitmap.rows && i + (font->height - font->face->glyph->bitmap_top) < maxHeight; i++){
-                uint32_t yOffset = (i + y + (font->height - font->face->glyph->bitmap_top)) * (surface->width);
-                
-                unsigned j = 0;
-                if(x < 0){
-                    j = -x;
-                }
+            DrawGlyph(font, glyph, x + xOffset, y, colour_i, surface, limits);
 
-                for(; j < font->face->glyph->bitmap.width && (x + xOffset + static_cast<long>(j)) < surface->width; j++){
-                    unsigned off = yOffset + (j + x + xOffset);
-                    if(font->face->glyph->bitmap.buffer[i * font->face->glyph->bitmap.width + j] == 255)
-                        buffer[off] = colour_i;
-                    else if( font->face->glyph->bitmap.buffer[i * font->face->glyph->bitmap.width + j]){
-                        double val = font->face->glyph->bitmap.buffer[i * font->face->glyph->bitmap.width + j] * 1.0 / 255;
-                        buffer[off] = AlphaBlend(buffer[off], r, g, b, val);
-                    }
-                }
-            }
-            
-            xOffset += font->face->glyph->advance.x >> 6;
+            xOffset += glyph->advance;
             str++;
         }
         return xOffset;
@@ -188,13 +257,10 @@ namespace Lemon::Graphics{
             return 0;
         }
 
-        if(int err = FT_Load_Char(font->face, c, FT_LOAD_ADVANCE_ONLY)) {
-            printf("Freetype Error (%d)\n", err);
-            fontState = 0;
-            return 0;
-        }
+        Glyph* glyph = GetGlyph(font, c);
+        if(!glyph) return 0;
 
-        return font->face->glyph->advance.x >> 6;
+        return glyph->advance;
     }
 
     int GetCharWidth(char c){
@@ -225,13 +291,10 @@ namespace Lemon::Graphics{
                 continue;
             }
 
-            if(int err = FT_Load_Char(font->face, *str, FT_LOAD_ADVANCE_ONLY)) {
-                printf("Freetype Error (%d)\n", err);
-                fontState = 0;
-                return 0;
-            }
+            Glyph* glyph = GetGlyph(font, *str);
+            if(!glyph) return 0;
 
-            len += font->face->glyph->advance.x >> 6;
+            len += glyph->advance;
             str++;
         }
 
@@ -149,35 +149,34 @@ namespace Lemon::GUI {
 
         fileList->ClearItems();
 
-        std::string absPath;
+        // Get the entries along with their stat data in batches rather than a readdir and stat per entry
+        alignas(8) uint8_t direntBuffer[4096];
+        ssize_t length;
+        while((length = lemon_readdir_batch(currentDir, direntBuffer, sizeof(direntBuffer), LEMON_READDIR_STAT)) > 0){
+            for(ssize_t offset = 0; offset < length;){
+                lemon_batch_dirent_t* dirent = (lemon_batch_dirent_t*)(direntBuffer + offset);
+                offset += dirent->recordLength;
 
-        int i = 0;
-        lemon_dirent_t dirent;
-        while(lemon_readdir(currentDir, i++, &dirent) > 0){
-            ListItem item;
-            item.details.push_back(dirent.name);
-
-            absPath = currentPath + "/" + dirent.name;
-
-            struct stat statResult;
-            int ret = stat(absPath.c_str(), &statResult);
-            if(ret){
-                perror("GUI: FileView: File: Stat:");
-                assert(!ret);
-                return;
-            }
+                ListItem item;
+                item.details.push_back(dirent->name);
 
-            if(S_ISDIR(statResult.st_mode)){
-                fileList->AddItem(item);
-                continue;
-            }
+                struct stat* statResult = lemon_batch_dirent_stat(dirent);
+                if(S_ISDIR(statResult->st_mode)){
+                    fileList->AddItem(item);
+                    continue;
+                }
+
+                char buf[80];
+                sprintf(buf, "%lu KB", statResult->st_size / 1024);
 
-            char buf[80];
-            sprintf(buf, "%lu KB", statResult.st_size / 1024);
+                item.details.push_back(std::string(buf));
 
-            item.details.push_back(std::string(buf));
+                fileList->AddItem(item);
+            }
+        }
 
-            fileList->AddItem(item);
+        if(length < 0){
+            perror("GUI: FileView: Readdir:");
         }
 
         #endif
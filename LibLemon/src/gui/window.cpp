@@ -1,6 +1,8 @@
 #include <gui/window.h>
 #include <core/sharedmem.h>
 
+#include "LemonWMInterface.h"
+
 #include <stdlib.h>
 
 #include <unistd.h>
@@ -15,9 +17,8 @@ namespace Lemon::GUI{
         sockAddr.sun_family = AF_UNIX;
 
         msgClient.Connect(sockAddr, sizeof(sockaddr_un)); // Connect to Window Manager
+        msgClient.UseSharedRing(); // Events and commands go through shared memory if the window manager lets us
 
-        LemonMessage* createMsg = (LemonMessage*)malloc(sizeof(LemonMessage) + sizeof(WMCommand) + strlen(title));
-    
         size_t windowBufferSize = ((sizeof(WindowBuffer) + 0x1F) & (~0x1F)) + ((size.x * size.y * 4 + 0x1F) & (~0x1F) /* Round up to 32 bytes*/) * 2;
 
         windowBufferKey = Lemon::CreateSharedMemory(windowBufferSize, SMEM_FLAGS_SHARED);
@@ -33,74 +34,31 @@ namespace Lemon::GUI{
         surface.width = size.x;
         surface.height = size.y;
 
-        WMCommand* cmd = (WMCommand*)createMsg->data;
-        cmd->cmd = WMCreateWindow;
-        cmd->create.pos = pos;
-        cmd->create.size = size;
-        cmd->create.flags = flags;
-        cmd->create.bufferKey = windowBufferKey;
-        memcpy(cmd->create.title, title, strlen(title));
-        cmd->create.titleLength = strlen(title);
-
-        createMsg->length = sizeof(WMCommand) + strlen(title);
-        createMsg->protocol = LEMON_MESSAGE_PROTOCOL_WMCMD;
-        
-        msgClient.Send(createMsg);
-
-        free(createMsg);
+        LemonWM::Client(msgClient).CreateWindow(title, pos, size, flags, windowBufferKey);
 
         rootContainer.window = this;
     }
 
     Window::~Window(){
-        LemonMessage* destroyMsg = (LemonMessage*)malloc(sizeof(LemonMessage) + sizeof(WMCommand));
-
-        WMCommand* cmd = (WMCommand*)destroyMsg->data;
-        cmd->cmd = WMDestroyWindow;
-
-        destroyMsg->length = sizeof(WMCommand);
-        destroyMsg->protocol = LEMON_MESSAGE_PROTOCOL_WMCMD;
-
-        msgClient.Send(destroyMsg);
-
-        free(destroyMsg);
+        LemonWM::Client(msgClient).DestroyWindow();
 
         usleep(100);
     }
 
     void Window::SetTitle(const char* title){
-        msgClient.Send(Lemon::Message(LEMON_MESSAGE_PROTOCOL_WMCMD, static_cast<unsigned short>(WMSetTitle), Lemon::Message::EncodeString(title)));
+        LemonWM::Client(msgClient).SetTitle(title);
     }
 
     void Window::Minimize(bool minimized){
-        LemonMessage* msg = (LemonMessage*)malloc(sizeof(LemonMessage) + sizeof(WMCommand));
-
-        WMCommand* cmd = (WMCommand*)msg->data;
-        cmd->cmd = WMMinimize;
-        cmd->minimized = minimized;
-
-        msg->length = sizeof(WMCommand);
-        msg->protocol = LEMON_MESSAGE_PROTOCOL_WMCMD;
-
-        msgClient.Send(msg);
-
-        free(msg);
+        LemonWM::Client(msgClient).Minimize(minimized);
     }
     
     void Window::Minimize(int windowID, bool minimized){
-        LemonMessage* msg = (LemonMessage*)malloc(sizeof(LemonMessage) + sizeof(WMCommand));
-
-        WMCommand* cmd = (WMCommand*)msg->data;
-        cmd->cmd = WMMinimizeOther;
-        cmd->minimized = minimized;
-        cmd->minimizeWindowID = windowID;
-
-        msg->length = sizeof(WMCommand);
-        msg->protocol = LEMON_MESSAGE_PROTOCOL_WMCMD;
-
-        msgClient.Send(msg);
+        LemonWM::Client(msgClient).MinimizeOther(windowID, minimized);
+    }
 
-        free(msg);
+    void Window::InitializeShellConnection(){
+        LemonWM::Client(msgClient).InitializeShellConnection();
     }
 
     void Window::Resize(vector2i_t size){
@@ -121,33 +79,37 @@ namespace Lemon::GUI{
         surface.width = size.x;
         surface.height = size.y;
 
+        damage.clear(); // Both buffers are new
+        backBufferStale = false;
+
         if(menuBar){
             rootContainer.SetBounds({{0, 16}, {size.x, size.y - WINDOW_MENUBAR_HEIGHT}});
         } else {
             rootContainer.SetBounds({{0, 0}, size});
         }
 
-        LemonMessage* msg = (LemonMessage*)malloc(sizeof(LemonMessage) + sizeof(WMCommand));
-
-        WMCommand* cmd = (WMCommand*)msg->data;
-        cmd->cmd = WMResize;
-
-        cmd->size = size;
-        cmd->bufferKey = windowBufferKey;
-
-        msg->length = sizeof(WMCommand);
-        msg->protocol = LEMON_MESSAGE_PROTOCOL_WMCMD;
-
-        msgClient.Send(msg);
-
-        free(msg);
+        LemonWM::Client(msgClient).Resize(size, windowBufferKey);
 
         rootContainer.UpdateFixedBounds();
     }
 
     void Window::SwapBuffers(){
-        if(windowBufferInfo->drawing) return;
+        if(windowBufferInfo->drawing) return; // Any damage is kept for the next swap
+
+        windowBufferInfo->LockDamage();
 
+        // Damage the window manager hasn't drawn yet is added to rather than replaced
+        uint32_t count = windowBufferInfo->dirty ? windowBufferInfo->damageCount : 0;
+        if(damage.empty() || (windowBufferInfo->dirty && !count) || count + damage.size() > WINDOW_MAX_DAMAGE_RECTS){
+            windowBufferInfo->damageCount = 0; // Whole window
+        } else {
+            for(rect_t& r : damage){
+                windowBufferInfo->damage[count++] = r;
+            }
+            windowBufferInfo->damageCount = count;
+        }
+
+        uint8_t* front = surface.buffer;
         if(surface.buffer == buffer1){
             windowBufferInfo->currentBuffer = 0;
             surface.buffer = buffer2;
@@ -157,6 +119,29 @@ namespace Lemon::GUI{
         }
 
         windowBufferInfo->dirty = 1;
+        windowBufferInfo->UnlockDamage();
+
+        if(damage.empty()){
+            backBufferStale = true;
+        } else { // Bring the back buffer up to date so only the next damage has to be drawn
+            surface_t frontSurface = {.width = surface.width, .height = surface.height, .depth = 32, .buffer = front};
+            for(rect_t& r : damage){
+                Graphics::surfacecpy(&surface, &frontSurface, r.pos, r);
+            }
+
+            damage.clear();
+        }
+    }
+
+    void Window::Damage(rect_t rect){
+        if(backBufferStale){
+            surface_t frontSurface = {.width = surface.width, .height = surface.height, .depth = 32, .buffer = (surface.buffer == buffer1) ? buffer2 : buffer1};
+            Graphics::surfacecpy(&surface, &frontSurface);
+
+            backBufferStale = false;
+        }
+
+        damage.push_back(rect);
     }
 
     void Window::Paint(){
@@ -174,7 +159,7 @@ namespace Lemon::GUI{
     }
     
     bool Window::PollEvent(LemonEvent& ev){
-        if(auto m = msgClient.Poll()){
+        if(const LemonMessage* m = msgClient.Next()){
             if(m->protocol == LEMON_MESSAGE_PROTOCOL_WMEVENT){
                 ev = *((LemonEvent*)m->data);
                 return true;
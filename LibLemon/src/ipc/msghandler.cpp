@@ -1,6 +1,7 @@
 #include <core/message.h>
 #include <core/msghandler.h>
 #include <lemon/util.h>
+#include <lemon/epoll.h>
 
 #include <assert.h>
 #include <stdlib.h>
@@ -18,6 +19,15 @@ namespace Lemon {
     }
 
     MessageClient::~MessageClient(){
+        if(ring){
+            ring->Close();
+            delete ring;
+        }
+
+        if(pendingRing){
+            delete pendingRing;
+        }
+
         close(sock.fd);
     }
 
@@ -52,7 +62,82 @@ namespace Lemon {
         }
     }
 
-    std::shared_ptr<LemonMessageInfo> MessageServer::Poll(){
+    MessageServer::~MessageServer(){
+        while(rings.size()){
+            RemoveRing(rings.begin()->first);
+        }
+    }
+
+    bool MessageClient::UseSharedRing(){
+        if(ring || pendingRing){
+            return ring != nullptr;
+        }
+
+        pendingRing = new MessageRing();
+        if(!pendingRing->Create()){
+            delete pendingRing;
+            pendingRing = nullptr;
+            return false;
+        }
+
+        SendRingRequest(MessageRingSetup, pendingRing->Key());
+
+        // Wait for the answer, anything the server sends before it is queued.
+        // If the server is too slow we carry on using the socket until it answers.
+        pollfd pfd = sock;
+        while(pendingRing && poll(&pfd, 1, 1000) > 0 && (pfd.revents & POLLIN)){
+            while(Receive(MSG_DONTWAIT) && pendingRing);
+        }
+
+        return ring != nullptr;
+    }
+
+    static std::shared_ptr<LemonMessageInfo> CopyMessage(int fd, const LemonMessage* msg){
+        std::shared_ptr<LemonMessageInfo> info((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo) + msg->length));
+        info->clientFd = fd;
+        memcpy(&info->msg, msg, sizeof(LemonMessage) + msg->length);
+
+        return info;
+    }
+
+    void MessageServer::OnRingRequest(int fd, const LemonMessage& msg){
+        MessageRingRequest request;
+        if(msg.length != sizeof(MessageRingRequest) || recv(fd, &request, sizeof(MessageRingRequest), 0) < static_cast<ssize_t>(sizeof(MessageRingRequest))){
+            printf("Warning: Invalid ring request\n");
+            return;
+        }
+
+        if(request.type != MessageRingSetup || rings.count(fd)){
+            return; // Doorbells only need to wake us up
+        }
+
+        MessageRing* ring = new MessageRing();
+        if(!ring->Attach(request.key)){
+            printf("Warning: Failed to attach message ring %lu\n", request.key);
+            delete ring;
+
+            SendRingRequest(fd, MessageRingRejected);
+            return;
+        }
+
+        rings[fd] = ring;
+        SendRingRequest(fd, MessageRingAccepted); // Everything we send after this goes through the ring
+    }
+
+    void MessageServer::RemoveRing(int fd){
+        auto it = rings.find(fd);
+        if(it == rings.end()){
+            return;
+        }
+
+        it->second->Close();
+        delete it->second;
+        rings.erase(it);
+    }
+
+    const LemonMessage* MessageServer::Next(int& clientFd){
+        current.reset();
+
     retry:
         int fd = 0;
         while((fd = accept(sock.fd, nullptr, nullptr)) > 0){
@@ -60,27 +145,35 @@ namespace Lemon {
         }
 
         if(queue.size() > 0){
-            auto element = queue.front();
+            current = queue.front();
             queue.pop_front();
-            return element;
-        }
 
-        if(!fds.size()) {
-            return std::shared_ptr<LemonMessageInfo>(nullptr);
+            clientFd = current->clientFd;
+            return &current->msg;
         }
 
-        int evCount = poll(fds.data(), fds.size(), 0);
+        int evCount = fds.size() ? poll(fds.data(), fds.size(), 0) : 0;
         if(evCount > 0){
             for(size_t i = 0; i < fds.size(); i++){
                 if(fds[i].revents & (POLLNVAL | POLLHUP)){
                     int fd = fds[i].fd;
-                    fds.erase(fds.begin() + i);
+                    fds.erase(fds.begin() + i--);
+
+                    if(auto it = rings.find(fd); it != rings.end()){
+                        // Anything left in the ring was sent before the client hung up
+                        while(const LemonMessage* msg = it->second->Read()){
+                            queue.push_back(CopyMessage(fd, msg));
+                        }
+
+                        RemoveRing(fd);
+                    }
                     
                     std::shared_ptr<LemonMessageInfo> newMsg = std::shared_ptr<LemonMessageInfo>((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo)));
                     newMsg->msg.protocol = 0; // Disconnected
                     newMsg->clientFd = fd;
 
-                    return newMsg;
+                    queue.push_back(newMsg);
+                    continue;
                 }
 
                 if(!(fds[i].revents & POLLIN)) continue; // We only care about POLLIN
@@ -103,6 +196,11 @@ namespace Lemon {
                     printf("invalid magic: %x\n", msg.magic);
                     continue;
                 }
+
+                if(msg.protocol == LEMON_MESSAGE_PROTOCOL_RING){
+                    OnRingRequest(fds[i].fd, msg);
+                    continue;
+                }
                 
                 std::shared_ptr<LemonMessageInfo> newMsg((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo) + msg.length));
                 newMsg->msg = msg;
@@ -122,35 +220,41 @@ namespace Lemon {
                 goto retry;
         }
 
-        return std::shared_ptr<LemonMessageInfo>(nullptr);
-    }
-
-    std::shared_ptr<LemonMessage> MessageClient::Poll(){
-    retry:
-        if(queue.size() > 0){
-            auto element = queue.front();
-            queue.pop_front();
-            return element;
+        // Clients using a ring only send doorbells and setup requests through their socket,
+        // so nothing in the ring can be overtaken by something queued above
+        for(auto& ring : rings){
+            if(const LemonMessage* msg = ring.second->Read()){
+                clientFd = ring.first;
+                return msg;
+            }
         }
 
-        int ret = poll(&sock, 1, 0);
+        return nullptr;
+    }
 
-        if(ret < 0){
-            perror("Poll: ");
+    std::shared_ptr<LemonMessageInfo> MessageServer::Poll(){
+        int fd;
+        const LemonMessage* msg = Next(fd);
 
-            return std::shared_ptr<LemonMessage>(nullptr);
+        if(!msg){
+            return std::shared_ptr<LemonMessageInfo>(nullptr);
+        } else if(current){
+            return std::move(current); // Came from the queue, already a copy
         }
 
-        if(!(sock.revents & POLLIN)) return std::shared_ptr<LemonMessage>(nullptr);
+        return CopyMessage(fd, msg);
+    }
 
+    // Read one message from the socket, returns false if there was nothing to read
+    bool MessageClient::Receive(int flags){
         LemonMessage msg;
 
-        ssize_t len = recv(sock.fd, &msg, sizeof(LemonMessage), MSG_DONTWAIT);
+        ssize_t len = recv(sock.fd, &msg, sizeof(LemonMessage), flags);
         
         if(len < (ssize_t)sizeof(LemonMessage)){
             //printf("invalid length: %d\n", len);
             
-            return std::shared_ptr<LemonMessage>(nullptr);
+            return false;
         }
 
         if(msg.magic != LEMON_MESSAGE_MAGIC){
@@ -163,7 +267,25 @@ namespace Lemon {
         if(msg.magic != LEMON_MESSAGE_MAGIC){
             printf("invalid magic: %x\n", msg.magic);
             
-            return std::shared_ptr<LemonMessage>(nullptr);
+            return false;
+        }
+
+        if(msg.protocol == LEMON_MESSAGE_PROTOCOL_RING){
+            MessageRingRequest request;
+            if(msg.length != sizeof(MessageRingRequest) || recv(sock.fd, &request, sizeof(MessageRingRequest), 0) < static_cast<ssize_t>(sizeof(MessageRingRequest))){
+                printf("Warning: Invalid ring request\n");
+                return false;
+            }
+
+            if(request.type == MessageRingAccepted && pendingRing){
+                ring = pendingRing;
+                pendingRing = nullptr;
+            } else if(request.type == MessageRingRejected && pendingRing){
+                delete pendingRing;
+                pendingRing = nullptr;
+            }
+
+            return true; // Doorbells only need to wake us up
         }
 
         std::shared_ptr<LemonMessage> newMsg((LemonMessage*)malloc(sizeof(LemonMessage) + msg.length));
@@ -174,66 +296,179 @@ namespace Lemon {
         if(len < msg.length){
             printf("Warning: invalid message length %u. Only read %ld bytes\n", msg.length, len);
             
-            return std::shared_ptr<LemonMessage>(nullptr);
+            return false;
         }
 
-        queue.push_back(newMsg);
+        if(ring && ring->ReceivesOnSocket()){
+            // The server moved to the socket after filling the ring, whatever is left in the ring was sent first
+            while(const LemonMessage* ringMsg = ring->Read()){
+                std::shared_ptr<LemonMessage> copy((LemonMessage*)malloc(sizeof(LemonMessage) + ringMsg->length));
+                memcpy(copy.get(), ringMsg, sizeof(LemonMessage) + ringMsg->length);
+                queue.push_back(copy);
+            }
+        }
 
-        goto retry;
+        queue.push_back(newMsg);
+        return true;
     }
 
-    std::shared_ptr<LemonMessage> MessageClient::PollSync(){
-    retry:
+    const LemonMessage* MessageClient::Next(){
+        current.reset();
+
+        if(queue.empty()){
+            if(ring){
+                if(const LemonMessage* msg = ring->Read()){
+                    return msg;
+                }
+
+                while(Receive(MSG_DONTWAIT)); // The ring is empty, clear out any doorbells so the socket stops polling as readable
+            } else {
+                Receive(MSG_DONTWAIT);
+            }
+        }
+
         if(queue.size() > 0){
-            auto element = queue.front();
+            current = queue.front();
             queue.pop_front();
-            return element;
+
+            return current.get();
         }
 
-        LemonMessage msg;
+        return ring ? ring->Read() : nullptr;
+    }
 
-        ssize_t len = recv(sock.fd, &msg, sizeof(LemonMessage), 0);
-        
-        if(len < (ssize_t)sizeof(LemonMessage)){
-            //printf("invalid length: %d\n", len);
-            
-            return std::shared_ptr<LemonMessage>(nullptr);
-        }
+    const LemonMessage* MessageClient::WaitFor(unsigned int protocol){
+        current.reset();
 
-        if(msg.magic != LEMON_MESSAGE_MAGIC){
-            printf("Invalid magic: %x, discarding data.\n", msg.magic);
-            while(msg.magic != LEMON_MESSAGE_MAGIC && len >= static_cast<ssize_t>(sizeof(msg))){
-                len = recv(sock.fd, &msg, sizeof(msg), MSG_DONTWAIT); // Discard everything until we find a message
+        for(;;){
+            for(auto it = queue.begin(); it != queue.end(); it++){
+                if((*it)->protocol == protocol){
+                    current = *it;
+                    queue.erase(it);
+
+                    return current.get();
+                }
+            }
+
+            if(ring){
+                while(const LemonMessage* msg = ring->Read()){
+                    if(msg->protocol == protocol){
+                        return msg;
+                    }
+
+                    std::shared_ptr<LemonMessage> newMsg((LemonMessage*)malloc(sizeof(LemonMessage) + msg->length)); // Keep it for Next
+                    memcpy(newMsg.get(), msg, sizeof(LemonMessage) + msg->length);
+                    queue.push_back(newMsg);
+                }
+
+                if(ring->Closed()){
+                    return nullptr;
+                } else if(!ring->ReceivesOnSocket()){
+                    ring->Wait();
+                    continue;
+                }
+
+                // The server ran out of room in the ring, everything after what we just read comes through the socket
+            }
+
+            if(!Receive(0)){
+                return nullptr;
             }
         }
+    }
 
-        if(msg.magic != LEMON_MESSAGE_MAGIC){
-            printf("invalid magic: %x\n", msg.magic);
-            
+    std::shared_ptr<LemonMessage> MessageClient::Poll(){
+        const LemonMessage* msg = Next();
+
+        if(!msg){
             return std::shared_ptr<LemonMessage>(nullptr);
+        } else if(current){
+            return std::move(current); // Came from the queue, already a copy
         }
 
-        std::shared_ptr<LemonMessage> newMsg((LemonMessage*)malloc(sizeof(LemonMessage) + msg.length));
-        *newMsg = msg;
+        std::shared_ptr<LemonMessage> newMsg((LemonMessage*)malloc(sizeof(LemonMessage) + msg->length));
+        memcpy(newMsg.get(), msg, sizeof(LemonMessage) + msg->length);
 
-        len = recv(sock.fd, newMsg->data, msg.length, 0);
+        return newMsg;
+    }
 
-        if(len < msg.length){
-            printf("Warning: invalid message length %u. Only read %ld bytes\n", msg.length, len);
-            
-            return std::shared_ptr<LemonMessage>(nullptr);
+    std::shared_ptr<LemonMessage> MessageClient::PollSync(){
+        if(ring){
+            for(;;){
+                if(auto msg = Poll()){
+                    return msg;
+                } else if(ring->Closed()){
+                    return std::shared_ptr<LemonMessage>(nullptr);
+                } else if(ring->ReceivesOnSocket()){
+                    break; // The ring is empty and the server has moved to the socket
+                }
+
+                ring->Wait();
+            }
         }
 
-        queue.push_back(newMsg);
+    retry:
+        if(queue.size() > 0){
+            auto element = queue.front();
+            queue.pop_front();
+            return element;
+        }
+
+        if(!Receive(0)){
+            return std::shared_ptr<LemonMessage>(nullptr);
+        }
 
         goto retry;
     }
 
     void MessageClient::Wait(){
+        if(ring && !ring->ReceivesOnSocket()){
+            if(queue.empty()){
+                ring->Wait();
+            }
+
+            return;
+        }
+
         char c;
         recv(sock.fd, &c, 0, MSG_PEEK);
     }
 
+    // Returns false if the message has to go through the socket instead
+    bool MessageServer::SendRing(int fd, MessageRing* ring, const LemonMessage* msg){
+        if(ring->SendsOnSocket()){
+            return false;
+        }
+
+        int ret = ring->Write(msg, false); // Don't let a client that isn't reading hold us up
+
+        if(ret == MessageRing::WriteDoorbell){
+            SendRingRequest(fd, MessageRingDoorbell);
+        } else if(ret == MessageRing::WriteFull){
+            // Dropping it could leave the client waiting forever on a response,
+            // it reads what is left in the ring before the socket so nothing gets reordered
+            printf("Warning: Message ring of %d is full, falling back to the socket\n", fd);
+
+            ring->FallBackToSocket();
+            return false;
+        }
+
+        return true;
+    }
+
+    void MessageServer::SendRingRequest(int fd, uint32_t type){
+        struct {
+            LemonMessage header;
+            MessageRingRequest request;
+        } msg;
+
+        msg.header.protocol = LEMON_MESSAGE_PROTOCOL_RING;
+        msg.header.length = sizeof(MessageRingRequest);
+        msg.request.type = type;
+
+        send(fd, &msg, sizeof(msg), MSG_DONTWAIT);
+    }
+
     void MessageServer::Send(LemonMessage* msg, int fd){
         if(fd < 0) {
             printf("Invalid fd: %i\n", fd);
@@ -242,6 +477,10 @@ namespace Lemon {
 
         msg->magic = LEMON_MESSAGE_MAGIC;
 
+        if(auto it = rings.find(fd); it != rings.end() && SendRing(fd, it->second, msg)){
+            return;
+        }
+
         ssize_t sent = send(fd, msg, msg->length + sizeof(LemonMessage), MSG_DONTWAIT);
 
         if(sent <= 0){
@@ -257,6 +496,10 @@ namespace Lemon {
             return;
         }
 
+        if(auto it = rings.find(fd); it != rings.end() && SendRing(fd, it->second, reinterpret_cast<const LemonMessage*>(msg.data()))){
+            return;
+        }
+
         ssize_t sent = send(fd, msg.data(), msg.length(), MSG_DONTWAIT);
 
         if(sent < 0){
@@ -266,9 +509,38 @@ namespace Lemon {
         }
     }
 
+    void MessageClient::SendRing(const LemonMessage* msg){
+        int ret = ring->Write(msg, true);
+
+        if(ret == MessageRing::WriteDoorbell){
+            SendRingRequest(MessageRingDoorbell);
+        } else if(ret == MessageRing::WriteClosed){
+            printf("Warning: Send: Connection closed\n");
+        }
+    }
+
+    void MessageClient::SendRingRequest(uint32_t type, uint64_t key){
+        struct {
+            LemonMessage header;
+            MessageRingRequest request;
+        } msg;
+
+        msg.header.protocol = LEMON_MESSAGE_PROTOCOL_RING;
+        msg.header.length = sizeof(MessageRingRequest);
+        msg.request.type = type;
+        msg.request.key = key;
+
+        send(sock.fd, &msg, sizeof(msg), 0);
+    }
+
     void MessageClient::Send(LemonMessage* msg){
         msg->magic = LEMON_MESSAGE_MAGIC;
 
+        if(ring){
+            SendRing(msg);
+            return;
+        }
+
         ssize_t sent = send(sock.fd, msg, msg->length + sizeof(LemonMessage), 0);
 
         if(sent <= 0){
@@ -279,6 +551,11 @@ namespace Lemon {
     }
 
     void MessageClient::Send(const Message& msg){
+        if(ring){
+            SendRing(reinterpret_cast<const LemonMessage*>(msg.data()));
+            return;
+        }
+
         ssize_t sent = send(sock.fd, msg.data(), msg.length(), 0);
 
         if(sent <= 0){
@@ -300,23 +577,69 @@ namespace Lemon {
         return v;
     }
 
+    bool MessageServer::ArmDoorbells(){
+        bool ready = queue.size() > 0;
+
+        for(auto& ring : rings){
+            if(!ring.second->ArmSocketDoorbell()){
+                ready = true;
+            }
+        }
+
+        return ready;
+    }
+
+    bool MessageClient::ArmDoorbells(){
+        if(queue.size() > 0){
+            return true;
+        }
+
+        return ring && !ring->ArmSocketDoorbell();
+    }
+
+    MessageMultiplexer::~MessageMultiplexer(){
+        if(epollFd >= 0){
+            close(epollFd);
+        }
+    }
+
     void MessageMultiplexer::AddSource(MessageHandler& handler){
         handlers.push_back(&handler);
     }
 
     bool MessageMultiplexer::PollSync(){
-        std::vector<pollfd> fds;
+        if(epollFd < 0){
+            epollFd = lemon_epoll_create(0);
+            assert(epollFd >= 0);
+        }
 
+        // Servers gain clients over time, so pick up any new file descriptors.
+        // The kernel drops closed ones from the epoll instance by itself.
+        // Messages in shared memory rings don't show up on the socket unless we ask for a doorbell.
+        bool ready = false;
+        std::unordered_set<int> fds;
         for(MessageHandler* h : handlers){
+            if(h->ArmDoorbells()){
+                ready = true;
+            }
+
             for(pollfd& f : h->GetFileDescriptors()){
-                f.events |= POLLIN;
-                fds.push_back(f);
+                fds.insert(f.fd);
+
+                if(!watching.count(f.fd)){
+                    lemon_epoll_event_t event = { .events = EPOLLIN, .data = static_cast<uint64_t>(f.fd) };
+                    lemon_epoll_ctl(epollFd, EPOLL_CTL_ADD, f.fd, &event);
+                }
             }
         }
+        watching = std::move(fds);
 
-        int evCount = 0;
-        
-        evCount = poll(fds.data(), fds.size(), 200);
+        if(ready){
+            return true;
+        }
+
+        lemon_epoll_event_t events[16];
+        int evCount = lemon_epoll_wait(epollFd, events, 16, 200);
 
         if(evCount > 0){
             return true;
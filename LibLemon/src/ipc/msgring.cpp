@@ -0,0 +1,264 @@
+#include <core/msgring.h>
+#include <core/sharedmem.h>
+
+#include <lemon/syscall.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYS_FUTEX_WAKE
+    #define SYS_FUTEX_WAKE 70
+#endif
+
+#ifndef SYS_FUTEX_WAIT
+    #define SYS_FUTEX_WAIT 71
+#endif
+
+namespace Lemon {
+    static inline void FutexWait(std::atomic<int>* futex, int expected){
+        syscall(SYS_FUTEX_WAIT, futex, expected, 0, 0, 0);
+    }
+
+    static inline void FutexWake(std::atomic<int>* futex){
+        syscall(SYS_FUTEX_WAKE, futex, 0, 0, 0, 0);
+    }
+
+    static inline uint32_t RecordSize(uint32_t length){
+        return (length + 7) & ~7U;
+    }
+
+    MessageRing::~MessageRing(){
+        if(header){
+            UnmapSharedMemory(header, key); // Destroyed once the other end has unmapped it too
+        }
+
+        if(scratch){
+            free(scratch);
+        }
+    }
+
+    void MessageRing::Map(bool server){
+        uint8_t* toServer = reinterpret_cast<uint8_t*>(header + 1);
+        uint8_t* toClient = toServer + LEMON_MESSAGE_RING_SIZE;
+        size = LEMON_MESSAGE_RING_SIZE;
+
+        if(server){
+            rx = &header->toServer;
+            rxData = toServer;
+            tx = &header->toClient;
+            txData = toClient;
+        } else {
+            rx = &header->toClient;
+            rxData = toClient;
+            tx = &header->toServer;
+            txData = toServer;
+        }
+    }
+
+    bool MessageRing::Create(){
+        key = CreateSharedMemory(sizeof(MessageRingHeader) + LEMON_MESSAGE_RING_SIZE * 2, SMEM_FLAGS_SHARED);
+        if(!key){
+            return false;
+        }
+
+        header = reinterpret_cast<MessageRingHeader*>(MapSharedMemory(key));
+        if(!header){
+            DestroySharedMemory(key);
+            return false;
+        }
+
+        header->magic = LEMON_MESSAGE_RING_MAGIC;
+        header->size = LEMON_MESSAGE_RING_SIZE;
+        header->closed = 0;
+
+        for(MessageRingControl* control : {&header->toServer, &header->toClient}){
+            control->head = 0;
+            control->tail = 0;
+            control->writerWaiting = 0;
+            control->writerOnSocket = 0;
+            control->readerWaiting = MessageRingNotWaiting;
+        }
+
+        Map(false);
+        return true;
+    }
+
+    bool MessageRing::Attach(uint64_t key){
+        header = reinterpret_cast<MessageRingHeader*>(MapSharedMemory(key));
+        if(!header){
+            return false;
+        }
+
+        this->key = key;
+
+        if(header->magic != LEMON_MESSAGE_RING_MAGIC || header->size != LEMON_MESSAGE_RING_SIZE){
+            UnmapSharedMemory(header, key);
+            header = nullptr;
+            return false;
+        }
+
+        Map(true);
+        return true;
+    }
+
+    void MessageRing::Close(){
+        header->closed = 1;
+
+        for(MessageRingControl* control : {tx, rx}){
+            if(control->readerWaiting.exchange(MessageRingNotWaiting) == MessageRingWaitingFutex){
+                FutexWake(&control->readerWaiting);
+            }
+
+            if(control->writerWaiting.exchange(0)){
+                FutexWake(&control->writerWaiting);
+            }
+        }
+    }
+
+    int MessageRing::Write(const LemonMessage* msg, bool block){
+        uint32_t length = sizeof(LemonMessage) + msg->length;
+        uint32_t recordSize = RecordSize(length);
+        uint32_t head = tx->head.load(std::memory_order_relaxed);
+
+        while(size - (head - tx->tail.load(std::memory_order_acquire)) < recordSize){
+            if(Closed()){
+                return WriteClosed;
+            } else if(!block){
+                return WriteFull;
+            }
+
+            tx->writerWaiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the fence in Release
+
+            if(size - (head - tx->tail.load(std::memory_order_relaxed)) < recordSize && !Closed()){
+                FutexWait(&tx->writerWaiting, 1);
+            }
+
+            tx->writerWaiting.store(0, std::memory_order_relaxed);
+        }
+
+        if(Closed()){
+            return WriteClosed;
+        }
+
+        uint32_t offset = head & (size - 1);
+        uint32_t first = (length < size - offset) ? length : (size - offset);
+        memcpy(txData + offset, msg, first);
+        memcpy(txData, reinterpret_cast<const uint8_t*>(msg) + first, length - first);
+
+        tx->head.store(head + recordSize, std::memory_order_release);
+
+        // Pairs with the fence in Wait and ArmSocketDoorbell, either the reader sees the new head or we see it waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(tx->readerWaiting.load(std::memory_order_relaxed) != MessageRingNotWaiting){
+            int waiting = tx->readerWaiting.exchange(MessageRingNotWaiting);
+
+            if(waiting == MessageRingWaitingFutex){
+                FutexWake(&tx->readerWaiting);
+            } else if(waiting == MessageRingWaitingSocket){
+                return WriteDoorbell;
+            }
+        }
+
+        return WriteOk;
+    }
+
+    void MessageRing::FallBackToSocket(){
+        tx->writerOnSocket.store(1, std::memory_order_relaxed);
+
+        // Pairs with the fence in Wait, either the reader sees the flag or we see it waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(tx->readerWaiting.exchange(MessageRingNotWaiting) == MessageRingWaitingFutex){
+            FutexWake(&tx->readerWaiting);
+        }
+    }
+
+    // Give the space taken by the last message back to the writer
+    void MessageRing::Release(){
+        if(!pending){
+            return;
+        }
+
+        rx->tail.store(rx->tail.load(std::memory_order_relaxed) + pending, std::memory_order_release);
+        pending = 0;
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(rx->writerWaiting.load(std::memory_order_relaxed) && rx->writerWaiting.exchange(0)){
+            FutexWake(&rx->writerWaiting);
+        }
+    }
+
+    const LemonMessage* MessageRing::Read(){
+        Release();
+
+        if(broken){
+            return nullptr;
+        }
+
+        uint32_t tail = rx->tail.load(std::memory_order_relaxed);
+        uint32_t head = rx->head.load(std::memory_order_acquire);
+        if(head == tail){
+            return nullptr;
+        }
+
+        // Messages are padded to 8 bytes so the header never wraps
+        uint32_t offset = tail & (size - 1);
+        LemonMessage* msg = reinterpret_cast<LemonMessage*>(rxData + offset);
+        LemonMessage info = *msg; // The writer can still scribble over the ring, so only look at the header once
+
+        uint32_t length = sizeof(LemonMessage) + info.length;
+        if(info.magic != LEMON_MESSAGE_MAGIC || RecordSize(length) > head - tail){
+            printf("[MessageRing] Invalid message (magic: %x, length: %u), closing\n", info.magic, info.length);
+
+            broken = true;
+            Close();
+            return nullptr;
+        }
+
+        pending = RecordSize(length);
+
+        if(offset + length > size){
+            if(!scratch){
+                scratch = reinterpret_cast<LemonMessage*>(malloc(sizeof(LemonMessage) + UINT16_MAX));
+            }
+
+            uint32_t first = size - offset;
+            memcpy(scratch, msg, first);
+            memcpy(reinterpret_cast<uint8_t*>(scratch) + first, rxData, length - first);
+            *scratch = info;
+
+            return scratch;
+        }
+
+        return msg;
+    }
+
+    void MessageRing::Wait(){
+        Release();
+
+        rx->readerWaiting.store(MessageRingWaitingFutex, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if(rx->head.load(std::memory_order_relaxed) != rx->tail.load(std::memory_order_relaxed) || Closed() || ReceivesOnSocket()){
+            rx->readerWaiting.store(MessageRingNotWaiting, std::memory_order_relaxed);
+            return;
+        }
+
+        FutexWait(&rx->readerWaiting, MessageRingWaitingFutex);
+    }
+
+    bool MessageRing::ArmSocketDoorbell(){
+        Release();
+
+        rx->readerWaiting.store(MessageRingWaitingSocket, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if(rx->head.load(std::memory_order_relaxed) != rx->tail.load(std::memory_order_relaxed)){
+            rx->readerWaiting.store(MessageRingNotWaiting, std::memory_order_relaxed);
+            return false;
+        }
+
+        return true;
+    }
+}
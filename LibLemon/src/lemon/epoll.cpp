@@ -0,0 +1,40 @@
+#include <lemon/epoll.h>
+#include <lemon/syscall.h>
+
+#include <errno.h>
+
+#ifndef SYS_EPOLL_CREATE
+    #define SYS_EPOLL_CREATE 77
+    #define SYS_EPOLL_CTL 78
+    #define SYS_EPOLL_WAIT 79
+#endif
+
+int lemon_epoll_create(int flags){
+    long ret = syscall(SYS_EPOLL_CREATE, flags, 0, 0, 0, 0);
+    if(ret < 0){
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
+
+int lemon_epoll_ctl(int epfd, int op, int fd, lemon_epoll_event_t* event){
+    long ret = syscall(SYS_EPOLL_CTL, epfd, op, fd, (uintptr_t)event, 0);
+    if(ret < 0){
+        errno = -ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+int lemon_epoll_wait(int epfd, lemon_epoll_event_t* events, int maxEvents, int timeout){
+    long ret = syscall(SYS_EPOLL_WAIT, epfd, (uintptr_t)events, maxEvents, timeout, 0);
+    if(ret < 0){
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
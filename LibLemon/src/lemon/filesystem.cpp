@@ -2,6 +2,16 @@
 #include <stddef.h>
 #include <lemon/filesystem.h>
 
+#include <errno.h>
+
+#ifndef SYS_READDIR_BATCH
+    #define SYS_READDIR_BATCH 80
+#endif
+
+#ifndef SYS_MAP_FILE
+    #define SYS_MAP_FILE 81
+#endif
+
 int lemon_open(const char* filename, int flags){
     return syscall(SYS_OPEN, (uintptr_t)filename, flags, 0, 0, 0);
 }
@@ -24,4 +34,26 @@ off_t lemon_seek(int fd, off_t offset, int whence){
 
 int lemon_readdir(int fd, uint64_t count, lemon_dirent_t* dirent){
     return syscall(SYS_READDIR, fd, (uintptr_t)dirent, count, 0, 0);
+}
+
+ssize_t lemon_readdir_batch(int fd, void* buffer, size_t size, int flags){
+    long ret = syscall(SYS_READDIR_BATCH, fd, (uintptr_t)buffer, size, flags, 0);
+    if(ret < 0){
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
+
+void* lemon_map_file(int fd, size_t size, off_t offset, int flags, void* hint){
+    uintptr_t address = (uintptr_t)hint;
+
+    long ret = syscall(SYS_MAP_FILE, fd, (uintptr_t)&address, (size + 0xFFF) >> 12, offset, flags);
+    if(ret < 0){
+        errno = -ret;
+        return NULL;
+    }
+
+    return (void*)address;
 } 
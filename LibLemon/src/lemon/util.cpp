@@ -5,12 +5,30 @@
 #include <stdint.h>
 #include <errno.h>
 
+#ifndef SYS_SET_SCHEDULING
+    #define SYS_SET_SCHEDULING 76
+#endif
+
+#ifndef SYS_FORK
+    #define SYS_FORK 82
+#endif
+
 extern char** environ;
 
 pid_t lemon_spawn(const char* path, int argc, char* const argv[], int flags){
 	return syscall(SYS_EXEC, (uintptr_t)path, argc, (uintptr_t)argv, flags, environ);
 } 
 
+pid_t lemon_fork(){
+	long ret = syscall(SYS_FORK, 0, 0, 0, 0, 0);
+	if(ret < 0){
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
+
 namespace Lemon{
     void Yield(){
         syscall(SYS_YIELD, 0, 0, 0, 0, 0);
@@ -46,4 +64,14 @@ namespace Lemon{
             list.push_back(pInfo);
         }
     }
+
+    int SetScheduling(uint64_t pid, uint64_t tid, int schedClass, int nice){
+        long ret = syscall(SYS_SET_SCHEDULING, pid, tid, schedClass, nice, 0);
+        if(ret < 0){
+            errno = -ret;
+            return -1;
+        }
+
+        return 0;
+    }
 }
\ No newline at end of file
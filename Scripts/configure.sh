@@ -8,7 +8,11 @@ if ! [ -x "$(command -v x86_64-lemon-gcc)" ]; then
 	exit 1
 fi
 
-cd LibLemon
+cd InterfaceCompiler
+meson build --prefix=$(dirname $(dirname $(command -v x86_64-lemon-gcc)))
+ninja -C build install
+
+cd ../LibLemon
 meson build --cross $SPATH/lemon-crossfile.txt
 
 cd ../Applications
@@ -46,59 +46,50 @@ void CompositorInstance::Paint(){
     lastRender = cTime;
 
     surface_t* renderSurface = &wm->surface;
+    MouseState& mouse = wm->input.mouse;
     
     if(wm->redrawBackground){
-        #ifdef LEMONWM_USE_CLIPPING
-            auto doClipping = [&](rect_t newRect){
-                retry:
-                for(WMWindow* win : wm->windows){
-                    auto& clips = win->clips;
-                    for(auto it = clips.begin(); it != clips.end(); it++){
-                        rect_t rect = *it;
-                        if(rect.left() < newRect.right() && rect.right() > newRect.left() && rect.top() < newRect.bottom() && rect.bottom() > newRect.top()){
-                            clips.erase(it);
-                            cclips.erase(it);
-
-                            clips.splice(clips.end(), rect.Split(newRect));
-                            cclips.splice(cclips.end(), rect.Split(newRect));
-                            goto retry;
-                        }
-                    }
-                }
-            };
-
-            for(WMWindow* win : wm->windows){
-                win->clips.clear();
-            }
-            cclips.clear();
-
-            for(WMWindow* win : wm->windows){
-                if(win->minimized) continue;
-
-                if(win->flags & WINDOW_FLAGS_NODECORATION) {
-                    doClipping({win->pos, win->size});
-                    cclips.push_back({win->pos, win->size});
-                } else {
-                    doClipping({win->pos.x + WINDOW_BORDER_THICKNESS, win->pos.y + WINDOW_BORDER_THICKNESS + WINDOW_TITLEBAR_HEIGHT, win->size.x, win->size.y});
-                    cclips.push_back({win->pos.x + WINDOW_BORDER_THICKNESS, win->pos.y + WINDOW_BORDER_THICKNESS + WINDOW_TITLEBAR_HEIGHT, win->size.x, win->size.y});
-                }
-            }
+        Damage({0, 0, renderSurface->width, renderSurface->height});
+        wm->redrawBackground = false;
+    }
 
-        #endif
+    bool mouseMoved = mouse.pos.x != lastMousePos.x || mouse.pos.y != lastMousePos.y;
+    if(mouseMoved){
+        Damage({lastMousePos, {mouseCursor.width, mouseCursor.height}});
+        Damage({mouse.pos, {mouseCursor.width, mouseCursor.height}});
+    }
 
-        if(useImage){
-            surfacecpy(renderSurface, &backgroundImage);
-        } else {
-            DrawRect(0, 0, renderSurface->width, renderSurface->height, backgroundColor, renderSurface);
+    rect_t& menuBounds = wm->contextMenuBounds;
+    if(wm->contextMenuActive != lastContextMenuActive || (wm->contextMenuActive && (mouseMoved /* Item highlight */ || menuBounds.x != lastContextMenuBounds.x || menuBounds.y != lastContextMenuBounds.y || menuBounds.height != lastContextMenuBounds.height))){
+        if(lastContextMenuActive) Damage(lastContextMenuBounds);
+        if(wm->contextMenuActive) Damage(menuBounds);
+    }
+
+    lastMousePos = mouse.pos;
+    lastContextMenuActive = wm->contextMenuActive;
+    lastContextMenuBounds = menuBounds;
+
+    for(WMWindow* win : wm->windows){
+        if(win->minimized) continue;
+
+        if(win->RefreshTitlebar()){
+            Damage(win->GetTitlebarRect());
         }
 
-        //wm->redrawBackground = false;
+        win->PollDamage();
     }
 
-    for(WMWindow* win : wm->windows){
-        win->Draw(renderSurface);
+    #ifdef LEMONWM_FRAMERATE_COUNTER
+        Damage({0, 0, 80, 16});
+    #endif
+
+    if(damage.empty()) return; // Nothing has changed
+
+    for(rect_t& region : damage){
+        PaintRegion(region);
     }
 
+    // The context menu and cursor sit above everything, just draw them over whatever was repainted
     if(wm->contextMenuActive){
         rect_t bounds = wm->contextMenuBounds;
 
@@ -112,7 +103,7 @@ void CompositorInstance::Paint(){
         int ypos = bounds.y;
 
         for(ContextMenuItem& item : wm->menu.items){
-            if(PointInRect({bounds.pos.x, ypos, CONTEXT_ITEM_WIDTH, CONTEXT_ITEM_HEIGHT},wm->input.mouse.pos)){
+            if(PointInRect({bounds.pos.x, ypos, CONTEXT_ITEM_WIDTH, CONTEXT_ITEM_HEIGHT}, mouse.pos)){
                 DrawRect(bounds.x, ypos,  bounds.width, CONTEXT_ITEM_HEIGHT, Lemon::colours[Lemon::Colour::Foreground], renderSurface);
             }
 
@@ -121,50 +112,88 @@ void CompositorInstance::Paint(){
         }
     }
 
-    surfacecpyTransparent(renderSurface, &mouseCursor, wm->input.mouse.pos);
+    surfacecpyTransparent(renderSurface, &mouseCursor, mouse.pos);
 
     #ifdef LEMONWM_FRAMERATE_COUNTER
     {
         DrawRect(0, 0, 80, 16, 0, 0 ,0, renderSurface);
         DrawString(std::to_string(fRate).c_str(), 2, 2, 255, 255, 255, renderSurface);
-
-        #ifdef LEMONWM_USE_CLIPPING
-                surfacecpy(&wm->screenSurface, renderSurface, {0, 0}, {0, 0, 80, 16});
-        #endif
     }
     #endif
 
-    
-    if(wm->redrawBackground && wm->screenSurface.buffer){
-        surfacecpy(&wm->screenSurface, renderSurface);
-        wm->redrawBackground = false;
-    } else if(wm->screenSurface.buffer){
-        #ifdef LEMONWM_USE_CLIPPING
-            for(rect_t& r : cclips){
-                surfacecpy(&wm->screenSurface, renderSurface, r.pos, r);
+    if(wm->screenSurface.buffer){
+        for(rect_t& region : damage){
+            surfacecpy(&wm->screenSurface, renderSurface, region.pos, region);
+        }
+    }
+
+    damage.clear();
+}
+
+void CompositorInstance::PaintRegion(rect_t region){
+    surface_t* renderSurface = &wm->surface;
+    std::list<rect_t> remaining = {region};
+
+    // Go from the top window down, each window only draws what is left of the region after the windows above it
+    for(auto it = wm->windows.rbegin(); it != wm->windows.rend() && !remaining.empty(); it++){
+        WMWindow* win = *it;
+        if(win->minimized) continue;
+
+        rect_t bounds = win->GetBounds();
+        for(auto r = remaining.begin(); r != remaining.end();){
+            if(!RectsIntersect(*r, bounds)){
+                r++;
+                continue;
             }
-        #else
-            surfacecpy(&wm->screenSurface, renderSurface);
-        #endif
+
+            win->Draw(renderSurface, RectIntersection(*r, bounds));
+
+            remaining.splice(remaining.end(), RectSubtract(*r, bounds)); // None of the pieces intersect this window so they get skipped
+            r = remaining.erase(r);
+        }
     }
 
-    if(wm->contextMenuActive){
+    for(rect_t& r : remaining){
         if(useImage){
-            surfacecpy(renderSurface, &backgroundImage, wm->contextMenuBounds.pos, wm->contextMenuBounds);
+            surfacecpy(renderSurface, &backgroundImage, r.pos, r);
         } else {
-            DrawRect(wm->contextMenuBounds, backgroundColor, renderSurface);
+            DrawRect(r, backgroundColor, renderSurface);
         }
     }
-    
-    if(useImage){
-        surfacecpy(renderSurface, &backgroundImage, wm->input.mouse.pos, {wm->input.mouse.pos, {mouseCursor.width, mouseCursor.height}});
-    } else {
-        DrawRect(wm->input.mouse.pos.x, wm->input.mouse.pos.y, mouseCursor.width, mouseCursor.height, backgroundColor, renderSurface);
+}
+
+void CompositorInstance::Damage(rect_t rect){
+    rect = RectIntersection(rect, {0, 0, wm->surface.width, wm->surface.height});
+    if(rect.width <= 0 || rect.height <= 0) return;
+
+    // Only add what isn't already damaged so nothing gets drawn or copied twice
+    std::list<rect_t> pieces = {rect};
+    for(rect_t& d : damage){
+        for(auto it = pieces.begin(); it != pieces.end();){
+            if(!RectsIntersect(*it, d)){
+                it++;
+                continue;
+            }
+
+            pieces.splice(pieces.end(), RectSubtract(*it, d));
+            it = pieces.erase(it);
+        }
+
+        if(pieces.empty()) return;
     }
 
-    #ifdef LEMONWM_USE_CLIPPING
-        surfacecpy(&wm->screenSurface, renderSurface, wm->input.mouse.pos, {wm->input.mouse.pos, {mouseCursor.width, mouseCursor.height}});
-    #else
+    damage.splice(damage.end(), pieces);
 
-    #endif
-}
\ No newline at end of file
+    if(damage.size() > COMPOSITOR_MAX_DAMAGE_RECTS){
+        int left = rect.left(), top = rect.top(), right = rect.right(), bottom = rect.bottom();
+        for(rect_t& d : damage){
+            left = std::min(left, d.left());
+            top = std::min(top, d.top());
+            right = std::max(right, d.right());
+            bottom = std::max(bottom, d.bottom());
+        }
+
+        damage.clear();
+        damage.push_back({left, top, right - left, bottom - top});
+    }
+}
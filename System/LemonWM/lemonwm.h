@@ -7,7 +7,10 @@
 #include <core/event.h>
 #include <gui/window.h>
 
+#include "LemonWMInterface.h"
+
 #include <list>
+#include <algorithm>
 
 #define WINDOW_BORDER_COLOUR {32,32,32}
 #define WINDOW_TITLEBAR_HEIGHT 24
@@ -15,7 +18,8 @@
 #define CONTEXT_ITEM_HEIGHT 20
 #define CONTEXT_ITEM_WIDTH 160
 
-//#define LEMONWM_USE_CLIPPING
+#define COMPOSITOR_MAX_DAMAGE_RECTS 32 // Past this the damage is merged into its bounding box
+
 //#define LEMONWM_FRAMERATE_COUNTER
 
 using WindowBuffer = Lemon::GUI::WindowBuffer;
@@ -52,14 +56,14 @@ protected:
     WMInstance* wm;
 
     rect_t closeRect, minimizeRect;
+
+    surface_t titlebar = {0, 0, 32, nullptr}; // Cached titlebar, only redrawn when it changes
+    bool closeHover = false;
+    bool minimizeHover = false;
 public:
     WMWindow(WMInstance* wm, unsigned long key);
     ~WMWindow();
 
-    #ifdef LEMONWM_USE_CLIPPING
-        std::list<rect_t> clips;
-    #endif
-
     vector2i_t pos;
     vector2i_t size;
     char* title;
@@ -71,7 +75,12 @@ public:
 
     int clientFd = 0;
 
-    void Draw(surface_t* surface);
+    bool titlebarDirty = true; // Set when the title or size changes
+
+    void Draw(surface_t* surface, rect_t clip); // Only draws the part of the window within clip
+
+    bool RefreshTitlebar(); // Returns true if the titlebar was redrawn
+    void PollDamage(); // Pass the damage reported by the client on to the compositor
 
     void Minimize(bool state);
     void Resize(vector2i_t size, unsigned long bufferKey);
@@ -80,6 +89,10 @@ public:
     rect_t GetCloseRect();
     rect_t GetMinimizeRect();
 
+    rect_t GetBounds(); // Window including decorations
+    rect_t GetContentRect();
+    rect_t GetTitlebarRect();
+
     rect_t GetBottomBorderRect();
     rect_t GetTopBorderRect();
     rect_t GetLeftBorderRect();
@@ -136,13 +149,19 @@ protected:
 
     timespec lastRender;
 
-    #ifdef LEMONWM_USE_CLIPPING
-        std::list<rect_t> cclips;
-    #endif
+    std::list<rect_t> damage; // Non-overlapping screen regions to redraw next frame
+
+    vector2i_t lastMousePos = {0, 0};
+    bool lastContextMenuActive = false;
+    rect_t lastContextMenuBounds = {0, 0, 0, 0};
+
+    void PaintRegion(rect_t region);
 public:
     CompositorInstance(WMInstance* wm);
     void Paint();
 
+    void Damage(rect_t rect);
+
     surface_t windowButtons;
     surface_t mouseCursor;
 
@@ -150,7 +169,7 @@ public:
     surface_t backgroundImage;
 };
 
-class WMInstance {
+class WMInstance : public LemonWM::Server {
 protected:
     Lemon::MessageServer server;
     Lemon::MessageClient shellClient;
@@ -172,6 +191,14 @@ protected:
     void MinimizeWindow(int id, bool state);
 
     void SetActive(WMWindow* win);
+
+    void OnCreateWindow(int client, const char* title, vector2i_t pos, vector2i_t size, uint32_t flags, uint64_t bufferKey);
+    void OnDestroyWindow(int client);
+    void OnSetTitle(int client, const char* title);
+    void OnResize(int client, vector2i_t size, uint64_t bufferKey);
+    void OnMinimize(int client, bool minimized);
+    void OnMinimizeOther(int client, int32_t windowID, bool minimized);
+    void OnInitializeShellConnection(int client);
 public:
     bool redrawBackground = true;
     bool contextMenuActive = false;
@@ -197,6 +224,38 @@ public:
     void KeyUpdate(int key, bool pressed);
 };
 
+static inline bool RectsIntersect(rect_t a, rect_t b){
+    return a.left() < b.right() && a.right() > b.left() && a.top() < b.bottom() && a.bottom() > b.top();
+}
+
+static inline rect_t RectIntersection(rect_t a, rect_t b){
+    int left = std::max(a.left(), b.left());
+    int top = std::max(a.top(), b.top());
+
+    return {left, top, std::min(a.right(), b.right()) - left, std::min(a.bottom(), b.bottom()) - top};
+}
+
+// Parts of victim not covered by cut, at most four
+static inline std::list<rect_t> RectSubtract(rect_t victim, rect_t cut){
+    std::list<rect_t> pieces;
+
+    if(!RectsIntersect(victim, cut)){
+        pieces.push_back(victim);
+        return pieces;
+    }
+
+    if(cut.top() > victim.top()) pieces.push_back({victim.x, victim.y, victim.width, cut.top() - victim.top()}); // Above
+    if(cut.bottom() < victim.bottom()) pieces.push_back({victim.x, cut.bottom(), victim.width, victim.bottom() - cut.bottom()}); // Below
+
+    int top = std::max(victim.top(), cut.top());
+    int height = std::min(victim.bottom(), cut.bottom()) - top;
+
+    if(cut.left() > victim.left()) pieces.push_back({victim.x, top, cut.left() - victim.left(), height}); // Left
+    if(cut.right() < victim.right()) pieces.push_back({cut.right(), top, victim.right() - cut.right(), height}); // Right
+
+    return pieces;
+}
+
 static inline bool PointInWindow(WMWindow* win, vector2i_t point){
 	int windowHeight = (win->flags & WINDOW_FLAGS_NODECORATION) ? win->size.y : (win->size.y + WINDOW_TITLEBAR_HEIGHT + (WINDOW_BORDER_THICKNESS * 4)); // Account for titlebar and borders
 	int windowWidth = (win->flags & WINDOW_FLAGS_NODECORATION) ? win->size.x : (win->size.x + (WINDOW_BORDER_THICKNESS * 4)); // Account for borders and extend the window a little bit so it is easier to resize
@@ -14,6 +14,7 @@
 
 #ifdef __lemon__
     #include <lemon/spawn.h>
+    #include <lemon/util.h>
 #endif
 
 #include "lemonwm.h"
@@ -95,8 +96,18 @@ int main(){
     }
 
     wm.screenSurface = fbSurface;
+    wm.redrawBackground = true; // Only damaged regions get copied from here on, make sure the screen starts out complete
+
+    #ifdef __lemon__
+        // Input and compositing should not have to wait behind batch work
+        if(Lemon::SetScheduling(0, 0, SchedulingClassInteractive, 0)){
+            printf("LemonWM: Warning: Failed to set scheduling class\n");
+        }
+    #endif
 
     for(;;){
         wm.Update();
+
+        usleep(1000); // Interactive threads run before everything else, so don't spin between polls
     }
 }
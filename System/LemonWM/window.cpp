@@ -18,50 +18,115 @@ WMWindow::WMWindow(WMInstance* wm, unsigned long key){
 WMWindow::~WMWindow(){
 	free(title);
 
+	if(titlebar.buffer){
+		delete[] titlebar.buffer;
+	}
+
 	Lemon::UnmapSharedMemory(windowBufferInfo, bufferKey);
 }
 
-void WMWindow::Draw(surface_t* surface){
+void WMWindow::Draw(surface_t* surface, rect_t clip){
 	if(minimized) return;
 
-	if(flags & WINDOW_FLAGS_NODECORATION){
-		surface_t wSurface = {.width = size.x, .height = size.y, .buffer = ((windowBufferInfo->currentBuffer == 0) ? buffer1 : buffer2)};
-		Lemon::Graphics::surfacecpy(surface, &wSurface, pos);
-		return;
+	if(!(flags & WINDOW_FLAGS_NODECORATION)){
+		rect_t titlebarRect = GetTitlebarRect();
+		if(RectsIntersect(titlebarRect, clip)){
+			rect_t r = RectIntersection(titlebarRect, clip);
+			Lemon::Graphics::surfacecpy(surface, &titlebar, r.pos, {r.pos - pos, r.size});
+		}
+
+		int top = pos.y + WINDOW_TITLEBAR_HEIGHT + WINDOW_BORDER_THICKNESS; // First row below the titlebar
+		rect_t outerBorders[] = {
+			{pos.x, top, 1, size.y + WINDOW_BORDER_THICKNESS}, // Left
+			{pos.x + size.x + WINDOW_BORDER_THICKNESS * 2 - 1, top, 1, size.y + WINDOW_BORDER_THICKNESS}, // Right
+			{pos.x + 1, top + size.y + 1, size.x + WINDOW_BORDER_THICKNESS, 1}, // Bottom
+		};
+		rect_t innerBorders[] = {
+			{pos.x + 1, top, 1, size.y + 1},
+			{pos.x + size.x + WINDOW_BORDER_THICKNESS, top, 1, size.y + 1},
+			{pos.x + WINDOW_BORDER_THICKNESS, top + size.y, size.x, 1},
+		};
+
+		for(rect_t& r : outerBorders){
+			if(RectsIntersect(r, clip)) Lemon::Graphics::DrawRect(RectIntersection(r, clip), WINDOW_BORDER_COLOUR, surface);
+		}
+
+		for(rect_t& r : innerBorders){
+			if(RectsIntersect(r, clip)) Lemon::Graphics::DrawRect(RectIntersection(r, clip), {42, 50, 64}, surface);
+		}
 	}
 
-	Lemon::Graphics::DrawRectOutline(pos.x, pos.y, size.x + WINDOW_BORDER_THICKNESS * 2, size.y + WINDOW_TITLEBAR_HEIGHT + WINDOW_BORDER_THICKNESS * 2, WINDOW_BORDER_COLOUR, surface);
-	Lemon::Graphics::DrawRectOutline(pos.x + (WINDOW_BORDER_THICKNESS / 2), pos.y + WINDOW_TITLEBAR_HEIGHT + (WINDOW_BORDER_THICKNESS / 2), size.x + WINDOW_BORDER_THICKNESS, size.y + WINDOW_BORDER_THICKNESS, {42, 50, 64}, surface);
-	Lemon::Graphics::DrawGradientVertical({pos + (vector2i_t){1,1}, {size.x + WINDOW_BORDER_THICKNESS, WINDOW_TITLEBAR_HEIGHT}}, {96, 96, 96}, {42, 50, 64}, surface);
+	rect_t content = GetContentRect();
+	if(!RectsIntersect(content, clip)) return;
 
-	Lemon::Graphics::DrawString(title, pos.x + 6, pos.y + 6, 255, 255, 255, surface);
+	rect_t r = RectIntersection(content, clip);
 
-	surface_t* buttons = &wm->compositor.windowButtons;
+	windowBufferInfo->drawing = 1;
+	surface_t wSurface = {.width = size.x, .height = size.y, .buffer = ((windowBufferInfo->currentBuffer == 0) ? buffer1 : buffer2)};
+	
+	Lemon::Graphics::surfacecpy(surface, &wSurface, r.pos, {r.pos - content.pos, r.size});
 
-	if(Lemon::Graphics::PointInRect({{closeRect.x + pos.x, closeRect.y + pos.y}, closeRect.size}, wm->input.mouse.pos)){
-		Lemon::Graphics::surfacecpy(surface, buttons, pos + closeRect.pos, {{0, 19}, {19, 19}}); // Close button
-	} else {
-		Lemon::Graphics::surfacecpy(surface, buttons, pos + closeRect.pos, {{0, 0}, {19, 19}}); // Close button
-	}
+	windowBufferInfo->drawing = 0;
+}
+
+bool WMWindow::RefreshTitlebar(){
+	if(flags & WINDOW_FLAGS_NODECORATION) return false;
+
+	bool close = Lemon::Graphics::PointInRect(GetCloseRect(), wm->input.mouse.pos);
+	bool minimize = Lemon::Graphics::PointInRect(GetMinimizeRect(), wm->input.mouse.pos);
+
+	if(!titlebarDirty && close == closeHover && minimize == minimizeHover) return false;
 
-	if(Lemon::Graphics::PointInRect({{pos.x + minimizeRect.x, pos.y + minimizeRect.y}, minimizeRect.size}, wm->input.mouse.pos)){
-		Lemon::Graphics::surfacecpy(surface, buttons, pos + minimizeRect.pos, {{19, 19}, {19, 19}}); // Minimize button
-	} else {
-		Lemon::Graphics::surfacecpy(surface, buttons, pos + minimizeRect.pos, {{19, 0}, {19, 19}}); // Minimize button
+	closeHover = close;
+	minimizeHover = minimize;
+	titlebarDirty = false;
+
+	int width = size.x + WINDOW_BORDER_THICKNESS * 2;
+	int height = WINDOW_TITLEBAR_HEIGHT + WINDOW_BORDER_THICKNESS;
+	if(!titlebar.buffer || titlebar.width != width){
+		if(titlebar.buffer) delete[] titlebar.buffer;
+
+		titlebar.width = width;
+		titlebar.height = height;
+		titlebar.buffer = new uint8_t[width * height * 4];
 	}
 
+	// The window outlines are drawn at full size, the titlebar surface cuts off everything below its top edge
+	Lemon::Graphics::DrawRectOutline(0, 0, size.x + WINDOW_BORDER_THICKNESS * 2, size.y + WINDOW_TITLEBAR_HEIGHT + WINDOW_BORDER_THICKNESS * 2, WINDOW_BORDER_COLOUR, &titlebar);
+	Lemon::Graphics::DrawRectOutline(WINDOW_BORDER_THICKNESS / 2, WINDOW_TITLEBAR_HEIGHT + (WINDOW_BORDER_THICKNESS / 2), size.x + WINDOW_BORDER_THICKNESS, size.y + WINDOW_BORDER_THICKNESS, {42, 50, 64}, &titlebar);
+	Lemon::Graphics::DrawGradientVertical({{1, 1}, {size.x + WINDOW_BORDER_THICKNESS, WINDOW_TITLEBAR_HEIGHT}}, {96, 96, 96}, {42, 50, 64}, &titlebar);
+
+	Lemon::Graphics::DrawString(title, 6, 6, 255, 255, 255, &titlebar);
+
+	surface_t* buttons = &wm->compositor.windowButtons;
+
+	Lemon::Graphics::surfacecpy(&titlebar, buttons, closeRect.pos, {{0, closeHover ? 19 : 0}, {19, 19}}); // Close button
+	Lemon::Graphics::surfacecpy(&titlebar, buttons, minimizeRect.pos, {{19, minimizeHover ? 19 : 0}, {19, 19}}); // Minimize button
+
+	return true;
+}
+
+void WMWindow::PollDamage(){
+	if(minimized || !windowBufferInfo->dirty) return;
+
 	windowBufferInfo->drawing = 1;
-    surface_t wSurface = {.width = size.x, .height = size.y, .buffer = ((windowBufferInfo->currentBuffer == 0) ? buffer1 : buffer2)};
-	
-	vector2i_t clipOffset =  pos + (vector2i_t){WINDOW_BORDER_THICKNESS, WINDOW_BORDER_THICKNESS + WINDOW_TITLEBAR_HEIGHT};
-	
-	#ifdef _LEMONWM_USE_CLIPPING
-		for(rect_t& clip : clips){
-			Lemon::Graphics::surfacecpy(surface, &wSurface, clip.pos, {clip.pos - clipOffset, clip.size});
-		}
-	#else
-		Lemon::Graphics::surfacecpy(surface, &wSurface, clipOffset);
-	#endif
+	windowBufferInfo->LockDamage();
+
+	rect_t content = GetContentRect();
+	uint32_t count = windowBufferInfo->damageCount;
+
+	if(!count || count > WINDOW_MAX_DAMAGE_RECTS){ // Whole window
+		wm->compositor.Damage(content);
+	} else for(uint32_t i = 0; i < count; i++){
+		rect_t r = windowBufferInfo->damage[i];
+		r.pos += content.pos;
+
+		if(RectsIntersect(r, content)) wm->compositor.Damage(RectIntersection(r, content));
+	}
+
+	windowBufferInfo->damageCount = 0;
+	windowBufferInfo->dirty = 0;
+	windowBufferInfo->UnlockDamage();
 
 	windowBufferInfo->drawing = 0;
 }
@@ -81,6 +146,7 @@ void WMWindow::Resize(vector2i_t size, unsigned long key){
     buffer2 = ((uint8_t*)windowBufferInfo) + windowBufferInfo->buffer2Offset;
 
 	this->size = size;
+	titlebarDirty = true;
 
 	RecalculateButtonRects();
 }
@@ -97,6 +163,22 @@ rect_t WMWindow::GetMinimizeRect(){
 	return r;
 }
 
+rect_t WMWindow::GetBounds(){
+	if(flags & WINDOW_FLAGS_NODECORATION) return {pos, size};
+
+	return {pos, {size.x + WINDOW_BORDER_THICKNESS * 2, size.y + WINDOW_TITLEBAR_HEIGHT + WINDOW_BORDER_THICKNESS * 2}};
+}
+
+rect_t WMWindow::GetContentRect(){
+	if(flags & WINDOW_FLAGS_NODECORATION) return {pos, size};
+
+	return {pos + (vector2i_t){WINDOW_BORDER_THICKNESS, WINDOW_BORDER_THICKNESS + WINDOW_TITLEBAR_HEIGHT}, size};
+}
+
+rect_t WMWindow::GetTitlebarRect(){
+	return {pos, {size.x + WINDOW_BORDER_THICKNESS * 2, WINDOW_TITLEBAR_HEIGHT + WINDOW_BORDER_THICKNESS}};
+}
+
 void WMWindow::RecalculateButtonRects(){
 	surface_t* buttons = &wm->compositor.windowButtons;
 	closeRect = {{size.x - (buttons->width / 3) - 2, (12 - ((buttons->height / 3) / 2))}, {buttons->width / 3, buttons->height / 3}};
@@ -44,6 +44,7 @@ void WMInstance::MinimizeWindow(int id, bool state){
 
     if(!win) {
         printf("[LemonWM] Invalid window ID: %d\n", id);
+        return;
     }
 
     MinimizeWindow(win, state);
@@ -65,97 +66,113 @@ void WMInstance::SetActive(WMWindow* win){
         
         windows.remove(win);
         windows.push_back(win); // Add to top
+
+        compositor.Damage(win->GetBounds());
     }
 }
 
-void WMInstance::Poll(){
-    while(auto m = server.Poll()){
-        if(m && m->msg.protocol == LEMON_MESSAGE_PROTOCOL_WMCMD){
-            auto cmd = (Lemon::GUI::WMCommand*)m->msg.data;
+void WMInstance::OnCreateWindow(int client, const char* title, vector2i_t pos, vector2i_t size, uint32_t flags, uint64_t bufferKey){
+    printf("[LemonWM] Creating Window:    Size: %dx%d, Title: %s\n", size.x, size.y, title);
 
-            if(cmd->cmd == Lemon::GUI::WMCreateWindow){
-                char* title = (char*)malloc(cmd->create.titleLength + 1);
-                strncpy(title, cmd->create.title, cmd->create.titleLength);
-                title[cmd->create.titleLength] = 0;
+    WMWindow* win = new WMWindow(this, bufferKey);
+    win->title = strdup(title);
+    win->pos = pos;
+    win->size = size;
+    win->flags = flags;
+    win->clientFd = client;
+    win->RecalculateButtonRects();
 
-                printf("[LemonWM] Creating Window:    Size: %dx%d, Title: %s\n", cmd->create.size.x, cmd->create.size.y, title);
+    windows.push_back(win);
 
-                WMWindow* win = new WMWindow(this, cmd->create.bufferKey);
-                win->title = title;
-                win->pos = cmd->create.pos;
-                win->size = cmd->create.size;
-                win->flags = cmd->create.flags;
-                win->clientFd = m->clientFd;
-                win->RecalculateButtonRects();
+    if(shellConnected && !(win->flags & WINDOW_FLAGS_NOSHELL)){
+        Lemon::Shell::AddWindow(client, Lemon::Shell::ShellWindowState::ShellWindowStateNormal, win->title, shellClient);
+    }
+    SetActive(win);
 
-                windows.push_back(win);
+    redrawBackground = true;
+}
 
-                if(shellConnected && !(win->flags & WINDOW_FLAGS_NOSHELL)){
-                    Lemon::Shell::AddWindow(m->clientFd, Lemon::Shell::ShellWindowState::ShellWindowStateNormal, title, shellClient);
-                }
-                SetActive(win);
+void WMInstance::OnDestroyWindow(int client){
+    printf("Destroying Window\n");
+    WMWindow* win = FindWindow(client);
 
-                redrawBackground = true;
-            } else if (cmd->cmd == Lemon::GUI::WMResize){
-                WMWindow* win = FindWindow(m->clientFd);
+    if(!win){
+        printf("[LemonWM] Warning: Unknown Window ID: %d\n", client);
+        return;
+    }
 
-                if(!win){
-                    printf("[LemonWM] Warning: Unknown Window ID: %d\n", m->clientFd);
-                    continue;
-                }
+    if(active == win){
+        SetActive(nullptr);
+    }
+    
+    if(shellConnected && !(win->flags & WINDOW_FLAGS_NOSHELL)){
+        Lemon::Shell::RemoveWindow(client, shellClient);
+    }
 
-                win->Resize(cmd->size, cmd->bufferKey);
-            } else if(cmd->cmd == Lemon::GUI::WMDestroyWindow){
-                printf("Destroying Window\n");
-                WMWindow* win = FindWindow(m->clientFd);
+    windows.remove(win);
+    redrawBackground = true;
 
-                if(!win){
-                    printf("[LemonWM] Warning: Unknown Window ID: %d\n", m->clientFd);
-                    continue;
-                }
+    delete win;
+}
 
-                if(active == win){
-                    SetActive(nullptr);
-                }
-                
-                if(shellConnected && !(win->flags & WINDOW_FLAGS_NOSHELL)){
-                    Lemon::Shell::RemoveWindow(m->clientFd, shellClient);
-                }
+void WMInstance::OnSetTitle(int client, const char* title){
+    WMWindow* win = FindWindow(client);
 
-                windows.remove(win);
-                redrawBackground = true;
+    if(!win){
+        printf("[LemonWM] Warning: Unknown Window ID: %d\n", client);
+        return;
+    }
 
-                delete win;
-            } else if(cmd->cmd == Lemon::GUI::WMSetTitle){
-                WMWindow* win = FindWindow(m->clientFd);
+    if(win->title) free(win->title);
+    win->title = strdup(title);
+    win->titlebarDirty = true;
+}
 
-                if(!win){
-                    printf("[LemonWM] Warning: Unknown Window ID: %d\n", m->clientFd);
-                    continue;
-                }
-                
-                char* title = (char*)malloc(cmd->titleLength + 1);
-                strncpy(title, cmd->title, cmd->titleLength);
-                title[cmd->titleLength] = 0;
-
-                if(win->title) free(win->title);
-                win->title = title;
-            } else if(cmd->cmd == Lemon::GUI::WMMinimize){
-                MinimizeWindow(m->clientFd, cmd->minimized);
-            } else if(cmd->cmd == Lemon::GUI::WMMinimizeOther){
-                MinimizeWindow(cmd->minimizeWindowID, cmd->minimized);
-            } else if(cmd->cmd == Lemon::GUI::WMInitializeShellConnection){
-                sockaddr_un shellAddr;
-                strcpy(shellAddr.sun_path, Lemon::Shell::shellSocketAddress);
-                shellAddr.sun_family = AF_UNIX;
-                shellClient.Connect(shellAddr, sizeof(sockaddr_un));
-
-                shellConnected = true;
-            } else if(cmd->cmd == Lemon::GUI::WMOpenContextMenu){
-                WMWindow* win = FindWindow(m->clientFd);
+void WMInstance::OnResize(int client, vector2i_t size, uint64_t bufferKey){
+    WMWindow* win = FindWindow(client);
+
+    if(!win){
+        printf("[LemonWM] Warning: Unknown Window ID: %d\n", client);
+        return;
+    }
+
+    compositor.Damage(win->GetBounds());
+    win->Resize(size, bufferKey);
+    compositor.Damage(win->GetBounds());
+}
+
+void WMInstance::OnMinimize(int client, bool minimized){
+    MinimizeWindow(client, minimized);
+}
+
+void WMInstance::OnMinimizeOther(int, int32_t windowID, bool minimized){
+    MinimizeWindow(windowID, minimized);
+}
+
+void WMInstance::OnInitializeShellConnection(int){
+    sockaddr_un shellAddr;
+    strcpy(shellAddr.sun_path, Lemon::Shell::shellSocketAddress);
+    shellAddr.sun_family = AF_UNIX;
+    shellClient.Connect(shellAddr, sizeof(sockaddr_un));
+
+    shellConnected = true;
+}
+
+void WMInstance::Poll(){
+    int clientFd;
+    while(const Lemon::LemonMessage* m = server.Next(clientFd)){
+        if(m->protocol == LemonWM::Protocol){
+            if(!Dispatch(server, clientFd, m)){
+                printf("[LemonWM] Warning: Invalid request from client %d\n", clientFd);
+            }
+        } else if(m->protocol == LEMON_MESSAGE_PROTOCOL_WMCMD){ // Context menus are variable length so still use WMCommand
+            auto cmd = (Lemon::GUI::WMCommand*)m->data;
+
+            if(m->length >= sizeof(Lemon::GUI::WMCommand) && cmd->cmd == Lemon::GUI::WMOpenContextMenu){
+                WMWindow* win = FindWindow(clientFd);
 
                 if(!win){
-                    printf("[LemonWM] Warning: Unknown Window ID: %d\n", m->clientFd);
+                    printf("[LemonWM] Warning: Unknown Window ID: %d\n", clientFd);
                     continue;
                 }
 
@@ -171,7 +188,7 @@ void WMInstance::Poll(){
                 Lemon::GUI::WMContextMenuEntry* item = cmd->contextMenu.contextEntries;
                 for(int i = 0; i < cmd->contextMenu.contextEntryCount; i++){
 
-                    if(((uintptr_t)item) + sizeof(Lemon::GUI::WMContextMenuEntry) + item->length - (uintptr_t)(m->msg.data) > m->msg.length){
+                    if(((uintptr_t)item) + sizeof(Lemon::GUI::WMContextMenuEntry) + item->length - (uintptr_t)(m->data) > m->length){
                         printf("[LemonWM] Invalid context menu item length: %d", item->length);
                         continue;
                     }
@@ -189,8 +206,8 @@ void WMInstance::Poll(){
                 menu.owner = win;
                 contextMenuActive = true;
             }
-        } else if (m && m->msg.protocol == 0){ // Client Disconnected
-            WMWindow* win = FindWindow(m->clientFd);
+        } else if (m->protocol == 0){ // Client Disconnected
+            WMWindow* win = FindWindow(clientFd);
 
             if(!win){
                 continue;
@@ -201,7 +218,7 @@ void WMInstance::Poll(){
             }
 
             if(shellConnected && !(win->flags & WINDOW_FLAGS_NOSHELL)){
-                Lemon::Shell::RemoveWindow(m->clientFd, shellClient);
+                Lemon::Shell::RemoveWindow(clientFd, shellClient);
             }
             
             windows.remove(win);
@@ -213,7 +230,13 @@ void WMInstance::Poll(){
 }
 
 void WMInstance::PostEvent(Lemon::LemonEvent& ev, WMWindow* win){
-    server.Send(Lemon::Message(LEMON_MESSAGE_PROTOCOL_WMEVENT, ev), win->clientFd);
+    alignas(Lemon::LemonMessage) uint8_t buffer[sizeof(Lemon::LemonMessage) + sizeof(Lemon::LemonEvent)]; // Built on the stack, events are sent for every mouse movement
+    Lemon::LemonMessage* msg = reinterpret_cast<Lemon::LemonMessage*>(buffer);
+    msg->protocol = LEMON_MESSAGE_PROTOCOL_WMEVENT;
+    msg->length = sizeof(Lemon::LemonEvent);
+    memcpy(msg->data, &ev, sizeof(Lemon::LemonEvent));
+
+    server.Send(msg, win->clientFd);
 }
 
 void WMInstance::MouseDown(){
@@ -363,8 +386,6 @@ void WMInstance::MouseMove(){
         PostEvent(ev, active);
         
         resizeStartPos = input.mouse.pos;
-
-        redrawBackground = true;
     } else if (active && PointInWindowProper(active, input.mouse.pos)){
         Lemon::LemonEvent ev;
         ev.event = Lemon::EventMouseMoved;
@@ -395,10 +416,14 @@ void WMInstance::Update(){
     input.Poll(); // Poll input devices
 
     if(drag && active){
-        active->pos = input.mouse.pos - dragOffset; // Move window
-        if(active->pos.y < 0) active->pos.y = 0;
+        vector2i_t pos = input.mouse.pos - dragOffset;
+        if(pos.y < 0) pos.y = 0;
 
-        redrawBackground = true;
+        if(pos.x != active->pos.x || pos.y != active->pos.y){
+            compositor.Damage(active->GetBounds());
+            active->pos = pos; // Move window
+            compositor.Damage(active->GetBounds());
+        }
     }
 
     compositor.Paint(); // Render the frame